@@ -0,0 +1,49 @@
+#include "bboy/base/aligned_buffer.h"
+
+#include <cstdlib>
+
+#include "bboy/gbase/strings/substitute.h"
+
+using strings::Substitute;
+
+namespace bb {
+
+AlignedBuffer::AlignedBuffer()
+    : data_(nullptr),
+      size_(0),
+      alignment_(0) {
+}
+
+AlignedBuffer::~AlignedBuffer() {
+  Free();
+}
+
+Status AlignedBuffer::Allocate(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+      alignment % sizeof(void*) != 0) {
+    return Status::InvalidArgument(
+        Substitute("invalid buffer alignment: $0", alignment));
+  }
+  Free();
+  const size_t aligned_size = AlignUp(size, alignment);
+  void* p = nullptr;
+  int err = posix_memalign(&p, alignment, aligned_size);
+  if (err != 0) {
+    return Status::RuntimeError(
+        Substitute("unable to allocate $0 bytes aligned on $1", aligned_size, alignment),
+        "posix_memalign() failed", err);
+  }
+  data_ = static_cast<uint8_t*>(p);
+  size_ = aligned_size;
+  alignment_ = alignment;
+  return Status::OK();
+}
+
+void AlignedBuffer::Free() {
+  free(data_);
+  data_ = nullptr;
+  size_ = 0;
+  alignment_ = 0;
+}
+
+} // namespace bb
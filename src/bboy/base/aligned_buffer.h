@@ -0,0 +1,58 @@
+#ifndef BBOY_BASE_ALIGNED_BUFFER_H_
+#define BBOY_BASE_ALIGNED_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <glog/logging.h>
+
+#include "bboy/gbase/macros.h"
+#include "bboy/base/status.h"
+
+namespace bb {
+
+// Returns 'value' rounded down/up to a multiple of 'alignment', which must be
+// a power of two.
+inline uint64_t AlignDown(uint64_t value, size_t alignment) {
+  DCHECK_EQ(0, alignment & (alignment - 1));
+  return value & ~(static_cast<uint64_t>(alignment) - 1);
+}
+
+inline uint64_t AlignUp(uint64_t value, size_t alignment) {
+  return AlignDown(value + alignment - 1, alignment);
+}
+
+inline bool IsAligned(uint64_t value, size_t alignment) {
+  return AlignDown(value, alignment) == value;
+}
+
+// A heap-allocated buffer whose address and size are multiples of a given
+// power-of-two alignment, as required for I/O on files opened with O_DIRECT.
+// See the 'direct_io' file options in env.h.
+class AlignedBuffer {
+ public:
+  AlignedBuffer();
+  ~AlignedBuffer();
+
+  // Allocate a buffer of at least 'size' bytes aligned on 'alignment'. The
+  // size is rounded up to a multiple of the alignment. Any previously
+  // allocated memory is freed; its contents are not preserved.
+  Status Allocate(size_t alignment, size_t size) WARN_UNUSED_RESULT;
+
+  uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+  size_t alignment() const { return alignment_; }
+
+ private:
+  void Free();
+
+  uint8_t* data_;
+  size_t size_;
+  size_t alignment_;
+
+  DISALLOW_COPY_AND_ASSIGN(AlignedBuffer);
+};
+
+} // namespace bb
+
+#endif // BBOY_BASE_ALIGNED_BUFFER_H_
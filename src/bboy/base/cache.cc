@@ -0,0 +1,362 @@
+#include "bboy/base/cache.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "bboy/gbase/hash/city.h"
+#include "bboy/gbase/sysinfo.h"
+#include "bboy/base/mem_tracker.h"
+#include "bboy/base/sync/locks.h"
+
+DEFINE_double(cache_protected_segment_ratio, 0.8,
+              "Fraction of the capacity of a Cache reserved for its protected "
+              "segment, i.e. for entries that were looked up at least once after "
+              "being inserted. The rest holds new entries on probation, so a "
+              "larger ratio gives more resistance to scans but less room for "
+              "new entries to prove themselves.");
+
+using std::shared_ptr;
+using std::vector;
+using util_hash::CityHash64;
+
+namespace bb {
+
+namespace internal {
+
+namespace {
+
+enum Segment {
+  PROBATIONARY,
+  PROTECTED,
+};
+
+// An entry of the cache: this header, followed by the key and the value in a
+// single allocation.
+struct CacheEntry {
+  // Links in the LRU list of the entry's segment.
+  CacheEntry* next;
+  CacheEntry* prev;
+
+  uint64_t hash;
+  size_t key_len;
+  size_t val_len;
+  // The memory taken by the entry, charged to the cache's MemTracker.
+  size_t alloc_size;
+  // The amount of the shard's capacity taken by the entry.
+  size_t charge;
+
+  // One reference per handle, plus one while the entry is in the cache.
+  int refs;
+  bool in_cache;
+  Segment segment;
+
+  uint8_t kv_data[1];
+
+  Slice key() const {
+    return Slice(kv_data, key_len);
+  }
+
+  uint8_t* mutable_value() {
+    return kv_data + key_len;
+  }
+};
+
+// The key of the hash table of a shard, along with its precomputed hash.
+struct HashedKey {
+  Slice key;
+  uint64_t hash;
+
+  bool operator==(const HashedKey& other) const {
+    return hash == other.hash && key == other.key;
+  }
+};
+
+struct HashedKeyHasher {
+  size_t operator()(const HashedKey& k) const {
+    return k.hash;
+  }
+};
+
+// A circular doubly-linked list of entries, with the most recently used
+// entry at the front.
+class LruList {
+ public:
+  LruList() {
+    head_.next = &head_;
+    head_.prev = &head_;
+  }
+
+  bool empty() const {
+    return head_.next == &head_;
+  }
+
+  void PushFront(CacheEntry* e) {
+    e->next = head_.next;
+    e->prev = &head_;
+    e->next->prev = e;
+    head_.next = e;
+  }
+
+  static void Remove(CacheEntry* e) {
+    e->next->prev = e->prev;
+    e->prev->next = e->next;
+  }
+
+  CacheEntry* back() {
+    DCHECK(!empty());
+    return head_.prev;
+  }
+
+ private:
+  // Dummy head; only its links are used.
+  CacheEntry head_;
+};
+
+} // anonymous namespace
+
+class CacheShard {
+ public:
+  CacheShard(size_t capacity, MemTracker* mem_tracker)
+    : capacity_(capacity),
+      protected_capacity_(capacity * FLAGS_cache_protected_segment_ratio),
+      mem_tracker_(mem_tracker),
+      usage_(0),
+      protected_usage_(0) {
+  }
+
+  ~CacheShard() {
+    for (const auto& e : table_) {
+      CacheEntry* entry = e.second;
+      CHECK_EQ(entry->refs, 1) << "Cache destroyed with outstanding handles";
+      FreeEntry(entry);
+    }
+  }
+
+  void Insert(CacheEntry* entry) {
+    vector<CacheEntry*> to_free;
+    {
+      std::lock_guard<simple_spinlock> l(lock_);
+      entry->refs = 2;
+      entry->in_cache = true;
+      entry->segment = PROBATIONARY;
+      probationary_.PushFront(entry);
+      usage_ += entry->charge;
+
+      // The key of the table points into the entry, so the entry being
+      // replaced must go along with its key.
+      HashedKey key{ entry->key(), entry->hash };
+      auto it = table_.find(key);
+      if (it != table_.end()) {
+        CacheEntry* old = it->second;
+        table_.erase(it);
+        RemoveFromCache(old, &to_free);
+      }
+      table_.emplace(key, entry);
+
+      while (usage_ > capacity_ && !probationary_.empty()) {
+        CacheEntry* victim = probationary_.back();
+        table_.erase(HashedKey{ victim->key(), victim->hash });
+        RemoveFromCache(victim, &to_free);
+      }
+    }
+    FreeEntries(to_free);
+  }
+
+  CacheEntry* Lookup(const Slice& key, uint64_t hash, Cache::LookupBehavior behavior) {
+    std::lock_guard<simple_spinlock> l(lock_);
+    auto it = table_.find(HashedKey{ key, hash });
+    if (it == table_.end()) {
+      return nullptr;
+    }
+    CacheEntry* e = it->second;
+    e->refs++;
+    if (behavior == Cache::PROMOTE) {
+      Unlink(e);
+      e->segment = PROTECTED;
+      protected_.PushFront(e);
+      protected_usage_ += e->charge;
+      // Demote the least recently used protected entries, giving them
+      // another chance on probation.
+      while (protected_usage_ > protected_capacity_) {
+        CacheEntry* demoted = protected_.back();
+        Unlink(demoted);
+        demoted->segment = PROBATIONARY;
+        probationary_.PushFront(demoted);
+      }
+    }
+    return e;
+  }
+
+  void Release(CacheEntry* e) {
+    vector<CacheEntry*> to_free;
+    {
+      std::lock_guard<simple_spinlock> l(lock_);
+      MaybeUnref(e, &to_free);
+    }
+    FreeEntries(to_free);
+  }
+
+  void Erase(const Slice& key, uint64_t hash) {
+    vector<CacheEntry*> to_free;
+    {
+      std::lock_guard<simple_spinlock> l(lock_);
+      auto it = table_.find(HashedKey{ key, hash });
+      if (it == table_.end()) {
+        return;
+      }
+      CacheEntry* e = it->second;
+      table_.erase(it);
+      RemoveFromCache(e, &to_free);
+    }
+    FreeEntries(to_free);
+  }
+
+  void FreeEntry(CacheEntry* e) {
+    mem_tracker_->Release(e->alloc_size);
+    free(e);
+  }
+
+ private:
+  // Unlink 'e' from the LRU list of its segment. Must be called with 'lock_'
+  // held.
+  void Unlink(CacheEntry* e) {
+    LruList::Remove(e);
+    if (e->segment == PROTECTED) {
+      protected_usage_ -= e->charge;
+    }
+  }
+
+  // Remove 'e', which is no longer in 'table_', from the cache. Must be
+  // called with 'lock_' held.
+  void RemoveFromCache(CacheEntry* e, vector<CacheEntry*>* to_free) {
+    Unlink(e);
+    usage_ -= e->charge;
+    e->in_cache = false;
+    MaybeUnref(e, to_free);
+  }
+
+  // Drop a reference to 'e', adding it to 'to_free' if it was the last one.
+  // Must be called with 'lock_' held.
+  static void MaybeUnref(CacheEntry* e, vector<CacheEntry*>* to_free) {
+    DCHECK_GT(e->refs, 0);
+    if (--e->refs == 0) {
+      DCHECK(!e->in_cache);
+      to_free->push_back(e);
+    }
+  }
+
+  void FreeEntries(const vector<CacheEntry*>& entries) {
+    for (CacheEntry* e : entries) {
+      FreeEntry(e);
+    }
+  }
+
+  const size_t capacity_;
+  const size_t protected_capacity_;
+  MemTracker* const mem_tracker_;
+
+  simple_spinlock lock_;
+  // The total charge of the entries in the cache, and of those in the
+  // protected segment.
+  size_t usage_;
+  size_t protected_usage_;
+  LruList probationary_;
+  LruList protected_;
+  std::unordered_map<HashedKey, CacheEntry*, HashedKeyHasher> table_;
+
+  DISALLOW_COPY_AND_ASSIGN(CacheShard);
+};
+
+} // namespace internal
+
+using internal::CacheEntry;
+using internal::CacheShard;
+
+const int64_t Cache::kAutomaticCharge;
+
+Cache::Cache(const std::string& id, size_t capacity,
+             const shared_ptr<MemTracker>& parent_mem_tracker, int num_shards)
+    : mem_tracker_(MemTracker::CreateTracker(-1, id, parent_mem_tracker)),
+      shard_bits_(0) {
+  CHECK(FLAGS_cache_protected_segment_ratio >= 0 && FLAGS_cache_protected_segment_ratio < 1)
+      << "--cache_protected_segment_ratio must be in [0, 1)";
+  if (num_shards <= 0) {
+    num_shards = base::NumCPUs();
+  }
+  while ((1 << shard_bits_) < num_shards) {
+    shard_bits_++;
+  }
+  num_shards = 1 << shard_bits_;
+  size_t shard_capacity = (capacity + num_shards - 1) / num_shards;
+  for (int i = 0; i < num_shards; i++) {
+    shards_.emplace_back(new CacheShard(shard_capacity, mem_tracker_.get()));
+  }
+}
+
+Cache::~Cache() {
+}
+
+CacheShard* Cache::GetShard(uint64_t hash) const {
+  // Use the high bits: the hash table of a shard is indexed by the low ones.
+  return shards_[shard_bits_ > 0 ? hash >> (64 - shard_bits_) : 0].get();
+}
+
+Cache::PendingHandle* Cache::Allocate(const Slice& key, size_t val_len, int64_t charge) {
+  size_t alloc_size = sizeof(CacheEntry) - 1 + key.size() + val_len;
+  CacheEntry* e = static_cast<CacheEntry*>(malloc(alloc_size));
+  CHECK(e != nullptr) << "Failed to allocate " << alloc_size << " bytes";
+  mem_tracker_->Consume(alloc_size);
+  e->hash = CityHash64(reinterpret_cast<const char*>(key.data()), key.size());
+  e->key_len = key.size();
+  e->val_len = val_len;
+  e->alloc_size = alloc_size;
+  e->charge = charge == kAutomaticCharge ? alloc_size : charge;
+  e->refs = 0;
+  e->in_cache = false;
+  e->segment = internal::PROBATIONARY;
+  memcpy(e->kv_data, key.data(), key.size());
+  return reinterpret_cast<PendingHandle*>(e);
+}
+
+uint8_t* Cache::MutableValue(PendingHandle* handle) {
+  return reinterpret_cast<CacheEntry*>(handle)->mutable_value();
+}
+
+void Cache::Free(PendingHandle* handle) {
+  CacheEntry* e = reinterpret_cast<CacheEntry*>(handle);
+  GetShard(e->hash)->FreeEntry(e);
+}
+
+Cache::Handle* Cache::Insert(PendingHandle* handle) {
+  CacheEntry* e = reinterpret_cast<CacheEntry*>(handle);
+  GetShard(e->hash)->Insert(e);
+  return reinterpret_cast<Handle*>(e);
+}
+
+Cache::Handle* Cache::Lookup(const Slice& key, LookupBehavior behavior) {
+  uint64_t hash = CityHash64(reinterpret_cast<const char*>(key.data()), key.size());
+  return reinterpret_cast<Handle*>(GetShard(hash)->Lookup(key, hash, behavior));
+}
+
+void Cache::Release(Handle* handle) {
+  CacheEntry* e = reinterpret_cast<CacheEntry*>(handle);
+  GetShard(e->hash)->Release(e);
+}
+
+Slice Cache::Value(Handle* handle) const {
+  CacheEntry* e = reinterpret_cast<CacheEntry*>(handle);
+  return Slice(e->mutable_value(), e->val_len);
+}
+
+void Cache::Erase(const Slice& key) {
+  uint64_t hash = CityHash64(reinterpret_cast<const char*>(key.data()), key.size());
+  GetShard(hash)->Erase(key, hash);
+}
+
+} // namespace bb
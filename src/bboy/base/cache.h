@@ -0,0 +1,131 @@
+#ifndef BBOY_BASE_CACHE_H_
+#define BBOY_BASE_CACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bboy/gbase/macros.h"
+#include "bboy/base/slice.h"
+
+namespace bb {
+
+class MemTracker;
+
+namespace internal {
+class CacheShard;
+} // namespace internal
+
+// A sharded cache mapping keys to byte buffers, e.g. blocks of files keyed
+// by file name and offset.
+//
+// The capacity of the cache is split evenly among its shards, each of which
+// has its own lock and evicts its least recently used entries once the total
+// "charge" of its entries exceeds its share. The charge of an entry defaults
+// to the memory it takes.
+//
+// Eviction is scan-resistant: each shard is a segmented LRU. Entries are
+// inserted into a probationary segment and promoted to a protected segment,
+// which takes up to --cache_protected_segment_ratio of the capacity, when
+// they're looked up again. Entries pushed out of the protected segment go back
+// to the most recently used end of the probationary one, and eviction only
+// ever takes from the probationary segment. A large scan touching each block
+// once can thus only displace other probationary entries, never the
+// frequently used ones.
+//
+// Entries are reference-counted: a handle returned by Insert() or Lookup()
+// keeps its entry, and the value it points to, valid until it's released,
+// even if the entry is erased or evicted in the meantime.
+//
+// The memory of the entries is charged to a MemTracker which is a child of
+// the tracker passed to the constructor.
+//
+// This class is thread-safe.
+class Cache {
+ public:
+  // An entry in the cache, referenced by the caller.
+  struct Handle {};
+
+  // An entry allocated with Allocate() which has yet to be inserted.
+  struct PendingHandle {};
+
+  // How a hit in Lookup() affects the entry.
+  enum LookupBehavior {
+    // The entry becomes the most recently used one, and is promoted to the
+    // protected segment.
+    PROMOTE,
+    // The entry's position is left unchanged. For scans and other one-off
+    // accesses that shouldn't keep the entry in the cache longer.
+    NO_PROMOTE,
+  };
+
+  // The charge of an entry is the memory it takes.
+  static const int64_t kAutomaticCharge = -1;
+
+  // Creates a cache with room for entries with a total charge of
+  // 'capacity', split among 'num_shards' shards (rounded up to a power of
+  // two; if 0, based on the number of CPUs). The memory of the entries is
+  // charged to a new tracker named 'id', a child of 'parent_mem_tracker' (or
+  // of the root tracker if null).
+  Cache(const std::string& id, size_t capacity,
+        const std::shared_ptr<MemTracker>& parent_mem_tracker = std::shared_ptr<MemTracker>(),
+        int num_shards = 0);
+
+  // All handles must have been released.
+  ~Cache();
+
+  // Allocate an entry for 'key' with a value of 'val_len' bytes, to be
+  // filled in through MutableValue() (for instance, by reading data directly
+  // into it) before being passed to Insert(). An entry which is not inserted
+  // must be passed to Free().
+  //
+  // 'charge' is the amount of the capacity taken by the entry, see
+  // kAutomaticCharge.
+  PendingHandle* Allocate(const Slice& key, size_t val_len,
+                          int64_t charge = kAutomaticCharge);
+
+  // The value buffer of the pending entry 'handle'.
+  uint8_t* MutableValue(PendingHandle* handle);
+
+  // Free the pending entry 'handle' without inserting it.
+  void Free(PendingHandle* handle);
+
+  // Insert the pending entry 'handle', replacing any entry with the same key,
+  // and return a handle to it, which must be passed to Release() once the
+  // caller is done with it. The entry may be evicted right away if it's
+  // larger than the capacity of its shard, but the returned handle is valid
+  // regardless.
+  Handle* Insert(PendingHandle* handle) WARN_UNUSED_RESULT;
+
+  // Look up the entry of 'key'. Returns null if there is none; otherwise the
+  // returned handle must be passed to Release() once the caller is done with
+  // it.
+  Handle* Lookup(const Slice& key, LookupBehavior behavior = PROMOTE) WARN_UNUSED_RESULT;
+
+  // Release a handle returned by Insert() or Lookup().
+  void Release(Handle* handle);
+
+  // The value of the entry 'handle'. Valid until the handle is released.
+  Slice Value(Handle* handle) const;
+
+  // Remove the entry of 'key' from the cache, if any. Handles to the entry
+  // remain valid.
+  void Erase(const Slice& key);
+
+  const std::shared_ptr<MemTracker>& mem_tracker() const { return mem_tracker_; }
+
+ private:
+  internal::CacheShard* GetShard(uint64_t hash) const;
+
+  std::shared_ptr<MemTracker> mem_tracker_;
+  std::vector<std::unique_ptr<internal::CacheShard>> shards_;
+  // The number of bits of a key's hash that select its shard.
+  int shard_bits_;
+
+  DISALLOW_COPY_AND_ASSIGN(Cache);
+};
+
+} // namespace bb
+
+#endif // BBOY_BASE_CACHE_H_
@@ -0,0 +1,240 @@
+#include "bboy/base/crc.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#include "bboy/gbase/cpu.h"
+#include "bboy/gbase/endian.h"
+#include "bboy/gbase/port.h"
+
+// Polynomials are represented bit-reflected, as in the CRC register: bit 31
+// is the coefficient of x^0 and bit 0 that of x^31.
+
+namespace bb {
+namespace crc {
+
+namespace {
+
+// The Castagnoli polynomial, without its x^32 term.
+const uint32_t kPoly = 0x82f63b78;
+
+// Large buffers are checksummed as three streams of blocks of these sizes.
+const size_t kLongBlock = 8192;
+const size_t kShortBlock = 256;
+
+// Returns a * b modulo the polynomial.
+uint32_t MultModP(uint32_t a, uint32_t b) {
+  uint32_t m = 1U << 31;
+  uint32_t p = 0;
+  while (true) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) {
+        break;
+      }
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ kPoly : b >> 1;
+  }
+  return p;
+}
+
+struct Tables {
+  Tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? (c >> 1) ^ kPoly : c >> 1;
+      }
+      slice[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+      for (int k = 1; k < 8; k++) {
+        slice[k][i] = (slice[k - 1][i] >> 8) ^ slice[0][slice[k - 1][i] & 0xff];
+      }
+    }
+
+    uint32_t p = 1U << 30;  // x^1
+    x2n[0] = p;
+    for (int n = 1; n < 32; n++) {
+      x2n[n] = p = MultModP(p, p);
+    }
+
+    long_shift[0] = X2nModP(8 * kLongBlock, 0);
+    long_shift[1] = X2nModP(16 * kLongBlock, 0);
+    short_shift[0] = X2nModP(8 * kShortBlock, 0);
+    short_shift[1] = X2nModP(16 * kShortBlock, 0);
+    // See ShiftClmul().
+    long_shift_clmul[0] = X2nModP(8 * kLongBlock - 33, 0);
+    long_shift_clmul[1] = X2nModP(16 * kLongBlock - 33, 0);
+    short_shift_clmul[0] = X2nModP(8 * kShortBlock - 33, 0);
+    short_shift_clmul[1] = X2nModP(16 * kShortBlock - 33, 0);
+  }
+
+  // Returns x^(n * 2^k) modulo the polynomial.
+  uint32_t X2nModP(size_t n, int k) const {
+    uint32_t p = 1U << 31;  // x^0
+    while (n) {
+      if (n & 1) {
+        p = MultModP(x2n[k & 31], p);
+      }
+      n >>= 1;
+      k++;
+    }
+    return p;
+  }
+
+  // Tables for slicing-by-8: slice[k][b] is the CRC of byte b followed by
+  // k zero bytes.
+  uint32_t slice[8][256];
+
+  // x2n[k] is x^(2^k) modulo the polynomial.
+  uint32_t x2n[32];
+
+  // The operators shifting a CRC register over one and two blocks.
+  uint32_t long_shift[2];
+  uint32_t short_shift[2];
+  uint32_t long_shift_clmul[2];
+  uint32_t short_shift_clmul[2];
+};
+
+const Tables& GetTables() {
+  static const Tables tables;
+  return tables;
+}
+
+uint32_t SoftwareImpl(uint32_t crc, const uint8_t* p, size_t n) {
+  const Tables& t = GetTables();
+  while (n > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    crc = t.slice[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    n--;
+  }
+  while (n >= 8) {
+    uint64_t word = LittleEndian::Load64(p) ^ crc;
+    crc = t.slice[7][word & 0xff] ^
+          t.slice[6][(word >> 8) & 0xff] ^
+          t.slice[5][(word >> 16) & 0xff] ^
+          t.slice[4][(word >> 24) & 0xff] ^
+          t.slice[3][(word >> 32) & 0xff] ^
+          t.slice[2][(word >> 40) & 0xff] ^
+          t.slice[1][(word >> 48) & 0xff] ^
+          t.slice[0][word >> 56];
+    p += 8;
+    n -= 8;
+  }
+  while (n > 0) {
+    crc = t.slice[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    n--;
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+
+// Returns the CRC register 'crc' shifted over the data that 'k' is the
+// operator of: the product of reflected 32-bit polynomials is one bit short
+// of 64 bits, and the crc32 instruction multiplies its input by x^32, so
+// 'k' must be x^(8n - 33) to shift over n bytes.
+__attribute__((target("sse4.2,pclmul")))
+uint32_t ShiftClmul(uint32_t crc, uint32_t k) {
+  __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(k), 0);
+  return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+// Checksum three streams of 'block' bytes each, starting at 'p', combining
+// their CRC registers with the shift operators 'shift' (see Tables).
+template<bool kClmul>
+__attribute__((target("sse4.2")))
+uint64_t InterleavedBlocks(uint64_t crc, const uint8_t* p, size_t block,
+                           const uint32_t* shift) {
+  uint64_t crc1 = 0;
+  uint64_t crc2 = 0;
+  const uint8_t* end = p + block;
+  do {
+    crc = _mm_crc32_u64(crc, LittleEndian::Load64(p));
+    crc1 = _mm_crc32_u64(crc1, LittleEndian::Load64(p + block));
+    crc2 = _mm_crc32_u64(crc2, LittleEndian::Load64(p + 2 * block));
+    p += 8;
+  } while (p < end);
+  if (kClmul) {
+    return ShiftClmul(crc, shift[1]) ^ ShiftClmul(crc1, shift[0]) ^ crc2;
+  }
+  return MultModP(shift[1], crc) ^ MultModP(shift[0], crc1) ^ crc2;
+}
+
+template<bool kClmul>
+__attribute__((target("sse4.2")))
+uint32_t HardwareImpl(uint32_t crc32, const uint8_t* p, size_t n) {
+  const Tables& t = GetTables();
+  uint64_t crc = crc32;
+  while (n > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    n--;
+  }
+  // The three streams keep the three pipelined crc32 units of the CPU busy,
+  // rather than waiting on the latency of each instruction in turn.
+  while (n >= 3 * kLongBlock) {
+    crc = InterleavedBlocks<kClmul>(crc, p, kLongBlock,
+                                    kClmul ? t.long_shift_clmul : t.long_shift);
+    p += 3 * kLongBlock;
+    n -= 3 * kLongBlock;
+  }
+  while (n >= 3 * kShortBlock) {
+    crc = InterleavedBlocks<kClmul>(crc, p, kShortBlock,
+                                    kClmul ? t.short_shift_clmul : t.short_shift);
+    p += 3 * kShortBlock;
+    n -= 3 * kShortBlock;
+  }
+  while (n >= 8) {
+    crc = _mm_crc32_u64(crc, LittleEndian::Load64(p));
+    p += 8;
+    n -= 8;
+  }
+  while (n > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    n--;
+  }
+  return crc;
+}
+
+#endif // defined(__x86_64__)
+
+typedef uint32_t (*CrcImpl)(uint32_t crc, const uint8_t* p, size_t n);
+
+CrcImpl SelectImpl() {
+#if defined(__x86_64__)
+  base::CPU cpu;
+  if (cpu.has_sse42()) {
+    return cpu.has_pclmulqdq() ? &HardwareImpl<true> : &HardwareImpl<false>;
+  }
+#endif
+  return &SoftwareImpl;
+}
+
+CrcImpl GetImpl() {
+  static const CrcImpl impl = SelectImpl();
+  return impl;
+}
+
+} // anonymous namespace
+
+uint32_t Crc32c(const void* data, size_t n, uint32_t crc) {
+  return ~GetImpl()(~crc, static_cast<const uint8_t*>(data), n);
+}
+
+uint32_t Crc32cCombine(uint32_t crc_a, uint32_t crc_b, size_t len_b) {
+  return MultModP(GetTables().X2nModP(len_b, 3), crc_a) ^ crc_b;
+}
+
+bool IsCrc32cHardwareAccelerated() {
+  return GetImpl() != &SoftwareImpl;
+}
+
+uint32_t Crc32cSoftware(const void* data, size_t n, uint32_t crc) {
+  return ~SoftwareImpl(~crc, static_cast<const uint8_t*>(data), n);
+}
+
+} // namespace crc
+} // namespace bb
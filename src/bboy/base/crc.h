@@ -0,0 +1,36 @@
+#ifndef BBOY_BASE_CRC_H_
+#define BBOY_BASE_CRC_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bb {
+namespace crc {
+
+// CRC-32C (Castagnoli), as computed by the SSE4.2 crc32 instruction and used
+// by iSCSI and ext4, with the usual pre- and post-inversion.
+//
+// Returns the CRC of the 'n' bytes at 'data' appended to data whose CRC is
+// 'crc' (0 for none). The implementation is picked at runtime: on CPUs with
+// SSE4.2, large buffers are checksummed as three interleaved streams whose
+// CRCs are combined with carry-less multiplications (PCLMULQDQ, if
+// available), running at several GB/s; other CPUs use a portable
+// slicing-by-8 implementation.
+uint32_t Crc32c(const void* data, size_t n, uint32_t crc = 0);
+
+// Returns the CRC of the concatenation of A and B given 'crc_a', the CRC of
+// A, and 'crc_b' and 'len_b', the CRC and length of B. Allows computing the
+// CRC of a large buffer from the CRCs of chunks computed in parallel.
+uint32_t Crc32cCombine(uint32_t crc_a, uint32_t crc_b, size_t len_b);
+
+// Whether Crc32c() uses the SSE4.2 crc32 instruction.
+bool IsCrc32cHardwareAccelerated();
+
+// The portable implementation of Crc32c(), regardless of the CPU. For tests
+// and benchmarks.
+uint32_t Crc32cSoftware(const void* data, size_t n, uint32_t crc = 0);
+
+} // namespace crc
+} // namespace bb
+
+#endif // BBOY_BASE_CRC_H_
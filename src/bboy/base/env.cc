@@ -1,9 +1,13 @@
 
 #include "bboy/base/env.h"
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 
+#include "bboy/gbase/strings/substitute.h"
 #include "bboy/base/faststring.h"
+#include "bboy/base/slice.h"
 
 using std::unique_ptr;
 
@@ -12,12 +16,79 @@ namespace bb {
 Env::~Env() {
 }
 
+Status Env::CopyFile(const std::string& source_path, const std::string& dest_path,
+                     const WritableFileOptions& opts) {
+  unique_ptr<SequentialFile> source;
+  RETURN_NOT_OK(NewSequentialFile(source_path, &source));
+  uint64_t size;
+  RETURN_NOT_OK(GetFileSize(source_path, &size));
+
+  unique_ptr<WritableFile> dest;
+  RETURN_NOT_OK(NewWritableFile(opts, dest_path, &dest));
+  RETURN_NOT_OK(dest->PreAllocate(size));
+
+  const int32_t kBufferSize = 1024 * 1024;
+  unique_ptr<uint8_t[]> scratch(new uint8_t[kBufferSize]);
+
+  uint64_t bytes_read = 0;
+  while (bytes_read < size) {
+    uint64_t max_bytes_to_read = std::min<uint64_t>(size - bytes_read, kBufferSize);
+    Slice data;
+    RETURN_NOT_OK(source->Read(max_bytes_to_read, &data, scratch.get()));
+    RETURN_NOT_OK(dest->Append(data));
+    bytes_read += data.size();
+  }
+  return dest->Close();
+}
+
+Status Env::ParallelWalk(const std::string& root, DirectoryOrder order,
+                         const WalkCallback& cb, const ParallelWalkOptions& /* opts */) {
+  return Walk(root, order, cb);
+}
+
+Status Env::ParallelGetFileSizeOnDiskRecursively(const std::string& root,
+                                                 const ParallelWalkOptions& /* opts */,
+                                                 uint64_t* bytes_used) {
+  return GetFileSizeOnDiskRecursively(root, bytes_used);
+}
+
+Status Env::ParallelDeleteRecursively(const std::string& dirname,
+                                      const ParallelWalkOptions& /* opts */) {
+  return DeleteRecursively(dirname);
+}
+
 SequentialFile::~SequentialFile() {
 }
 
 RandomAccessFile::~RandomAccessFile() {
 }
 
+Status RandomAccessFile::ReadV(const std::vector<ReadRequest>& requests) const {
+  for (const ReadRequest& req : requests) {
+    uint64_t offset = req.offset;
+    uint8_t* dst = req.scratch;
+    size_t rem = req.length;
+    while (rem > 0) {
+      Slice chunk;
+      RETURN_NOT_OK(Read(offset, rem, &chunk, dst));
+      if (chunk.size() == 0) {
+        return Status::IOError(strings::Substitute(
+            "EOF trying to read $0 bytes at offset $1 of $2",
+            req.length, req.offset, filename()));
+      }
+      // Read() may return data pointing elsewhere than 'dst'.
+      if (chunk.data() != dst) {
+        memmove(dst, chunk.data(), chunk.size());
+      }
+      offset += chunk.size();
+      dst += chunk.size();
+      rem -= chunk.size();
+    }
+    *req.result = Slice(req.scratch, req.length);
+  }
+  return Status::OK();
+}
+
 WritableFile::~WritableFile() {
 }
 
@@ -20,12 +20,15 @@ extern uint32_t g_parsed_unmask;
 
 class faststring;
 class FileLock;
+class MemTracker;
 class RandomAccessFile;
 class RWFile;
 class SequentialFile;
 class Slice;
+class ThreadPool;
 class WritableFile;
 
+struct ParallelWalkOptions;
 struct RandomAccessFileOptions;
 struct RWFileOptions;
 struct WritableFileOptions;
@@ -159,6 +162,24 @@ class Env {
   // This should operate safely, not following any symlinks, etc.
   virtual Status DeleteRecursively(const std::string &dirname) = 0;
 
+  // Like DeleteRecursively(), but walks the tree in parallel as described by
+  // ParallelWalk().
+  //
+  // The default implementation calls DeleteRecursively().
+  virtual Status ParallelDeleteRecursively(const std::string& dirname,
+                                           const ParallelWalkOptions& opts);
+
+  // Copy the contents of file 'source_path' to file 'dest_path', which is
+  // opened according to 'opts' (and synced if 'opts.sync_on_close' is set).
+  // This is not atomic: on error, a partial copy may be left in 'dest_path'.
+  //
+  // The default implementation copies the data through a user-space buffer
+  // using the file abstractions of this Env. Implementations may use faster
+  // mechanisms, such as reflinks or in-kernel copies.
+  virtual Status CopyFile(const std::string& source_path,
+                          const std::string& dest_path,
+                          const WritableFileOptions& opts);
+
   // Store the logical size of fname in *file_size.
   virtual Status GetFileSize(const std::string& fname, uint64_t* file_size) = 0;
 
@@ -172,6 +193,14 @@ class Env {
   // as reported by GetFileSizeOnDisk(), storing the grand total in 'bytes_used'.
   virtual Status GetFileSizeOnDiskRecursively(const std::string& root, uint64_t* bytes_used) = 0;
 
+  // Like GetFileSizeOnDiskRecursively(), but walks the tree in parallel as
+  // described by ParallelWalk().
+  //
+  // The default implementation calls GetFileSizeOnDiskRecursively().
+  virtual Status ParallelGetFileSizeOnDiskRecursively(const std::string& root,
+                                                      const ParallelWalkOptions& opts,
+                                                      uint64_t* bytes_used);
+
   // Returns the modified time of the file in microseconds.
   //
   // The timestamp is a 'system' timestamp, and is not guaranteed to be
@@ -270,6 +299,22 @@ class Env {
                       DirectoryOrder order,
                       const WalkCallback& cb) = 0;
 
+  // Like Walk(), but the subdirectories of 'root' are listed in parallel on a
+  // thread pool (see ParallelWalkOptions), so 'cb' is invoked concurrently
+  // from several threads and must be thread-safe. Entries are visited in no
+  // particular order, except that a directory is visited before (PRE_ORDER)
+  // or after (POST_ORDER) all of its contents.
+  //
+  // If any entry could not be accessed or 'cb' returned an error, the walk
+  // still completes and returns an error with the number of failures and the
+  // first of them.
+  //
+  // The default implementation calls Walk().
+  virtual Status ParallelWalk(const std::string& root,
+                              DirectoryOrder order,
+                              const WalkCallback& cb,
+                              const ParallelWalkOptions& opts);
+
   // Finds paths on the filesystem matching a pattern.
   //
   // The found pathnames are added to the 'paths' vector. If no pathnames are
@@ -356,6 +401,19 @@ class SequentialFile {
   virtual const std::string& filename() const = 0;
 };
 
+// A single range to read with RandomAccessFile::ReadV().
+struct ReadRequest {
+  // The range of the file to read.
+  uint64_t offset;
+  size_t length;
+
+  // Buffer of at least 'length' bytes to read the data into.
+  uint8_t* scratch;
+
+  // On success, set to the data read, which may point into 'scratch'.
+  Slice* result;
+};
+
 // A file abstraction for randomly reading the contents of a file.
 class RandomAccessFile {
  public:
@@ -374,6 +432,17 @@ class RandomAccessFile {
   virtual Status Read(uint64_t offset, size_t n, Slice* result,
                       uint8_t *scratch) const = 0;
 
+  // Read all the ranges described by 'requests' at once. Unlike Read(), every
+  // range is read in full: hitting EOF before the end of a range is an error.
+  // Implementations may reorder the reads, coalesce adjacent ranges into a
+  // single system call and issue independent ranges in parallel. If an error
+  // is returned, the contents of the scratch buffers are undefined.
+  //
+  // The default implementation reads the ranges one at a time.
+  //
+  // Safe for concurrent use by multiple threads.
+  virtual Status ReadV(const std::vector<ReadRequest>& requests) const;
+
   // Returns the size of the file
   virtual Status Size(uint64_t *size) const = 0;
 
@@ -383,6 +452,11 @@ class RandomAccessFile {
   // Returns the approximate memory usage of this RandomAccessFile including
   // the object itself.
   virtual size_t memory_footprint() const = 0;
+
+  // Whether Read() returns data from a memory mapping of the file. If so,
+  // 'scratch' is not used and may be null, and the returned data stay valid
+  // for the lifetime of this object.
+  virtual bool IsMemoryMapped() const { return false; }
 };
 
 // Creation-time options for WritableFile
@@ -393,14 +467,48 @@ struct WritableFileOptions {
   // See CreateMode for details.
   Env::CreateMode mode;
 
+  // If non-zero, appended data is accumulated in a user-space buffer of this
+  // size and written out with a single system call when the buffer fills up,
+  // or on Flush(), Sync() and Close(). Useful for writers issuing many small
+  // appends. Data in the buffer is not visible to readers of the file until
+  // it's written out.
+  size_t buffer_size;
+
+  // The tracker charged for the memory of the write buffer. If null, the
+  // buffer is charged to the global "writable_file_buffers" tracker.
+  std::shared_ptr<MemTracker> buffer_mem_tracker;
+
+  // Open the file with O_DIRECT, bypassing the page cache. Appends are
+  // accumulated in a buffer aligned on the filesystem block size (see
+  // Env::GetBlockSize()) of at least 'buffer_size' bytes and written out in
+  // whole blocks; a partial last block is padded on disk and rewritten by
+  // subsequent appends. Not supported by every filesystem (e.g. tmpfs).
+  bool direct_io;
+
   WritableFileOptions()
     : sync_on_close(false),
-      mode(Env::CREATE_IF_NON_EXISTING_TRUNCATE) { }
+      mode(Env::CREATE_IF_NON_EXISTING_TRUNCATE),
+      buffer_size(0),
+      direct_io(false) { }
 };
 
 // Options specified when a file is opened for random access.
 struct RandomAccessFileOptions {
-  RandomAccessFileOptions() {}
+  // Open the file with O_DIRECT, bypassing the page cache. Reads at
+  // unaligned offsets or into unaligned buffers go through an internal
+  // aligned bounce buffer; see AlignedBuffer for avoiding the extra copy.
+  bool direct_io;
+
+  // Map the whole file into memory. Read() then returns Slices pointing into
+  // the mapping rather than copying into 'scratch' (see
+  // RandomAccessFile::IsMemoryMapped()). The mapping is taken when the file
+  // is opened: data appended to the file afterwards is not visible. Not
+  // compatible with 'direct_io'.
+  bool mmap;
+
+  RandomAccessFileOptions()
+    : direct_io(false),
+      mmap(false) {}
 };
 
 // A file abstraction for sequential writing.  The implementation
@@ -466,9 +574,44 @@ struct RWFileOptions {
   // See CreateMode for details.
   Env::CreateMode mode;
 
+  // Open the file with O_DIRECT, bypassing the page cache. Unaligned reads
+  // go through an aligned bounce buffer; unaligned writes read, modify and
+  // write back the partially covered blocks, so concurrent writes to
+  // different parts of the same block are not safe in this mode.
+  bool direct_io;
+
+  // Make Sync() flush the file even if nothing was written through this
+  // handle since the last sync, e.g. to sync the data written through
+  // another handle to the same file. By default, such syncs are skipped.
+  bool sync_unwritten;
+
   RWFileOptions()
     : sync_on_close(false),
-      mode(Env::CREATE_IF_NON_EXISTING_TRUNCATE) { }
+      mode(Env::CREATE_IF_NON_EXISTING_TRUNCATE),
+      direct_io(false),
+      sync_unwritten(false) { }
+};
+
+// Options for the parallel directory traversals of Env.
+struct ParallelWalkOptions {
+  // The pool onto which subdirectories are fanned out. It may be shared with
+  // other work: the traversal never blocks a pool thread. If null, a pool of
+  // 'num_threads' threads is created for the duration of the traversal.
+  ThreadPool* pool;
+
+  // See 'pool'.
+  int num_threads;
+
+  // The maximum number of directories kept open so that their subdirectories
+  // and files can be accessed relative to them (openat(2) and friends) rather
+  // than by resolving their full paths again. Directories being listed are
+  // open regardless, so at most one per pool thread is added to this.
+  int max_open_dirs;
+
+  ParallelWalkOptions()
+    : pool(nullptr),
+      num_threads(8),
+      max_open_dirs(256) { }
 };
 
 // A file abstraction for both reading and writing. No notion of a built-in
@@ -19,7 +19,10 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <algorithm>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <type_traits>
 #include <vector>
@@ -33,16 +36,27 @@
 #include "bboy/gbase/strings/substitute.h"
 
 #include "bboy/base/sync/atomic.h"
+#include "bboy/base/aligned_buffer.h"
 #include "bboy/base/env.h"
 #include "bboy/base/errno.h"
 #include "bboy/base/malloc.h"
+#include "bboy/base/mem_tracker.h"
 #include "bboy/base/path_util.h"
 #include "bboy/base/monotime.h"
 #include "bboy/base/slice.h"
 #include "bboy/base/scoped_cleanup.h"
+#include "bboy/base/sync/countdown_latch.h"
+#include "bboy/base/sync/locks.h"
+#include "bboy/base/sync/mutex.h"
+#include "bboy/base/sync/rw_mutex.h"
+#include "bboy/base/thread/threadpool.h"
 
 #include <linux/falloc.h>
+#include <linux/fs.h>
 #include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <sys/vfs.h>
 
@@ -93,8 +107,14 @@ DEFINE_bool(never_fsync, false,
 DEFINE_double(env_inject_io_error_on_write_or_preallocate, 0.0,
               "Fraction of the time that write or preallocate operations will fail");
 
+DEFINE_int32(env_readv_parallelism, 8,
+             "Maximum number of non-adjacent ranges that RandomAccessFile::ReadV() "
+             "reads in parallel, including the calling thread. Set to 1 to read "
+             "all ranges from the calling thread.");
+
 using base::subtle::Atomic64;
 using base::subtle::Barrier_AtomicIncrement;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -191,6 +211,231 @@ static Status DoOpen(const string& filename, Env::CreateMode mode, int* fd) {
   return Status::OK();
 }
 
+// Switch the open file 'fd' to direct I/O (O_DIRECT) and output the
+// alignment required for offsets, lengths and buffers of its I/O.
+static Status EnableDirectIO(const string& filename, int fd, size_t* alignment) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0) {
+    return IOError(filename, errno);
+  }
+  struct stat sbuf;
+  if (fstat(fd, &sbuf) != 0) {
+    return IOError(filename, errno);
+  }
+  // The preferred I/O block size of the filesystem is a multiple of the
+  // logical block size of the device, so it's always a safe alignment.
+  *alignment = std::max<size_t>(sbuf.st_blksize, 512);
+  return Status::OK();
+}
+
+// Read up to 'n' bytes at 'offset' from 'fd', which is open for direct I/O
+// with the given 'alignment', into 'scratch'. If the request is not aligned,
+// the data is read through an aligned bounce buffer. Stops short of 'n'
+// bytes only at EOF; outputs the number of bytes read into 'nread'.
+static Status DoDirectRead(const string& filename, int fd, size_t alignment,
+                           uint64_t offset, size_t n, uint8_t* scratch, size_t* nread) {
+  const uint64_t start = AlignDown(offset, alignment);
+  const uint64_t end = AlignUp(offset + n, alignment);
+  const bool aligned = start == offset && end == offset + n &&
+                       IsAligned(reinterpret_cast<uintptr_t>(scratch), alignment);
+  AlignedBuffer bounce;
+  uint8_t* dst = scratch;
+  if (!aligned) {
+    RETURN_NOT_OK(bounce.Allocate(alignment, end - start));
+    dst = bounce.data();
+  }
+
+  const size_t len = end - start;
+  size_t total = 0;
+  while (total < len) {
+    ssize_t r;
+    RETRY_ON_EINTR(r, pread(fd, dst + total, len - total, start + total));
+    if (r < 0) {
+      return IOError(filename, errno);
+    }
+    total += r;
+    // A short read which is not a multiple of the block size can only
+    // happen at EOF (and a retry would fail with EINVAL anyway).
+    if (r == 0 || !IsAligned(total, alignment)) {
+      break;
+    }
+  }
+
+  const size_t head = offset - start;
+  *nread = total > head ? std::min<size_t>(total - head, n) : 0;
+  if (!aligned && *nread > 0) {
+    memcpy(scratch, dst + head, *nread);
+  }
+  return Status::OK();
+}
+
+// Read from 'fd' at 'offset' until all the 'iovcnt' buffers of 'iov' are
+// filled, retrying on short reads. Modifies 'iov'.
+static Status DoPreadvFully(const string& filename, int fd, struct iovec* iov,
+                            int iovcnt, uint64_t offset) {
+  while (iovcnt > 0) {
+    ssize_t r;
+    RETRY_ON_EINTR(r, preadv(fd, iov, iovcnt, offset));
+    if (r < 0) {
+      return IOError(filename, errno);
+    }
+    if (r == 0) {
+      return Status::IOError(Substitute("EOF trying to read at offset $0 of $1",
+                                        offset, filename));
+    }
+    offset += r;
+    size_t n = r;
+    while (iovcnt > 0 && n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return Status::OK();
+}
+
+// Returns the pool used by ReadV() to read independent ranges in parallel, or
+// null if parallel reads are disabled.
+static ThreadPool* GetReadVThreadPool() {
+  static ThreadPool* pool = []() -> ThreadPool* {
+    if (FLAGS_env_readv_parallelism <= 1) {
+      return nullptr;
+    }
+    gscoped_ptr<ThreadPool> p;
+    Status s = ThreadPoolBuilder("env-readv")
+        .set_min_threads(0)
+        .set_max_threads(FLAGS_env_readv_parallelism - 1)
+        .Build(&p);
+    if (!s.ok()) {
+      LOG(WARNING) << "Unable to create the ReadV() thread pool, ranges will be "
+                   << "read serially: " << s.ToString();
+      return nullptr;
+    }
+    return p.release();
+  }();
+  return pool;
+}
+
+static Status DoPwriteFully(const string& filename, int fd, const uint8_t* data,
+                            size_t n, uint64_t offset) {
+  ssize_t written;
+  RETRY_ON_EINTR(written, pwrite(fd, data, n, offset));
+
+  if (PREDICT_FALSE(written == -1)) {
+    int err = errno;
+    return IOError(filename, err);
+  }
+
+  if (PREDICT_FALSE(written != n)) {
+    return Status::IOError(
+        Substitute("pwrite error: expected to write $0 bytes, wrote $1 bytes instead"
+                   " (perhaps the disk is out of space)",
+                   n, written));
+  }
+  return Status::OK();
+}
+
+// Copy 'size' bytes from the start of 'src_fd' to offset 'dst_offset' of
+// 'dst_fd', keeping the data out of user space where possible. In order of
+// preference: a reflink (FICLONE) shares the source's extents on copy-on-write
+// filesystems; copy_file_range(2) copies within the kernel and may offload
+// the copy to the storage; sendfile(2) also copies within the kernel and works
+// across filesystems on kernels where copy_file_range(2) doesn't. Each method
+// falls back to the next one if it isn't supported for these files, and the
+// last resort is a pread(2)/pwrite(2) loop.
+static Status DoCopyFileData(const string& src_name, int src_fd,
+                             const string& dst_name, int dst_fd,
+                             uint64_t size, uint64_t dst_offset) {
+  if (size == 0) {
+    return Status::OK();
+  }
+#ifdef FICLONE
+  if (dst_offset == 0) {
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+      return Status::OK();
+    }
+    VLOG(2) << "Could not reflink " << src_name << " to " << dst_name << ": "
+            << ErrnoToString(errno);
+  }
+#endif
+
+  // The maximum number of bytes moved by a single in-kernel copy, so that
+  // a copy of a large file doesn't hold up a signal for too long.
+  const size_t kMaxKernelCopy = 1L << 30;
+  const size_t kBufferSize = 1024 * 1024;
+  enum CopyMethod { COPY_FILE_RANGE, SENDFILE, READ_WRITE };
+  CopyMethod method = COPY_FILE_RANGE;
+  unique_ptr<uint8_t[]> buf;
+  off_t src_off = 0;
+  off_t dst_off = dst_offset;
+  while (src_off < size) {
+    ssize_t r;
+    switch (method) {
+      case COPY_FILE_RANGE:
+#ifdef __NR_copy_file_range
+        RETRY_ON_EINTR(r, syscall(__NR_copy_file_range, src_fd, &src_off, dst_fd, &dst_off,
+                                  std::min<uint64_t>(size - src_off, kMaxKernelCopy), 0));
+#else
+        r = -1;
+        errno = ENOSYS;
+#endif
+        if (r < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                      errno == EOPNOTSUPP)) {
+          VLOG(2) << "copy_file_range() not usable for " << dst_name << ": "
+                  << ErrnoToString(errno);
+          method = SENDFILE;
+          continue;
+        }
+        break;
+      case SENDFILE:
+        // sendfile() writes at the current file offset of the destination.
+        if (lseek(dst_fd, dst_off, SEEK_SET) < 0) {
+          return IOError(dst_name, errno);
+        }
+        RETRY_ON_EINTR(r, sendfile(dst_fd, src_fd, &src_off,
+                                   std::min<uint64_t>(size - src_off, kMaxKernelCopy)));
+        if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+          VLOG(2) << "sendfile() not usable for " << dst_name << ": "
+                  << ErrnoToString(errno);
+          method = READ_WRITE;
+          continue;
+        }
+        if (r > 0) {
+          dst_off += r;
+        }
+        break;
+      case READ_WRITE:
+        if (!buf) {
+          buf.reset(new uint8_t[kBufferSize]);
+        }
+        RETRY_ON_EINTR(r, pread(src_fd, buf.get(),
+                                std::min<uint64_t>(size - src_off, kBufferSize), src_off));
+        if (r < 0) {
+          return IOError(src_name, errno);
+        }
+        if (r > 0) {
+          RETURN_NOT_OK(DoPwriteFully(dst_name, dst_fd, buf.get(), r, dst_off));
+          src_off += r;
+          dst_off += r;
+        }
+        break;
+    }
+    if (r < 0) {
+      // Can't tell which of the files the in-kernel copy failed on.
+      return IOError(Substitute("$0 -> $1", src_name, dst_name), errno);
+    }
+    if (r == 0) {
+      return Status::IOError(Substitute("EOF trying to copy $0 bytes of $1: the file "
+                                        "shrank to $2 bytes", size, src_name, src_off));
+    }
+  }
+  return Status::OK();
+}
+
 class PosixSequentialFile: public SequentialFile {
  private:
   std::string filename_;
@@ -235,15 +480,24 @@ class PosixRandomAccessFile: public RandomAccessFile {
  private:
   std::string filename_;
   int fd_;
+  // The alignment of direct I/O, or 0 if the file is not open with O_DIRECT.
+  size_t direct_io_alignment_;
 
  public:
-  PosixRandomAccessFile(std::string fname, int fd)
-      : filename_(std::move(fname)), fd_(fd) {}
+  PosixRandomAccessFile(std::string fname, int fd, size_t direct_io_alignment = 0)
+      : filename_(std::move(fname)), fd_(fd), direct_io_alignment_(direct_io_alignment) {}
   virtual ~PosixRandomAccessFile() { close(fd_); }
 
   virtual Status Read(uint64_t offset, size_t n, Slice* result,
                       uint8_t *scratch) const OVERRIDE {
 //    ThreadRestrictions::AssertIOAllowed();
+    if (direct_io_alignment_ > 0) {
+      size_t nread = 0;
+      Status s = DoDirectRead(filename_, fd_, direct_io_alignment_,
+                              offset, n, scratch, &nread);
+      *result = Slice(scratch, nread);
+      return s;
+    }
     Status s;
     ssize_t r;
     RETRY_ON_EINTR(r, pread(fd_, scratch, n, offset));
@@ -266,6 +520,80 @@ class PosixRandomAccessFile: public RandomAccessFile {
     return Status::OK();
   }
 
+  // Sorts the requests by offset and coalesces adjacent ranges into a single
+  // preadv() call. The resulting batches are read in parallel on the ReadV()
+  // thread pool, with the calling thread reading the first one.
+  virtual Status ReadV(const vector<ReadRequest>& requests) const OVERRIDE {
+    if (direct_io_alignment_ > 0 || requests.size() <= 1) {
+      return RandomAccessFile::ReadV(requests);
+    }
+
+    vector<const ReadRequest*> sorted;
+    sorted.reserve(requests.size());
+    for (const ReadRequest& req : requests) {
+      if (req.length > 0) {
+        sorted.push_back(&req);
+      }
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const ReadRequest* a, const ReadRequest* b) {
+                return a->offset < b->offset;
+              });
+
+    struct Batch {
+      uint64_t offset;
+      uint64_t end;
+      vector<struct iovec> iov;
+    };
+    vector<Batch> batches;
+    for (const ReadRequest* req : sorted) {
+      if (batches.empty() ||
+          batches.back().end != req->offset ||
+          batches.back().iov.size() >= IOV_MAX) {
+        batches.emplace_back();
+        batches.back().offset = req->offset;
+        batches.back().end = req->offset;
+      }
+      Batch& b = batches.back();
+      b.iov.push_back({ req->scratch, req->length });
+      b.end += req->length;
+    }
+
+    vector<Status> statuses(batches.size());
+    auto read_batch = [&](size_t i) {
+      Batch& b = batches[i];
+      statuses[i] = DoPreadvFully(filename_, fd_, b.iov.data(), b.iov.size(), b.offset);
+    };
+    ThreadPool* pool = batches.size() > 1 ? GetReadVThreadPool() : nullptr;
+    if (pool) {
+      CountDownLatch latch(batches.size() - 1);
+      for (size_t i = 1; i < batches.size(); i++) {
+        Status s = pool->SubmitFunc([&read_batch, &latch, i]() {
+          read_batch(i);
+          latch.CountDown();
+        });
+        if (!s.ok()) {
+          read_batch(i);
+          latch.CountDown();
+        }
+      }
+      read_batch(0);
+      latch.Wait();
+    } else {
+      for (size_t i = 0; i < batches.size(); i++) {
+        read_batch(i);
+      }
+    }
+
+    for (const Status& s : statuses) {
+      RETURN_NOT_OK(s);
+    }
+    for (const ReadRequest& req : requests) {
+      *req.result = Slice(req.scratch, req.length);
+    }
+    return Status::OK();
+  }
+
   virtual const string& filename() const OVERRIDE { return filename_; }
 
   virtual size_t memory_footprint() const OVERRIDE {
@@ -273,6 +601,51 @@ class PosixRandomAccessFile: public RandomAccessFile {
   }
 };
 
+// mmap() based random-access. The file is mapped whole when it's opened.
+class PosixMmapRandomAccessFile: public RandomAccessFile {
+ public:
+  // Takes ownership of the mapping of 'size' bytes at 'base', which is null
+  // if the file is empty.
+  PosixMmapRandomAccessFile(std::string fname, const uint8_t* base, size_t size)
+      : filename_(std::move(fname)), base_(base), size_(size) {}
+
+  virtual ~PosixMmapRandomAccessFile() {
+    if (base_ != nullptr && munmap(const_cast<uint8_t*>(base_), size_) != 0) {
+      PLOG(WARNING) << "Failed to unmap " << filename_;
+    }
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      uint8_t* /* scratch */) const OVERRIDE {
+    if (PREDICT_FALSE(offset > size_)) {
+      *result = Slice();
+      return Status::IOError(Substitute("$0: read at offset $1 beyond the end of the file "
+                                        "($2 bytes)", filename_, offset, size_));
+    }
+    *result = Slice(base_ + offset, std::min<uint64_t>(n, size_ - offset));
+    return Status::OK();
+  }
+
+  virtual Status Size(uint64_t* size) const OVERRIDE {
+    *size = size_;
+    return Status::OK();
+  }
+
+  virtual const string& filename() const OVERRIDE { return filename_; }
+
+  virtual size_t memory_footprint() const OVERRIDE {
+    // The mapping is backed by the page cache.
+    return bboy_malloc_usable_size(this) + filename_.capacity();
+  }
+
+  virtual bool IsMemoryMapped() const OVERRIDE { return true; }
+
+ private:
+  const std::string filename_;
+  const uint8_t* const base_;
+  const size_t size_;
+};
+
 // Use non-memory mapped POSIX files to write data to a file.
 //
 // TODO (perf) investigate zeroing a pre-allocated allocated area in
@@ -280,18 +653,34 @@ class PosixRandomAccessFile: public RandomAccessFile {
 class PosixWritableFile : public WritableFile {
  public:
   PosixWritableFile(std::string fname, int fd, uint64_t file_size,
-                    bool sync_on_close)
+                    bool sync_on_close, size_t buffer_size = 0,
+                    std::shared_ptr<MemTracker> buffer_mem_tracker = nullptr)
       : filename_(std::move(fname)),
         fd_(fd),
         sync_on_close_(sync_on_close),
         filesize_(file_size),
         pre_allocated_size_(0),
-        pending_sync_(false) {}
+        pending_sync_(false),
+        buffer_capacity_(buffer_size),
+        buffer_len_(0),
+        buffer_mem_tracker_(std::move(buffer_mem_tracker)) {
+    if (buffer_capacity_ > 0) {
+      if (!buffer_mem_tracker_) {
+        buffer_mem_tracker_ = MemTracker::FindOrCreateGlobalTracker(
+            -1, "writable_file_buffers");
+      }
+      buffer_.reset(new uint8_t[buffer_capacity_]);
+      buffer_mem_tracker_->Consume(buffer_capacity_);
+    }
+  }
 
   ~PosixWritableFile() {
     if (fd_ >= 0) {
       WARN_NOT_OK(Close(), "Failed to close " + filename_);
     }
+    if (buffer_) {
+      buffer_mem_tracker_->Release(buffer_capacity_);
+    }
   }
 
   virtual Status Append(const Slice& data) OVERRIDE {
@@ -302,16 +691,30 @@ class PosixWritableFile : public WritableFile {
 
   virtual Status AppendVector(const vector<Slice>& data_vector) OVERRIDE {
 //    ThreadRestrictions::AssertIOAllowed();
-    static const size_t kIovMaxElements = IOV_MAX;
-
-    Status s;
-    for (size_t i = 0; i < data_vector.size() && s.ok(); i += kIovMaxElements) {
-      size_t n = std::min(data_vector.size() - i, kIovMaxElements);
-      s = DoWritev(data_vector, i, n);
+    if (buffer_) {
+      RETURN_NOT_OK(buffer_error_);
+      size_t nbytes = 0;
+      for (const Slice& data : data_vector) {
+        nbytes += data.size();
+      }
+      if (buffer_len_ + nbytes <= buffer_capacity_) {
+        for (const Slice& data : data_vector) {
+          memcpy(buffer_.get() + buffer_len_, data.data(), data.size());
+          buffer_len_ += data.size();
+        }
+        return Status::OK();
+      }
+      if (buffer_len_ > 0) {
+        // Write out the buffered data along with the new data, in one go.
+        vector<Slice> combined;
+        combined.reserve(data_vector.size() + 1);
+        combined.emplace_back(buffer_.get(), buffer_len_);
+        combined.insert(combined.end(), data_vector.begin(), data_vector.end());
+        buffer_len_ = 0;
+        return SetBufferError(DoAppendVector(combined));
+      }
     }
-
-    pending_sync_ = true;
-    return s;
+    return DoAppendVector(data_vector);
   }
 
   virtual Status PreAllocate(uint64_t size) OVERRIDE {
@@ -320,7 +723,7 @@ class PosixWritableFile : public WritableFile {
 
 //    TRACE_EVENT1("io", "PosixWritableFile::PreAllocate", "path", filename_);
 //    ThreadRestrictions::AssertIOAllowed();
-    uint64_t offset = std::max(filesize_, pre_allocated_size_);
+    uint64_t offset = std::max(Size(), pre_allocated_size_);
     if (fallocate(fd_, 0, offset, size) < 0) {
       if (errno == EOPNOTSUPP) {
         LOG(WARNING) << "The filesystem does not support fallocate().";
@@ -337,7 +740,7 @@ class PosixWritableFile : public WritableFile {
   virtual Status Close() OVERRIDE {
 //    TRACE_EVENT1("io", "PosixWritableFile::Close", "path", filename_);
 //    ThreadRestrictions::AssertIOAllowed();
-    Status s;
+    Status s = FlushBuffer();
 
     // If we've allocated more space than we used, truncate to the
     // actual size of the file and perform Sync().
@@ -373,6 +776,7 @@ class PosixWritableFile : public WritableFile {
   virtual Status Flush(FlushMode mode) OVERRIDE {
 //    TRACE_EVENT1("io", "PosixWritableFile::Flush", "path", filename_);
 //    ThreadRestrictions::AssertIOAllowed();
+    RETURN_NOT_OK(FlushBuffer());
     int flags = SYNC_FILE_RANGE_WRITE;
     if (mode == FLUSH_SYNC) {
       flags |= SYNC_FILE_RANGE_WAIT_BEFORE;
@@ -387,6 +791,7 @@ class PosixWritableFile : public WritableFile {
   virtual Status Sync() OVERRIDE {
 //    TRACE_EVENT1("io", "PosixWritableFile::Sync", "path", filename_);
 //    ThreadRestrictions::AssertIOAllowed();
+    RETURN_NOT_OK(FlushBuffer());
 //    LOG_SLOW_EXECUTION(WARNING, 1000, Substitute("sync call for $0", filename_)) {
       if (pending_sync_) {
         pending_sync_ = false;
@@ -397,13 +802,47 @@ class PosixWritableFile : public WritableFile {
   }
 
   virtual uint64_t Size() const OVERRIDE {
-    return filesize_;
+    return filesize_ + buffer_len_;
   }
 
   virtual const string& filename() const OVERRIDE { return filename_; }
 
  private:
 
+  Status DoAppendVector(const vector<Slice>& data_vector) {
+    static const size_t kIovMaxElements = IOV_MAX;
+
+    Status s;
+    for (size_t i = 0; i < data_vector.size() && s.ok(); i += kIovMaxElements) {
+      size_t n = std::min(data_vector.size() - i, kIovMaxElements);
+      s = DoWritev(data_vector, i, n);
+    }
+
+    pending_sync_ = true;
+    return s;
+  }
+
+  // Write out the contents of the write buffer, if any.
+  Status FlushBuffer() {
+    RETURN_NOT_OK(buffer_error_);
+    if (buffer_len_ == 0) {
+      return Status::OK();
+    }
+    vector<Slice> data_vector = { Slice(buffer_.get(), buffer_len_) };
+    buffer_len_ = 0;
+    return SetBufferError(DoAppendVector(data_vector));
+  }
+
+  // Records the failure to write out buffered data. Appends of that data
+  // have already returned OK, and some of it may have been written, so it
+  // can't be retried: all further operations fail instead.
+  Status SetBufferError(const Status& s) {
+    if (PREDICT_FALSE(!s.ok())) {
+      buffer_error_ = s;
+    }
+    return s;
+  }
+
   Status DoWritev(const vector<Slice>& data_vector,
                   size_t offset, size_t n) {
 //    MAYBE_RETURN_FAILURE(FLAGS_env_inject_io_error_on_write_or_preallocate,
@@ -450,14 +889,233 @@ class PosixWritableFile : public WritableFile {
   uint64_t pre_allocated_size_;
 
   bool pending_sync_;
+
+  // User-space write buffer; null unless buffering was requested through
+  // WritableFileOptions::buffer_size.
+  const size_t buffer_capacity_;
+  std::unique_ptr<uint8_t[]> buffer_;
+  size_t buffer_len_;
+  std::shared_ptr<MemTracker> buffer_mem_tracker_;
+
+  // See SetBufferError().
+  Status buffer_error_;
+};
+
+// WritableFile implementation for files opened with O_DIRECT.
+//
+// Appends are accumulated in an aligned buffer and written out in whole
+// blocks. On Flush(), Sync() and Close(), the last partial block is written
+// padded with zeroes (the file is then truncated back to its logical size)
+// and kept in the buffer, so that subsequent appends rewrite that block with
+// more data. When appending to an existing file, its partial last block is
+// read back into the buffer first.
+class PosixDirectWritableFile : public WritableFile {
+ public:
+  PosixDirectWritableFile(std::string fname, int fd, uint64_t file_size,
+                          bool sync_on_close, size_t alignment,
+                          std::shared_ptr<MemTracker> buffer_mem_tracker)
+      : filename_(std::move(fname)),
+        fd_(fd),
+        sync_on_close_(sync_on_close),
+        alignment_(alignment),
+        buffer_mem_tracker_(std::move(buffer_mem_tracker)),
+        buf_offset_(AlignDown(file_size, alignment)),
+        buf_len_(file_size - buf_offset_),
+        flushed_len_(buf_len_),
+        pre_allocated_size_(0),
+        pending_sync_(false) {}
+
+  ~PosixDirectWritableFile() {
+    if (fd_ >= 0) {
+      WARN_NOT_OK(Close(), "Failed to close " + filename_);
+    }
+    if (buf_.data()) {
+      buffer_mem_tracker_->Release(buf_.size());
+    }
+  }
+
+  // Allocate the write buffer and load the partial last block of the file,
+  // if any. Must be called before any other method.
+  Status Init(size_t buffer_size) {
+    static const size_t kDefaultBufferSize = 1024 * 1024;
+    if (buffer_size == 0) {
+      buffer_size = kDefaultBufferSize;
+    }
+    RETURN_NOT_OK(buf_.Allocate(alignment_, std::max(buffer_size, alignment_)));
+    if (!buffer_mem_tracker_) {
+      buffer_mem_tracker_ = MemTracker::FindOrCreateGlobalTracker(
+          -1, "writable_file_buffers");
+    }
+    buffer_mem_tracker_->Consume(buf_.size());
+
+    if (buf_len_ > 0) {
+      size_t nread;
+      RETURN_NOT_OK(DoDirectRead(filename_, fd_, alignment_, buf_offset_, alignment_,
+                                 buf_.data(), &nread));
+      if (nread < buf_len_) {
+        return Status::IOError(Substitute("$0: short read of the last block: "
+                                          "expected $1 bytes, read $2",
+                                          filename_, buf_len_, nread));
+      }
+    }
+    return Status::OK();
+  }
+
+  virtual Status Append(const Slice& data) OVERRIDE {
+    vector<Slice> data_vector;
+    data_vector.push_back(data);
+    return AppendVector(data_vector);
+  }
+
+  virtual Status AppendVector(const vector<Slice>& data_vector) OVERRIDE {
+    for (const Slice& data : data_vector) {
+      const uint8_t* src = data.data();
+      size_t rem = data.size();
+      while (rem > 0) {
+        const size_t n = std::min(rem, buf_.size() - buf_len_);
+        memcpy(buf_.data() + buf_len_, src, n);
+        buf_len_ += n;
+        src += n;
+        rem -= n;
+        if (buf_len_ == buf_.size()) {
+          RETURN_NOT_OK(DoPwriteFully(filename_, fd_, buf_.data(), buf_.size(), buf_offset_));
+          pending_sync_ = true;
+          buf_offset_ += buf_.size();
+          buf_len_ = 0;
+          flushed_len_ = 0;
+        }
+      }
+    }
+    return Status::OK();
+  }
+
+  virtual Status PreAllocate(uint64_t size) OVERRIDE {
+    uint64_t offset = std::max(Size(), pre_allocated_size_);
+    if (fallocate(fd_, 0, offset, size) < 0) {
+      if (errno == EOPNOTSUPP) {
+        LOG(WARNING) << "The filesystem does not support fallocate().";
+      } else if (errno == ENOSYS) {
+        LOG(WARNING) << "The kernel does not implement fallocate().";
+      } else {
+        return IOError(filename_, errno);
+      }
+    }
+    pre_allocated_size_ = offset + size;
+    return Status::OK();
+  }
+
+  virtual Status Close() OVERRIDE {
+    Status s = FlushBuffer();
+
+    if (Size() < pre_allocated_size_) {
+      int ret;
+      RETRY_ON_EINTR(ret, ftruncate(fd_, Size()));
+      if (ret != 0 && s.ok()) {
+        s = IOError(filename_, errno);
+      }
+      pending_sync_ = true;
+    }
+
+    if (sync_on_close_) {
+      Status sync_status = Sync();
+      if (!sync_status.ok()) {
+        LOG(ERROR) << "Unable to Sync " << filename_ << ": " << sync_status.ToString();
+        if (s.ok()) {
+          s = sync_status;
+        }
+      }
+    }
+
+    if (close(fd_) < 0) {
+      if (s.ok()) {
+        s = IOError(filename_, errno);
+      }
+    }
+
+    fd_ = -1;
+    return s;
+  }
+
+  virtual Status Flush(FlushMode mode) OVERRIDE {
+    // With O_DIRECT, the data is handed to the device as it's written:
+    // there is no dirty data in the page cache to start writeback for.
+    return FlushBuffer();
+  }
+
+  virtual Status Sync() OVERRIDE {
+    RETURN_NOT_OK(FlushBuffer());
+    if (pending_sync_) {
+      pending_sync_ = false;
+      RETURN_NOT_OK(DoSync(fd_, filename_));
+    }
+    return Status::OK();
+  }
+
+  virtual uint64_t Size() const OVERRIDE {
+    return buf_offset_ + buf_len_;
+  }
+
+  virtual const string& filename() const OVERRIDE { return filename_; }
+
+ private:
+  // Write out the buffered data not yet on disk, padding the last block.
+  Status FlushBuffer() {
+    if (buf_len_ == flushed_len_) {
+      return Status::OK();
+    }
+    const size_t padded_len = AlignUp(buf_len_, alignment_);
+    memset(buf_.data() + buf_len_, 0, padded_len - buf_len_);
+    RETURN_NOT_OK(DoPwriteFully(filename_, fd_, buf_.data(), padded_len, buf_offset_));
+    pending_sync_ = true;
+
+    // Cut the padding off, unless it's within the preallocated space (which
+    // is truncated on Close()).
+    const uint64_t end = Size();
+    if (buf_offset_ + padded_len > pre_allocated_size_ && padded_len != buf_len_) {
+      int ret;
+      RETRY_ON_EINTR(ret, ftruncate(fd_, std::max(end, pre_allocated_size_)));
+      if (ret != 0) {
+        return IOError(filename_, errno);
+      }
+    }
+
+    // Keep only the partial last block in the buffer.
+    const size_t full_len = AlignDown(buf_len_, alignment_);
+    if (full_len > 0) {
+      memmove(buf_.data(), buf_.data() + full_len, buf_len_ - full_len);
+      buf_offset_ += full_len;
+      buf_len_ -= full_len;
+    }
+    flushed_len_ = buf_len_;
+    return Status::OK();
+  }
+
+  const std::string filename_;
+  int fd_;
+  const bool sync_on_close_;
+  const size_t alignment_;
+  std::shared_ptr<MemTracker> buffer_mem_tracker_;
+
+  AlignedBuffer buf_;
+  // The file offset of the first byte of 'buf_'; always aligned.
+  uint64_t buf_offset_;
+  // The number of bytes of data in 'buf_'.
+  size_t buf_len_;
+  // The number of leading bytes of 'buf_' which are already on disk.
+  size_t flushed_len_;
+  uint64_t pre_allocated_size_;
+  bool pending_sync_;
 };
 
 class PosixRWFile : public RWFile {
  public:
-  PosixRWFile(string fname, int fd, bool sync_on_close)
+  PosixRWFile(string fname, int fd, bool sync_on_close, size_t direct_io_alignment = 0,
+              bool sync_unwritten = false)
       : filename_(std::move(fname)),
         fd_(fd),
         sync_on_close_(sync_on_close),
+        direct_io_alignment_(direct_io_alignment),
+        sync_unwritten_(sync_unwritten),
         pending_sync_(false),
         closed_(false) {}
 
@@ -468,6 +1126,17 @@ class PosixRWFile : public RWFile {
   virtual Status Read(uint64_t offset, size_t length,
                       Slice* result, uint8_t* scratch) const OVERRIDE {
 //    ThreadRestrictions::AssertIOAllowed();
+    if (direct_io_alignment_ > 0) {
+      size_t nread = 0;
+      RETURN_NOT_OK(DoDirectRead(filename_, fd_, direct_io_alignment_,
+                                 offset, length, scratch, &nread));
+      if (nread < length) {
+        return Status::IOError(Substitute("EOF trying to read $0 bytes at offset $1",
+                                          length, offset));
+      }
+      *result = Slice(scratch, length);
+      return Status::OK();
+    }
     int rem = length;
     uint8_t* dst = scratch;
     while (rem > 0) {
@@ -498,19 +1167,10 @@ class PosixRWFile : public RWFile {
 //                         Status::IOError(Env::kInjectedFailureStatusMsg));
 
 //    ThreadRestrictions::AssertIOAllowed();
-    ssize_t written;
-    RETRY_ON_EINTR(written, pwrite(fd_, data.data(), data.size(), offset));
-
-    if (PREDICT_FALSE(written == -1)) {
-      int err = errno;
-      return IOError(filename_, err);
-    }
-
-    if (PREDICT_FALSE(written != data.size())) {
-      return Status::IOError(
-          Substitute("pwrite error: expected to write $0 bytes, wrote $1 bytes instead"
-                     " (perhaps the disk is out of space)",
-                     data.size(), written));
+    if (direct_io_alignment_ > 0) {
+      RETURN_NOT_OK(DoDirectWrite(offset, data));
+    } else {
+      RETURN_NOT_OK(DoPwriteFully(filename_, fd_, data.data(), data.size(), offset));
     }
 
     pending_sync_.Store(true);
@@ -552,6 +1212,7 @@ class PosixRWFile : public RWFile {
                              Substitute("ftruncate() failed: $0", ErrnoToString(err)),
                              err);
     }
+    pending_sync_.Store(true);
     return Status::OK();
   }
 
@@ -578,7 +1239,7 @@ class PosixRWFile : public RWFile {
   }
 
   virtual Status Sync() OVERRIDE {
-    if (!pending_sync_.CompareAndSwap(true, false)) {
+    if (!pending_sync_.CompareAndSwap(true, false) && !sync_unwritten_) {
       return Status::OK();
     }
 
@@ -632,9 +1293,83 @@ class PosixRWFile : public RWFile {
   }
 
  private:
+  // Write 'data' at 'offset' of a file open with O_DIRECT.
+  //
+  // A write past the end of the file may write padding after its data, and
+  // then cut the file back to its end. So that this never truncates the
+  // data of a concurrent write, writes which may extend the file hold
+  // 'resize_lock_' exclusively, and the others hold it shared: the file
+  // can't grow under them.
+  Status DoDirectWrite(uint64_t offset, const Slice& data) {
+    const uint64_t aligned_end = AlignUp(offset + data.size(), direct_io_alignment_);
+    uint64_t file_size;
+    {
+      shared_lock<RWMutex> l(resize_lock_);
+      RETURN_NOT_OK(Size(&file_size));
+      if (aligned_end <= file_size) {
+        return DoDirectWriteUnlocked(offset, data, file_size);
+      }
+    }
+    std::lock_guard<RWMutex> l(resize_lock_);
+    RETURN_NOT_OK(Size(&file_size));
+    return DoDirectWriteUnlocked(offset, data, file_size);
+  }
+
+  // Write 'data' at 'offset' of a file open with O_DIRECT, whose size is
+  // 'file_size'. The partially covered blocks at either end of an unaligned
+  // write are read, modified and written back whole.
+  Status DoDirectWriteUnlocked(uint64_t offset, const Slice& data, uint64_t file_size) {
+    const size_t alignment = direct_io_alignment_;
+    const uint64_t end = offset + data.size();
+    if (IsAligned(offset, alignment) && IsAligned(end, alignment) &&
+        IsAligned(reinterpret_cast<uintptr_t>(data.data()), alignment)) {
+      return DoPwriteFully(filename_, fd_, data.data(), data.size(), offset);
+    }
+
+    const uint64_t start = AlignDown(offset, alignment);
+    const uint64_t aligned_end = AlignUp(end, alignment);
+
+    AlignedBuffer buf;
+    RETURN_NOT_OK(buf.Allocate(alignment, aligned_end - start));
+    // Bytes beyond EOF read as zeroes, as if the file had been extended.
+    memset(buf.data(), 0, buf.size());
+    size_t nread;
+    if (start != offset) {
+      RETURN_NOT_OK(DoDirectRead(filename_, fd_, alignment, start, alignment,
+                                 buf.data(), &nread));
+    }
+    const uint64_t last_block = aligned_end - alignment;
+    if (end != aligned_end && (last_block != start || start == offset)) {
+      RETURN_NOT_OK(DoDirectRead(filename_, fd_, alignment, last_block, alignment,
+                                 buf.data() + (last_block - start), &nread));
+    }
+    memcpy(buf.data() + (offset - start), data.data(), data.size());
+    RETURN_NOT_OK(DoPwriteFully(filename_, fd_, buf.data(), buf.size(), start));
+
+    // Writing whole blocks may have extended the file past the end of the
+    // written data: cut it back. 'file_size' is still the size of the file
+    // apart from this write, as the caller holds 'resize_lock_'.
+    if (aligned_end > file_size && end < aligned_end) {
+      int ret;
+      RETRY_ON_EINTR(ret, ftruncate(fd_, std::max(file_size, end)));
+      if (ret != 0) {
+        return IOError(filename_, errno);
+      }
+    }
+    return Status::OK();
+  }
+
   const std::string filename_;
   const int fd_;
   const bool sync_on_close_;
+  // The alignment of direct I/O, or 0 if the file is not open with O_DIRECT.
+  const size_t direct_io_alignment_;
+
+  // See DoDirectWrite().
+  RWMutex resize_lock_;
+
+  // See RWFileOptions::sync_unwritten.
+  const bool sync_unwritten_;
 
   AtomicBool pending_sync_;
   bool closed_;
@@ -657,6 +1392,280 @@ class PosixFileLock : public FileLock {
   int fd_;
 };
 
+// Walks a directory tree in parallel for PosixEnv::ParallelWalk() and its
+// derivatives. Every directory is listed by a task of its own on the pool;
+// subdirectories are opened with openat(2) relative to their parent while
+// the parent is kept open (see ParallelWalkOptions::max_open_dirs), and the
+// visitor accesses files relative to their directory.
+//
+// Like Walk(), the walk doesn't cross filesystem boundaries nor follow
+// symbolic links.
+//
+// Always held by a shared_ptr: the pool tasks keep the walker alive, as they
+// may still be unwinding after Run() returned.
+class ParallelDirWalker : public std::enable_shared_from_this<ParallelDirWalker> {
+ public:
+  // Invoked for each entry found. For files, 'dir_fd' is an open descriptor
+  // of 'dirname'; for directories, it's -1. May be invoked concurrently.
+  typedef std::function<Status(Env::FileType type, int dir_fd,
+                               const string& dirname, const string& basename)> Visitor;
+
+  ParallelDirWalker(Env::DirectoryOrder order, Visitor visitor, int max_open_dirs)
+    : order_(order),
+      visitor_(std::move(visitor)),
+      max_open_dirs_(max_open_dirs),
+      num_open_dirs_(0),
+      root_dev_(0),
+      done_(1),
+      num_errors_(0) {
+  }
+
+  // Walk 'root', fanning directories out onto 'pool', and wait for the walk
+  // to complete.
+  Status Run(const string& root, ThreadPool* pool) {
+    CHECK_NE(root, "/");
+    CHECK_NE(root, "./");
+    CHECK_NE(root, ".");
+    CHECK_NE(root, "");
+    pool_ = pool;
+
+    struct stat sbuf;
+    if (lstat(root.c_str(), &sbuf) != 0) {
+      return IOError(root, errno);
+    }
+    if (!S_ISDIR(sbuf.st_mode)) {
+      string dirname = DirName(root);
+      int dir_fd;
+      RETRY_ON_EINTR(dir_fd, open(dirname.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      if (dir_fd < 0) {
+        return IOError(dirname, errno);
+      }
+      ScopedFdCloser fd_closer(dir_fd);
+      return visitor_(Env::FILE_TYPE, dir_fd, dirname, BaseName(root));
+    }
+    root_dev_ = sbuf.st_dev;
+
+    shared_ptr<DirNode> node(new DirNode(DirName(root), BaseName(root), nullptr, nullptr));
+    Schedule(std::move(node));
+    done_.Wait();
+
+    MutexLock l(lock_);
+    if (num_errors_ > 0) {
+      return Status::IOError(root, Substitute("$0 error(s) occurred during walk, the first: $1",
+                                              num_errors_, first_error_.ToString()));
+    }
+    return Status::OK();
+  }
+
+ private:
+  // An open directory, closed when the last reference is dropped.
+  class DirHandle {
+   public:
+    explicit DirHandle(DIR* dir)
+      : dir_(dir) {
+    }
+
+    ~DirHandle() {
+      if (PREDICT_FALSE(closedir(dir_) != 0)) {
+        PLOG(WARNING) << "Failed to close directory";
+      }
+      if (walker_) {
+        walker_->num_open_dirs_.IncrementBy(-1);
+      }
+    }
+
+    // Account for this handle against 'max_open_dirs_' of 'walker'.
+    void Retain(shared_ptr<ParallelDirWalker> walker) {
+      walker_ = std::move(walker);
+    }
+
+    DIR* dir() const { return dir_; }
+    int fd() const { return dirfd(dir_); }
+
+   private:
+    DIR* const dir_;
+    shared_ptr<ParallelDirWalker> walker_;
+
+    DISALLOW_COPY_AND_ASSIGN(DirHandle);
+  };
+
+  // A directory of the walk.
+  struct DirNode {
+    DirNode(string dirname, string basename, shared_ptr<DirNode> parent,
+            shared_ptr<DirHandle> parent_handle)
+      : dirname(std::move(dirname)),
+        basename(std::move(basename)),
+        parent(std::move(parent)),
+        parent_handle(std::move(parent_handle)),
+        listed(false),
+        pending(1) {
+    }
+
+    const string dirname;
+    const string basename;
+    const shared_ptr<DirNode> parent;
+
+    // The parent directory, if it was kept open. Released once this
+    // directory is open.
+    shared_ptr<DirHandle> parent_handle;
+
+    // Whether the directory was opened and listed successfully.
+    bool listed;
+
+    // One for the listing of this directory, plus one for each subdirectory
+    // that hasn't been walked completely yet.
+    AtomicInt<int32_t> pending;
+  };
+
+  void Schedule(shared_ptr<DirNode> node) {
+    shared_ptr<ParallelDirWalker> self = shared_from_this();
+    Status s = pool_->SubmitFunc([self, node]() { self->ProcessDir(node); });
+    if (PREDICT_FALSE(!s.ok())) {
+      // The pool is shutting down: walk the directory from this thread instead.
+      ProcessDir(node);
+    }
+  }
+
+  void ProcessDir(const shared_ptr<DirNode>& node) {
+    if (order_ == Env::PRE_ORDER) {
+      Visit(Env::DIRECTORY_TYPE, -1, node->dirname, node->basename);
+    }
+    string path = JoinPathSegments(node->dirname, node->basename);
+    const int kFlags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int fd;
+    if (node->parent_handle) {
+      RETRY_ON_EINTR(fd, openat(node->parent_handle->fd(), node->basename.c_str(), kFlags));
+    } else {
+      RETRY_ON_EINTR(fd, open(path.c_str(), kFlags));
+    }
+    node->parent_handle.reset();
+    if (fd < 0) {
+      AccessError(IOError(path, errno));
+      FinishDir(node);
+      return;
+    }
+    DIR* dir = fdopendir(fd);
+    if (dir == nullptr) {
+      AccessError(IOError(path, errno));
+      close(fd);
+      FinishDir(node);
+      return;
+    }
+    shared_ptr<DirHandle> handle(new DirHandle(dir));
+
+    vector<string> subdirs;
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) != 0) {
+      AccessError(IOError(path, errno));
+    } else if (sbuf.st_dev == root_dev_) {
+      ListDir(path, handle.get(), &subdirs);
+    }
+    node->listed = true;
+
+    if (!subdirs.empty()) {
+      bool keep_open = num_open_dirs_.Increment() <= max_open_dirs_;
+      if (keep_open) {
+        handle->Retain(shared_from_this());
+      } else {
+        num_open_dirs_.IncrementBy(-1);
+      }
+      node->pending.IncrementBy(subdirs.size(), kMemOrderBarrier);
+      for (string& name : subdirs) {
+        Schedule(std::make_shared<DirNode>(path, std::move(name), node,
+                                           keep_open ? handle : nullptr));
+      }
+    }
+    handle.reset();
+    FinishDir(node);
+  }
+
+  // Visit the files of the open directory 'path' and output the names of
+  // its subdirectories into 'subdirs'.
+  void ListDir(const string& path, DirHandle* handle, vector<string>* subdirs) {
+    while (true) {
+      errno = 0;
+      struct dirent* ent = readdir(handle->dir());
+      if (ent == nullptr) {
+        if (errno != 0) {
+          AccessError(IOError(path, errno));
+        }
+        return;
+      }
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+        continue;
+      }
+      bool is_dir = ent->d_type == DT_DIR;
+      if (ent->d_type == DT_UNKNOWN) {
+        // Not every filesystem fills in the type.
+        struct stat sbuf;
+        if (fstatat(handle->fd(), ent->d_name, &sbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+          AccessError(IOError(JoinPathSegments(path, ent->d_name), errno));
+          continue;
+        }
+        is_dir = S_ISDIR(sbuf.st_mode);
+      }
+      if (is_dir) {
+        subdirs->emplace_back(ent->d_name);
+      } else {
+        Visit(Env::FILE_TYPE, handle->fd(), path, ent->d_name);
+      }
+    }
+  }
+
+  // Account for the completion of one unit of 'node', and of its ancestors
+  // whose last pending unit it was.
+  void FinishDir(shared_ptr<DirNode> node) {
+    while (node->pending.IncrementBy(-1, kMemOrderBarrier) == 0) {
+      if (order_ == Env::POST_ORDER && node->listed) {
+        Visit(Env::DIRECTORY_TYPE, -1, node->dirname, node->basename);
+      }
+      if (!node->parent) {
+        // The walk is complete; Run() may return and drop its reference.
+        done_.CountDown();
+        return;
+      }
+      node = node->parent;
+    }
+  }
+
+  void Visit(Env::FileType type, int dir_fd, const string& dirname, const string& basename) {
+    Status s = visitor_(type, dir_fd, dirname, basename);
+    if (!s.ok()) {
+      RecordError(s);
+    }
+  }
+
+  void AccessError(const Status& s) {
+    LOG(WARNING) << "Unable to access file during walk: " << s.ToString();
+    RecordError(s);
+  }
+
+  void RecordError(const Status& s) {
+    MutexLock l(lock_);
+    if (num_errors_++ == 0) {
+      first_error_ = s;
+    }
+  }
+
+  const Env::DirectoryOrder order_;
+  const Visitor visitor_;
+  const int max_open_dirs_;
+  ThreadPool* pool_;
+
+  // The number of directories kept open for their subdirectories.
+  AtomicInt<int32_t> num_open_dirs_;
+
+  dev_t root_dev_;
+  CountDownLatch done_;
+
+  // Protects the members below.
+  Mutex lock_;
+  int num_errors_;
+  Status first_error_;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelDirWalker);
+};
+
 class PosixEnv : public Env {
  public:
   PosixEnv();
@@ -693,7 +1702,34 @@ class PosixEnv : public Env {
       return IOError(fname, errno);
     }
 
-    result->reset(new PosixRandomAccessFile(fname, fd));
+    if (opts.mmap) {
+      DCHECK(!opts.direct_io);
+      ScopedFdCloser fd_closer(fd);
+      struct stat sbuf;
+      if (fstat(fd, &sbuf) != 0) {
+        return IOError(fname, errno);
+      }
+      void* base = nullptr;
+      if (sbuf.st_size > 0) {
+        base = mmap(nullptr, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+          return IOError(fname, errno);
+        }
+      }
+      result->reset(new PosixMmapRandomAccessFile(
+          fname, static_cast<const uint8_t*>(base), sbuf.st_size));
+      return Status::OK();
+    }
+
+    size_t alignment = 0;
+    if (opts.direct_io) {
+      Status s = EnableDirectIO(fname, fd, &alignment);
+      if (!s.ok()) {
+        close(fd);
+        return s;
+      }
+    }
+    result->reset(new PosixRandomAccessFile(fname, fd, alignment));
     return Status::OK();
   }
 
@@ -735,8 +1771,7 @@ class PosixEnv : public Env {
 //    TRACE_EVENT1("io", "PosixEnv::NewRWFile", "path", fname);
     int fd;
     RETURN_NOT_OK(DoOpen(fname, opts.mode, &fd));
-    result->reset(new PosixRWFile(fname, fd, opts.sync_on_close));
-    return Status::OK();
+    return InstantiateNewRWFile(fname, fd, opts, result);
   }
 
   virtual Status NewTempRWFile(const RWFileOptions& opts, const std::string& name_template,
@@ -744,8 +1779,7 @@ class PosixEnv : public Env {
 //    TRACE_EVENT1("io", "PosixEnv::NewTempRWFile", "template", name_template);
     int fd;
     RETURN_NOT_OK(MkTmpFile(name_template, &fd, created_filename));
-    res->reset(new PosixRWFile(*created_filename, fd, opts.sync_on_close));
-    return Status::OK();
+    return InstantiateNewRWFile(*created_filename, fd, opts, res);
   }
 
   virtual bool FileExists(const std::string& fname) OVERRIDE {
@@ -843,6 +1877,66 @@ class PosixEnv : public Env {
                                        Unretained(this)));
   }
 
+  virtual Status CopyFile(const std::string& source_path, const std::string& dest_path,
+                          const WritableFileOptions& opts) OVERRIDE {
+  //  TRACE_EVENT2("io", "PosixEnv::CopyFile", "src", source_path, "dst", dest_path);
+  //  ThreadRestrictions::AssertIOAllowed();
+    if (opts.direct_io) {
+      // The data must go through aligned user-space buffers anyway.
+      return Env::CopyFile(source_path, dest_path, opts);
+    }
+    int src_fd;
+    RETRY_ON_EINTR(src_fd, open(source_path.c_str(), O_RDONLY));
+    if (src_fd < 0) {
+      return IOError(source_path, errno);
+    }
+    ScopedFdCloser src_closer(src_fd);
+    struct stat sbuf;
+    if (fstat(src_fd, &sbuf) != 0) {
+      return IOError(source_path, errno);
+    }
+
+    int dst_fd;
+    RETURN_NOT_OK(DoOpen(dest_path, opts.mode, &dst_fd));
+    ScopedFdCloser dst_closer(dst_fd);
+    uint64_t dst_offset = 0;
+    if (opts.mode == OPEN_EXISTING) {
+      // Like a WritableFile, append to the existing data.
+      struct stat dst_sbuf;
+      if (fstat(dst_fd, &dst_sbuf) != 0) {
+        return IOError(dest_path, errno);
+      }
+      dst_offset = dst_sbuf.st_size;
+    }
+    RETURN_NOT_OK(DoCopyFileData(source_path, src_fd, dest_path, dst_fd,
+                                 sbuf.st_size, dst_offset));
+    if (opts.sync_on_close) {
+      RETURN_NOT_OK(DoSync(dst_fd, dest_path));
+    }
+    return Status::OK();
+  }
+
+  virtual Status ParallelDeleteRecursively(const std::string& name,
+                                           const ParallelWalkOptions& opts) OVERRIDE {
+    return RunParallelWalk(name, POST_ORDER, opts,
+        [](FileType type, int dir_fd, const string& dirname, const string& basename) {
+          Status s;
+          string full_path = JoinPathSegments(dirname, basename);
+          if (type == FILE_TYPE) {
+            if (unlinkat(dir_fd, basename.c_str(), 0) != 0) {
+              s = IOError(full_path, errno);
+            }
+            WARN_NOT_OK(s, "Could not delete file");
+          } else {
+            if (rmdir(full_path.c_str()) != 0) {
+              s = IOError(full_path, errno);
+            }
+            WARN_NOT_OK(s, "Could not delete directory");
+          }
+          return s;
+        });
+  }
+
   virtual Status GetFileSize(const std::string& fname, uint64_t* size) OVERRIDE {
   //  TRACE_EVENT1("io", "PosixEnv::GetFileSize", "path", fname);
   //  ThreadRestrictions::AssertIOAllowed();
@@ -885,6 +1979,27 @@ class PosixEnv : public Env {
     return Status::OK();
   }
 
+  virtual Status ParallelGetFileSizeOnDiskRecursively(const string& root,
+                                                      const ParallelWalkOptions& opts,
+                                                      uint64_t* bytes_used) OVERRIDE {
+//    TRACE_EVENT1("io", "PosixEnv::ParallelGetFileSizeOnDiskRecursively", "path", root);
+    AtomicInt<int64_t> total(0);
+    RETURN_NOT_OK(RunParallelWalk(root, PRE_ORDER, opts,
+        [&total](FileType type, int dir_fd, const string& dirname, const string& basename) {
+          // Like GetFileSizeOnDiskRecursively(), ignore directories.
+          if (type == FILE_TYPE) {
+            struct stat sbuf;
+            if (fstatat(dir_fd, basename.c_str(), &sbuf, 0) != 0) {
+              return IOError(JoinPathSegments(dirname, basename), errno);
+            }
+            total.IncrementBy(sbuf.st_blocks * 512);
+          }
+          return Status::OK();
+        }));
+    *bytes_used = total.Load();
+    return Status::OK();
+  }
+
   virtual Status GetBlockSize(const string& fname, uint64_t* block_size) OVERRIDE {
 //    TRACE_EVENT1("io", "PosixEnv::GetBlockSize", "path", fname);
 //    ThreadRestrictions::AssertIOAllowed();
@@ -1125,6 +2240,15 @@ class PosixEnv : public Env {
     return Status::OK();
   }
 
+  virtual Status ParallelWalk(const string& root, DirectoryOrder order, const WalkCallback& cb,
+                              const ParallelWalkOptions& opts) OVERRIDE {
+//    TRACE_EVENT1("io", "PosixEnv::ParallelWalk", "path", root);
+    return RunParallelWalk(root, order, opts,
+        [&cb](FileType type, int /* dir_fd */, const string& dirname, const string& basename) {
+          return cb.Run(type, dirname, basename);
+        });
+  }
+
   Status Glob(const string& path_pattern, vector<string>* paths) override {
   //  TRACE_EVENT1("io", "PosixEnv::Glob", "path_pattern", path_pattern);
    // ThreadRestrictions::AssertIOAllowed();
@@ -1303,10 +2427,61 @@ class PosixEnv : public Env {
     if (opts.mode == OPEN_EXISTING) {
       RETURN_NOT_OK(GetFileSize(fname, &file_size));
     }
-    result->reset(new PosixWritableFile(fname, fd, file_size, opts.sync_on_close));
+    if (opts.direct_io) {
+      size_t alignment;
+      Status s = EnableDirectIO(fname, fd, &alignment);
+      unique_ptr<PosixDirectWritableFile> file;
+      if (s.ok()) {
+        file.reset(new PosixDirectWritableFile(fname, fd, file_size, opts.sync_on_close,
+                                               alignment, opts.buffer_mem_tracker));
+        s = file->Init(opts.buffer_size);
+      } else {
+        close(fd);
+      }
+      RETURN_NOT_OK(s);
+      result->reset(file.release());
+      return Status::OK();
+    }
+    result->reset(new PosixWritableFile(fname, fd, file_size, opts.sync_on_close,
+                                        opts.buffer_size, opts.buffer_mem_tracker));
     return Status::OK();
   }
 
+  Status InstantiateNewRWFile(const std::string& fname,
+                              int fd,
+                              const RWFileOptions& opts,
+                              unique_ptr<RWFile>* result) {
+    size_t alignment = 0;
+    if (opts.direct_io) {
+      Status s = EnableDirectIO(fname, fd, &alignment);
+      if (!s.ok()) {
+        close(fd);
+        return s;
+      }
+    }
+    result->reset(new PosixRWFile(fname, fd, opts.sync_on_close, alignment,
+                                  opts.sync_unwritten));
+    return Status::OK();
+  }
+
+  // Walk 'root' with a ParallelDirWalker on the pool of 'opts'.
+  static Status RunParallelWalk(const string& root, DirectoryOrder order,
+                                const ParallelWalkOptions& opts,
+                                ParallelDirWalker::Visitor visitor) {
+    gscoped_ptr<ThreadPool> own_pool;
+    ThreadPool* pool = opts.pool;
+    if (pool == nullptr) {
+      RETURN_NOT_OK(ThreadPoolBuilder("env-walk")
+                    .set_min_threads(0)
+                    .set_max_threads(opts.num_threads)
+                    .Build(&own_pool));
+      pool = own_pool.get();
+    }
+    shared_ptr<ParallelDirWalker> walker(
+        new ParallelDirWalker(order, std::move(visitor), opts.max_open_dirs));
+    return walker->Run(root, pool);
+  }
+
   Status DeleteRecursivelyCb(FileType type, const string& dirname, const string& basename) {
     string full_path = JoinPathSegments(dirname, basename);
     Status s;
@@ -0,0 +1,394 @@
+#include "bboy/base/file_cache.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <utility>
+
+#include <glog/logging.h>
+
+#include "bboy/gbase/map-util.h"
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/env.h"
+#include "bboy/base/malloc.h"
+#include "bboy/base/slice.h"
+
+using std::list;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using strings::Substitute;
+
+namespace bb {
+
+namespace internal {
+
+// An open file in the LRU of a shard. Exactly one of 'raf' and 'rwf' is set.
+struct FileCacheEntry {
+  const FileCacheDescriptor* desc;
+  shared_ptr<RandomAccessFile> raf;
+  shared_ptr<RWFile> rwf;
+};
+
+struct FileCacheShard {
+  explicit FileCacheShard(int capacity)
+    : capacity(capacity) {
+  }
+
+  // Output the open file of 'desc' into 'entry' and mark it as the most
+  // recently used. Returns false if the file isn't open.
+  bool Lookup(const FileCacheDescriptor* desc, FileCacheEntry* entry) {
+    MutexLock l(lock);
+    auto it = index.find(desc);
+    if (it == index.end()) {
+      return false;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    *entry = *it->second;
+    return true;
+  }
+
+  // Insert the newly opened file 'entry', closing the least recently used
+  // files over capacity. If another thread inserted a file for the same
+  // descriptor in the meantime, outputs that one into 'entry' instead.
+  void Insert(FileCacheEntry* entry) {
+    // Declared before the lock, so that the files are closed once it's
+    // released.
+    list<FileCacheEntry> evicted;
+    MutexLock l(lock);
+    auto it = index.find(entry->desc);
+    if (it != index.end()) {
+      lru.splice(lru.begin(), lru, it->second);
+      evicted.emplace_back(std::move(*entry));
+      *entry = *it->second;
+      return;
+    }
+    lru.push_front(*entry);
+    index[entry->desc] = lru.begin();
+    while (lru.size() > capacity) {
+      auto last = std::prev(lru.end());
+      index.erase(last->desc);
+      evicted.splice(evicted.end(), lru, last);
+    }
+  }
+
+  // Close the file of 'desc', if it's open.
+  void Erase(const FileCacheDescriptor* desc) {
+    // Declared before the lock, see Insert().
+    list<FileCacheEntry> evicted;
+    MutexLock l(lock);
+    auto it = index.find(desc);
+    if (it != index.end()) {
+      evicted.splice(evicted.end(), lru, it->second);
+      index.erase(it);
+    }
+  }
+
+  int size() {
+    MutexLock l(lock);
+    return lru.size();
+  }
+
+  const size_t capacity;
+
+  // Protects the members below.
+  Mutex lock;
+  // The open files, most recently used first.
+  list<FileCacheEntry> lru;
+  std::unordered_map<const FileCacheDescriptor*, list<FileCacheEntry>::iterator> index;
+};
+
+// The state shared by all the handles of a file.
+class FileCacheDescriptor {
+ public:
+  FileCacheDescriptor(FileCache* cache, FileCacheShard* shard, string filename, bool rw)
+    : cache_(cache),
+      shard_(shard),
+      filename_(std::move(filename)),
+      rw_(rw) {
+  }
+
+  ~FileCacheDescriptor() {
+    // Close the file before a deferred deletion.
+    shard_->Erase(this);
+    cache_->DestroyDescriptor(this);
+  }
+
+  // Output the open file, opening it if it isn't cached.
+  Status GetRandomAccessFile(shared_ptr<RandomAccessFile>* file) const {
+    DCHECK(!rw_);
+    FileCacheEntry entry;
+    RETURN_NOT_OK(GetFile(&entry));
+    *file = std::move(entry.raf);
+    return Status::OK();
+  }
+
+  Status GetRWFile(shared_ptr<RWFile>* file) const {
+    DCHECK(rw_);
+    FileCacheEntry entry;
+    RETURN_NOT_OK(GetFile(&entry));
+    *file = std::move(entry.rwf);
+    return Status::OK();
+  }
+
+  const string& filename() const { return filename_; }
+  bool rw() const { return rw_; }
+
+ private:
+  Status GetFile(FileCacheEntry* entry) const {
+    if (shard_->Lookup(this, entry)) {
+      return Status::OK();
+    }
+    entry->desc = this;
+    if (rw_) {
+      RWFileOptions opts;
+      opts.mode = Env::OPEN_EXISTING;
+      // See FileCache::OpenExistingFile().
+      opts.sync_unwritten = true;
+      unique_ptr<RWFile> f;
+      RETURN_NOT_OK(cache_->env_->NewRWFile(opts, filename_, &f));
+      entry->rwf = std::move(f);
+    } else {
+      unique_ptr<RandomAccessFile> f;
+      RETURN_NOT_OK(cache_->env_->NewRandomAccessFile(filename_, &f));
+      entry->raf = std::move(f);
+    }
+    shard_->Insert(entry);
+    return Status::OK();
+  }
+
+  FileCache* const cache_;
+  FileCacheShard* const shard_;
+  const string filename_;
+  const bool rw_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileCacheDescriptor);
+};
+
+} // namespace internal
+
+using internal::FileCacheDescriptor;
+
+namespace {
+
+// A read-only handle of a file in the cache.
+class CachedRandomAccessFile : public RandomAccessFile {
+ public:
+  explicit CachedRandomAccessFile(shared_ptr<FileCacheDescriptor> desc)
+    : desc_(std::move(desc)) {
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      uint8_t* scratch) const OVERRIDE {
+    shared_ptr<RandomAccessFile> f;
+    RETURN_NOT_OK(desc_->GetRandomAccessFile(&f));
+    return f->Read(offset, n, result, scratch);
+  }
+
+  virtual Status ReadV(const vector<ReadRequest>& requests) const OVERRIDE {
+    shared_ptr<RandomAccessFile> f;
+    RETURN_NOT_OK(desc_->GetRandomAccessFile(&f));
+    return f->ReadV(requests);
+  }
+
+  virtual Status Size(uint64_t* size) const OVERRIDE {
+    shared_ptr<RandomAccessFile> f;
+    RETURN_NOT_OK(desc_->GetRandomAccessFile(&f));
+    return f->Size(size);
+  }
+
+  virtual const string& filename() const OVERRIDE {
+    return desc_->filename();
+  }
+
+  virtual size_t memory_footprint() const OVERRIDE {
+    // The descriptor is shared with the other handles of the file.
+    return bboy_malloc_usable_size(this);
+  }
+
+ private:
+  const shared_ptr<FileCacheDescriptor> desc_;
+};
+
+// A read-write handle of a file in the cache.
+class CachedRWFile : public RWFile {
+ public:
+  explicit CachedRWFile(shared_ptr<FileCacheDescriptor> desc)
+    : desc_(std::move(desc)) {
+  }
+
+  virtual Status Read(uint64_t offset, size_t length,
+                      Slice* result, uint8_t* scratch) const OVERRIDE {
+    shared_ptr<RWFile> f;
+    RETURN_NOT_OK(desc_->GetRWFile(&f));
+    return f->Read(offset, length, result, scratch);
+  }
+
+  virtual Status Write(uint64_t offset, const Slice& data) OVERRIDE {
+    shared_ptr<RWFile> f;
+    RETURN_NOT_OK(desc_->GetRWFile(&f));
+    return f->Write(offset, data);
+  }
+
+  virtual Status PreAllocate(uint64_t offset, size_t length,
+                             PreAllocateMode mode) OVERRIDE {
+    shared_ptr<RWFile> f;
+    RETURN_NOT_OK(desc_->GetRWFile(&f));
+    return f->PreAllocate(offset, length, mode);
+  }
+
+  virtual Status Truncate(uint64_t length) OVERRIDE {
+    shared_ptr<RWFile> f;
+    RETURN_NOT_OK(desc_->GetRWFile(&f));
+    return f->Truncate(length);
+  }
+
+  virtual Status PunchHole(uint64_t offset, size_t length) OVERRIDE {
+    shared_ptr<RWFile> f;
+    RETURN_NOT_OK(desc_->GetRWFile(&f));
+    return f->PunchHole(offset, length);
+  }
+
+  virtual Status Flush(FlushMode mode, uint64_t offset, size_t length) OVERRIDE {
+    shared_ptr<RWFile> f;
+    RETURN_NOT_OK(desc_->GetRWFile(&f));
+    return f->Flush(mode, offset, length);
+  }
+
+  virtual Status Sync() OVERRIDE {
+    shared_ptr<RWFile> f;
+    RETURN_NOT_OK(desc_->GetRWFile(&f));
+    return f->Sync();
+  }
+
+  virtual Status Close() OVERRIDE {
+    // The underlying file belongs to the cache.
+    return Status::OK();
+  }
+
+  virtual Status Size(uint64_t* size) const OVERRIDE {
+    shared_ptr<RWFile> f;
+    RETURN_NOT_OK(desc_->GetRWFile(&f));
+    return f->Size(size);
+  }
+
+  virtual const string& filename() const OVERRIDE {
+    return desc_->filename();
+  }
+
+ private:
+  const shared_ptr<FileCacheDescriptor> desc_;
+};
+
+} // anonymous namespace
+
+FileCache::FileCache(string name, Env* env, int max_open_files, int num_shards)
+    : name_(std::move(name)),
+      env_(env) {
+  CHECK_GT(max_open_files, 0);
+  CHECK_GT(num_shards, 0);
+  int shard_capacity = std::max(1, max_open_files / num_shards);
+  for (int i = 0; i < num_shards; i++) {
+    shards_.emplace_back(new internal::FileCacheShard(shard_capacity));
+  }
+}
+
+FileCache::~FileCache() {
+}
+
+Status FileCache::OpenExistingFile(const string& file_name,
+                                   shared_ptr<RandomAccessFile>* file) {
+  shared_ptr<FileCacheDescriptor> desc;
+  RETURN_NOT_OK(FindOrCreateDescriptor(file_name, false, &desc));
+  shared_ptr<RandomAccessFile> f;
+  RETURN_NOT_OK(desc->GetRandomAccessFile(&f));
+  file->reset(new CachedRandomAccessFile(std::move(desc)));
+  return Status::OK();
+}
+
+Status FileCache::OpenExistingFile(const string& file_name,
+                                   shared_ptr<RWFile>* file) {
+  shared_ptr<FileCacheDescriptor> desc;
+  RETURN_NOT_OK(FindOrCreateDescriptor(file_name, true, &desc));
+  shared_ptr<RWFile> f;
+  RETURN_NOT_OK(desc->GetRWFile(&f));
+  file->reset(new CachedRWFile(std::move(desc)));
+  return Status::OK();
+}
+
+Status FileCache::DeleteFile(const string& file_name) {
+  // Declared before the lock: dropping the last reference to a descriptor
+  // takes the lock.
+  shared_ptr<FileCacheDescriptor> desc;
+  {
+    MutexLock l(lock_);
+    if (ContainsKey(pending_deletes_, file_name)) {
+      return Status::NotFound("File already deleted", file_name);
+    }
+    auto it = descriptors_.find(file_name);
+    if (it != descriptors_.end()) {
+      desc = it->second.lock();
+    }
+    if (desc) {
+      pending_deletes_.insert(file_name);
+      return Status::OK();
+    }
+  }
+  return env_->DeleteFile(file_name);
+}
+
+int FileCache::num_open_files() const {
+  int num = 0;
+  for (const auto& shard : shards_) {
+    num += shard->size();
+  }
+  return num;
+}
+
+Status FileCache::FindOrCreateDescriptor(const string& file_name, bool rw,
+                                         shared_ptr<FileCacheDescriptor>* desc) {
+  // Declared before the lock, see DeleteFile().
+  shared_ptr<FileCacheDescriptor> d;
+  MutexLock l(lock_);
+  if (ContainsKey(pending_deletes_, file_name)) {
+    return Status::NotFound("File is being deleted", file_name);
+  }
+  std::weak_ptr<FileCacheDescriptor>& weak_desc = descriptors_[file_name];
+  d = weak_desc.lock();
+  if (d) {
+    if (d->rw() != rw) {
+      return Status::IllegalState(Substitute("File $0 is already open $1", file_name,
+                                             d->rw() ? "for writing" : "for reading only"));
+    }
+  } else {
+    size_t shard_idx = std::hash<string>()(file_name) % shards_.size();
+    d = std::make_shared<FileCacheDescriptor>(this, shards_[shard_idx].get(), file_name, rw);
+    weak_desc = d;
+  }
+  *desc = std::move(d);
+  return Status::OK();
+}
+
+void FileCache::DestroyDescriptor(const FileCacheDescriptor* desc) {
+  const string& file_name = desc->filename();
+  {
+    MutexLock l(lock_);
+    auto it = descriptors_.find(file_name);
+    // The file may have been opened again since the last reference to 'desc'
+    // was dropped.
+    if (it != descriptors_.end() && it->second.expired()) {
+      descriptors_.erase(it);
+    }
+    if (!ContainsKey(pending_deletes_, file_name)) {
+      return;
+    }
+  }
+  // Opening the file fails until it's out of 'pending_deletes_'.
+  WARN_NOT_OK(env_->DeleteFile(file_name), "Could not delete file " + file_name);
+  MutexLock l(lock_);
+  pending_deletes_.erase(file_name);
+}
+
+} // namespace bb
@@ -0,0 +1,112 @@
+#ifndef BBOY_BASE_FILE_CACHE_H_
+#define BBOY_BASE_FILE_CACHE_H_
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "bboy/gbase/macros.h"
+#include "bboy/base/status.h"
+#include "bboy/base/sync/mutex.h"
+
+namespace bb {
+
+class Env;
+class RandomAccessFile;
+class RWFile;
+
+namespace internal {
+class FileCacheDescriptor;
+struct FileCacheShard;
+} // namespace internal
+
+// A cache of open files on behalf of many long-lived file handles.
+//
+// Files opened through the cache are returned as lightweight handles which
+// don't hold a file descriptor of their own. The underlying file is opened
+// lazily on access and kept in a bounded, sharded LRU: once more than
+// 'max_open_files' files are open, the least recently used ones are closed
+// and transparently reopened on their next access. This allows a process to
+// work with many more files than its open file limit (see
+// Env::GetOpenFileLimit()) without paying an open(2) for every access.
+//
+// A file in use by an operation of a handle isn't closed before the
+// operation completes, so the number of open files may briefly exceed the
+// limit by the number of concurrent operations.
+//
+// All the handles of a file share its descriptor. A file deleted through
+// DeleteFile() is only removed from the filesystem once its last handle has
+// been destroyed. Files must not be renamed or deleted behind the back of the
+// cache while they have handles, since they're reopened by name.
+//
+// The cache must outlive all the handles it returned.
+//
+// This class is thread-safe.
+class FileCache {
+ public:
+  // 'max_open_files' is divided evenly among 'num_shards' shards, each with
+  // an LRU of its own.
+  FileCache(std::string name, Env* env, int max_open_files, int num_shards = 16);
+  ~FileCache();
+
+  // Open the existing file 'file_name' for reading, outputting a handle
+  // into 'file'. The file is opened right away, so that errors such as a
+  // missing file are reported here rather than on first access.
+  Status OpenExistingFile(const std::string& file_name,
+                          std::shared_ptr<RandomAccessFile>* file) WARN_UNUSED_RESULT;
+
+  // Open the existing file 'file_name' for reading and writing, outputting
+  // a handle into 'file'.
+  //
+  // Closing the underlying file on eviction doesn't sync it, so that an
+  // eviction never makes an unrelated open wait for the disk. Instead,
+  // RWFile::Sync() of the handle always syncs the file, which also covers
+  // writes made through file descriptors that have since been closed.
+  // Close() of the handle doesn't close anything: the underlying file is
+  // closed on eviction or once the last handle of the file is destroyed.
+  //
+  // A file may not be open both for reading only and for reading and
+  // writing at the same time.
+  Status OpenExistingFile(const std::string& file_name,
+                          std::shared_ptr<RWFile>* file) WARN_UNUSED_RESULT;
+
+  // Delete the file 'file_name'. If the file has handles, the deletion is
+  // deferred until the last one is destroyed; the file can't be opened
+  // through the cache in the meantime.
+  Status DeleteFile(const std::string& file_name) WARN_UNUSED_RESULT;
+
+  // The number of files currently held open by the cache.
+  int num_open_files() const;
+
+  const std::string& name() const { return name_; }
+
+ private:
+  friend class internal::FileCacheDescriptor;
+
+  // Look up the descriptor of 'file_name', creating it if there is none.
+  Status FindOrCreateDescriptor(const std::string& file_name, bool rw,
+                                std::shared_ptr<internal::FileCacheDescriptor>* desc);
+
+  // Called when the last reference to 'desc' is dropped. Forgets about the
+  // descriptor and carries out its deferred deletion, if any.
+  void DestroyDescriptor(const internal::FileCacheDescriptor* desc);
+
+  const std::string name_;
+  Env* const env_;
+  std::vector<std::unique_ptr<internal::FileCacheShard>> shards_;
+
+  // Protects the members below.
+  Mutex lock_;
+  // The descriptors of the files with handles, by file name.
+  std::unordered_map<std::string, std::weak_ptr<internal::FileCacheDescriptor>> descriptors_;
+  // Files whose deletion is deferred until their last handle is destroyed.
+  std::unordered_set<std::string> pending_deletes_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileCache);
+};
+
+} // namespace bb
+
+#endif // BBOY_BASE_FILE_CACHE_H_
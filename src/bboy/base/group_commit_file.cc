@@ -0,0 +1,132 @@
+#include "bboy/base/group_commit_file.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <glog/logging.h>
+
+#include "bboy/base/env.h"
+#include "bboy/base/slice.h"
+
+using std::unique_ptr;
+using std::vector;
+
+namespace bb {
+
+Status GroupCommitFile::Open(Env* env, unique_ptr<WritableFile> file,
+                             unique_ptr<GroupCommitFile>* result) {
+  RWFileOptions opts;
+  opts.mode = Env::OPEN_EXISTING;
+  // Nothing is written through the handle, but its syncs must still reach
+  // the file.
+  opts.sync_unwritten = true;
+  unique_ptr<RWFile> sync_file;
+  RETURN_NOT_OK_PREPEND(env->NewRWFile(opts, file->filename(), &sync_file),
+                        "could not open the file for syncs");
+  result->reset(new GroupCommitFile(std::move(file), std::move(sync_file)));
+  return Status::OK();
+}
+
+GroupCommitFile::GroupCommitFile(unique_ptr<WritableFile> file, unique_ptr<RWFile> sync_file)
+    : file_(std::move(file)),
+      appended_seq_(0),
+      sync_file_(std::move(sync_file)),
+      sync_done_(&lock_),
+      synced_seq_(0),
+      sync_in_progress_(false),
+      num_syncs_(0) {
+  CHECK(file_);
+  CHECK(sync_file_);
+}
+
+GroupCommitFile::~GroupCommitFile() {
+}
+
+Status GroupCommitFile::Append(const Slice& data, int64_t* seq) {
+  MutexLock l(file_lock_);
+  RETURN_NOT_OK(file_->Append(data));
+  ++appended_seq_;
+  if (seq) {
+    *seq = appended_seq_;
+  }
+  return Status::OK();
+}
+
+Status GroupCommitFile::AppendVector(const vector<Slice>& data_vector, int64_t* seq) {
+  MutexLock l(file_lock_);
+  RETURN_NOT_OK(file_->AppendVector(data_vector));
+  ++appended_seq_;
+  if (seq) {
+    *seq = appended_seq_;
+  }
+  return Status::OK();
+}
+
+Status GroupCommitFile::SyncUpTo(int64_t seq) {
+  MutexLock l(lock_);
+  while (true) {
+    if (!sync_error_.ok()) {
+      return sync_error_;
+    }
+    if (synced_seq_ >= seq) {
+      return Status::OK();
+    }
+    if (!sync_in_progress_) {
+      break;
+    }
+    sync_done_.Wait();
+  }
+
+  // Become the leader of the next group.
+  sync_in_progress_ = true;
+  l.Unlock();
+
+  int64_t target_seq;
+  Status s;
+  {
+    MutexLock fl(file_lock_);
+    // Everything appended so far is covered by this sync, including appends
+    // made by writers which haven't called SyncUpTo() yet. The flush moves
+    // any data buffered by the file into the kernel.
+    target_seq = appended_seq_;
+    s = file_->Flush(WritableFile::FLUSH_ASYNC);
+  }
+  if (s.ok()) {
+    // Syncing the file through any handle makes all its data durable.
+    s = sync_file_->Sync();
+  }
+
+  l.Lock();
+  sync_in_progress_ = false;
+  ++num_syncs_;
+  if (s.ok()) {
+    synced_seq_ = std::max(synced_seq_, target_seq);
+  } else {
+    sync_error_ = s;
+  }
+  sync_done_.Broadcast();
+  return s;
+}
+
+Status GroupCommitFile::Sync() {
+  int64_t seq;
+  {
+    MutexLock fl(file_lock_);
+    seq = appended_seq_;
+  }
+  return SyncUpTo(seq);
+}
+
+Status GroupCommitFile::Close() {
+  MutexLock fl(file_lock_);
+  Status s = file_->Close();
+  Status sync_file_status = sync_file_->Close();
+  return s.ok() ? sync_file_status : s;
+}
+
+int64_t GroupCommitFile::num_syncs() const {
+  MutexLock l(lock_);
+  return num_syncs_;
+}
+
+} // namespace bb
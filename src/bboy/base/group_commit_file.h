@@ -0,0 +1,95 @@
+#ifndef BBOY_BASE_GROUP_COMMIT_FILE_H_
+#define BBOY_BASE_GROUP_COMMIT_FILE_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "bboy/gbase/macros.h"
+#include "bboy/base/status.h"
+#include "bboy/base/sync/condition_variable.h"
+#include "bboy/base/sync/mutex.h"
+
+namespace bb {
+
+class Env;
+class RWFile;
+class Slice;
+class WritableFile;
+
+// A wrapper around a WritableFile shared by several writer threads which
+// batches their Sync() calls ("group commit").
+//
+// Every append is assigned a monotonically increasing sequence number. A
+// writer which needs its data to be durable calls SyncUpTo() with the
+// sequence number of its last append. If no sync is in progress, the caller
+// becomes the leader and issues a single Sync() of the underlying file,
+// which covers every append made before it started; writers arriving while
+// the sync is running wait for it and, if their data was not covered, one
+// of them leads the next sync. With N concurrent writers this results in
+// far fewer than N fdatasync() calls.
+//
+// WritableFile implementations are not thread-safe, so the leader only
+// flushes the file, under the lock serializing appends, then syncs it through
+// a second handle without the lock: appends proceed, and form the next group,
+// while the sync is in progress.
+//
+// A failed sync is sticky: once the underlying Sync() fails, the durability
+// of the data written so far is unknown, so all subsequent SyncUpTo() calls
+// return the same error.
+//
+// This class is thread-safe.
+class GroupCommitFile {
+ public:
+  // Wraps 'file', opened for appends from 'env', into '*result'. Opens a
+  // second handle to the file, for the syncs.
+  static Status Open(Env* env, std::unique_ptr<WritableFile> file,
+                     std::unique_ptr<GroupCommitFile>* result) WARN_UNUSED_RESULT;
+
+  ~GroupCommitFile();
+
+  // Append 'data' to the file. On success, outputs the sequence number of
+  // the append into 'seq' (if not null).
+  Status Append(const Slice& data, int64_t* seq) WARN_UNUSED_RESULT;
+  Status AppendVector(const std::vector<Slice>& data_vector,
+                      int64_t* seq) WARN_UNUSED_RESULT;
+
+  // Make durable all the data appended up to and including the append with
+  // sequence number 'seq'.
+  Status SyncUpTo(int64_t seq) WARN_UNUSED_RESULT;
+
+  // Make durable all the data appended so far.
+  Status Sync() WARN_UNUSED_RESULT;
+
+  Status Close() WARN_UNUSED_RESULT;
+
+  // The number of syncs issued to the underlying file. Used by tests.
+  int64_t num_syncs() const;
+
+ private:
+  GroupCommitFile(std::unique_ptr<WritableFile> file, std::unique_ptr<RWFile> sync_file);
+
+  // Serializes calls to the underlying file, which is not thread-safe.
+  Mutex file_lock_;
+  std::unique_ptr<WritableFile> file_;
+  // Sequence number of the last append; protected by 'file_lock_'.
+  int64_t appended_seq_;
+
+  // Another handle to the file, only used to sync it. Thread-safe.
+  std::unique_ptr<RWFile> sync_file_;
+
+  // Protects the group commit state below.
+  mutable Mutex lock_;
+  ConditionVariable sync_done_;
+  // All appends with sequence numbers up to this one are durable.
+  int64_t synced_seq_;
+  bool sync_in_progress_;
+  Status sync_error_;
+  int64_t num_syncs_;
+
+  DISALLOW_COPY_AND_ASSIGN(GroupCommitFile);
+};
+
+} // namespace bb
+
+#endif // BBOY_BASE_GROUP_COMMIT_FILE_H_
@@ -1,21 +1,41 @@
 #include "bboy/base/json/jsonreader.h"
 
+#include <limits>
+#include <memory>
+
+#include <glog/logging.h>
+#include <rapidjson/reader.h>
+
 #include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/env.h"
 
+using rapidjson::SizeType;
 using rapidjson::Value;
 using std::string;
+using std::unique_ptr;
 using std::vector;
 using strings::Substitute;
 
 namespace bb {
 
-JsonReader::JsonReader(string text) : text_(std::move(text)) {}
+JsonReader::JsonReader(string text)
+    : text_(std::move(text)),
+      insitu_text_(nullptr) {
+}
+
+JsonReader::JsonReader(InSitu /* tag */, char* text)
+    : insitu_text_(text) {
+}
 
 JsonReader::~JsonReader() {
 }
 
 Status JsonReader::Init() {
-  document_.Parse<0>(text_.c_str());
+  if (insitu_text_) {
+    document_.ParseInsitu<0>(insitu_text_);
+  } else {
+    document_.Parse<0>(text_.c_str());
+  }
   if (document_.HasParseError()) {
     return Status::Corruption("JSON text is corrupt", document_.GetParseError());
   }
@@ -62,7 +82,7 @@ Status JsonReader::ExtractString(const Value* object,
     return Status::InvalidArgument(Substitute(
         "Wrong type during field extraction: expected string but got $0",
         val->GetType()));  }
-  result->assign(val->GetString());
+  result->assign(val->GetString(), val->GetStringLength());
   return Status::OK();
 }
 
@@ -104,4 +124,359 @@ Status JsonReader::ExtractField(const Value* object,
   return Status::OK();
 }
 
+// Receives the events of the rapidjson SAX parser, tracking the path of the
+// current value to dispatch it to the callbacks.
+//
+// The methods return false to stop the parsing, which only works with
+// rapidjson 1.x: the streams also end as soon as status() isn't OK.
+class JsonSaxReader::Handler {
+ public:
+  typedef char Ch;
+
+  explicit Handler(const std::unordered_map<string, Callbacks>* callbacks)
+      : callbacks_(callbacks),
+        expect_key_(false) {
+  }
+
+  bool Null() {
+    return EndValue();
+  }
+
+  bool Bool(bool b) {
+    const Callbacks* cbs = FindCallbacks();
+    if (cbs) {
+      if (cbs->bool_cb) {
+        Check(cbs->bool_cb(b));
+      } else {
+        WrongType("bool");
+      }
+    }
+    return EndValue();
+  }
+
+  bool Int(int i) { return Int64(i); }
+  bool Uint(unsigned u) { return Int64(u); }
+
+  bool Int64(int64_t i) {
+    const Callbacks* cbs = FindCallbacks();
+    if (cbs) {
+      if (cbs->int64_cb) {
+        Check(cbs->int64_cb(i));
+      } else if (cbs->double_cb) {
+        Check(cbs->double_cb(i));
+      } else {
+        WrongType("int64");
+      }
+    }
+    return EndValue();
+  }
+
+  bool Uint64(uint64_t u) {
+    if (u <= std::numeric_limits<int64_t>::max()) {
+      return Int64(u);
+    }
+    const Callbacks* cbs = FindCallbacks();
+    if (cbs) {
+      if (cbs->double_cb) {
+        Check(cbs->double_cb(u));
+      } else {
+        WrongType("uint64");
+      }
+    }
+    return EndValue();
+  }
+
+  bool Double(double d) {
+    const Callbacks* cbs = FindCallbacks();
+    if (cbs) {
+      if (cbs->double_cb) {
+        Check(cbs->double_cb(d));
+      } else {
+        WrongType("double");
+      }
+    }
+    return EndValue();
+  }
+
+  bool String(const Ch* str, SizeType length, bool copy) {
+    // rapidjson 0.11 reports the names of the members as strings.
+    if (expect_key_) {
+      return Key(str, length, copy);
+    }
+    const Callbacks* cbs = FindCallbacks();
+    if (cbs) {
+      if (cbs->string_cb) {
+        Check(cbs->string_cb(Slice(str, length)));
+      } else {
+        WrongType("string");
+      }
+    }
+    return EndValue();
+  }
+
+  bool Key(const Ch* str, SizeType length, bool /* copy */) {
+    size_t base = frames_.back().base_len;
+    path_.resize(base);
+    if (base > 0) {
+      path_.push_back('.');
+    }
+    path_.append(str, length);
+    expect_key_ = false;
+    return status_.ok();
+  }
+
+  bool StartObject() {
+    const Callbacks* cbs = FindCallbacks();
+    if (cbs) {
+      if (cbs->start_cb) {
+        Check(cbs->start_cb());
+      } else if (!cbs->end_cb) {
+        WrongType("object");
+      }
+    }
+    frames_.push_back({ true, path_.size() });
+    expect_key_ = true;
+    return status_.ok();
+  }
+
+  bool EndObject(SizeType /* member_count */) {
+    path_.resize(frames_.back().base_len);
+    frames_.pop_back();
+    const Callbacks* cbs = FindCallbacks();
+    if (cbs && cbs->end_cb) {
+      Check(cbs->end_cb());
+    }
+    return EndValue();
+  }
+
+  bool StartArray() {
+    if (FindCallbacks()) {
+      WrongType("array");
+    }
+    frames_.push_back({ false, path_.size() });
+    path_.append("[]");
+    expect_key_ = false;
+    return status_.ok();
+  }
+
+  bool EndArray(SizeType /* element_count */) {
+    path_.resize(frames_.back().base_len);
+    frames_.pop_back();
+    return EndValue();
+  }
+
+  const Status& status() const { return status_; }
+
+ private:
+  struct Frame {
+    bool is_object;
+    // The length of the path of the object or array.
+    size_t base_len;
+  };
+
+  // Returns the callbacks for the current value, or NULL if it has none.
+  const Callbacks* FindCallbacks() const {
+    if (!status_.ok()) {
+      return nullptr;
+    }
+    auto it = callbacks_->find(path_);
+    return it == callbacks_->end() ? nullptr : &it->second;
+  }
+
+  // Called after each value.
+  bool EndValue() {
+    if (!frames_.empty() && frames_.back().is_object) {
+      expect_key_ = true;
+    }
+    return status_.ok();
+  }
+
+  void Check(const Status& s) {
+    if (PREDICT_FALSE(!s.ok())) {
+      status_ = s;
+    }
+  }
+
+  void WrongType(const char* type) {
+    status_ = Status::InvalidArgument(Substitute(
+        "Wrong type during field extraction: unexpected $0 at '$1'", type, path_));
+  }
+
+  const std::unordered_map<string, Callbacks>* callbacks_;
+
+  // The path of the current value.
+  string path_;
+
+  // The objects and arrays the current value is in.
+  vector<Frame> frames_;
+
+  // Whether the next string is the name of a member.
+  bool expect_key_;
+
+  Status status_;
+};
+
+// A rapidjson input stream over a Slice. Ends early if the status of the
+// handler isn't OK.
+class JsonSaxReader::SliceStream {
+ public:
+  typedef char Ch;
+
+  SliceStream(const Slice& text, const Handler* handler)
+      : begin_(reinterpret_cast<const char*>(text.data())),
+        cur_(begin_),
+        end_(begin_ + text.size()),
+        handler_(handler) {
+  }
+
+  Ch Peek() const {
+    return PREDICT_TRUE(cur_ < end_ && handler_->status().ok()) ? *cur_ : '\0';
+  }
+
+  Ch Take() {
+    return PREDICT_TRUE(cur_ < end_ && handler_->status().ok()) ? *cur_++ : '\0';
+  }
+
+  size_t Tell() const { return cur_ - begin_; }
+
+  // Only used for parsing in place.
+  Ch* PutBegin() { LOG(DFATAL) << "not supported"; return nullptr; }
+  void Put(Ch /* c */) { LOG(DFATAL) << "not supported"; }
+  void Flush() {}
+  size_t PutEnd(Ch* /* begin */) { return 0; }
+
+ private:
+  const char* begin_;
+  const char* cur_;
+  const char* end_;
+  const Handler* handler_;
+};
+
+// A rapidjson input stream reading a SequentialFile in chunks. Ends early if
+// the status of the handler isn't OK, or on a read error.
+class JsonSaxReader::FileStream {
+ public:
+  typedef char Ch;
+
+  FileStream(SequentialFile* file, const Handler* handler)
+      : file_(file),
+        handler_(handler),
+        scratch_(new uint8_t[kChunkSize]),
+        chunk_begin_(nullptr),
+        cur_(nullptr),
+        end_(nullptr),
+        consumed_(0) {
+    Refill();
+  }
+
+  Ch Peek() const {
+    return PREDICT_TRUE(cur_ < end_ && handler_->status().ok()) ? *cur_ : '\0';
+  }
+
+  Ch Take() {
+    if (PREDICT_FALSE(cur_ == end_ || !handler_->status().ok())) {
+      return '\0';
+    }
+    Ch c = *cur_++;
+    if (PREDICT_FALSE(cur_ == end_)) {
+      Refill();
+    }
+    return c;
+  }
+
+  size_t Tell() const { return consumed_ + (cur_ - chunk_begin_); }
+
+  // Only used for parsing in place.
+  Ch* PutBegin() { LOG(DFATAL) << "not supported"; return nullptr; }
+  void Put(Ch /* c */) { LOG(DFATAL) << "not supported"; }
+  void Flush() {}
+  size_t PutEnd(Ch* /* begin */) { return 0; }
+
+  const Status& status() const { return status_; }
+
+ private:
+  static const size_t kChunkSize = 64 * 1024;
+
+  void Refill() {
+    if (cur_) {
+      consumed_ += cur_ - chunk_begin_;
+    }
+    Slice chunk;
+    status_ = file_->Read(kChunkSize, &chunk, scratch_.get());
+    if (!status_.ok()) {
+      chunk.clear();
+    }
+    chunk_begin_ = cur_ = reinterpret_cast<const char*>(chunk.data());
+    end_ = cur_ + chunk.size();
+  }
+
+  SequentialFile* file_;
+  const Handler* handler_;
+  unique_ptr<uint8_t[]> scratch_;
+  const char* chunk_begin_;
+  const char* cur_;
+  const char* end_;
+  // The number of bytes in the chunks before the current one.
+  size_t consumed_;
+  Status status_;
+};
+
+JsonSaxReader::JsonSaxReader() {
+}
+
+JsonSaxReader::~JsonSaxReader() {
+}
+
+void JsonSaxReader::OnInt64(const string& path, Int64Callback cb) {
+  callbacks_[path].int64_cb = std::move(cb);
+}
+
+void JsonSaxReader::OnDouble(const string& path, DoubleCallback cb) {
+  callbacks_[path].double_cb = std::move(cb);
+}
+
+void JsonSaxReader::OnBool(const string& path, BoolCallback cb) {
+  callbacks_[path].bool_cb = std::move(cb);
+}
+
+void JsonSaxReader::OnString(const string& path, StringCallback cb) {
+  callbacks_[path].string_cb = std::move(cb);
+}
+
+void JsonSaxReader::OnObjectStart(const string& path, ObjectCallback cb) {
+  callbacks_[path].start_cb = std::move(cb);
+}
+
+void JsonSaxReader::OnObjectEnd(const string& path, ObjectCallback cb) {
+  callbacks_[path].end_cb = std::move(cb);
+}
+
+Status JsonSaxReader::Parse(const Slice& text) {
+  Handler handler(&callbacks_);
+  SliceStream stream(text, &handler);
+  return DoParse(&stream, &handler);
+}
+
+Status JsonSaxReader::ParseFile(SequentialFile* file) {
+  Handler handler(&callbacks_);
+  FileStream stream(file, &handler);
+  Status s = DoParse(&stream, &handler);
+  RETURN_NOT_OK_PREPEND(stream.status(),
+                        Substitute("Unable to read JSON from $0", file->filename()));
+  return s;
+}
+
+template<class Stream>
+Status JsonSaxReader::DoParse(Stream* stream, Handler* handler) {
+  rapidjson::Reader reader;
+  bool ok = reader.Parse<0>(*stream, *handler);
+  RETURN_NOT_OK(handler->status());
+  if (!ok) {
+    return Status::Corruption("JSON text is corrupt",
+                              Substitute("$0 at offset $1", reader.GetParseError(),
+                                         reader.GetErrorOffset()));
+  }
+  return Status::OK();
+}
+
 } // namespace bb
@@ -2,7 +2,9 @@
 #define BBOY_UTIL_JSONREADER_H_
 
 #include <stdint.h>
+#include <functional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <rapidjson/document.h>
@@ -10,10 +12,13 @@
 
 #include "bboy/gbase/gscoped_ptr.h"
 #include "bboy/gbase/macros.h"
+#include "bboy/base/slice.h"
 #include "bboy/base/status.h"
 
 namespace bb {
 
+class SequentialFile;
+
 // Wraps the JSON parsing functionality of rapidjson::Document.
 //
 // Unlike JsonWriter, this class does not hide rapidjson internals from
@@ -23,6 +28,16 @@ namespace bb {
 class JsonReader {
  public:
   explicit JsonReader(std::string text);
+
+  // Selects in-situ parsing: JsonReader(JsonReader::InSitu(), buf).
+  struct InSitu {};
+
+  // Parses 'text' in place instead of copying it: the strings of the
+  // document point into 'text' rather than being copied, which roughly
+  // halves the peak memory use for large documents. 'text' must be
+  // null-terminated and outlive the JsonReader, and Init() overwrites it.
+  JsonReader(InSitu, char* text);
+
   ~JsonReader();
 
   Status Init();
@@ -64,11 +79,81 @@ class JsonReader {
                       const rapidjson::Value** result) const;
 
   std::string text_;
+  // The text to parse in place, or NULL.
+  char* insitu_text_;
   rapidjson::Document document_;
 
   DISALLOW_COPY_AND_ASSIGN(JsonReader);
 };
 
+// Parses JSON text without building a document, calling back with the values
+// of the fields of interest as they are parsed. Memory use doesn't depend on
+// the size of the text, which can be streamed from a file.
+//
+// Fields are designated by their path from the root: the names of the
+// members leading to them separated by dots, with "[]" appended for the
+// elements of an array. For example, in
+//
+//   {"tablets": [{"id": "a", "size": 10}, {"id": "b", "size": 20}]}
+//
+// the tablet objects are at "tablets[]" and their ids at "tablets[].id". The
+// root is at "".
+//
+// A value at a path with callbacks but none for its type, other than null,
+// is an error. So is a callback returning an error: either stops the parsing
+// and is returned by Parse().
+class JsonSaxReader {
+ public:
+  typedef std::function<Status(int64_t value)> Int64Callback;
+  // Also called for integers, converted.
+  typedef std::function<Status(double value)> DoubleCallback;
+  typedef std::function<Status(bool value)> BoolCallback;
+  // 'value' is only valid during the call.
+  typedef std::function<Status(const Slice& value)> StringCallback;
+  typedef std::function<Status()> ObjectCallback;
+
+  JsonSaxReader();
+  ~JsonSaxReader();
+
+  // Set the callback for the values of a type at 'path', replacing any
+  // earlier one. Must not be called during parsing.
+  void OnInt64(const std::string& path, Int64Callback cb);
+  void OnDouble(const std::string& path, DoubleCallback cb);
+  void OnBool(const std::string& path, BoolCallback cb);
+  void OnString(const std::string& path, StringCallback cb);
+
+  // Set the callbacks for the start and the end of the objects at 'path'.
+  void OnObjectStart(const std::string& path, ObjectCallback cb);
+  void OnObjectEnd(const std::string& path, ObjectCallback cb);
+
+  // Parses 'text', which needn't be null-terminated.
+  Status Parse(const Slice& text);
+
+  // Parses the rest of 'file', reading it in chunks.
+  Status ParseFile(SequentialFile* file);
+
+ private:
+  class Handler;
+  class SliceStream;
+  class FileStream;
+
+  struct Callbacks {
+    Int64Callback int64_cb;
+    DoubleCallback double_cb;
+    BoolCallback bool_cb;
+    StringCallback string_cb;
+    ObjectCallback start_cb;
+    ObjectCallback end_cb;
+  };
+
+  template<class Stream>
+  Status DoParse(Stream* stream, Handler* handler);
+
+  std::unordered_map<std::string, Callbacks> callbacks_;
+
+  DISALLOW_COPY_AND_ASSIGN(JsonSaxReader);
+};
+
 } // namespace kudu
 
 #endif // BBOY_UTIL_JSONREADER_H_
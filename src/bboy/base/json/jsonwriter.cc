@@ -1,7 +1,12 @@
 #include "bboy/base/json/jsonwriter.h"
 
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <glog/logging.h>
@@ -11,14 +16,21 @@
 #include <rapidjson/prettywriter.h>
 #include <rapidjson/rapidjson.h>
 
-//#include "kudu/util/pb_util.pb.h"
+#include "bboy/gbase/strings/numbers.h"
+#include "bboy/base/faststring.h"
+#include "bboy/base/pb_util.pb.h"
+#include "bboy/base/sync/mutex.h"
 
+using google::protobuf::Descriptor;
+using google::protobuf::DescriptorPool;
 using google::protobuf::FieldDescriptor;
 using google::protobuf::Message;
 using google::protobuf::Reflection;
 
 using std::ostringstream;
 using std::string;
+using std::unique_ptr;
+using std::unordered_map;
 using std::vector;
 
 namespace bb {
@@ -87,6 +99,416 @@ class JsonWriterImpl : public JsonWriterIf {
   DISALLOW_COPY_AND_ASSIGN(JsonWriterImpl);
 };
 
+// Adapts JsonBufferWriter to the virtual interface above.
+template<JsonWriter::Mode kMode>
+class JsonBufferWriterImpl : public JsonWriterIf {
+ public:
+  explicit JsonBufferWriterImpl(faststring* out) : writer_(out) {}
+
+  virtual void Null() OVERRIDE { writer_.Null(); }
+  virtual void Bool(bool b) OVERRIDE { writer_.Bool(b); }
+  virtual void Int(int i) OVERRIDE { writer_.Int(i); }
+  virtual void Uint(unsigned u) OVERRIDE { writer_.Uint(u); }
+  virtual void Int64(int64_t i64) OVERRIDE { writer_.Int64(i64); }
+  virtual void Uint64(uint64_t u64) OVERRIDE { writer_.Uint64(u64); }
+  virtual void Double(double d) OVERRIDE { writer_.Double(d); }
+  virtual void String(const char* str, size_t length) OVERRIDE { writer_.String(str, length); }
+  virtual void String(const char* str) OVERRIDE { writer_.String(str); }
+  virtual void String(const std::string& str) OVERRIDE { writer_.String(str); }
+
+  virtual void StartObject() OVERRIDE { writer_.StartObject(); }
+  virtual void EndObject() OVERRIDE { writer_.EndObject(); }
+  virtual void StartArray() OVERRIDE { writer_.StartArray(); }
+  virtual void EndArray() OVERRIDE { writer_.EndArray(); }
+
+ private:
+  JsonBufferWriter<kMode> writer_;
+  DISALLOW_COPY_AND_ASSIGN(JsonBufferWriterImpl);
+};
+
+namespace {
+
+// Written in place of the value of 'string' and 'bytes' fields with the
+// REDACT option.
+const char kRedactionMessage[] = "<redacted>";
+
+// Writes 'pb' to 'w', a JsonWriter or a JsonBufferWriter.
+template<class W>
+void WriteProtobuf(const Message& pb, W* w);
+
+template<class W>
+void WriteProtobufField(const Message& pb, const FieldDescriptor* field, W* w) {
+  const Reflection* reflection = pb.GetReflection();
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      w->Int(reflection->GetInt32(pb, field));
+      break;
+    case FieldDescriptor::CPPTYPE_INT64:
+      w->Int64(reflection->GetInt64(pb, field));
+      break;
+    case FieldDescriptor::CPPTYPE_UINT32:
+      w->Uint(reflection->GetUInt32(pb, field));
+      break;
+    case FieldDescriptor::CPPTYPE_UINT64:
+      w->Uint64(reflection->GetUInt64(pb, field));
+      break;
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      w->Double(reflection->GetDouble(pb, field));
+      break;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      w->Double(reflection->GetFloat(pb, field));
+      break;
+    case FieldDescriptor::CPPTYPE_BOOL:
+      w->Bool(reflection->GetBool(pb, field));
+      break;
+    case FieldDescriptor::CPPTYPE_ENUM:
+      w->String(reflection->GetEnum(pb, field)->name());
+      break;
+    case FieldDescriptor::CPPTYPE_STRING:
+      if (field->options().GetExtension(REDACT)) {
+        w->String(kRedactionMessage);
+      } else {
+        w->String(reflection->GetString(pb, field));
+      }
+      break;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      WriteProtobuf(reflection->GetMessage(pb, field), w);
+      break;
+    default:
+      LOG(FATAL) << "Unknown cpp_type: " << field->cpp_type();
+  }
+}
+
+template<class W>
+void WriteProtobufRepeatedField(const Message& pb, const FieldDescriptor* field, int index,
+                                W* w) {
+  const Reflection* reflection = pb.GetReflection();
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      w->Int(reflection->GetRepeatedInt32(pb, field, index));
+      break;
+    case FieldDescriptor::CPPTYPE_INT64:
+      w->Int64(reflection->GetRepeatedInt64(pb, field, index));
+      break;
+    case FieldDescriptor::CPPTYPE_UINT32:
+      w->Uint(reflection->GetRepeatedUInt32(pb, field, index));
+      break;
+    case FieldDescriptor::CPPTYPE_UINT64:
+      w->Uint64(reflection->GetRepeatedUInt64(pb, field, index));
+      break;
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      w->Double(reflection->GetRepeatedDouble(pb, field, index));
+      break;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      w->Double(reflection->GetRepeatedFloat(pb, field, index));
+      break;
+    case FieldDescriptor::CPPTYPE_BOOL:
+      w->Bool(reflection->GetRepeatedBool(pb, field, index));
+      break;
+    case FieldDescriptor::CPPTYPE_ENUM:
+      w->String(reflection->GetRepeatedEnum(pb, field, index)->name());
+      break;
+    case FieldDescriptor::CPPTYPE_STRING:
+      if (field->options().GetExtension(REDACT)) {
+        w->String(kRedactionMessage);
+      } else {
+        w->String(reflection->GetRepeatedString(pb, field, index));
+      }
+      break;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      WriteProtobuf(reflection->GetRepeatedMessage(pb, field, index), w);
+      break;
+    default:
+      LOG(FATAL) << "Unknown cpp_type: " << field->cpp_type();
+  }
+}
+
+template<class W>
+void WriteProtobuf(const Message& pb, W* w) {
+  const Reflection* reflection = pb.GetReflection();
+  vector<const FieldDescriptor*> fields;
+  reflection->ListFields(pb, &fields);
+
+  w->StartObject();
+  for (const FieldDescriptor* field : fields) {
+    w->String(field->name());
+    if (field->is_repeated()) {
+      w->StartArray();
+      for (int i = 0; i < reflection->FieldSize(pb, field); i++) {
+        WriteProtobufRepeatedField(pb, field, i, w);
+      }
+      w->EndArray();
+    } else {
+      WriteProtobufField(pb, field, w);
+    }
+  }
+  w->EndObject();
+}
+
+// WriteProtobuf() looks up, for every field of every message it writes,
+// which fields are set, their names and their types, and escapes the names.
+// For messages of generated types, all of that is instead worked out once
+// per type and writer class into a ProtobufPlan, which is cached for the
+// lifetime of the process.
+template<class W>
+struct ProtobufPlan;
+
+template<class W>
+struct ProtobufFieldPlan {
+  // Writes the value of a singular field (index -1) or an element of a
+  // repeated field.
+  typedef void (*WriteFn)(const Message& pb, const Reflection* reflection,
+                          const FieldDescriptor* field, int index, W* w);
+
+  const FieldDescriptor* field;
+
+  // The name of the field, quoted and escaped.
+  string key;
+
+  // Null for message fields.
+  WriteFn write;
+
+  // For message fields, the plan of the message type, or null if it has
+  // none: see GetProtobufPlan().
+  const ProtobufPlan<W>* message_plan;
+};
+
+template<class W>
+struct ProtobufPlan {
+  // The fields of the message, by increasing field number as
+  // Reflection::ListFields() would list them.
+  vector<ProtobufFieldPlan<W>> fields;
+};
+
+template<class W>
+void WriteInt32(const Message& pb, const Reflection* reflection, const FieldDescriptor* field,
+                int index, W* w) {
+  w->Int(index < 0 ? reflection->GetInt32(pb, field) :
+         reflection->GetRepeatedInt32(pb, field, index));
+}
+
+template<class W>
+void WriteInt64(const Message& pb, const Reflection* reflection, const FieldDescriptor* field,
+                int index, W* w) {
+  w->Int64(index < 0 ? reflection->GetInt64(pb, field) :
+           reflection->GetRepeatedInt64(pb, field, index));
+}
+
+template<class W>
+void WriteUInt32(const Message& pb, const Reflection* reflection, const FieldDescriptor* field,
+                 int index, W* w) {
+  w->Uint(index < 0 ? reflection->GetUInt32(pb, field) :
+          reflection->GetRepeatedUInt32(pb, field, index));
+}
+
+template<class W>
+void WriteUInt64(const Message& pb, const Reflection* reflection, const FieldDescriptor* field,
+                 int index, W* w) {
+  w->Uint64(index < 0 ? reflection->GetUInt64(pb, field) :
+            reflection->GetRepeatedUInt64(pb, field, index));
+}
+
+template<class W>
+void WriteDouble(const Message& pb, const Reflection* reflection, const FieldDescriptor* field,
+                 int index, W* w) {
+  w->Double(index < 0 ? reflection->GetDouble(pb, field) :
+            reflection->GetRepeatedDouble(pb, field, index));
+}
+
+template<class W>
+void WriteFloat(const Message& pb, const Reflection* reflection, const FieldDescriptor* field,
+                int index, W* w) {
+  w->Double(index < 0 ? reflection->GetFloat(pb, field) :
+            reflection->GetRepeatedFloat(pb, field, index));
+}
+
+template<class W>
+void WriteBool(const Message& pb, const Reflection* reflection, const FieldDescriptor* field,
+               int index, W* w) {
+  w->Bool(index < 0 ? reflection->GetBool(pb, field) :
+          reflection->GetRepeatedBool(pb, field, index));
+}
+
+template<class W>
+void WriteEnum(const Message& pb, const Reflection* reflection, const FieldDescriptor* field,
+               int index, W* w) {
+  w->String((index < 0 ? reflection->GetEnum(pb, field) :
+             reflection->GetRepeatedEnum(pb, field, index))->name());
+}
+
+template<class W>
+void WriteString(const Message& pb, const Reflection* reflection, const FieldDescriptor* field,
+                 int index, W* w) {
+  // Unlike GetString(), GetStringReference() doesn't copy the value.
+  string scratch;
+  w->String(index < 0 ? reflection->GetStringReference(pb, field, &scratch) :
+            reflection->GetRepeatedStringReference(pb, field, index, &scratch));
+}
+
+template<class W>
+void WriteRedacted(const Message& /* pb */, const Reflection* /* reflection */,
+                   const FieldDescriptor* /* field */, int /* index */, W* w) {
+  w->String(kRedactionMessage, sizeof(kRedactionMessage) - 1);
+}
+
+template<class W>
+typename ProtobufFieldPlan<W>::WriteFn GetWriteFn(const FieldDescriptor* field) {
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32: return &WriteInt32<W>;
+    case FieldDescriptor::CPPTYPE_INT64: return &WriteInt64<W>;
+    case FieldDescriptor::CPPTYPE_UINT32: return &WriteUInt32<W>;
+    case FieldDescriptor::CPPTYPE_UINT64: return &WriteUInt64<W>;
+    case FieldDescriptor::CPPTYPE_DOUBLE: return &WriteDouble<W>;
+    case FieldDescriptor::CPPTYPE_FLOAT: return &WriteFloat<W>;
+    case FieldDescriptor::CPPTYPE_BOOL: return &WriteBool<W>;
+    case FieldDescriptor::CPPTYPE_ENUM: return &WriteEnum<W>;
+    case FieldDescriptor::CPPTYPE_STRING:
+      if (field->options().GetExtension(REDACT)) {
+        return &WriteRedacted<W>;
+      }
+      return &WriteString<W>;
+    case FieldDescriptor::CPPTYPE_MESSAGE: return nullptr;
+    default:
+      LOG(FATAL) << "Unknown cpp_type: " << field->cpp_type();
+  }
+  return nullptr;
+}
+
+// The plans of the message types, by writer class.
+template<class W>
+struct ProtobufPlanCache {
+  Mutex lock;
+  unordered_map<const Descriptor*, unique_ptr<ProtobufPlan<W>>> plans;
+};
+
+// Returns the plan of 'descriptor', building it, and the plans of the message
+// types of its fields, on first use. Must be called with 'cache->lock' held.
+template<class W>
+const ProtobufPlan<W>* GetProtobufPlanUnlocked(const Descriptor* descriptor,
+                                               ProtobufPlanCache<W>* cache) {
+  // Descriptors from other pools may be freed, and their address reused by
+  // another type. Messages with extensions are left to ListFields(), which
+  // also lists the extensions which are set.
+  if (descriptor->file()->pool() != DescriptorPool::generated_pool() ||
+      descriptor->extension_range_count() > 0) {
+    return nullptr;
+  }
+  unique_ptr<ProtobufPlan<W>>& slot = cache->plans[descriptor];
+  if (slot) {
+    return slot.get();
+  }
+  // The plan is published before its fields are filled in so that recursive
+  // types refer to it rather than build it again.
+  slot.reset(new ProtobufPlan<W>);
+  ProtobufPlan<W>* plan = slot.get();
+
+  vector<const FieldDescriptor*> fields;
+  fields.reserve(descriptor->field_count());
+  for (int i = 0; i < descriptor->field_count(); i++) {
+    fields.push_back(descriptor->field(i));
+  }
+  std::sort(fields.begin(), fields.end(),
+            [](const FieldDescriptor* a, const FieldDescriptor* b) {
+              return a->number() < b->number();
+            });
+
+  plan->fields.reserve(fields.size());
+  for (const FieldDescriptor* field : fields) {
+    ProtobufFieldPlan<W> fp;
+    fp.field = field;
+    faststring key;
+    CompactJsonBufferWriter(&key).String(field->name());
+    fp.key = key.ToString();
+    fp.write = GetWriteFn<W>(field);
+    fp.message_plan = nullptr;
+    if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) {
+      fp.message_plan = GetProtobufPlanUnlocked(field->message_type(), cache);
+    }
+    plan->fields.push_back(std::move(fp));
+  }
+  return plan;
+}
+
+// Returns the plan of 'descriptor', or null if it must be written by
+// WriteProtobuf().
+template<class W>
+const ProtobufPlan<W>* GetProtobufPlan(const Descriptor* descriptor) {
+  // Never freed, so that messages may still be written while the process
+  // exits.
+  static ProtobufPlanCache<W>* cache = new ProtobufPlanCache<W>;
+  MutexLock l(cache->lock);
+  return GetProtobufPlanUnlocked(descriptor, cache);
+}
+
+void WriteProtobufKey(const ProtobufFieldPlan<JsonWriter>& fp, JsonWriter* w) {
+  w->String(fp.field->name());
+}
+
+template<JsonWriter::Mode kMode>
+void WriteProtobufKey(const ProtobufFieldPlan<JsonBufferWriter<kMode>>& fp,
+                      JsonBufferWriter<kMode>* w) {
+  w->RawValue(fp.key.data(), fp.key.size());
+}
+
+template<class W>
+void WriteProtobufWithPlan(const Message& pb, const ProtobufPlan<W>& plan, W* w);
+
+template<class W>
+void WriteProtobufValue(const Message& pb, const Reflection* reflection,
+                        const ProtobufFieldPlan<W>& fp, int index, W* w) {
+  if (fp.write) {
+    fp.write(pb, reflection, fp.field, index, w);
+    return;
+  }
+  const Message& msg = index < 0 ? reflection->GetMessage(pb, fp.field) :
+                       reflection->GetRepeatedMessage(pb, fp.field, index);
+  if (fp.message_plan) {
+    WriteProtobufWithPlan(msg, *fp.message_plan, w);
+  } else {
+    WriteProtobuf(msg, w);
+  }
+}
+
+template<class W>
+void WriteProtobufWithPlan(const Message& pb, const ProtobufPlan<W>& plan, W* w) {
+  const Reflection* reflection = pb.GetReflection();
+  w->StartObject();
+  for (const ProtobufFieldPlan<W>& fp : plan.fields) {
+    if (fp.field->is_repeated()) {
+      int size = reflection->FieldSize(pb, fp.field);
+      if (size == 0) {
+        continue;
+      }
+      WriteProtobufKey(fp, w);
+      w->StartArray();
+      for (int i = 0; i < size; i++) {
+        WriteProtobufValue(pb, reflection, fp, i, w);
+      }
+      w->EndArray();
+    } else {
+      if (!reflection->HasField(pb, fp.field)) {
+        continue;
+      }
+      WriteProtobufKey(fp, w);
+      WriteProtobufValue(pb, reflection, fp, -1, w);
+    }
+  }
+  w->EndObject();
+}
+
+// Writes 'pb' to 'w' with its plan if it has one.
+template<class W>
+void WriteProtobufCached(const Message& pb, W* w) {
+  const ProtobufPlan<W>* plan = GetProtobufPlan<W>(pb.GetDescriptor());
+  if (plan) {
+    WriteProtobufWithPlan(pb, *plan, w);
+  } else {
+    WriteProtobuf(pb, w);
+  }
+}
+
+} // anonymous namespace
+
 //
 // JsonWriter
 //
@@ -104,6 +526,18 @@ JsonWriter::JsonWriter(ostringstream* out, Mode m) {
       break;
   }
 }
+
+JsonWriter::JsonWriter(faststring* out, Mode m) {
+  switch (m) {
+    case PRETTY:
+      impl_.reset(new JsonBufferWriterImpl<PRETTY>(DCHECK_NOTNULL(out)));
+      break;
+    case COMPACT:
+      impl_.reset(new JsonBufferWriterImpl<COMPACT>(DCHECK_NOTNULL(out)));
+      break;
+  }
+}
+
 JsonWriter::~JsonWriter() {
 }
 
@@ -152,115 +586,20 @@ template<> void JsonWriter::Value(const size_t& val) {
 #endif
 
 void JsonWriter::Protobuf(const Message& pb) {
-  const Reflection* reflection = pb.GetReflection();
-  vector<const FieldDescriptor*> fields;
-  reflection->ListFields(pb, &fields);
-
-  StartObject();
-  for (const FieldDescriptor* field : fields) {
-    String(field->name());
-    if (field->is_repeated()) {
-      StartArray();
-      for (int i = 0; i < reflection->FieldSize(pb, field); i++) {
-        ProtobufRepeatedField(pb, field, i);
-      }
-      EndArray();
-    } else {
-      ProtobufField(pb, field);
-    }
-  }
-  EndObject();
-}
-
-void JsonWriter::ProtobufField(const Message& pb, const FieldDescriptor* field) {
-  const Reflection* reflection = pb.GetReflection();
-  switch (field->cpp_type()) {
-    case FieldDescriptor::CPPTYPE_INT32:
-      Int(reflection->GetInt32(pb, field));
-      break;
-    case FieldDescriptor::CPPTYPE_INT64:
-      Int64(reflection->GetInt64(pb, field));
-      break;
-    case FieldDescriptor::CPPTYPE_UINT32:
-      Uint(reflection->GetUInt32(pb, field));
-      break;
-    case FieldDescriptor::CPPTYPE_UINT64:
-      Uint64(reflection->GetUInt64(pb, field));
-      break;
-    case FieldDescriptor::CPPTYPE_DOUBLE:
-      Double(reflection->GetDouble(pb, field));
-      break;
-    case FieldDescriptor::CPPTYPE_FLOAT:
-      Double(reflection->GetFloat(pb, field));
-      break;
-    case FieldDescriptor::CPPTYPE_BOOL:
-      Bool(reflection->GetBool(pb, field));
-      break;
-    case FieldDescriptor::CPPTYPE_ENUM:
-      String(reflection->GetEnum(pb, field)->name());
-      break;
-    case FieldDescriptor::CPPTYPE_STRING:
-#if 0 // TODO(wqx):
-      String(BBOY_MAYBE_REDACT_IF(field->options().GetExtension(REDACT),
-                                  reflection->GetString(pb, field)));
-#endif
-      String(reflection->GetString(pb, field));
-      break;
-    case FieldDescriptor::CPPTYPE_MESSAGE:
-      Protobuf(reflection->GetMessage(pb, field));
-      break;
-    default:
-      LOG(FATAL) << "Unknown cpp_type: " << field->cpp_type();
-  }
+  WriteProtobufCached(pb, this);
 }
 
-void JsonWriter::ProtobufRepeatedField(const Message& pb, const FieldDescriptor* field, int index) {
-  const Reflection* reflection = pb.GetReflection();
-  switch (field->cpp_type()) {
-    case FieldDescriptor::CPPTYPE_INT32:
-      Int(reflection->GetRepeatedInt32(pb, field, index));
-      break;
-    case FieldDescriptor::CPPTYPE_INT64:
-      Int64(reflection->GetRepeatedInt64(pb, field, index));
-      break;
-    case FieldDescriptor::CPPTYPE_UINT32:
-      Uint(reflection->GetRepeatedUInt32(pb, field, index));
-      break;
-    case FieldDescriptor::CPPTYPE_UINT64:
-      Uint64(reflection->GetRepeatedUInt64(pb, field, index));
-      break;
-    case FieldDescriptor::CPPTYPE_DOUBLE:
-      Double(reflection->GetRepeatedDouble(pb, field, index));
-      break;
-    case FieldDescriptor::CPPTYPE_FLOAT:
-      Double(reflection->GetRepeatedFloat(pb, field, index));
-      break;
-    case FieldDescriptor::CPPTYPE_BOOL:
-      Bool(reflection->GetRepeatedBool(pb, field, index));
-      break;
-    case FieldDescriptor::CPPTYPE_ENUM:
-      String(reflection->GetRepeatedEnum(pb, field, index)->name());
-      break;
-    case FieldDescriptor::CPPTYPE_STRING:
-#if 0 //TODO(wqx):
-      String(BBOY_MAYBE_REDACT_IF(field->options().GetExtension(REDACT),
-                                  reflection->GetRepeatedString(pb, field, index)));
-#endif
-      String(reflection->GetRepeatedString(pb, field, index));
+string JsonWriter::ToJson(const Message& pb, Mode mode) {
+  faststring buf;
+  switch (mode) {
+    case PRETTY:
+      PrettyJsonBufferWriter(&buf).Protobuf(pb);
       break;
-    case FieldDescriptor::CPPTYPE_MESSAGE:
-      Protobuf(reflection->GetRepeatedMessage(pb, field, index));
+    case COMPACT:
+      CompactJsonBufferWriter(&buf).Protobuf(pb);
       break;
-    default:
-      LOG(FATAL) << "Unknown cpp_type: " << field->cpp_type();
   }
-}
-
-string JsonWriter::ToJson(const Message& pb, Mode mode) {
-  ostringstream stream;
-  JsonWriter writer(&stream, mode);
-  writer.Protobuf(pb);
-  return stream.str();
+  return buf.ToString();
 }
 
 //
@@ -313,4 +652,234 @@ void JsonWriterImpl<T>::StartArray() { writer_.StartArray(); }
 template<class T>
 void JsonWriterImpl<T>::EndArray() { writer_.EndArray(); }
 
-} // namespace kudu
+//
+// JsonBufferWriter
+//
+
+namespace {
+
+// For each byte, 0 if it needn't be escaped in a JSON string, 'u' if it must
+// be written as \u00XX, or else the character to write after a backslash.
+const char kEscapes[256] = {
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+  // The rest are 0.
+};
+
+// The indentation of PRETTY mode, as rapidjson::PrettyWriter.
+const int kIndent = 4;
+
+} // anonymous namespace
+
+template<JsonWriter::Mode kMode>
+JsonBufferWriter<kMode>::JsonBufferWriter(faststring* out)
+  : out_(DCHECK_NOTNULL(out)) {
+}
+
+template<JsonWriter::Mode kMode>
+JsonBufferWriter<kMode>::~JsonBufferWriter() {
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Raw(const char* str, size_t length) {
+  out_->append(str, length);
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::NewLine() {
+  size_t n = levels_.size() * kIndent;
+  size_t len = out_->size();
+  out_->resize(len + 1 + n);
+  uint8_t* p = out_->data() + len;
+  *p++ = '\n';
+  memset(p, ' ', n);
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Prefix() {
+  if (levels_.empty()) {
+    return;
+  }
+  Level& level = levels_.back();
+  if (kMode == JsonWriter::COMPACT) {
+    if (level.value_count > 0) {
+      // In an object, the values alternate between names and values.
+      out_->push_back(level.in_array || level.value_count % 2 == 0 ? ',' : ':');
+    }
+  } else {
+    bool indent = true;
+    if (level.in_array) {
+      if (level.value_count > 0) {
+        out_->push_back(',');
+      }
+    } else if (level.value_count % 2 == 1) {
+      Raw(": ", 2);
+      indent = false;
+    } else if (level.value_count > 0) {
+      out_->push_back(',');
+    }
+    if (indent) {
+      NewLine();
+    }
+  }
+  level.value_count++;
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Null() {
+  Prefix();
+  Raw("null", 4);
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Bool(bool b) {
+  Prefix();
+  if (b) {
+    Raw("true", 4);
+  } else {
+    Raw("false", 5);
+  }
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Int(int i) {
+  Prefix();
+  char buf[kFastToBufferSize];
+  Raw(buf, FastInt32ToBufferLeft(i, buf) - buf);
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Uint(unsigned u) {
+  Prefix();
+  char buf[kFastToBufferSize];
+  Raw(buf, FastUInt32ToBufferLeft(u, buf) - buf);
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Int64(int64_t i64) {
+  Prefix();
+  char buf[kFastToBufferSize];
+  Raw(buf, FastInt64ToBufferLeft(i64, buf) - buf);
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Uint64(uint64_t u64) {
+  Prefix();
+  char buf[kFastToBufferSize];
+  Raw(buf, FastUInt64ToBufferLeft(u64, buf) - buf);
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Double(double d) {
+  Prefix();
+  if (PREDICT_FALSE(!std::isfinite(d))) {
+    Raw("null", 4);
+    return;
+  }
+  char buf[kFastToBufferSize];
+  // Integral values, common in metrics, are much cheaper to format as
+  // integers than with DoubleToBuffer(), which calls snprintf() and strtod().
+  // -0.0 is left to DoubleToBuffer().
+  if (d > -1e15 && d < 1e15 && d == static_cast<int64_t>(d) &&
+      (d != 0 || !std::signbit(d))) {
+    Raw(buf, FastInt64ToBufferLeft(static_cast<int64_t>(d), buf) - buf);
+    return;
+  }
+  DoubleToBuffer(d, buf);
+  Raw(buf, strlen(buf));
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::String(const char* str, size_t length) {
+  static const char kHexDigits[] = "0123456789ABCDEF";
+  Prefix();
+  out_->push_back('"');
+  const char* run = str;
+  const char* end = str + length;
+  for (const char* p = str; p < end; p++) {
+    char esc = kEscapes[static_cast<uint8_t>(*p)];
+    if (PREDICT_TRUE(esc == 0)) {
+      continue;
+    }
+    Raw(run, p - run);
+    run = p + 1;
+    if (esc == 'u') {
+      char u[6] = { '\\', 'u', '0', '0',
+                    kHexDigits[static_cast<uint8_t>(*p) >> 4],
+                    kHexDigits[*p & 0xf] };
+      Raw(u, sizeof(u));
+    } else {
+      char e[2] = { '\\', esc };
+      Raw(e, sizeof(e));
+    }
+  }
+  Raw(run, end - run);
+  out_->push_back('"');
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::String(const char* str) {
+  String(str, strlen(str));
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::String(const string& str) {
+  String(str.data(), str.size());
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::Protobuf(const Message& pb) {
+  WriteProtobufCached(pb, this);
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::RawValue(const char* json, size_t length) {
+  Prefix();
+  Raw(json, length);
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::StartObject() {
+  Prefix();
+  out_->push_back('{');
+  levels_.push_back({ false, 0 });
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::EndObject() {
+  DCHECK(!levels_.empty() && !levels_.back().in_array);
+  DCHECK_EQ(0, levels_.back().value_count % 2) << "member without a value";
+  bool empty = levels_.back().value_count == 0;
+  levels_.pop_back();
+  if (kMode == JsonWriter::PRETTY && !empty) {
+    NewLine();
+  }
+  out_->push_back('}');
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::StartArray() {
+  Prefix();
+  out_->push_back('[');
+  levels_.push_back({ true, 0 });
+}
+
+template<JsonWriter::Mode kMode>
+void JsonBufferWriter<kMode>::EndArray() {
+  DCHECK(!levels_.empty() && levels_.back().in_array);
+  bool empty = levels_.back().value_count == 0;
+  levels_.pop_back();
+  if (kMode == JsonWriter::PRETTY && !empty) {
+    NewLine();
+  }
+  out_->push_back(']');
+}
+
+template class JsonBufferWriter<JsonWriter::COMPACT>;
+template class JsonBufferWriter<JsonWriter::PRETTY>;
+
+} // namespace bb
@@ -0,0 +1,1193 @@
+#include "bboy/base/mem_env.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "bboy/gbase/callback.h"
+#include "bboy/gbase/casts.h"
+#include "bboy/gbase/map-util.h"
+#include "bboy/gbase/stringprintf.h"
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/gbase/strings/util.h"
+#include "bboy/gbase/walltime.h"
+#include "bboy/base/env.h"
+#include "bboy/base/errno.h"
+#include "bboy/base/mem_tracker.h"
+#include "bboy/base/slice.h"
+#include "bboy/base/sync/mutex.h"
+
+using std::map;
+using std::pair;
+using std::set;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using strings::Substitute;
+
+namespace bb {
+
+namespace {
+
+// The unit in which file data are allocated, and the block size reported
+// for every path.
+const size_t kBlockSize = 4096;
+
+typedef MemEnvOptions::FailureInjector FailureInjector;
+
+// Returns the error a POSIX filesystem would return for 'err_number'.
+Status ErrnoError(const string& context, int err_number) {
+  switch (err_number) {
+    case ENOENT:
+      return Status::NotFound(context, ErrnoToString(err_number), err_number);
+    case EEXIST:
+      return Status::AlreadyPresent(context, ErrnoToString(err_number), err_number);
+  }
+  return Status::IOError(context, ErrnoToString(err_number), err_number);
+}
+
+Status MaybeInjectFailure(const FailureInjector& injector, MemEnvOptions::Operation op,
+                          const string& path) {
+  if (injector) {
+    return injector(op, path);
+  }
+  return Status::OK();
+}
+
+// The data of a file, shared by the namespace of the Env and the open
+// handles of the file, so that deleted files stay readable until they're
+// closed.
+//
+// The data are held in blocks of 'kBlockSize' bytes, charged to a
+// MemTracker. Unallocated blocks read as zeroes.
+class MemFile {
+ public:
+  explicit MemFile(shared_ptr<MemTracker> mem_tracker)
+    : mem_tracker_(std::move(mem_tracker)),
+      size_(0),
+      num_blocks_(0),
+      mtime_(GetCurrentTimeMicros()) {
+  }
+
+  ~MemFile() {
+    FreeBlocks(0, blocks_.size());
+  }
+
+  uint64_t size() const {
+    MutexLock l(lock_);
+    return size_;
+  }
+
+  uint64_t allocated_bytes() const {
+    MutexLock l(lock_);
+    return num_blocks_ * kBlockSize;
+  }
+
+  int64_t mtime() const {
+    MutexLock l(lock_);
+    return mtime_;
+  }
+
+  // Copy up to 'n' bytes from 'offset' into 'dst', stopping at the end of
+  // the file. Returns the number of bytes copied.
+  size_t Read(uint64_t offset, size_t n, uint8_t* dst) const {
+    MutexLock l(lock_);
+    if (offset >= size_) {
+      return 0;
+    }
+    n = std::min<uint64_t>(n, size_ - offset);
+    size_t done = 0;
+    while (done < n) {
+      uint64_t pos = offset + done;
+      size_t block_offset = pos % kBlockSize;
+      size_t chunk = std::min(n - done, kBlockSize - block_offset);
+      size_t idx = pos / kBlockSize;
+      if (idx < blocks_.size() && blocks_[idx]) {
+        memcpy(dst + done, blocks_[idx].get() + block_offset, chunk);
+      } else {
+        memset(dst + done, 0, chunk);
+      }
+      done += chunk;
+    }
+    return n;
+  }
+
+  Status Write(uint64_t offset, const Slice& data) {
+    if (data.empty()) {
+      return Status::OK();
+    }
+    MutexLock l(lock_);
+    RETURN_NOT_OK(AllocateBlocks(offset, offset + data.size()));
+    size_t done = 0;
+    while (done < data.size()) {
+      uint64_t pos = offset + done;
+      size_t block_offset = pos % kBlockSize;
+      size_t chunk = std::min(data.size() - done, kBlockSize - block_offset);
+      memcpy(blocks_[pos / kBlockSize].get() + block_offset, data.data() + done, chunk);
+      done += chunk;
+    }
+    size_ = std::max<uint64_t>(size_, offset + data.size());
+    mtime_ = GetCurrentTimeMicros();
+    return Status::OK();
+  }
+
+  // Allocate the blocks covering 'length' bytes from 'offset', extending the
+  // file over them if 'change_size' is set.
+  Status PreAllocate(uint64_t offset, uint64_t length, bool change_size) {
+    MutexLock l(lock_);
+    RETURN_NOT_OK(AllocateBlocks(offset, offset + length));
+    if (change_size && offset + length > size_) {
+      size_ = offset + length;
+      mtime_ = GetCurrentTimeMicros();
+    }
+    return Status::OK();
+  }
+
+  // Resize the file to 'size' bytes. Blocks past the end of the file, even
+  // preallocated ones, are freed.
+  void Truncate(uint64_t size) {
+    MutexLock l(lock_);
+    size_t keep_blocks = (size + kBlockSize - 1) / kBlockSize;
+    if (keep_blocks < blocks_.size()) {
+      FreeBlocks(keep_blocks, blocks_.size());
+      blocks_.resize(keep_blocks);
+    }
+    // Whatever follows the new end in its block must read as zeroes if the
+    // file is extended again.
+    if (size % kBlockSize != 0 && keep_blocks <= blocks_.size() && blocks_[keep_blocks - 1]) {
+      memset(blocks_[keep_blocks - 1].get() + size % kBlockSize, 0,
+             kBlockSize - size % kBlockSize);
+    }
+    size_ = size;
+    mtime_ = GetCurrentTimeMicros();
+  }
+
+  // Zero 'length' bytes from 'offset', freeing the blocks entirely within
+  // them. The size of the file doesn't change.
+  void PunchHole(uint64_t offset, uint64_t length) {
+    MutexLock l(lock_);
+    uint64_t end = std::min<uint64_t>(offset + length, blocks_.size() * kBlockSize);
+    while (offset < end) {
+      size_t idx = offset / kBlockSize;
+      size_t block_offset = offset % kBlockSize;
+      size_t chunk = std::min<uint64_t>(end - offset, kBlockSize - block_offset);
+      if (chunk == kBlockSize) {
+        FreeBlocks(idx, idx + 1);
+      } else if (blocks_[idx]) {
+        memset(blocks_[idx].get() + block_offset, 0, chunk);
+      }
+      offset += chunk;
+    }
+    mtime_ = GetCurrentTimeMicros();
+  }
+
+ private:
+  // Allocate the missing blocks covering the bytes from 'begin' to 'end', or
+  // none if they can't all be charged to 'mem_tracker_'. Must be called with
+  // 'lock_' held.
+  Status AllocateBlocks(uint64_t begin, uint64_t end) {
+    if (begin >= end) {
+      return Status::OK();
+    }
+    size_t first = begin / kBlockSize;
+    size_t last = (end + kBlockSize - 1) / kBlockSize;
+    size_t missing = 0;
+    for (size_t i = first; i < last; i++) {
+      if (i >= blocks_.size() || !blocks_[i]) {
+        missing++;
+      }
+    }
+    if (missing == 0) {
+      return Status::OK();
+    }
+    if (!mem_tracker_->TryConsume(missing * kBlockSize)) {
+      return Status::IOError("In-memory filesystem is full", ErrnoToString(ENOSPC), ENOSPC);
+    }
+    if (blocks_.size() < last) {
+      blocks_.resize(last);
+    }
+    for (size_t i = first; i < last; i++) {
+      if (!blocks_[i]) {
+        blocks_[i].reset(new uint8_t[kBlockSize]());
+      }
+    }
+    num_blocks_ += missing;
+    return Status::OK();
+  }
+
+  // Free the allocated blocks among those from 'first' to 'last'
+  // (exclusive). Must be called with 'lock_' held.
+  void FreeBlocks(size_t first, size_t last) {
+    size_t freed = 0;
+    for (size_t i = first; i < last; i++) {
+      if (blocks_[i]) {
+        blocks_[i].reset();
+        freed++;
+      }
+    }
+    num_blocks_ -= freed;
+    mem_tracker_->Release(freed * kBlockSize);
+  }
+
+  const shared_ptr<MemTracker> mem_tracker_;
+
+  mutable Mutex lock_;
+  vector<unique_ptr<uint8_t[]>> blocks_;
+  uint64_t size_;
+  size_t num_blocks_;
+  int64_t mtime_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemFile);
+};
+
+class MemSequentialFile : public SequentialFile {
+ public:
+  MemSequentialFile(string filename, string path, shared_ptr<MemFile> file,
+                    FailureInjector injector)
+    : filename_(std::move(filename)),
+      path_(std::move(path)),
+      file_(std::move(file)),
+      injector_(std::move(injector)),
+      pos_(0) {
+  }
+
+  virtual Status Read(size_t n, Slice* result, uint8_t* scratch) OVERRIDE {
+    RETURN_NOT_OK(MaybeInjectFailure(injector_, MemEnvOptions::READ, path_));
+    size_t nread = file_->Read(pos_, n, scratch);
+    pos_ += nread;
+    *result = Slice(scratch, nread);
+    return Status::OK();
+  }
+
+  virtual Status Skip(uint64_t n) OVERRIDE {
+    pos_ = std::min(pos_ + n, file_->size());
+    return Status::OK();
+  }
+
+  virtual const string& filename() const OVERRIDE { return filename_; }
+
+ private:
+  const string filename_;
+  const string path_;
+  const shared_ptr<MemFile> file_;
+  const FailureInjector injector_;
+  uint64_t pos_;
+};
+
+class MemRandomAccessFile : public RandomAccessFile {
+ public:
+  MemRandomAccessFile(string filename, string path, shared_ptr<MemFile> file,
+                      FailureInjector injector)
+    : filename_(std::move(filename)),
+      path_(std::move(path)),
+      file_(std::move(file)),
+      injector_(std::move(injector)) {
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      uint8_t* scratch) const OVERRIDE {
+    RETURN_NOT_OK(MaybeInjectFailure(injector_, MemEnvOptions::READ, path_));
+    *result = Slice(scratch, file_->Read(offset, n, scratch));
+    return Status::OK();
+  }
+
+  virtual Status Size(uint64_t* size) const OVERRIDE {
+    *size = file_->size();
+    return Status::OK();
+  }
+
+  virtual const string& filename() const OVERRIDE { return filename_; }
+
+  virtual size_t memory_footprint() const OVERRIDE {
+    return sizeof(*this) + filename_.capacity() + path_.capacity();
+  }
+
+ private:
+  const string filename_;
+  const string path_;
+  const shared_ptr<MemFile> file_;
+  const FailureInjector injector_;
+};
+
+class MemWritableFile : public WritableFile {
+ public:
+  MemWritableFile(string filename, string path, shared_ptr<MemFile> file,
+                  FailureInjector injector, bool sync_on_close)
+    : filename_(std::move(filename)),
+      path_(std::move(path)),
+      file_(std::move(file)),
+      injector_(std::move(injector)),
+      sync_on_close_(sync_on_close),
+      offset_(file_->size()),
+      pre_allocated_(false),
+      closed_(false) {
+  }
+
+  ~MemWritableFile() {
+    if (!closed_) {
+      WARN_NOT_OK(Close(), "Failed to close " + filename_);
+    }
+  }
+
+  virtual Status Append(const Slice& data) OVERRIDE {
+    DCHECK(!closed_);
+    RETURN_NOT_OK(MaybeInjectFailure(injector_, MemEnvOptions::WRITE, path_));
+    RETURN_NOT_OK_PREPEND(file_->Write(offset_, data), filename_);
+    offset_ += data.size();
+    return Status::OK();
+  }
+
+  virtual Status AppendVector(const vector<Slice>& data_vector) OVERRIDE {
+    for (const Slice& data : data_vector) {
+      RETURN_NOT_OK(Append(data));
+    }
+    return Status::OK();
+  }
+
+  virtual Status PreAllocate(uint64_t size) OVERRIDE {
+    DCHECK(!closed_);
+    RETURN_NOT_OK(MaybeInjectFailure(injector_, MemEnvOptions::WRITE, path_));
+    RETURN_NOT_OK_PREPEND(file_->PreAllocate(offset_, size, false), filename_);
+    pre_allocated_ = true;
+    return Status::OK();
+  }
+
+  virtual Status Close() OVERRIDE {
+    if (closed_) {
+      return Status::OK();
+    }
+    closed_ = true;
+    // Like the POSIX implementation, give back the space preallocated but
+    // not written to.
+    if (pre_allocated_) {
+      file_->Truncate(offset_);
+    }
+    if (sync_on_close_) {
+      return Sync();
+    }
+    return Status::OK();
+  }
+
+  virtual Status Flush(FlushMode /* mode */) OVERRIDE {
+    return Status::OK();
+  }
+
+  virtual Status Sync() OVERRIDE {
+    return MaybeInjectFailure(injector_, MemEnvOptions::SYNC, path_);
+  }
+
+  virtual uint64_t Size() const OVERRIDE { return offset_; }
+
+  virtual const string& filename() const OVERRIDE { return filename_; }
+
+ private:
+  const string filename_;
+  const string path_;
+  const shared_ptr<MemFile> file_;
+  const FailureInjector injector_;
+  const bool sync_on_close_;
+  uint64_t offset_;
+  bool pre_allocated_;
+  bool closed_;
+};
+
+class MemRWFile : public RWFile {
+ public:
+  MemRWFile(string filename, string path, shared_ptr<MemFile> file,
+            FailureInjector injector, bool sync_on_close)
+    : filename_(std::move(filename)),
+      path_(std::move(path)),
+      file_(std::move(file)),
+      injector_(std::move(injector)),
+      sync_on_close_(sync_on_close),
+      closed_(false) {
+  }
+
+  ~MemRWFile() {
+    WARN_NOT_OK(Close(), "Failed to close " + filename_);
+  }
+
+  virtual Status Read(uint64_t offset, size_t length,
+                      Slice* result, uint8_t* scratch) const OVERRIDE {
+    RETURN_NOT_OK(MaybeInjectFailure(injector_, MemEnvOptions::READ, path_));
+    if (file_->Read(offset, length, scratch) < length) {
+      return Status::IOError(Substitute("EOF trying to read $0 bytes at offset $1",
+                                        length, offset));
+    }
+    *result = Slice(scratch, length);
+    return Status::OK();
+  }
+
+  virtual Status Write(uint64_t offset, const Slice& data) OVERRIDE {
+    RETURN_NOT_OK(MaybeInjectFailure(injector_, MemEnvOptions::WRITE, path_));
+    RETURN_NOT_OK_PREPEND(file_->Write(offset, data), filename_);
+    return Status::OK();
+  }
+
+  virtual Status PreAllocate(uint64_t offset, size_t length,
+                             PreAllocateMode mode) OVERRIDE {
+    RETURN_NOT_OK(MaybeInjectFailure(injector_, MemEnvOptions::WRITE, path_));
+    RETURN_NOT_OK_PREPEND(file_->PreAllocate(offset, length, mode == CHANGE_FILE_SIZE),
+                          filename_);
+    return Status::OK();
+  }
+
+  virtual Status Truncate(uint64_t length) OVERRIDE {
+    RETURN_NOT_OK(MaybeInjectFailure(injector_, MemEnvOptions::WRITE, path_));
+    file_->Truncate(length);
+    return Status::OK();
+  }
+
+  virtual Status PunchHole(uint64_t offset, size_t length) OVERRIDE {
+    RETURN_NOT_OK(MaybeInjectFailure(injector_, MemEnvOptions::WRITE, path_));
+    file_->PunchHole(offset, length);
+    return Status::OK();
+  }
+
+  virtual Status Flush(FlushMode /* mode */, uint64_t /* offset */,
+                       size_t /* length */) OVERRIDE {
+    return Status::OK();
+  }
+
+  virtual Status Sync() OVERRIDE {
+    return MaybeInjectFailure(injector_, MemEnvOptions::SYNC, path_);
+  }
+
+  virtual Status Close() OVERRIDE {
+    if (closed_) {
+      return Status::OK();
+    }
+    closed_ = true;
+    if (sync_on_close_) {
+      return Sync();
+    }
+    return Status::OK();
+  }
+
+  virtual Status Size(uint64_t* size) const OVERRIDE {
+    *size = file_->size();
+    return Status::OK();
+  }
+
+  virtual const string& filename() const OVERRIDE { return filename_; }
+
+ private:
+  const string filename_;
+  const string path_;
+  const shared_ptr<MemFile> file_;
+  const FailureInjector injector_;
+  const bool sync_on_close_;
+  bool closed_;
+};
+
+class MemFileLock : public FileLock {
+ public:
+  explicit MemFileLock(string path)
+    : path_(std::move(path)) {
+  }
+
+  const string& path() const { return path_; }
+
+ private:
+  const string path_;
+};
+
+// The namespace is a sorted map of absolute, normalized paths, so that the
+// entries under a directory are the range of the paths prefixed with it.
+class MemEnv : public Env {
+ public:
+  MemEnv(Env* base_env, const MemEnvOptions& opts)
+    : base_env_(base_env),
+      injector_(opts.failure_injector),
+      mem_tracker_(MemTracker::CreateTracker(opts.capacity_bytes, "mem_env",
+                                             opts.parent_mem_tracker)),
+      cwd_("/"),
+      next_temp_id_(0) {
+    dirs_["/"] = GetCurrentTimeMicros();
+  }
+
+  virtual Status NewSequentialFile(const string& fname,
+                                   unique_ptr<SequentialFile>* result) OVERRIDE {
+    string path;
+    shared_ptr<MemFile> file;
+    RETURN_NOT_OK(OpenFile(fname, OPEN_EXISTING, &path, &file));
+    result->reset(new MemSequentialFile(fname, path, std::move(file), injector_));
+    return Status::OK();
+  }
+
+  virtual Status NewRandomAccessFile(const string& fname,
+                                     unique_ptr<RandomAccessFile>* result) OVERRIDE {
+    return NewRandomAccessFile(RandomAccessFileOptions(), fname, result);
+  }
+
+  virtual Status NewRandomAccessFile(const RandomAccessFileOptions& /* opts */,
+                                     const string& fname,
+                                     unique_ptr<RandomAccessFile>* result) OVERRIDE {
+    string path;
+    shared_ptr<MemFile> file;
+    RETURN_NOT_OK(OpenFile(fname, OPEN_EXISTING, &path, &file));
+    result->reset(new MemRandomAccessFile(fname, path, std::move(file), injector_));
+    return Status::OK();
+  }
+
+  virtual Status NewWritableFile(const string& fname,
+                                 unique_ptr<WritableFile>* result) OVERRIDE {
+    return NewWritableFile(WritableFileOptions(), fname, result);
+  }
+
+  virtual Status NewWritableFile(const WritableFileOptions& opts,
+                                 const string& fname,
+                                 unique_ptr<WritableFile>* result) OVERRIDE {
+    string path;
+    shared_ptr<MemFile> file;
+    RETURN_NOT_OK(OpenFile(fname, opts.mode, &path, &file));
+    result->reset(new MemWritableFile(fname, path, std::move(file), injector_,
+                                      opts.sync_on_close));
+    return Status::OK();
+  }
+
+  virtual Status NewTempWritableFile(const WritableFileOptions& opts,
+                                     const string& name_template,
+                                     string* created_filename,
+                                     unique_ptr<WritableFile>* result) OVERRIDE {
+    string fname;
+    string path;
+    shared_ptr<MemFile> file;
+    RETURN_NOT_OK(OpenTempFile(name_template, &fname, &path, &file));
+    result->reset(new MemWritableFile(fname, path, std::move(file), injector_,
+                                      opts.sync_on_close));
+    created_filename->swap(fname);
+    return Status::OK();
+  }
+
+  virtual Status NewRWFile(const string& fname, unique_ptr<RWFile>* result) OVERRIDE {
+    return NewRWFile(RWFileOptions(), fname, result);
+  }
+
+  virtual Status NewRWFile(const RWFileOptions& opts, const string& fname,
+                           unique_ptr<RWFile>* result) OVERRIDE {
+    string path;
+    shared_ptr<MemFile> file;
+    RETURN_NOT_OK(OpenFile(fname, opts.mode, &path, &file));
+    result->reset(new MemRWFile(fname, path, std::move(file), injector_, opts.sync_on_close));
+    return Status::OK();
+  }
+
+  virtual Status NewTempRWFile(const RWFileOptions& opts, const string& name_template,
+                               string* created_filename, unique_ptr<RWFile>* res) OVERRIDE {
+    string fname;
+    string path;
+    shared_ptr<MemFile> file;
+    RETURN_NOT_OK(OpenTempFile(name_template, &fname, &path, &file));
+    res->reset(new MemRWFile(fname, path, std::move(file), injector_, opts.sync_on_close));
+    created_filename->swap(fname);
+    return Status::OK();
+  }
+
+  virtual bool FileExists(const string& fname) OVERRIDE {
+    MutexLock l(lock_);
+    string path = AbsPath(fname);
+    return ContainsKey(files_, path) || ContainsKey(dirs_, path);
+  }
+
+  virtual Status GetChildren(const string& dir, vector<string>* result) OVERRIDE {
+    result->clear();
+    MutexLock l(lock_);
+    string path = AbsPath(dir);
+    RETURN_NOT_OK(CheckIsDir(dir, path));
+    result->push_back(".");
+    result->push_back("..");
+    const string prefix = DirPrefix(path);
+    auto add_children = [&](const string& child) {
+      if (child.find('/', prefix.size()) == string::npos) {
+        result->push_back(child.substr(prefix.size()));
+      }
+    };
+    ForEachUnder(files_, prefix, add_children);
+    ForEachUnder(dirs_, prefix, add_children);
+    return Status::OK();
+  }
+
+  virtual Status DeleteFile(const string& fname) OVERRIDE {
+    string path;
+    RETURN_NOT_OK(Prepare(MemEnvOptions::METADATA, fname, &path));
+    MutexLock l(lock_);
+    if (ContainsKey(dirs_, path)) {
+      return ErrnoError(fname, EISDIR);
+    }
+    if (files_.erase(path) == 0) {
+      return ErrnoError(fname, ENOENT);
+    }
+    TouchParent(path);
+    return Status::OK();
+  }
+
+  virtual Status CreateDir(const string& dirname) OVERRIDE {
+    string path;
+    RETURN_NOT_OK(Prepare(MemEnvOptions::METADATA, dirname, &path));
+    MutexLock l(lock_);
+    if (ContainsKey(files_, path) || ContainsKey(dirs_, path)) {
+      return ErrnoError(dirname, EEXIST);
+    }
+    RETURN_NOT_OK(CheckParentDir(dirname, path));
+    dirs_[path] = GetCurrentTimeMicros();
+    TouchParent(path);
+    return Status::OK();
+  }
+
+  virtual Status DeleteDir(const string& dirname) OVERRIDE {
+    string path;
+    RETURN_NOT_OK(Prepare(MemEnvOptions::METADATA, dirname, &path));
+    MutexLock l(lock_);
+    RETURN_NOT_OK(CheckIsDir(dirname, path));
+    if (path == "/") {
+      return ErrnoError(dirname, EBUSY);
+    }
+    if (HasEntriesUnder(DirPrefix(path))) {
+      return ErrnoError(dirname, ENOTEMPTY);
+    }
+    dirs_.erase(path);
+    TouchParent(path);
+    return Status::OK();
+  }
+
+  virtual Status GetCurrentWorkingDir(string* cwd) const OVERRIDE {
+    MutexLock l(lock_);
+    *cwd = cwd_;
+    return Status::OK();
+  }
+
+  virtual Status ChangeDir(const string& dest) OVERRIDE {
+    MutexLock l(lock_);
+    string path = AbsPath(dest);
+    RETURN_NOT_OK(CheckIsDir(dest, path));
+    cwd_ = path;
+    return Status::OK();
+  }
+
+  virtual Status SyncDir(const string& dirname) OVERRIDE {
+    string path;
+    RETURN_NOT_OK(Prepare(MemEnvOptions::SYNC, dirname, &path));
+    MutexLock l(lock_);
+    return CheckIsDir(dirname, path);
+  }
+
+  virtual Status DeleteRecursively(const string& dirname) OVERRIDE {
+    string path;
+    RETURN_NOT_OK(Prepare(MemEnvOptions::METADATA, dirname, &path));
+    MutexLock l(lock_);
+    if (files_.erase(path) > 0) {
+      TouchParent(path);
+      return Status::OK();
+    }
+    RETURN_NOT_OK(CheckIsDir(dirname, path));
+    if (path == "/") {
+      return ErrnoError(dirname, EBUSY);
+    }
+    const string prefix = DirPrefix(path);
+    EraseUnder(&files_, prefix);
+    EraseUnder(&dirs_, prefix);
+    dirs_.erase(path);
+    TouchParent(path);
+    return Status::OK();
+  }
+
+  virtual Status GetFileSize(const string& fname, uint64_t* file_size) OVERRIDE {
+    MutexLock l(lock_);
+    string path = AbsPath(fname);
+    if (ContainsKey(dirs_, path)) {
+      *file_size = kBlockSize;
+      return Status::OK();
+    }
+    shared_ptr<MemFile> file;
+    RETURN_NOT_OK(LookupFile(fname, path, &file));
+    *file_size = file->size();
+    return Status::OK();
+  }
+
+  virtual Status GetFileSizeOnDisk(const string& fname, uint64_t* file_size) OVERRIDE {
+    MutexLock l(lock_);
+    string path = AbsPath(fname);
+    if (ContainsKey(dirs_, path)) {
+      *file_size = kBlockSize;
+      return Status::OK();
+    }
+    shared_ptr<MemFile> file;
+    RETURN_NOT_OK(LookupFile(fname, path, &file));
+    *file_size = file->allocated_bytes();
+    return Status::OK();
+  }
+
+  virtual Status GetFileSizeOnDiskRecursively(const string& root,
+                                              uint64_t* bytes_used) OVERRIDE {
+    MutexLock l(lock_);
+    string path = AbsPath(root);
+    uint64_t total = 0;
+    auto it = files_.find(path);
+    if (it != files_.end()) {
+      total = it->second->allocated_bytes();
+    } else {
+      RETURN_NOT_OK(CheckIsDir(root, path));
+      // Like the POSIX implementation, ignore directories.
+      for (it = files_.lower_bound(DirPrefix(path));
+           it != files_.end() && HasPrefixString(it->first, DirPrefix(path)); ++it) {
+        total += it->second->allocated_bytes();
+      }
+    }
+    *bytes_used = total;
+    return Status::OK();
+  }
+
+  virtual Status GetFileModifiedTime(const string& fname, int64_t* timestamp) OVERRIDE {
+    MutexLock l(lock_);
+    string path = AbsPath(fname);
+    auto it = dirs_.find(path);
+    if (it != dirs_.end()) {
+      *timestamp = it->second;
+      return Status::OK();
+    }
+    shared_ptr<MemFile> file;
+    RETURN_NOT_OK(LookupFile(fname, path, &file));
+    *timestamp = file->mtime();
+    return Status::OK();
+  }
+
+  virtual Status GetBlockSize(const string& fname, uint64_t* block_size) OVERRIDE {
+    RETURN_NOT_OK(CheckExists(fname));
+    *block_size = kBlockSize;
+    return Status::OK();
+  }
+
+  // Without a capacity, reports as free the spare capacity of the ancestors
+  // of the Env's MemTracker, if any of them has a limit.
+  virtual Status GetBytesFree(const string& path, int64_t* bytes_free) OVERRIDE {
+    RETURN_NOT_OK(CheckExists(path));
+    *bytes_free = std::max<int64_t>(mem_tracker_->SpareCapacity(), 0);
+    return Status::OK();
+  }
+
+  virtual Status RenameFile(const string& src, const string& target) OVERRIDE {
+    string src_path;
+    RETURN_NOT_OK(Prepare(MemEnvOptions::METADATA, src, &src_path));
+    MutexLock l(lock_);
+    string target_path = AbsPath(target);
+    if (src_path == target_path) {
+      return CheckExists(src, src_path);
+    }
+    auto it = files_.find(src_path);
+    if (it != files_.end()) {
+      if (ContainsKey(dirs_, target_path)) {
+        return ErrnoError(src, EISDIR);
+      }
+      RETURN_NOT_OK(CheckParentDir(target, target_path));
+      files_[target_path] = std::move(it->second);
+      files_.erase(src_path);
+    } else {
+      RETURN_NOT_OK(CheckIsDir(src, src_path));
+      if (src_path == "/" || HasPrefixString(target_path, DirPrefix(src_path))) {
+        return ErrnoError(src, EINVAL);
+      }
+      if (ContainsKey(files_, target_path)) {
+        return ErrnoError(src, ENOTDIR);
+      }
+      if (ContainsKey(dirs_, target_path) && HasEntriesUnder(DirPrefix(target_path))) {
+        return ErrnoError(src, ENOTEMPTY);
+      }
+      RETURN_NOT_OK(CheckParentDir(target, target_path));
+      MoveUnder(&files_, DirPrefix(src_path), DirPrefix(target_path));
+      MoveUnder(&dirs_, DirPrefix(src_path), DirPrefix(target_path));
+      dirs_[target_path] = dirs_[src_path];
+      dirs_.erase(src_path);
+    }
+    TouchParent(src_path);
+    TouchParent(target_path);
+    return Status::OK();
+  }
+
+  // Locks are exclusive within the Env: unlike POSIX record locks, a second
+  // lock of the same file by the process fails.
+  virtual Status LockFile(const string& fname, FileLock** lock) OVERRIDE {
+    *lock = nullptr;
+    string path;
+    RETURN_NOT_OK(Prepare(MemEnvOptions::METADATA, fname, &path));
+    MutexLock l(lock_);
+    if (ContainsKey(dirs_, path)) {
+      return ErrnoError(fname, EISDIR);
+    }
+    if (!ContainsKey(files_, path)) {
+      RETURN_NOT_OK(CheckParentDir(fname, path));
+      files_[path] = std::make_shared<MemFile>(mem_tracker_);
+      TouchParent(path);
+    }
+    if (!locked_files_.insert(path).second) {
+      return ErrnoError("lock " + fname, EAGAIN);
+    }
+    *lock = new MemFileLock(path);
+    return Status::OK();
+  }
+
+  virtual Status UnlockFile(FileLock* lock) OVERRIDE {
+    unique_ptr<MemFileLock> my_lock(down_cast<MemFileLock*>(lock));
+    MutexLock l(lock_);
+    CHECK_EQ(1, locked_files_.erase(my_lock->path()));
+    return Status::OK();
+  }
+
+  virtual Status GetTestDirectory(string* path) OVERRIDE {
+    MutexLock l(lock_);
+    if (!ContainsKey(dirs_, "/test")) {
+      dirs_["/test"] = GetCurrentTimeMicros();
+    }
+    *path = "/test";
+    return Status::OK();
+  }
+
+  virtual uint64_t NowMicros() OVERRIDE {
+    return base_env_->NowMicros();
+  }
+
+  virtual void SleepForMicroseconds(int micros) OVERRIDE {
+    base_env_->SleepForMicroseconds(micros);
+  }
+
+  virtual uint64_t gettid() OVERRIDE {
+    return base_env_->gettid();
+  }
+
+  virtual Status GetExecutablePath(string* path) OVERRIDE {
+    return base_env_->GetExecutablePath(path);
+  }
+
+  virtual Status IsDirectory(const string& path, bool* is_dir) OVERRIDE {
+    MutexLock l(lock_);
+    string abs_path = AbsPath(path);
+    RETURN_NOT_OK(CheckExists(path, abs_path));
+    *is_dir = ContainsKey(dirs_, abs_path);
+    return Status::OK();
+  }
+
+  // The entries are collected before 'cb' is invoked, so that it may modify
+  // the tree. Sorted paths list every directory before its contents.
+  virtual Status Walk(const string& root, DirectoryOrder order,
+                      const WalkCallback& cb) OVERRIDE {
+    vector<pair<string, FileType>> entries;
+    {
+      MutexLock l(lock_);
+      string path = AbsPath(root);
+      if (ContainsKey(files_, path)) {
+        entries.emplace_back(path, FILE_TYPE);
+      } else {
+        RETURN_NOT_OK(CheckIsDir(root, path));
+        entries.emplace_back(path, DIRECTORY_TYPE);
+        const string prefix = DirPrefix(path);
+        ForEachUnder(files_, prefix, [&](const string& p) {
+            entries.emplace_back(p, FILE_TYPE);
+          });
+        ForEachUnder(dirs_, prefix, [&](const string& p) {
+            entries.emplace_back(p, DIRECTORY_TYPE);
+          });
+        std::sort(entries.begin(), entries.end());
+      }
+    }
+    if (order == POST_ORDER) {
+      std::reverse(entries.begin(), entries.end());
+    }
+
+    bool had_errors = false;
+    for (const auto& e : entries) {
+      size_t slash = e.first.rfind('/');
+      string dirname = slash == 0 ? "/" : e.first.substr(0, slash);
+      string basename = e.first == "/" ? "/" : e.first.substr(slash + 1);
+      if (!cb.Run(e.second, dirname, basename).ok()) {
+        had_errors = true;
+      }
+    }
+    if (had_errors) {
+      return Status::IOError(root, "One or more errors occurred");
+    }
+    return Status::OK();
+  }
+
+  // Unlike glob(3), relative patterns yield absolute paths.
+  virtual Status Glob(const string& path_pattern, vector<string>* paths) OVERRIDE {
+    vector<string> matches;
+    {
+      MutexLock l(lock_);
+      string pattern = AbsPath(path_pattern);
+      auto match = [&](const string& path) {
+        if (fnmatch(pattern.c_str(), path.c_str(), FNM_PATHNAME | FNM_PERIOD) == 0) {
+          matches.push_back(path);
+        }
+      };
+      ForEachUnder(files_, "/", match);
+      ForEachUnder(dirs_, "/", match);
+    }
+    std::sort(matches.begin(), matches.end());
+    paths->insert(paths->end(), matches.begin(), matches.end());
+    return Status::OK();
+  }
+
+  virtual Status Canonicalize(const string& path, string* result) OVERRIDE {
+    MutexLock l(lock_);
+    string abs_path = AbsPath(path);
+    RETURN_NOT_OK_PREPEND(CheckExists(path, abs_path),
+                          Substitute("Unable to canonicalize $0", path));
+    *result = abs_path;
+    return Status::OK();
+  }
+
+  virtual Status GetTotalRAMBytes(int64_t* ram) OVERRIDE {
+    return base_env_->GetTotalRAMBytes(ram);
+  }
+
+  virtual int64_t GetOpenFileLimit() OVERRIDE {
+    return base_env_->GetOpenFileLimit();
+  }
+
+  virtual void IncreaseOpenFileLimit() OVERRIDE {
+    base_env_->IncreaseOpenFileLimit();
+  }
+
+  virtual Status IsOnExtFilesystem(const string& path, bool* result) OVERRIDE {
+    RETURN_NOT_OK(CheckExists(path));
+    *result = false;
+    return Status::OK();
+  }
+
+  virtual string GetKernelRelease() OVERRIDE {
+    return base_env_->GetKernelRelease();
+  }
+
+  // Files have no permissions.
+  virtual Status EnsureFileModeAdheresToUmask(const string& path) OVERRIDE {
+    return CheckExists(path);
+  }
+
+ private:
+  typedef map<string, shared_ptr<MemFile>> FileMap;
+  typedef map<string, int64_t> DirMap;
+
+  // Returns the absolute, normalized form of 'path'. Must be called with
+  // 'lock_' held, for 'cwd_'.
+  string AbsPath(const string& path) const {
+    vector<string> segments;
+    string full = path.empty() || path[0] != '/' ? cwd_ + "/" + path : path;
+    size_t start = 0;
+    while (start <= full.size()) {
+      size_t end = full.find('/', start);
+      if (end == string::npos) {
+        end = full.size();
+      }
+      string segment = full.substr(start, end - start);
+      if (segment == "..") {
+        if (!segments.empty()) {
+          segments.pop_back();
+        }
+      } else if (!segment.empty() && segment != ".") {
+        segments.push_back(std::move(segment));
+      }
+      start = end + 1;
+    }
+    string result;
+    for (const string& segment : segments) {
+      result += "/" + segment;
+    }
+    return result.empty() ? "/" : result;
+  }
+
+  // Returns the prefix of the paths under directory 'path'.
+  static string DirPrefix(const string& path) {
+    return path == "/" ? path : path + "/";
+  }
+
+  // Normalize 'fname' into 'path' and inject a failure into 'op' on it, if
+  // the injector says so. Must be called without 'lock_' held, so that the
+  // injector can use the Env.
+  Status Prepare(MemEnvOptions::Operation op, const string& fname, string* path) {
+    {
+      MutexLock l(lock_);
+      *path = AbsPath(fname);
+    }
+    return MaybeInjectFailure(injector_, op, *path);
+  }
+
+  // Open or create file 'fname' according to 'mode', outputting its
+  // normalized path into 'path'.
+  Status OpenFile(const string& fname, CreateMode mode, string* path,
+                  shared_ptr<MemFile>* file) {
+    RETURN_NOT_OK(Prepare(MemEnvOptions::OPEN, fname, path));
+    MutexLock l(lock_);
+    return OpenFileUnlocked(fname, *path, mode, file);
+  }
+
+  Status OpenFileUnlocked(const string& fname, const string& path, CreateMode mode,
+                          shared_ptr<MemFile>* file) {
+    if (ContainsKey(dirs_, path)) {
+      return ErrnoError(fname, EISDIR);
+    }
+    auto it = files_.find(path);
+    if (it != files_.end()) {
+      if (mode == CREATE_NON_EXISTING) {
+        return ErrnoError(fname, EEXIST);
+      }
+      if (mode == CREATE_IF_NON_EXISTING_TRUNCATE) {
+        it->second->Truncate(0);
+      }
+      *file = it->second;
+      return Status::OK();
+    }
+    if (mode == OPEN_EXISTING) {
+      return ErrnoError(fname, ENOENT);
+    }
+    RETURN_NOT_OK(CheckParentDir(fname, path));
+    *file = std::make_shared<MemFile>(mem_tracker_);
+    files_[path] = *file;
+    TouchParent(path);
+    return Status::OK();
+  }
+
+  // Create a file named after 'name_template', whose last six characters
+  // must be "XXXXXX", like mkstemp(3).
+  Status OpenTempFile(const string& name_template, string* fname, string* path,
+                      shared_ptr<MemFile>* file) {
+    const string kSuffix = "XXXXXX";
+    if (!HasSuffixString(name_template, kSuffix)) {
+      return ErrnoError(Substitute("Call to mkstemp() failed on name template $0",
+                                   name_template), EINVAL);
+    }
+    string template_path;
+    RETURN_NOT_OK(Prepare(MemEnvOptions::OPEN, name_template, &template_path));
+    const string prefix = name_template.substr(0, name_template.size() - kSuffix.size());
+    MutexLock l(lock_);
+    while (true) {
+      *fname = prefix + StringPrintf("%06x", next_temp_id_++ & 0xffffff);
+      *path = AbsPath(*fname);
+      Status s = OpenFileUnlocked(*fname, *path, CREATE_NON_EXISTING, file);
+      if (!s.IsAlreadyPresent()) {
+        return s;
+      }
+    }
+  }
+
+  // The following must be called with 'lock_' held.
+
+  Status LookupFile(const string& fname, const string& path, shared_ptr<MemFile>* file) {
+    auto it = files_.find(path);
+    if (it == files_.end()) {
+      return ErrnoError(fname, ENOENT);
+    }
+    *file = it->second;
+    return Status::OK();
+  }
+
+  Status CheckExists(const string& fname, const string& path) const {
+    if (!ContainsKey(files_, path) && !ContainsKey(dirs_, path)) {
+      return ErrnoError(fname, ENOENT);
+    }
+    return Status::OK();
+  }
+
+  Status CheckIsDir(const string& fname, const string& path) const {
+    if (ContainsKey(dirs_, path)) {
+      return Status::OK();
+    }
+    return ErrnoError(fname, ContainsKey(files_, path) ? ENOTDIR : ENOENT);
+  }
+
+  // Check that the directory where 'path' would be created exists.
+  Status CheckParentDir(const string& fname, const string& path) const {
+    size_t slash = path.rfind('/');
+    string parent = slash == 0 ? "/" : path.substr(0, slash);
+    if (ContainsKey(dirs_, parent)) {
+      return Status::OK();
+    }
+    return ErrnoError(fname, ContainsKey(files_, parent) ? ENOTDIR : ENOENT);
+  }
+
+  // Update the modification time of the directory of 'path', whose entries
+  // changed.
+  void TouchParent(const string& path) {
+    size_t slash = path.rfind('/');
+    auto it = dirs_.find(slash == 0 ? "/" : path.substr(0, slash));
+    if (it != dirs_.end()) {
+      it->second = GetCurrentTimeMicros();
+    }
+  }
+
+  bool HasEntriesUnder(const string& prefix) const {
+    auto f = files_.lower_bound(prefix);
+    auto d = dirs_.lower_bound(prefix);
+    return (f != files_.end() && HasPrefixString(f->first, prefix)) ||
+           (d != dirs_.end() && HasPrefixString(d->first, prefix));
+  }
+
+  template<class Map, class F>
+  static void ForEachUnder(const Map& m, const string& prefix, const F& f) {
+    for (auto it = m.lower_bound(prefix);
+         it != m.end() && HasPrefixString(it->first, prefix); ++it) {
+      if (it->first != prefix) {
+        f(it->first);
+      }
+    }
+  }
+
+  template<class Map>
+  static void EraseUnder(Map* m, const string& prefix) {
+    auto begin = m->lower_bound(prefix);
+    auto end = begin;
+    while (end != m->end() && HasPrefixString(end->first, prefix)) {
+      ++end;
+    }
+    m->erase(begin, end);
+  }
+
+  template<class Map>
+  static void MoveUnder(Map* m, const string& from, const string& to) {
+    Map moved;
+    for (auto it = m->lower_bound(from);
+         it != m->end() && HasPrefixString(it->first, from); ++it) {
+      moved[to + it->first.substr(from.size())] = std::move(it->second);
+    }
+    EraseUnder(m, from);
+    EraseUnder(m, to);
+    for (auto& e : moved) {
+      (*m)[e.first] = std::move(e.second);
+    }
+  }
+
+  Status CheckExists(const string& fname) const {
+    MutexLock l(lock_);
+    return CheckExists(fname, AbsPath(fname));
+  }
+
+  Env* const base_env_;
+  const FailureInjector injector_;
+  const shared_ptr<MemTracker> mem_tracker_;
+
+  mutable Mutex lock_;
+  string cwd_;
+  FileMap files_;
+  // The directories and their modification times.
+  DirMap dirs_;
+  set<string> locked_files_;
+  uint32_t next_temp_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemEnv);
+};
+
+} // anonymous namespace
+
+unique_ptr<Env> NewMemEnv(Env* base_env, const MemEnvOptions& opts) {
+  return unique_ptr<Env>(new MemEnv(base_env, opts));
+}
+
+} // namespace bb
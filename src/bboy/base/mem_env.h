@@ -0,0 +1,74 @@
+#ifndef BBOY_BASE_MEM_ENV_H_
+#define BBOY_BASE_MEM_ENV_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "bboy/base/status.h"
+
+namespace bb {
+
+class Env;
+class MemTracker;
+
+// Options for NewMemEnv().
+struct MemEnvOptions {
+  // The kinds of operation a failure can be injected into.
+  enum Operation {
+    // Opening or creating a file.
+    OPEN,
+    // Reading from a file.
+    READ,
+    // Anything that changes the data or the size of a file: appends, writes,
+    // preallocations, truncations and hole punches.
+    WRITE,
+    // Syncing a file or a directory.
+    SYNC,
+    // Creating, deleting, renaming or locking an entry of the namespace.
+    METADATA,
+  };
+
+  // Called before each operation of the given kind on 'path', which is
+  // absolute and normalized. If it returns an error, the operation fails
+  // with that error without doing anything. May be called concurrently
+  // from several threads.
+  typedef std::function<Status(Operation op, const std::string& path)> FailureInjector;
+
+  // The maximum number of bytes of file data the Env may hold, or -1 for no
+  // limit. Operations which would exceed it fail as a full filesystem would,
+  // with an IOError whose posix code is ENOSPC.
+  int64_t capacity_bytes;
+
+  // The parent of the MemTracker charged for the file data. If null, the
+  // root tracker is used. A limit of the parent or its ancestors also
+  // applies to the Env.
+  std::shared_ptr<MemTracker> parent_mem_tracker;
+
+  // If set, see FailureInjector.
+  FailureInjector failure_injector;
+
+  MemEnvOptions()
+    : capacity_bytes(-1) { }
+};
+
+// Returns a new Env which keeps its files and directories in memory. Useful
+// for tests and for scratch data which needn't survive the process: syncs
+// are free, and nothing touches the disk.
+//
+// The filesystem starts out with just the root directory, and the working
+// directory is the root. Files are stored in blocks of 4 KiB allocated on
+// first write, so files with holes (see RWFile::PunchHole()) are sparse, and
+// GetFileSizeOnDisk() and PreAllocate() behave as on a local filesystem.
+// Synchronization is not simulated: data are "durable" as soon as they are
+// written.
+//
+// Operations which don't involve the filesystem, such as NowMicros() or
+// GetTotalRAMBytes(), are forwarded to 'base_env', which must outlive the
+// returned Env. Files opened from the returned Env may outlive it.
+std::unique_ptr<Env> NewMemEnv(Env* base_env, const MemEnvOptions& opts = MemEnvOptions());
+
+} // namespace bb
+
+#endif // BBOY_BASE_MEM_ENV_H_
@@ -0,0 +1,251 @@
+#include "bboy/base/net/dns_resolver.h"
+
+#include <utility>
+
+#include <glog/logging.h>
+
+#include "bboy/gbase/callback.h"
+#include "bboy/base/async_util.h"
+#include "bboy/base/net/net_util.h"
+#include "bboy/base/net/sockaddr.h"
+#include "bboy/base/thread/threadpool.h"
+
+using std::string;
+using std::vector;
+
+namespace bb {
+
+struct DnsResolver::Waiter {
+  uint16_t port;
+  vector<Sockaddr>* addresses;
+  StatusCallback cb;
+};
+
+struct DnsResolver::Entry {
+  const string host;
+
+  // Whether a lookup has completed, and its outcome. The addresses have
+  // port 0.
+  bool resolved;
+  Status status;
+  vector<Sockaddr> addresses;
+
+  // When the outcome expires, and when it should be refreshed.
+  MonoTime expiration;
+  MonoTime refresh_time;
+
+  // Whether a lookup is queued or running.
+  bool looking_up;
+
+  // The requests waiting for the lookup.
+  vector<Waiter> waiters;
+
+  // The position of the entry in DnsResolver::lru_.
+  std::list<Entry*>::iterator lru_pos;
+
+  explicit Entry(string host)
+    : host(std::move(host)),
+      resolved(false),
+      looking_up(false) { }
+};
+
+DnsResolver::DnsResolver(const DnsResolverOptions& opts)
+  : opts_(opts),
+    shutting_down_(false) {
+}
+
+DnsResolver::~DnsResolver() {
+  Shutdown();
+}
+
+Status DnsResolver::Init() {
+  CHECK(!pool_) << "already initialized";
+  return ThreadPoolBuilder("dns-resolver")
+      .set_min_threads(0)
+      .set_max_threads(opts_.max_threads)
+      .Build(&pool_);
+}
+
+void DnsResolver::ResolveAddressesAsync(const HostPort& hostport,
+                                        vector<Sockaddr>* addresses,
+                                        const StatusCallback& cb) {
+  MonoTime now = MonoTime::Now();
+  Waiter waiter = { hostport.port(), addresses, cb };
+  Status status;
+  vector<Sockaddr> cached;
+  bool lookup = false;
+  bool wait = false;
+  {
+    MutexLock l(lock_);
+    if (shutting_down_) {
+      l.Unlock();
+      cb.Run(Status::ServiceUnavailable("DNS resolver is shut down"));
+      return;
+    }
+
+    std::unique_ptr<Entry>& slot = entries_[hostport.host()];
+    if (!slot) {
+      slot.reset(new Entry(hostport.host()));
+      lru_.push_front(slot.get());
+      slot->lru_pos = lru_.begin();
+    } else {
+      lru_.splice(lru_.begin(), lru_, slot->lru_pos);
+    }
+    Entry* entry = slot.get();
+
+    if (entry->resolved && now < entry->expiration) {
+      status = entry->status;
+      cached = entry->addresses;
+      if (!entry->looking_up && now >= entry->refresh_time) {
+        entry->looking_up = true;
+        lookup = true;
+      }
+    } else {
+      entry->waiters.push_back(waiter);
+      wait = true;
+      if (!entry->looking_up) {
+        entry->looking_up = true;
+        lookup = true;
+      }
+    }
+    EvictUnlocked();
+  }
+
+  if (lookup) {
+    StartLookup(hostport.host());
+  }
+  if (!wait) {
+    CompleteWaiter(waiter, status, cached);
+  }
+}
+
+Status DnsResolver::ResolveAddresses(const HostPort& hostport,
+                                     vector<Sockaddr>* addresses) {
+  Synchronizer s;
+  ResolveAddressesAsync(hostport, addresses, s.AsStatusCallback());
+  return s.Wait();
+}
+
+void DnsResolver::Shutdown() {
+  {
+    MutexLock l(lock_);
+    if (shutting_down_) {
+      return;
+    }
+    shutting_down_ = true;
+  }
+
+  // Lookups which are running complete their requests, and the queued ones
+  // are dropped. Their entries stay marked as being looked up, so that they
+  // aren't evicted under a racing StartLookup().
+  if (pool_) {
+    pool_->Shutdown();
+  }
+
+  vector<Waiter> waiters;
+  {
+    MutexLock l(lock_);
+    for (auto& e : entries_) {
+      Entry* entry = e.second.get();
+      for (Waiter& waiter : entry->waiters) {
+        waiters.push_back(std::move(waiter));
+      }
+      entry->waiters.clear();
+    }
+  }
+  Status s = Status::ServiceUnavailable("DNS resolver is shut down");
+  for (const Waiter& waiter : waiters) {
+    CompleteWaiter(waiter, s, vector<Sockaddr>());
+  }
+}
+
+void DnsResolver::StartLookup(const string& host) {
+  Status s;
+  if (PREDICT_FALSE(!pool_)) {
+    s = Status::IllegalState("DNS resolver is not initialized");
+  } else {
+    s = pool_->SubmitFunc([this, host]() { DoLookup(host); });
+  }
+  if (PREDICT_FALSE(!s.ok())) {
+    FinishLookup(host, s.CloneAndPrepend("Unable to start DNS lookup"),
+                 vector<Sockaddr>(), false);
+  }
+}
+
+void DnsResolver::DoLookup(const string& host) {
+  vector<Sockaddr> addresses;
+  Status s = HostPort(host, 0).ResolveAddresses(&addresses);
+  if (!s.ok()) {
+    addresses.clear();
+  }
+  FinishLookup(host, s, addresses, true);
+}
+
+void DnsResolver::FinishLookup(const string& host, const Status& s,
+                               const vector<Sockaddr>& addresses, bool cache) {
+  MonoTime now = MonoTime::Now();
+  vector<Waiter> waiters;
+  {
+    MutexLock l(lock_);
+    // Entries aren't evicted during a lookup.
+    auto it = entries_.find(host);
+    DCHECK(it != entries_.end());
+    Entry* entry = it->second.get();
+    entry->looking_up = false;
+    waiters.swap(entry->waiters);
+
+    // A failed refresh doesn't replace addresses which are still valid:
+    // flaky DNS shouldn't make hosts in use unreachable.
+    bool keep_old = !s.ok() && entry->resolved && entry->status.ok() &&
+                    now < entry->expiration;
+    if (cache && !keep_old) {
+      entry->resolved = true;
+      entry->status = s;
+      entry->addresses = addresses;
+      if (s.ok()) {
+        entry->expiration = now + opts_.positive_ttl;
+        entry->refresh_time = entry->expiration - opts_.refresh_before_expiration;
+      } else {
+        entry->expiration = now + opts_.negative_ttl;
+        entry->refresh_time = entry->expiration;
+      }
+    } else if (keep_old) {
+      VLOG(1) << "Unable to refresh the addresses of " << host << ", keeping the cached ones: "
+              << s.ToString();
+      // Don't retry on every request while DNS is failing.
+      entry->refresh_time = now + opts_.negative_ttl;
+    }
+    EvictUnlocked();
+  }
+
+  for (const Waiter& waiter : waiters) {
+    CompleteWaiter(waiter, s, addresses);
+  }
+}
+
+void DnsResolver::EvictUnlocked() {
+  auto it = lru_.end();
+  while (entries_.size() > static_cast<size_t>(opts_.max_cache_entries) &&
+         it != lru_.begin()) {
+    --it;
+    Entry* entry = *it;
+    if (entry->looking_up) {
+      continue;
+    }
+    it = lru_.erase(it);
+    entries_.erase(entries_.find(entry->host));
+  }
+}
+
+void DnsResolver::CompleteWaiter(const Waiter& waiter, const Status& s,
+                                 const vector<Sockaddr>& addresses) {
+  if (s.ok() && waiter.addresses) {
+    for (Sockaddr addr : addresses) {
+      addr.set_port(waiter.port);
+      waiter.addresses->push_back(addr);
+    }
+  }
+  waiter.cb.Run(s);
+}
+
+} // namespace bb
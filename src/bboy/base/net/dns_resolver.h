@@ -0,0 +1,130 @@
+#ifndef BBOY_BASE_NET_DNS_RESOLVER_H_
+#define BBOY_BASE_NET_DNS_RESOLVER_H_
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bboy/gbase/gscoped_ptr.h"
+#include "bboy/gbase/macros.h"
+#include "bboy/base/monotime.h"
+#include "bboy/base/status.h"
+#include "bboy/base/status_callback.h"
+#include "bboy/base/sync/mutex.h"
+
+namespace bb {
+
+class HostPort;
+class Sockaddr;
+class ThreadPool;
+
+struct DnsResolverOptions {
+  // The maximum number of lookups run at once.
+  int max_threads;
+
+  // The maximum number of hosts whose addresses are cached. Hosts being
+  // looked up aren't evicted, so the cache may briefly hold more.
+  int max_cache_entries;
+
+  // How long the addresses of a host are cached.
+  MonoDelta positive_ttl;
+
+  // How long a failure to resolve a host is cached.
+  MonoDelta negative_ttl;
+
+  // A cached host which is resolved this long or less before its addresses
+  // expire is looked up again in the background, so that hosts in use don't
+  // miss the cache. If the new lookup fails, the old addresses are kept
+  // until they expire.
+  MonoDelta refresh_before_expiration;
+
+  DnsResolverOptions()
+    : max_threads(4),
+      max_cache_entries(1024),
+      positive_ttl(MonoDelta::FromSeconds(60)),
+      negative_ttl(MonoDelta::FromSeconds(5)),
+      refresh_before_expiration(MonoDelta::FromSeconds(15)) { }
+};
+
+// Resolves host names with getaddrinfo(), as HostPort::ResolveAddresses()
+// does, but off the calling thread and through a cache.
+//
+// The lookups run on a small pool of threads. Concurrent requests for the
+// same host share a single lookup, so a burst of reconnections to a host
+// costs one query.
+//
+// Thread-safe.
+class DnsResolver {
+ public:
+  explicit DnsResolver(const DnsResolverOptions& opts = DnsResolverOptions());
+
+  // Calls Shutdown().
+  ~DnsResolver();
+
+  // Starts the thread pool. Must be called once, before resolving anything.
+  Status Init();
+
+  // Resolves the host of 'hostport', appends its addresses, with the port of
+  // 'hostport', to '*addresses' if it's not null, and calls 'cb'.
+  //
+  // If the host is cached, this happens before returning, on the calling
+  // thread. Otherwise, 'cb' is called on a thread of the resolver, so it
+  // must not block or destroy the resolver, and '*addresses' must remain
+  // valid until then.
+  void ResolveAddressesAsync(const HostPort& hostport,
+                             std::vector<Sockaddr>* addresses,
+                             const StatusCallback& cb);
+
+  // As ResolveAddressesAsync(), but waits for the addresses.
+  Status ResolveAddresses(const HostPort& hostport,
+                          std::vector<Sockaddr>* addresses);
+
+  // Stops the thread pool. Pending requests complete with a
+  // ServiceUnavailable status, as do further ones. Idempotent.
+  void Shutdown();
+
+ private:
+  struct Entry;
+  struct Waiter;
+
+  // Runs a lookup of 'host' on the thread pool.
+  void StartLookup(const std::string& host);
+
+  // Runs on the thread pool.
+  void DoLookup(const std::string& host);
+
+  // Records the outcome of a lookup of 'host' and completes the requests
+  // waiting for it. The outcome is cached if 'cache' is true.
+  void FinishLookup(const std::string& host, const Status& s,
+                    const std::vector<Sockaddr>& addresses, bool cache);
+
+  // Evicts the least recently used entries while there are too many.
+  void EvictUnlocked();
+
+  // Completes a request with the outcome of a lookup.
+  static void CompleteWaiter(const Waiter& waiter, const Status& s,
+                             const std::vector<Sockaddr>& addresses);
+
+  const DnsResolverOptions opts_;
+
+  gscoped_ptr<ThreadPool> pool_;
+
+  // Protects the following fields.
+  Mutex lock_;
+
+  // The cached hosts, and the hosts being looked up.
+  std::unordered_map<std::string, std::unique_ptr<Entry>> entries_;
+
+  // The entries, from the most to the least recently used.
+  std::list<Entry*> lru_;
+
+  bool shutting_down_;
+
+  DISALLOW_COPY_AND_ASSIGN(DnsResolver);
+};
+
+} // namespace bb
+
+#endif // BBOY_BASE_NET_DNS_RESOLVER_H_
@@ -16,6 +16,8 @@ class HostPort {
   explicit HostPort(const Sockaddr& addr);
 
   Status ParseString(const std::string& str, uint16_t default_port);
+  // Blocks the calling thread in getaddrinfo(). See DnsResolver for a
+  // cached, asynchronous alternative.
   Status ResolveAddresses(std::vector<Sockaddr>* addresses) const;
 
   std::string ToString() const;
@@ -448,6 +448,31 @@ Status Socket::Read(uint8_t *buf, size_t amt, size_t *nread) {
   return Status::OK();          
 } 
 
+Status Socket::Readv(const struct ::iovec *iov, int iov_len, size_t *nread) {
+  if (PREDICT_FALSE(iov_len <= 0)) {
+    return Status::NetworkError(
+                StringPrintf("readv: invalid io vector length of %d", iov_len), Slice(), EINVAL);
+  }
+  DCHECK_GE(fd_, 0);
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = const_cast<iovec *>(iov);
+  msg.msg_iovlen = iov_len;
+  int res = ::recvmsg(fd_, &msg, 0);
+  if (res <= 0) {
+    if (res == 0) {
+      return Status::NetworkError("recvmsg() got EOF from remote", Slice(), ESHUTDOWN);
+    }
+    int err = errno;
+    return Status::NetworkError(std::string("recvmsg error: ") +
+                                ErrnoToString(err), Slice(), err);
+  }
+
+  *nread = res;
+  return Status::OK();
+}
+
 Status Socket::BlockingRead(uint8_t *buf, size_t amt, size_t *nread, const MonoTime& deadline) {
   DCHECK_LE(amt, std::numeric_limits<int32_t>::max()) << "Reads > INT32_MAX not supported";
   DCHECK(nread); 
@@ -56,6 +56,9 @@ class Socket {
 
 
   virtual Status Read(uint8_t* buf, size_t amt, size_t* nread);
+  // Scatter read into 'iov' with a single recvmsg(2) call. Like Read(), a
+  // short read is not an error and EOF is reported as ESHUTDOWN.
+  virtual Status Readv(const struct ::iovec* iov, int iov_len, size_t* nread);
   Status BlockingRead(uint8_t* buf, size_t amt, size_t* nread, const MonoTime& dealline);
 
  private:
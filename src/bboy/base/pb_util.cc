@@ -0,0 +1,313 @@
+#include "bboy/base/pb_util.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+#include <utility>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/message.h>
+
+#include "bboy/gbase/endian.h"
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/crc.h"
+#include "bboy/base/env.h"
+
+DEFINE_int32(pb_container_write_batch_bytes, 64 * 1024,
+             "Records appended to a protobuf container file are written out once "
+             "at least this many bytes of them have accumulated.");
+
+DEFINE_int32(pb_container_read_ahead_bytes, 256 * 1024,
+             "Protobuf container files which aren't memory-mapped are read in "
+             "chunks of at least this many bytes.");
+
+using google::protobuf::FileDescriptor;
+using google::protobuf::FileDescriptorSet;
+using google::protobuf::Message;
+using std::string;
+using std::unique_ptr;
+using strings::Substitute;
+
+namespace bb {
+namespace pb_util {
+
+namespace {
+
+const char kMagic[] = "bbcntnr";
+const size_t kMagicLength = 8;
+const uint32_t kVersion = 1;
+const size_t kFileHeaderLength = kMagicLength + sizeof(uint32_t);
+
+// The length and its checksum.
+const size_t kRecordHeaderLength = 2 * sizeof(uint32_t);
+// The header and the checksum of the data.
+const size_t kRecordOverhead = kRecordHeaderLength + sizeof(uint32_t);
+
+uint32_t Checksum(const uint8_t* data, size_t n) {
+  return crc::Crc32c(data, n);
+}
+
+void AddFileDescriptor(const FileDescriptor* file,
+                       std::unordered_set<const FileDescriptor*>* seen,
+                       FileDescriptorSet* files) {
+  if (!seen->insert(file).second) {
+    return;
+  }
+  for (int i = 0; i < file->dependency_count(); i++) {
+    AddFileDescriptor(file->dependency(i), seen, files);
+  }
+  file->CopyTo(files->add_file());
+}
+
+} // anonymous namespace
+
+void GetFileDescriptorSet(const FileDescriptor* file, FileDescriptorSet* files) {
+  std::unordered_set<const FileDescriptor*> seen;
+  AddFileDescriptor(file, &seen, files);
+}
+
+WritablePBContainerFile::WritablePBContainerFile(unique_ptr<WritableFile> writer)
+    : state_(kNotInitialized),
+      writer_(std::move(writer)) {
+}
+
+WritablePBContainerFile::~WritablePBContainerFile() {
+  if (state_ == kOpen) {
+    WARN_NOT_OK(Close(), "Could not close container file " + writer_->filename());
+  }
+}
+
+Status WritablePBContainerFile::CreateNew(const Message& msg) {
+  DCHECK_EQ(state_, kNotInitialized);
+  DCHECK_EQ(writer_->Size(), 0);
+
+  uint8_t header[kFileHeaderLength];
+  memcpy(header, kMagic, kMagicLength);
+  LittleEndian::Store32(header + kMagicLength, kVersion);
+  batch_.append(header, sizeof(header));
+
+  ContainerSupHeaderPB sup_header;
+  GetFileDescriptorSet(msg.GetDescriptor()->file(), sup_header.mutable_protos());
+  sup_header.set_pb_type(msg.GetTypeName());
+  AppendRecordToBatch(sup_header);
+
+  state_ = kOpen;
+  return Flush();
+}
+
+Status WritablePBContainerFile::OpenExisting() {
+  DCHECK_EQ(state_, kNotInitialized);
+  DCHECK_GT(writer_->Size(), 0);
+  state_ = kOpen;
+  return Status::OK();
+}
+
+Status WritablePBContainerFile::Append(const Message& msg) {
+  DCHECK_EQ(state_, kOpen);
+  AppendRecordToBatch(msg);
+  if (batch_.size() >= FLAGS_pb_container_write_batch_bytes) {
+    RETURN_NOT_OK(Flush());
+  }
+  return Status::OK();
+}
+
+Status WritablePBContainerFile::Flush() {
+  DCHECK_EQ(state_, kOpen);
+  if (batch_.size() == 0) {
+    return Status::OK();
+  }
+  RETURN_NOT_OK(writer_->Append(Slice(batch_)));
+  batch_.clear();
+  return Status::OK();
+}
+
+Status WritablePBContainerFile::Sync() {
+  RETURN_NOT_OK(Flush());
+  return writer_->Sync();
+}
+
+Status WritablePBContainerFile::Close() {
+  if (state_ == kClosed) {
+    return Status::OK();
+  }
+  Status s = Flush();
+  // Close the file regardless, but report the first error.
+  Status close_status = writer_->Close();
+  state_ = kClosed;
+  RETURN_NOT_OK(s);
+  return close_status;
+}
+
+void WritablePBContainerFile::AppendRecordToBatch(const Message& msg) {
+  // Serialize straight into the batch.
+  const uint32_t len = msg.ByteSize();
+  const size_t record_offset = batch_.size();
+  batch_.resize(record_offset + kRecordOverhead + len);
+  uint8_t* dst = batch_.data() + record_offset;
+  LittleEndian::Store32(dst, len);
+  LittleEndian::Store32(dst + sizeof(uint32_t), Checksum(dst, sizeof(uint32_t)));
+  uint8_t* data = dst + kRecordHeaderLength;
+  uint8_t* end = msg.SerializeWithCachedSizesToArray(data);
+  DCHECK_EQ(end - data, len);
+  LittleEndian::Store32(end, Checksum(data, len));
+}
+
+ReadablePBContainerFile::ReadablePBContainerFile(unique_ptr<RandomAccessFile> reader)
+    : reader_(std::move(reader)),
+      file_size_(0),
+      offset_(0) {
+}
+
+ReadablePBContainerFile::~ReadablePBContainerFile() {
+}
+
+Status ReadablePBContainerFile::Open() {
+  RETURN_NOT_OK(reader_->Size(&file_size_));
+  Status s = Prefetch(kFileHeaderLength);
+  if (s.IsIncomplete()) {
+    return Status::Incomplete("Container file is too short to have a header",
+                              reader_->filename());
+  }
+  RETURN_NOT_OK(s);
+  if (memcmp(window_.data(), kMagic, kMagicLength) != 0) {
+    return Status::Corruption("Invalid container file magic", reader_->filename());
+  }
+  uint32_t version = LittleEndian::Load32(window_.data() + kMagicLength);
+  if (version != kVersion) {
+    return Status::NotSupported(
+        Substitute("Unsupported container file version $0", version), reader_->filename());
+  }
+  Consume(kFileHeaderLength);
+
+  Slice data;
+  RETURN_NOT_OK_PREPEND(ReadNextRecord(&data), "Could not read supplemental header");
+  if (!sup_header_.ParseFromArray(data.data(), data.size())) {
+    return Status::Corruption("Unable to parse supplemental header", reader_->filename());
+  }
+  return Status::OK();
+}
+
+Status ReadablePBContainerFile::ReadNextPB(Message* msg) {
+  if (PREDICT_FALSE(msg->GetTypeName() != pb_type())) {
+    return Status::InvalidArgument(
+        Substitute("Message of type $0 requested from container of $1",
+                   msg->GetTypeName(), pb_type()));
+  }
+  Slice data;
+  RETURN_NOT_OK(ReadNextRecord(&data));
+  if (!msg->ParseFromArray(data.data(), data.size())) {
+    return Status::Corruption(
+        Substitute("Unable to parse record of $0 bytes", data.size()), reader_->filename());
+  }
+  return Status::OK();
+}
+
+Status ReadablePBContainerFile::ReadNextRecord(Slice* data) {
+  if (offset_ == file_size_) {
+    return Status::EndOfFile("No more records", reader_->filename());
+  }
+  Status s = Prefetch(kRecordHeaderLength);
+  if (s.IsIncomplete()) {
+    return Status::Incomplete(
+        Substitute("Truncated record header at offset $0", offset_), reader_->filename());
+  }
+  RETURN_NOT_OK(s);
+  const uint8_t* header = window_.data();
+  uint32_t len = LittleEndian::Load32(header);
+  if (Checksum(header, sizeof(uint32_t)) !=
+      LittleEndian::Load32(header + sizeof(uint32_t))) {
+    return Status::Corruption(
+        Substitute("Length checksum mismatch at offset $0", offset_), reader_->filename());
+  }
+
+  s = Prefetch(kRecordOverhead + len);
+  if (s.IsIncomplete()) {
+    return Status::Incomplete(
+        Substitute("Truncated record of $0 bytes at offset $1", len, offset_),
+        reader_->filename());
+  }
+  RETURN_NOT_OK(s);
+  const uint8_t* record_data = window_.data() + kRecordHeaderLength;
+  if (Checksum(record_data, len) != LittleEndian::Load32(record_data + len)) {
+    return Status::Corruption(
+        Substitute("Data checksum mismatch at offset $0", offset_), reader_->filename());
+  }
+  *data = Slice(record_data, len);
+  Consume(kRecordOverhead + len);
+  return Status::OK();
+}
+
+Status ReadablePBContainerFile::Prefetch(size_t n) {
+  if (window_.size() >= n) {
+    return Status::OK();
+  }
+  const uint64_t remaining = file_size_ - offset_;
+  if (remaining < n) {
+    return Status::Incomplete("Unexpected end of file");
+  }
+  if (reader_->IsMemoryMapped()) {
+    // The rest of the file is available without copying.
+    return reader_->Read(offset_, remaining, &window_, nullptr);
+  }
+
+  // Keep the bytes already fetched, and read ahead.
+  const size_t have = window_.size();
+  const size_t to_read = std::min<uint64_t>(
+      std::max<size_t>(n, FLAGS_pb_container_read_ahead_bytes), remaining);
+  if (have > 0) {
+    memmove(buf_.data(), window_.data(), have);
+  }
+  buf_.resize(to_read);
+  Slice result;
+  RETURN_NOT_OK(reader_->Read(offset_ + have, to_read - have, &result, buf_.data() + have));
+  if (result.size() != to_read - have) {
+    return Status::IOError(
+        Substitute("Short read at offset $0: the file was truncated", offset_ + have),
+        reader_->filename());
+  }
+  if (result.data() != buf_.data() + have) {
+    memcpy(buf_.data() + have, result.data(), result.size());
+  }
+  window_ = Slice(buf_.data(), to_read);
+  return Status::OK();
+}
+
+void ReadablePBContainerFile::Consume(size_t n) {
+  window_.remove_prefix(n);
+  offset_ += n;
+}
+
+Status TruncateIncompleteRecord(Env* env, const string& path) {
+  unique_ptr<RandomAccessFile> file;
+  RETURN_NOT_OK(env->NewRandomAccessFile(path, &file));
+  ReadablePBContainerFile reader(std::move(file));
+  RETURN_NOT_OK(reader.Open());
+
+  Status s;
+  Slice data;
+  do {
+    s = reader.ReadNextRecord(&data);
+  } while (s.ok());
+  if (s.IsEndOfFile()) {
+    return Status::OK();
+  }
+  if (!s.IsIncomplete()) {
+    return s;
+  }
+
+  LOG(WARNING) << "Truncating container file " << path << " to "
+               << reader.offset() << " bytes: " << s.ToString();
+  RWFileOptions opts;
+  opts.mode = Env::OPEN_EXISTING;
+  unique_ptr<RWFile> rw_file;
+  RETURN_NOT_OK(env->NewRWFile(opts, path, &rw_file));
+  RETURN_NOT_OK(rw_file->Truncate(reader.offset()));
+  RETURN_NOT_OK(rw_file->Sync());
+  return rw_file->Close();
+}
+
+} // namespace pb_util
+} // namespace bb
@@ -0,0 +1,176 @@
+#ifndef BBOY_BASE_PB_UTIL_H_
+#define BBOY_BASE_PB_UTIL_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "bboy/gbase/macros.h"
+#include "bboy/base/faststring.h"
+#include "bboy/base/pb_util.pb.h"
+#include "bboy/base/slice.h"
+#include "bboy/base/status.h"
+
+namespace google {
+namespace protobuf {
+class FileDescriptor;
+class FileDescriptorSet;
+class Message;
+} // namespace protobuf
+} // namespace google
+
+namespace bb {
+
+class Env;
+class RandomAccessFile;
+class WritableFile;
+
+namespace pb_util {
+
+// Protobuf container files
+// ------------------------
+//
+// A container file holds a sequence of protobuf messages of a single type,
+// along with the schema needed to decode them. It can only be appended to.
+//
+// <magic>             8 bytes: "bbcntnr\0"
+// <version>           4 bytes, little-endian: 1
+// <sup header>        a record holding a ContainerSupHeaderPB
+// <record>*           records holding the messages
+//
+// Each record is:
+//
+// <length>            4 bytes, little-endian: the length of <data>
+// <length checksum>   4 bytes, little-endian: CRC-32C of <length>
+// <data>              the serialized message
+// <data checksum>     4 bytes, little-endian: CRC-32C of <data>
+//
+// Checksumming the length separately lets a reader tell a corrupt length
+// apart from a record cut short by a crash while it was being appended (see
+// TruncateIncompleteRecord()).
+
+// Writes a container file.
+//
+// Records are accumulated in memory and written out in batches of at least
+// --pb_container_write_batch_bytes, or on Flush(), Sync() and Close(): on a
+// crash, records which weren't flushed are lost.
+//
+// This class is not thread-safe.
+class WritablePBContainerFile {
+ public:
+  explicit WritablePBContainerFile(std::unique_ptr<WritableFile> writer);
+
+  // Closes the file if it's still open.
+  ~WritablePBContainerFile();
+
+  // Write the headers of a container of messages of the type of 'msg' to
+  // the new, empty file.
+  Status CreateNew(const google::protobuf::Message& msg) WARN_UNUSED_RESULT;
+
+  // Prepare to append to an existing container, which must end with a whole
+  // record (see TruncateIncompleteRecord()). The underlying file must have
+  // been opened in OPEN_EXISTING mode.
+  Status OpenExisting() WARN_UNUSED_RESULT;
+
+  // Append 'msg', which must be of the type of the container.
+  Status Append(const google::protobuf::Message& msg) WARN_UNUSED_RESULT;
+
+  // Write out the records accumulated so far.
+  Status Flush() WARN_UNUSED_RESULT;
+
+  // Write out the records accumulated so far and make them durable.
+  Status Sync() WARN_UNUSED_RESULT;
+
+  // Write out the records accumulated so far and close the file.
+  Status Close() WARN_UNUSED_RESULT;
+
+ private:
+  enum State {
+    kNotInitialized,
+    kOpen,
+    kClosed,
+  };
+
+  // Serialize 'msg' as a record at the end of 'batch_'.
+  void AppendRecordToBatch(const google::protobuf::Message& msg);
+
+  State state_;
+  std::unique_ptr<WritableFile> writer_;
+  // The records which haven't been written out yet.
+  faststring batch_;
+
+  DISALLOW_COPY_AND_ASSIGN(WritablePBContainerFile);
+};
+
+// Reads a container file from start to end.
+//
+// If the file is memory-mapped (see RandomAccessFileOptions::mmap), records
+// are parsed right out of the mapping; otherwise, the file is read ahead in
+// chunks of --pb_container_read_ahead_bytes.
+//
+// This class is not thread-safe.
+class ReadablePBContainerFile {
+ public:
+  explicit ReadablePBContainerFile(std::unique_ptr<RandomAccessFile> reader);
+  ~ReadablePBContainerFile();
+
+  // Read and validate the headers of the container.
+  Status Open() WARN_UNUSED_RESULT;
+
+  // Read the next record into 'msg', which must be of the type of the
+  // container. Returns:
+  // - EndOfFile if there are no more records;
+  // - Incomplete if the file ends in the middle of a record, e.g. because of
+  //   a crash while it was being appended;
+  // - Corruption if a checksum doesn't match or the record can't be parsed.
+  Status ReadNextPB(google::protobuf::Message* msg) WARN_UNUSED_RESULT;
+
+  // The offset of the end of the last record read successfully, or of the
+  // headers if no record was read.
+  uint64_t offset() const { return offset_; }
+
+  // The supplemental header of the container. Valid after Open().
+  const ContainerSupHeaderPB& sup_header() const { return sup_header_; }
+
+  // The fully qualified type of the messages in the container.
+  const std::string& pb_type() const { return sup_header_.pb_type(); }
+
+ private:
+  friend Status TruncateIncompleteRecord(Env* env, const std::string& path);
+
+  // Read the next record, outputting its data into 'data'. The data are
+  // valid until the next call.
+  Status ReadNextRecord(Slice* data);
+
+  // Make at least 'n' bytes from 'offset_' available in 'window_'. Returns
+  // Incomplete if the file ends first.
+  Status Prefetch(size_t n);
+
+  // Move past 'n' bytes of 'window_'.
+  void Consume(size_t n);
+
+  std::unique_ptr<RandomAccessFile> reader_;
+  uint64_t file_size_;
+  uint64_t offset_;
+  // The data of the file available from 'offset_', pointing into either the
+  // memory mapping of the file or 'buf_'.
+  Slice window_;
+  faststring buf_;
+  ContainerSupHeaderPB sup_header_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReadablePBContainerFile);
+};
+
+// Truncate an incomplete record at the end of the container file 'path', if
+// any, so that the container can be appended to again.
+Status TruncateIncompleteRecord(Env* env, const std::string& path) WARN_UNUSED_RESULT;
+
+// Output into 'files' the schema of 'file' along with all of its
+// dependencies, each one before its dependents.
+void GetFileDescriptorSet(const google::protobuf::FileDescriptor* file,
+                          google::protobuf::FileDescriptorSet* files);
+
+} // namespace pb_util
+} // namespace bb
+
+#endif // BBOY_BASE_PB_UTIL_H_
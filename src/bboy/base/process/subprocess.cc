@@ -2,9 +2,13 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -19,6 +23,7 @@
 #include <glog/logging.h>
 #include <glog/stl_logging.h>
 
+#include "bboy/gbase/map-util.h"
 #include "bboy/gbase/once.h"
 #include "bboy/gbase/port.h"
 #include "bboy/gbase/strings/join.h"
@@ -27,8 +32,11 @@
 #include "bboy/gbase/strings/substitute.h"
 //#include "bboy/base/debug-util.h"
 #include "bboy/base/errno.h"
+#include "bboy/base/scoped_cleanup.h"
 #include "bboy/base/status.h"
 
+extern char** environ;
+
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -54,6 +62,13 @@ static const char* kProcSelfFd =
 #define READDIR readdir64
 #define DIRENT dirent64
 typedef sighandler_t SignalHandlerCallback;
+
+// The size of the stack of the child until it calls exec().
+const size_t kChildStackSize = 256 * 1024;
+
+// close_range(2) and its flag, which the system headers may not define yet.
+const long kCloseRangeSyscall = 436;
+const unsigned int kCloseRangeCloexec = 1U << 2;
 #else
 #define READDIR readdir
 #define DIRENT dirent
@@ -73,22 +88,11 @@ void IgnoreSigPipe() {
   SetSignalHandler(SIGPIPE, SIG_IGN);
 }
 
-void ResetSigPipeHandlerToDefault() {
-  SetSignalHandler(SIGPIPE, SIG_DFL);
-}
-
 void EnsureSigPipeIgnored() {
   static GoogleOnceType once = GOOGLE_ONCE_INIT;
   GoogleOnceInit(&once, &IgnoreSigPipe);
 }
 
-// We unblock all signal masks since they are inherited.
-void ResetAllSignalMasksToUnblocked() {
-  sigset_t signals;
-  PCHECK(sigfillset(&signals) == 0);
-  PCHECK(sigprocmask(SIG_UNBLOCK, &signals, nullptr) == 0);
-}
-
 // Since opendir() calls malloc(), this must be called before fork().
 // This function is not async-signal-safe.
 Status OpenProcFdDir(DIR** dir) {
@@ -110,58 +114,173 @@ void CloseProcFdDir(DIR* dir) {
   }
 }
 
-// Close all open file descriptors other than stdin, stderr, stdout.
-// Expects a directory stream created by OpenProdFdDir() as a parameter.
-// This function is called after fork() and must not call malloc().
-// The rule of thumb is to only call async-signal-safe functions in such cases
-// if at all possible.
-void CloseNonStandardFDs(DIR* fd_dir) {
+// Everything the child needs to set itself up, prepared by the parent.
+//
+// On Linux, the child is created with clone(CLONE_VM | CLONE_VFORK): until it
+// calls exec(), it runs on the memory of the parent, which is suspended. So
+// the code of the child must not allocate memory, take locks or otherwise
+// change the state of the parent, and may only call async-signal-safe
+// functions. In particular, it can't log: errors are reported to the parent
+// through the sync pipe.
+struct ChildArgs {
+  const char* program;
+  char* const* argv;
+  char* const* envp;
+  // For each standard stream, the fd to dup onto it, or one of the
+  // following.
+  enum {
+    kShareParent = -1,
+    kDevNull = -2,
+  };
+  int std_fds[3];
+  // The listing of the open fds, from OpenProcFdDir().
+  DIR* fd_dir;
+  // The write side of the sync pipe.
+  int sync_fd;
+};
+
+// What the child writes into the sync pipe if it fails.
+struct ChildError {
+  enum Stage {
+    kSetup,
+    kExec,
+  };
+  int32_t stage;
+  int32_t err;
+};
+
+// Report 'err' to the parent and exit with it.
+void ChildFail(const ChildArgs& args, ChildError::Stage stage, int err) {
+  ChildError e;
+  e.stage = stage;
+  e.err = err;
+  ignore_result(write(args.sync_fd, &e, sizeof(e)));
+  _exit(err);
+}
+
+// Close all open file descriptors other than stdin, stderr, stdout and
+// 'keep_fd'. Expects a directory stream created by OpenProcFdDir() as a
+// parameter. Returns false on failure, with errno set.
+bool CloseNonStandardFDs(DIR* fd_dir, int keep_fd) {
+#if defined(__linux__)
+  // Where available (Linux 5.11), mark them all close-on-exec with a single
+  // system call. Unlike closing them, this leaves 'keep_fd' usable until
+  // exec().
+  if (syscall(kCloseRangeSyscall, 3, ~0U, kCloseRangeCloexec) == 0) {
+    return true;
+  }
+#endif
   // This is implemented by iterating over the open file descriptors
   // rather than using sysconf(SC_OPEN_MAX) -- the latter is error prone
   // since it may not represent the highest open fd if the fd soft limit
   // has changed since the process started. This should also be faster
   // since iterating over all possible fds is likely to cause 64k+ syscalls
   // in typical configurations.
-  //
-  // Note also that this doesn't use any of the Env utility functions, to
-  // make it as lean and mean as possible -- this runs in the subprocess
-  // after a fork, so there's some possibility that various global locks
-  // inside malloc() might be held, so allocating memory is a no-no.
-  PCHECK(fd_dir != nullptr);
+  if (fd_dir == nullptr) {
+    errno = EBADF;
+    return false;
+  }
   int dir_fd = dirfd(fd_dir);
 
   struct DIRENT* ent;
   // readdir64() is not reentrant (it uses a static buffer) and it also
   // locks fd_dir->lock, so it must not be called in a multi-threaded
   // environment and is certainly not async-signal-safe.
-  // However, it appears to be safe to call right after fork(), since only one
-  // thread exists in the child process at that time. It also does not call
-  // malloc() or free(). We could use readdir64_r() instead, but all that
-  // buys us is reentrancy, and not async-signal-safety, due to the use of
-  // dir->lock, so seems not worth the added complexity in lifecycle & plumbing.
+  // However, it's safe to call in the child, since the parent is the only
+  // other user of fd_dir and it doesn't use it until the child is set up.
+  // It also does not call malloc() or free().
   while ((ent = READDIR(fd_dir)) != nullptr) {
     uint32_t fd;
     if (!safe_strtou32(ent->d_name, &fd)) continue;
     if (!(fd == STDIN_FILENO  ||
           fd == STDOUT_FILENO ||
           fd == STDERR_FILENO ||
-          fd == dir_fd))  {
+          fd == dir_fd ||
+          fd == keep_fd))  {
       close(fd);
     }
   }
+  return true;
 }
 
-void RedirectToDevNull(int fd) {
-  // We must not close stderr or stdout, because then when a new file descriptor
-  // gets opened, it might get that fd number.  (We always allocate the lowest
-  // available file descriptor number.)  Instead, we reopen that fd as
-  // /dev/null.
-  int dev_null = open("/dev/null", O_WRONLY);
-  if (dev_null < 0) {
-    PLOG(WARNING) << "failed to open /dev/null";
-  } else {
-    PCHECK(dup2(dev_null, fd));
+// The body of the child process: set it up as described by 'arg', a
+// ChildArgs, and exec the program. Never returns.
+int ChildMain(void* arg) {
+  const ChildArgs& args = *static_cast<const ChildArgs*>(arg);
+
+  // Send the child a SIGKILL when the parent dies. This is done as early
+  // as possible in the child's life to prevent any orphaning whatsoever
+  // (e.g. from KUDU-402).
+#if defined(__linux__)
+  // TODO: prctl(PR_SET_PDEATHSIG) is Linux-specific, look into portable ways
+  // to prevent orphans when parent is killed.
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+
+  // The parent blocked all signals before creating the child. Before
+  // unblocking them, restore the default disposition of the signals which
+  // are caught, since the handlers of the parent must not run on its memory.
+  // Also reset SIGPIPE, which EnsureSigPipeIgnored() ignores. Other ignored
+  // signals stay ignored across exec(), as after fork().
+  for (int sig = 1; sig < NSIG; sig++) {
+    struct sigaction act;
+    if (sigaction(sig, nullptr, &act) != 0) {
+      continue;
+    }
+    if (act.sa_handler != SIG_DFL && (act.sa_handler != SIG_IGN || sig == SIGPIPE)) {
+      act.sa_handler = SIG_DFL;
+      sigemptyset(&act.sa_mask);
+      act.sa_flags = 0;
+      sigaction(sig, &act, nullptr);
+    }
+  }
+
+  for (int stdfd = 0; stdfd < 3; stdfd++) {
+    int fd = args.std_fds[stdfd];
+    if (fd == ChildArgs::kShareParent) {
+      continue;
+    }
+    if (fd == ChildArgs::kDevNull) {
+      // We must not close stderr or stdout, because then when a new file
+      // descriptor gets opened, it might get that fd number. (We always
+      // allocate the lowest available file descriptor number.) Instead, we
+      // reopen that fd as /dev/null.
+      int dev_null = open("/dev/null", O_WRONLY);
+      if (dev_null < 0) {
+        ChildFail(args, ChildError::kSetup, errno);
+      }
+      if (dup2(dev_null, stdfd) != stdfd) {
+        ChildFail(args, ChildError::kSetup, errno);
+      }
+      close(dev_null);
+    } else if (dup2(fd, stdfd) != stdfd) {
+      ChildFail(args, ChildError::kSetup, errno);
+    }
   }
+
+  if (!CloseNonStandardFDs(args.fd_dir, args.sync_fd)) {
+    ChildFail(args, ChildError::kSetup, errno);
+  }
+
+  // Ensure we are not blocking signals in the child process: the signal mask
+  // is inherited across exec().
+  sigset_t signals;
+  sigfillset(&signals);
+  if (sigprocmask(SIG_UNBLOCK, &signals, nullptr) != 0) {
+    ChildFail(args, ChildError::kSetup, errno);
+  }
+
+  // We rely on the 'p' variant of exec to do $PATH searching if the
+  // executable specified by the caller isn't an absolute path.
+#if defined(__linux__)
+  execvpe(args.program, args.argv, args.envp);
+#else
+  // The child has a copy of the memory of the parent.
+  environ = const_cast<char**>(args.envp);
+  execvp(args.program, args.argv);
+#endif
+  ChildFail(args, ChildError::kExec, errno);
+  return 0;
 }
 
 // Stateful libev watcher to help ReadFdsFully().
@@ -322,159 +441,191 @@ Status Subprocess::Start() {
   }
   EnsureSigPipeIgnored();
 
+  // Everything the child uses is allocated here, since it can't allocate
+  // memory itself (see ChildArgs).
   vector<char*> argv_ptrs;
   for (const string& arg : argv_) {
     argv_ptrs.push_back(const_cast<char*>(arg.c_str()));
   }
   argv_ptrs.push_back(nullptr);
 
+  // The environment of the parent, with the variables of env_ overridden.
+  vector<string> env_strs;
+  for (char** e = environ; *e != nullptr; e++) {
+    const char* eq = strchr(*e, '=');
+    if (eq == nullptr || !ContainsKey(env_, string(*e, eq - *e))) {
+      env_strs.emplace_back(*e);
+    }
+  }
+  for (const auto& env : env_) {
+    env_strs.push_back(env.first + "=" + env.second);
+  }
+  vector<char*> envp_ptrs;
+  for (const string& env : env_strs) {
+    envp_ptrs.push_back(const_cast<char*>(env.c_str()));
+  }
+  envp_ptrs.push_back(nullptr);
+
   // Pipe from caller process to child's stdin
   // [0] = stdin for child, [1] = how parent writes to it
   int child_stdin[2] = {-1, -1};
-  if (fd_state_[STDIN_FILENO] == PIPED) {
-    PCHECK(pipe2(child_stdin, O_CLOEXEC) == 0);
-  }
   // Pipe from child's stdout back to caller process
   // [0] = how parent reads from child's stdout, [1] = how child writes to it
   int child_stdout[2] = {-1, -1};
-  if (fd_state_[STDOUT_FILENO] == PIPED) {
-    PCHECK(pipe2(child_stdout, O_CLOEXEC) == 0);
-  }
   // Pipe from child's stderr back to caller process
   // [0] = how parent reads from child's stderr, [1] = how child writes to it
   int child_stderr[2] = {-1, -1};
+  // The synchronization pipe: this trick is to make sure the parent returns
+  // control only after the child process has invoked execvp(). It also
+  // carries a ChildError if the child fails before that.
+  int sync_pipe[2] = {-1, -1};
+  auto close_pipes = MakeScopedCleanup([&]() {
+    for (int* p : { child_stdin, child_stdout, child_stderr, sync_pipe }) {
+      for (int i = 0; i < 2; i++) {
+        if (p[i] >= 0) close(p[i]);
+      }
+    }
+  });
+  if (fd_state_[STDIN_FILENO] == PIPED) {
+    PCHECK(pipe2(child_stdin, O_CLOEXEC) == 0);
+  }
+  if (fd_state_[STDOUT_FILENO] == PIPED) {
+    PCHECK(pipe2(child_stdout, O_CLOEXEC) == 0);
+  }
   if (fd_state_[STDERR_FILENO] == PIPED) {
     PCHECK(pipe2(child_stderr, O_CLOEXEC) == 0);
   }
-  // The synchronization pipe: this trick is to make sure the parent returns
-  // control only after the child process has invoked execvp().
-  int sync_pipe[2];
   PCHECK(pipe2(sync_pipe, O_CLOEXEC) == 0);
 
   DIR* fd_dir = nullptr;
   RETURN_NOT_OK_PREPEND(OpenProcFdDir(&fd_dir), "Unable to open fd dir");
   unique_ptr<DIR, std::function<void(DIR*)>> fd_dir_closer(fd_dir,
                                                            CloseProcFdDir);
-  int ret = fork();
-  if (ret == -1) {
-    return Status::RuntimeError("Unable to fork", ErrnoToString(errno), errno);
-  }
-  if (ret == 0) { // We are the child
-    // Send the child a SIGTERM when the parent dies. This is done as early
-    // as possible in the child's life to prevent any orphaning whatsoever
-    // (e.g. from KUDU-402).
-#if defined(__linux__)
-    // TODO: prctl(PR_SET_PDEATHSIG) is Linux-specific, look into portable ways
-    // to prevent orphans when parent is killed.
-    prctl(PR_SET_PDEATHSIG, SIGKILL);
-#endif
 
-    // stdin
-    if (fd_state_[STDIN_FILENO] == PIPED) {
-      PCHECK(dup2(child_stdin[0], STDIN_FILENO) == STDIN_FILENO);
-    }
-
-    // stdout
-    switch (fd_state_[STDOUT_FILENO]) {
-      case PIPED: {
-        PCHECK(dup2(child_stdout[1], STDOUT_FILENO) == STDOUT_FILENO);
+  ChildArgs args;
+  args.program = program_.c_str();
+  args.argv = &argv_ptrs[0];
+  args.envp = &envp_ptrs[0];
+  const int child_ends[3] = { child_stdin[0], child_stdout[1], child_stderr[1] };
+  for (int i = 0; i < 3; i++) {
+    switch (fd_state_[i]) {
+      case PIPED:
+        args.std_fds[i] = child_ends[i];
         break;
-      }
-      case DISABLED: {
-        RedirectToDevNull(STDOUT_FILENO);
+      case DISABLED:
+        args.std_fds[i] = ChildArgs::kDevNull;
         break;
-      }
       default:
+        args.std_fds[i] = ChildArgs::kShareParent;
         break;
     }
+  }
+  args.fd_dir = fd_dir;
+  args.sync_fd = sync_pipe[1];
 
-    // stderr
-    switch (fd_state_[STDERR_FILENO]) {
-      case PIPED: {
-        PCHECK(dup2(child_stderr[1], STDERR_FILENO) == STDERR_FILENO);
-        break;
-      }
-      case DISABLED: {
-        RedirectToDevNull(STDERR_FILENO);
-        break;
-      }
-      default:
-        break;
-    }
+#if defined(__linux__)
+  // The child runs on the memory of the parent, but needs a stack of its own.
+  void* stack = mmap(nullptr, kChildStackSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) {
+    return Status::RuntimeError("Unable to allocate the stack of the child",
+                                ErrnoToString(errno), errno);
+  }
+#endif
 
-    // Close the read side of the sync pipe;
-    // the write side should be closed upon execvp().
-    PCHECK(close(sync_pipe[0]) == 0);
-
-    CloseNonStandardFDs(fd_dir);
-
-    // Ensure we are not ignoring or blocking signals in the child process.
-    ResetAllSignalMasksToUnblocked();
-    // Reset SIGPIPE to its default disposition because we previously set it to
-    // SIG_IGN via EnsureSigPipeIgnored(). At the time of writing, we don't
-    // explicitly ignore any other signals in Kudu.
-    ResetSigPipeHandlerToDefault();
-
-    // Set the environment for the subprocess. This is more portable than
-    // using execvpe(), which doesn't exist on OS X. We rely on the 'p'
-    // variant of exec to do $PATH searching if the executable specified
-    // by the caller isn't an absolute path.
-    for (const auto& env : env_) {
-      ignore_result(setenv(env.first.c_str(), env.second.c_str(), 1 /* overwrite */));
+  // Block all signals until the child has reset their handlers: a handler
+  // of the parent must not run in the child.
+  sigset_t all_signals;
+  sigset_t old_signals;
+  sigfillset(&all_signals);
+  PCHECK(pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals) == 0);
+#if defined(__linux__)
+  // Unlike fork(), clone(CLONE_VM) doesn't copy the page tables of the
+  // parent, so its cost doesn't grow with the memory of the parent, and it
+  // doesn't trigger copy-on-write faults in the parent afterwards.
+  // CLONE_VFORK suspends the parent until the child calls exec() or exits.
+  int ret = clone(&ChildMain, static_cast<char*>(stack) + kChildStackSize,
+                  CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+  int clone_err = errno;
+  PCHECK(munmap(stack, kChildStackSize) == 0);
+#else
+  int ret = fork();
+  int clone_err = errno;
+  if (ret == 0) { // We are the child
+    ChildMain(&args);
+  }
+#endif
+  PCHECK(pthread_sigmask(SIG_SETMASK, &old_signals, nullptr) == 0);
+  if (ret == -1) {
+    return Status::RuntimeError("Unable to fork", ErrnoToString(clone_err), clone_err);
+  }
+
+  // We are the parent
+  child_pid_ = ret;
+  // Close child's side of the pipes
+  for (int* fd : { &child_stdin[0], &child_stdout[1], &child_stderr[1] }) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
     }
+  }
 
-    execvp(program_.c_str(), &argv_ptrs[0]);
-    int err = errno;
-    PLOG(ERROR) << "Couldn't exec " << program_;
-    _exit(err);
-  } else {
-    // We are the parent
-    child_pid_ = ret;
-    // Close child's side of the pipes
-    if (fd_state_[STDIN_FILENO]  == PIPED) close(child_stdin[0]);
-    if (fd_state_[STDOUT_FILENO] == PIPED) close(child_stdout[1]);
-    if (fd_state_[STDERR_FILENO] == PIPED) close(child_stderr[1]);
-    // Keep parent's side of the pipes
-    child_fds_[STDIN_FILENO]  = child_stdin[1];
-    child_fds_[STDOUT_FILENO] = child_stdout[0];
-    child_fds_[STDERR_FILENO] = child_stderr[0];
-
-    // Wait for the child process to invoke execvp(). The trick involves
-    // a pipe with O_CLOEXEC option for its descriptors. The parent process
-    // performs blocking read from the pipe while the write side of the pipe
-    // is kept open by the child (it does not write any data, though). The write
-    // side of the pipe is closed when the child invokes execvp(). At that
-    // point, the parent should receive EOF, i.e. read() should return 0.
-    {
-      // Close the write side of the sync pipe. It's crucial to make sure
-      // it succeeds otherwise the blocking read() below might wait forever
-      // even if the child process has closed the pipe.
-      PCHECK(close(sync_pipe[1]) == 0);
-      while (true) {
-        uint8_t buf;
-        int err = 0;
-        const int rc = read(sync_pipe[0], &buf, 1);
-        if (rc == -1) {
-          err = errno;
-          if (err == EINTR) {
-            // Retry in case of a signal.
-            continue;
-          }
-        }
-        PCHECK(close(sync_pipe[0]) == 0);
-        if (rc == 0) {
-          // That's OK -- expecting EOF from the other side of the pipe.
-          break;
-        } else if (rc == -1) {
-          // Other errors besides EINTR are not expected.
-          return Status::RuntimeError("Unexpected error from the sync pipe",
-                                      ErrnoToString(err), err);
-        }
-        // No data is expected from the sync pipe.
-        LOG(FATAL) << Substitute("$0: unexpected data from the sync pipe", rc);
+  // Wait for the child process to invoke execvp(). The trick involves
+  // a pipe with O_CLOEXEC option for its descriptors. The parent process
+  // performs blocking read from the pipe while the write side of the pipe
+  // is kept open by the child. The write side of the pipe is closed when
+  // the child invokes execvp(). At that point, the parent should receive
+  // EOF, i.e. read() should return 0. If the child fails before, it writes
+  // a ChildError and exits instead.
+  //
+  // Close the write side of the sync pipe. It's crucial to make sure
+  // it succeeds otherwise the blocking read() below might wait forever
+  // even if the child process has closed the pipe.
+  PCHECK(close(sync_pipe[1]) == 0);
+  sync_pipe[1] = -1;
+  ChildError child_err;
+  size_t nread = 0;
+  while (nread < sizeof(child_err)) {
+    const ssize_t rc = read(sync_pipe[0], reinterpret_cast<char*>(&child_err) + nread,
+                            sizeof(child_err) - nread);
+    if (rc == -1) {
+      int err = errno;
+      if (err == EINTR) {
+        // Retry in case of a signal.
+        continue;
       }
+      // Other errors besides EINTR are not expected.
+      return Status::RuntimeError("Unexpected error from the sync pipe",
+                                  ErrnoToString(err), err);
     }
-  }
+    if (rc == 0) {
+      break;
+    }
+    nread += rc;
+  }
+  if (nread == sizeof(child_err)) {
+    int err = child_err.err;
+    if (child_err.stage == ChildError::kSetup) {
+      // The child has exited: reap it.
+      int wait_status;
+      while (waitpid(child_pid_, &wait_status, 0) == -1 && errno == EINTR) {}
+      child_pid_ = -1;
+      return Status::RuntimeError("Unable to set up the child process",
+                                  ErrnoToString(err), err);
+    }
+    // As documented, this isn't an error of Start(): Wait() returns the
+    // exit status of the child, which is 'err'.
+    LOG(ERROR) << "Couldn't exec " << program_ << ": " << ErrnoToString(err);
+  } else if (nread != 0) {
+    LOG(FATAL) << Substitute("$0: unexpected data from the sync pipe", nread);
+  }
+
+  // Keep parent's side of the pipes
+  child_fds_[STDIN_FILENO]  = child_stdin[1];
+  child_fds_[STDOUT_FILENO] = child_stdout[0];
+  child_fds_[STDERR_FILENO] = child_stderr[0];
+  close_pipes.cancel();
+  PCHECK(close(sync_pipe[0]) == 0);
 
   state_ = kRunning;
   return Status::OK();
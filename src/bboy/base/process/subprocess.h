@@ -56,10 +56,15 @@ class Subprocess {
 
   // Start the subprocess. Can only be called once.
   //
-  // This returns a bad Status if the fork() fails. However,
+  // On Linux, the child is created with clone(CLONE_VM | CLONE_VFORK), so
+  // the cost of this doesn't depend on the memory footprint of the parent
+  // as with fork().
+  //
+  // This returns a bad Status if the child can't be created, or if it
+  // fails to set up its standard streams or file descriptors. However,
   // note that if the executable path was incorrect such that
   // exec() fails, this will still return Status::OK. You must
-  // use Wait() to check for failure.
+  // use Wait() to check for failure: the exit code is the errno of exec().
   Status Start();
 
   // Wait for the subprocess to exit. The return value is the same as
@@ -125,6 +130,8 @@ class Subprocess {
   pid_t pid() const;
 
  private:
+  friend class SubprocessManager;
+
   enum State {
     kNotStarted,
     kRunning,
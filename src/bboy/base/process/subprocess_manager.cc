@@ -0,0 +1,512 @@
+#include "bboy/base/process/subprocess_manager.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/errno.h"
+#include "bboy/base/process/subprocess.h"
+#include "bboy/base/thread/thread.h"
+
+DEFINE_bool(subprocess_manager_inject_pidfd_failure, false,
+            "Act as if pidfd_open() failed for every child of a SubprocessManager, "
+            "so that they are polled for their exit. For testing.");
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using strings::Substitute;
+
+namespace bb {
+
+namespace {
+
+// pidfd_open(2), which the system headers may not define yet.
+const long kPidfdOpenSyscall = 434;
+
+// How often the children without a pidfd are polled, in milliseconds.
+const int kPollIntervalMs = 100;
+
+// The number of events handled per epoll_wait().
+const int kMaxEvents = 64;
+
+Status SetNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return Status::IOError("Unable to make fd non-blocking", ErrnoToString(errno), errno);
+  }
+  return Status::OK();
+}
+
+} // anonymous namespace
+
+// What an epoll event is about.
+struct SubprocessManager::Watch {
+  enum Kind {
+    // One of the standard streams of 'child', in the order of their fds.
+    STDIN,
+    STDOUT,
+    STDERR,
+    // The pidfd of 'child'.
+    EXIT,
+    // wake_fd_ or signal_fd_, with a null 'child'.
+    WAKE,
+    SIGNAL,
+  };
+
+  Watch(Child* child, Kind kind)
+    : child(child),
+      kind(kind) { }
+
+  Child* child;
+  Kind kind;
+};
+
+struct SubprocessManager::Child {
+  Child()
+    : pidfd(-1),
+      polled(false),
+      stdin_offset(0),
+      watches{ Watch(this, Watch::STDIN), Watch(this, Watch::STDOUT),
+               Watch(this, Watch::STDERR), Watch(this, Watch::EXIT) } {
+    fds[0] = fds[1] = fds[2] = -1;
+  }
+
+  unique_ptr<Subprocess> proc;
+  CompletionCallback cb;
+
+  // The parent side of the pipes to the standard streams of the child, -1
+  // once closed or if not piped.
+  int fds[3];
+
+  // Readable once the child has exited, or -1 once it has been reaped or if
+  // pidfd_open() failed.
+  int pidfd;
+
+  // Whether the child has no pidfd and must be polled for its exit.
+  bool polled;
+
+  string stdin_data;
+  size_t stdin_offset;
+
+  SubprocessResult result;
+
+  // The first error reading the output of the child.
+  Status status;
+
+  Watch watches[4];
+};
+
+SubprocessManager::SubprocessManager(const SubprocessManagerOptions& opts)
+    : opts_(opts),
+      epoll_fd_(-1),
+      wake_fd_(-1),
+      signal_fd_(-1),
+      wake_watch_(new Watch(nullptr, Watch::WAKE)),
+      signal_watch_(new Watch(nullptr, Watch::SIGNAL)),
+      num_running_(0),
+      shutting_down_(false),
+      num_polled_(0) {
+}
+
+SubprocessManager::~SubprocessManager() {
+  Shutdown();
+  for (int fd : { epoll_fd_, wake_fd_, signal_fd_ }) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+Status SubprocessManager::Init() {
+  CHECK_EQ(epoll_fd_, -1) << "already initialized";
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ == -1) {
+    return Status::IOError("epoll_create1() failed", ErrnoToString(errno), errno);
+  }
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd_ == -1) {
+    return Status::IOError("eventfd() failed", ErrnoToString(errno), errno);
+  }
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  signal_fd_ = signalfd(-1, &sigchld, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (signal_fd_ == -1) {
+    return Status::IOError("signalfd() failed", ErrnoToString(errno), errno);
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = wake_watch_.get();
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) == -1) {
+    return Status::IOError("epoll_ctl() failed", ErrnoToString(errno), errno);
+  }
+  ev.data.ptr = signal_watch_.get();
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, signal_fd_, &ev) == -1) {
+    return Status::IOError("epoll_ctl() failed", ErrnoToString(errno), errno);
+  }
+
+  return Thread::Create("subprocess manager", "subprocess manager",
+                        &SubprocessManager::RunLoop, this, &thread_);
+}
+
+Status SubprocessManager::Launch(unique_ptr<Subprocess> proc, string stdin_data,
+                                 CompletionCallback cb) {
+  {
+    MutexLock l(lock_);
+    if (!thread_ || shutting_down_) {
+      return Status::IllegalState("SubprocessManager is not running");
+    }
+  }
+
+  for (int stream : { STDOUT_FILENO, STDERR_FILENO }) {
+    if (proc->fd_state_[stream] == Subprocess::SHARED) {
+      proc->fd_state_[stream] = Subprocess::PIPED;
+    }
+  }
+  RETURN_NOT_OK(proc->Start());
+
+  unique_ptr<Child> child(new Child);
+  for (int stream = 0; stream < 3; stream++) {
+    if (proc->fd_state_[stream] == Subprocess::PIPED) {
+      child->fds[stream] = proc->ReleaseChildFd(stream);
+    }
+  }
+  child->proc = std::move(proc);
+  child->stdin_data = std::move(stdin_data);
+  child->cb = std::move(cb);
+
+  {
+    MutexLock l(lock_);
+    if (!shutting_down_) {
+      pending_.emplace_back(std::move(child));
+      num_running_++;
+    }
+  }
+  if (child) {
+    // Shut down in the meantime. The destructor of the Subprocess kills it.
+    for (int fd : child->fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    return Status::IllegalState("SubprocessManager is not running");
+  }
+  Wake();
+  return Status::OK();
+}
+
+void SubprocessManager::Shutdown() {
+  // The thread would join itself.
+  DCHECK(!thread_ || Thread::current_thread() != thread_.get())
+      << "Shutdown() called from a completion callback";
+  {
+    MutexLock l(lock_);
+    if (shutting_down_) {
+      return;
+    }
+    shutting_down_ = true;
+  }
+  if (!thread_) {
+    return;
+  }
+  Wake();
+  thread_->Join();
+
+  vector<unique_ptr<Child>> children;
+  {
+    MutexLock l(lock_);
+    children.swap(pending_);
+  }
+  for (auto& e : children_) {
+    children.emplace_back(std::move(e.second));
+  }
+  children_.clear();
+  for (auto& child : children) {
+    Finish(std::move(child), Status::Aborted("SubprocessManager was shut down"));
+  }
+}
+
+int SubprocessManager::num_running() const {
+  MutexLock l(lock_);
+  return num_running_;
+}
+
+void SubprocessManager::Wake() {
+  uint64_t one = 1;
+  ignore_result(write(wake_fd_, &one, sizeof(one)));
+}
+
+void SubprocessManager::RunLoop() {
+  // Let signal_fd_ receive SIGCHLD, at least when it is sent to this thread.
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  PCHECK(pthread_sigmask(SIG_BLOCK, &sigchld, nullptr) == 0);
+
+  struct epoll_event events[kMaxEvents];
+  while (true) {
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, num_polled_ > 0 ? kPollIntervalMs : -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PLOG(FATAL) << "epoll_wait() failed";
+    }
+    bool poll = n == 0;
+    for (int i = 0; i < n; i++) {
+      Watch* w = static_cast<Watch*>(events[i].data.ptr);
+      switch (w->kind) {
+        case Watch::STDIN:
+          WriteStdin(w->child);
+          break;
+        case Watch::STDOUT:
+        case Watch::STDERR:
+          ReadOutput(w->child, w->kind);
+          break;
+        case Watch::EXIT:
+          Reap(w->child);
+          break;
+        case Watch::WAKE: {
+          uint64_t count;
+          ignore_result(read(wake_fd_, &count, sizeof(count)));
+          break;
+        }
+        case Watch::SIGNAL: {
+          struct signalfd_siginfo info;
+          while (read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {}
+          poll = true;
+          break;
+        }
+      }
+    }
+    if (poll) {
+      for (const auto& e : children_) {
+        if (e.first->polled) {
+          Reap(e.first);
+        }
+      }
+    }
+
+    vector<unique_ptr<Child>> pending;
+    {
+      MutexLock l(lock_);
+      if (shutting_down_) {
+        return;
+      }
+      pending.swap(pending_);
+    }
+    for (auto& child : pending) {
+      Child* c = child.get();
+      children_.emplace(c, std::move(child));
+      Register(c);
+    }
+
+    // Children are only released here, since the events handled above may
+    // refer to them.
+    vector<Child*> complete;
+    for (const auto& e : children_) {
+      if (IsComplete(*e.first)) {
+        complete.push_back(e.first);
+      }
+    }
+    for (Child* c : complete) {
+      unique_ptr<Child> child = std::move(children_[c]);
+      children_.erase(c);
+      if (c->polled) {
+        num_polled_--;
+      }
+      Finish(std::move(child), c->status);
+    }
+  }
+}
+
+void SubprocessManager::Register(Child* child) {
+  struct epoll_event ev;
+  for (int stream = 0; stream < 3; stream++) {
+    int fd = child->fds[stream];
+    if (fd < 0) {
+      continue;
+    }
+    if (stream == STDIN_FILENO && child->stdin_data.empty()) {
+      CloseFd(&child->fds[stream]);
+      continue;
+    }
+    Status s = SetNonBlocking(fd);
+    if (PREDICT_TRUE(s.ok())) {
+      ev.events = stream == STDIN_FILENO ? EPOLLOUT : EPOLLIN;
+      ev.data.ptr = &child->watches[stream];
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        s = Status::IOError("epoll_ctl() failed", ErrnoToString(errno), errno);
+      }
+    }
+    if (PREDICT_FALSE(!s.ok())) {
+      if (child->status.ok()) {
+        child->status = s;
+      }
+      CloseFd(&child->fds[stream]);
+    }
+  }
+
+  if (PREDICT_FALSE(FLAGS_subprocess_manager_inject_pidfd_failure)) {
+    child->pidfd = -1;
+    errno = ENOSYS;
+  } else {
+    child->pidfd = syscall(kPidfdOpenSyscall, child->proc->pid(), 0);
+  }
+  if (child->pidfd >= 0) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = &child->watches[Watch::EXIT];
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, child->pidfd, &ev) == 0) {
+      return;
+    }
+    PLOG(WARNING) << "Unable to watch pidfd, polling child " << child->proc->pid();
+    close(child->pidfd);
+    child->pidfd = -1;
+  } else {
+    VLOG(1) << "pidfd_open() failed, polling child " << child->proc->pid() << ": "
+            << ErrnoToString(errno);
+  }
+  child->polled = true;
+  num_polled_++;
+  // It may have exited before being registered.
+  Reap(child);
+}
+
+void SubprocessManager::WriteStdin(Child* child) {
+  int fd = child->fds[STDIN_FILENO];
+  if (fd < 0) {
+    return;
+  }
+  while (child->stdin_offset < child->stdin_data.size()) {
+    ssize_t n = write(fd, child->stdin_data.data() + child->stdin_offset,
+                      child->stdin_data.size() - child->stdin_offset);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        return;
+      }
+      // Most likely EPIPE: the child doesn't read its stdin. That's up to
+      // it, so it's not an error.
+      VLOG(1) << "Unable to write to the stdin of child " << child->proc->pid()
+              << ": " << ErrnoToString(errno);
+      break;
+    }
+    child->stdin_offset += n;
+  }
+  CloseFd(&child->fds[STDIN_FILENO]);
+  string().swap(child->stdin_data);
+}
+
+void SubprocessManager::ReadOutput(Child* child, int stream) {
+  int fd = child->fds[stream];
+  if (fd < 0) {
+    return;
+  }
+  string* output;
+  bool* truncated;
+  if (stream == STDOUT_FILENO) {
+    output = &child->result.stdout_output;
+    truncated = &child->result.stdout_truncated;
+  } else {
+    output = &child->result.stderr_output;
+    truncated = &child->result.stderr_truncated;
+  }
+  char buf[4096];
+  while (true) {
+    ssize_t n = read(fd, buf, arraysize(buf));
+    if (n == 0) {
+      CloseFd(&child->fds[stream]);
+      return;
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        return;
+      }
+      if (child->status.ok()) {
+        child->status = Status::IOError(
+            Substitute("IO error reading from $0", child->proc->argv_[0]),
+            ErrnoToString(errno), errno);
+      }
+      CloseFd(&child->fds[stream]);
+      return;
+    }
+    size_t keep = std::min<size_t>(n, opts_.max_output_bytes - output->size());
+    output->append(buf, keep);
+    if (keep < static_cast<size_t>(n)) {
+      *truncated = true;
+    }
+  }
+}
+
+void SubprocessManager::Reap(Child* child) {
+  if (child->result.wait_status != -1) {
+    return;
+  }
+  int wait_status;
+  Status s = child->proc->WaitNoBlock(&wait_status);
+  if (s.IsTimedOut()) {
+    return;
+  }
+  if (PREDICT_FALSE(!s.ok())) {
+    LOG(DFATAL) << "Unable to reap child " << child->proc->pid() << ": " << s.ToString();
+    return;
+  }
+  child->result.wait_status = wait_status;
+  if (child->pidfd >= 0) {
+    CloseFd(&child->pidfd);
+  }
+}
+
+void SubprocessManager::CloseFd(int* fd) {
+  // Closing the fd isn't enough to stop watching it: until a child being
+  // launched calls exec(), it has a copy of the fd, which keeps it in the
+  // epoll instance.
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, *fd, nullptr);
+  close(*fd);
+  *fd = -1;
+}
+
+bool SubprocessManager::IsComplete(const Child& child) {
+  return child.result.wait_status != -1 &&
+      child.fds[STDOUT_FILENO] < 0 &&
+      child.fds[STDERR_FILENO] < 0;
+}
+
+void SubprocessManager::Finish(unique_ptr<Child> child, const Status& s) {
+  for (int stream = 0; stream < 3; stream++) {
+    if (child->fds[stream] >= 0) {
+      CloseFd(&child->fds[stream]);
+    }
+  }
+  if (child->pidfd >= 0) {
+    CloseFd(&child->pidfd);
+  }
+  if (child->result.wait_status == -1) {
+    WARN_NOT_OK(child->proc->Kill(SIGKILL), "Failed to send SIGKILL");
+    WARN_NOT_OK(child->proc->Wait(&child->result.wait_status), "Failed to Wait()");
+  }
+  {
+    MutexLock l(lock_);
+    num_running_--;
+  }
+  child->cb(s, child->result);
+}
+
+} // namespace bb
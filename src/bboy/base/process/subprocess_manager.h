@@ -0,0 +1,170 @@
+#ifndef BBOY_BASE_PROCESS_SUBPROCESS_MANAGER_H_
+#define BBOY_BASE_PROCESS_SUBPROCESS_MANAGER_H_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bboy/gbase/macros.h"
+#include "bboy/gbase/ref_counted.h"
+#include "bboy/base/status.h"
+#include "bboy/base/sync/mutex.h"
+
+namespace bb {
+
+class Subprocess;
+class Thread;
+
+struct SubprocessManagerOptions {
+  // The maximum number of bytes of the stdout, and of the stderr, of each
+  // child which are kept. The rest of the output is read and dropped.
+  size_t max_output_bytes;
+
+  SubprocessManagerOptions()
+    : max_output_bytes(1024 * 1024) { }
+};
+
+// The outcome of a subprocess run by a SubprocessManager.
+struct SubprocessResult {
+  // The status of the child, as returned by waitpid(), or -1 if it wasn't
+  // reaped.
+  int wait_status;
+
+  // What the child wrote to its stdout and stderr, up to
+  // SubprocessManagerOptions::max_output_bytes each.
+  std::string stdout_output;
+  std::string stderr_output;
+
+  // Whether some of the output was dropped.
+  bool stdout_truncated;
+  bool stderr_truncated;
+
+  SubprocessResult()
+    : wait_status(-1),
+      stdout_truncated(false),
+      stderr_truncated(false) { }
+};
+
+// Runs many subprocesses at once from a single thread.
+//
+// The thread waits with epoll(7) on the output pipes of all the children and
+// on their exits, which are reported by a pidfd (Linux 5.3). Where pidfds
+// aren't available, SIGCHLD is received with a signalfd, and since that only
+// sees the signal if every thread of the process blocks it, the children are
+// also polled every 100 ms.
+//
+// Thread-safe.
+class SubprocessManager {
+ public:
+  // Called once a child has exited and both its stdout and stderr have been
+  // closed, with the outcome of the child. The status is not OK if the
+  // output of the child couldn't be read, or if the manager was shut down
+  // before the child completed.
+  //
+  // Called on the thread of the manager, so it must not block, or on the
+  // thread calling Shutdown(). Since Shutdown() joins the thread of the
+  // manager, it must not be called from the callback.
+  typedef std::function<void(const Status& s, const SubprocessResult& result)>
+      CompletionCallback;
+
+  explicit SubprocessManager(const SubprocessManagerOptions& opts = SubprocessManagerOptions());
+
+  // Calls Shutdown().
+  ~SubprocessManager();
+
+  // Starts the thread of the manager. Must be called once, before Launch().
+  Status Init();
+
+  // Starts 'proc', which must not have been started, and calls 'cb' once it
+  // has completed.
+  //
+  // The stdout and stderr of 'proc' are captured unless they have been
+  // disabled. If its stdin is piped (the default), 'stdin_data' is written
+  // to it and then it's closed.
+  //
+  // Returns an error, without calling 'cb', if the subprocess can't be
+  // started or if the manager was shut down.
+  Status Launch(std::unique_ptr<Subprocess> proc, std::string stdin_data,
+                CompletionCallback cb);
+
+  // Kills the children which are still running with SIGKILL, reaps them and
+  // calls their callbacks with an Aborted status, then stops the thread of
+  // the manager. Further calls to Launch() fail. Idempotent.
+  //
+  // Must not be called from a completion callback.
+  void Shutdown();
+
+  // Returns the number of children launched but not completed yet.
+  int num_running() const;
+
+ private:
+  struct Child;
+  struct Watch;
+
+  // The body of the thread of the manager.
+  void RunLoop();
+
+  // Starts watching 'child', which has been launched.
+  void Register(Child* child);
+
+  // Handle events on the fds of 'child'.
+  void WriteStdin(Child* child);
+  void ReadOutput(Child* child, int stream);
+
+  // Reaps 'child' if it has exited.
+  void Reap(Child* child);
+
+  // Stops watching '*fd', closes it and sets it to -1.
+  void CloseFd(int* fd);
+
+  // Whether 'child' has exited and its output has been read.
+  static bool IsComplete(const Child& child);
+
+  // Kills and reaps 'child' if needed, releases its resources and calls its
+  // callback with 's'.
+  void Finish(std::unique_ptr<Child> child, const Status& s);
+
+  void Wake();
+
+  const SubprocessManagerOptions opts_;
+
+  // The epoll instance, the eventfd which wakes it up, and the signalfd
+  // receiving SIGCHLD. -1 until Init().
+  int epoll_fd_;
+  int wake_fd_;
+  int signal_fd_;
+
+  // Identify wake_fd_ and signal_fd_ in the epoll events.
+  std::unique_ptr<Watch> wake_watch_;
+  std::unique_ptr<Watch> signal_watch_;
+
+  scoped_refptr<Thread> thread_;
+
+  // Protects the following fields.
+  mutable Mutex lock_;
+
+  // Launched children which haven't been registered by the thread yet.
+  std::vector<std::unique_ptr<Child>> pending_;
+
+  // The number of children launched and not finished.
+  int num_running_;
+
+  bool shutting_down_;
+
+  // The children registered by the thread. Only accessed by the thread,
+  // then by Shutdown() after it has been stopped.
+  std::unordered_map<Child*, std::unique_ptr<Child>> children_;
+
+  // The number of children in children_ without a pidfd, which must be
+  // polled for their exit. Only accessed by the thread.
+  int num_polled_;
+
+  DISALLOW_COPY_AND_ASSIGN(SubprocessManager);
+};
+
+} // namespace bb
+
+#endif // BBOY_BASE_PROCESS_SUBPROCESS_MANAGER_H_
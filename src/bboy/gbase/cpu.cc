@@ -39,6 +39,7 @@ CPU::CPU()
     has_avx_(false),
     has_avx2_(false),
     has_aesni_(false),
+    has_pclmulqdq_(false),
     has_non_stop_time_stamp_counter_(false),
     has_broken_neon_(false),
     cpu_vendor_("unknown") {
@@ -241,6 +242,7 @@ void CPU::Initialize() {
         (cpu_info[2] & 0x08000000) != 0 /* OSXSAVE */ &&
         (_xgetbv(0) & 6) == 6 /* XSAVE enabled by kernel */;
     has_aesni_ = (cpu_info[2] & 0x02000000) != 0;
+    has_pclmulqdq_ = (cpu_info[2] & 0x00000002) != 0;
     has_avx2_ = has_avx_ && (cpu_info7[1] & 0x00000020) != 0;
   }
 
@@ -47,6 +47,7 @@ class CPU {
   bool has_avx() const { return has_avx_; }
   bool has_avx2() const { return has_avx2_; }
   bool has_aesni() const { return has_aesni_; }
+  bool has_pclmulqdq() const { return has_pclmulqdq_; }
   bool has_non_stop_time_stamp_counter() const {
     return has_non_stop_time_stamp_counter_;
   }
@@ -79,6 +80,7 @@ class CPU {
   bool has_avx_;
   bool has_avx2_;
   bool has_aesni_;
+  bool has_pclmulqdq_;
   bool has_non_stop_time_stamp_counter_;
   bool has_broken_neon_;
   std::string cpu_vendor_;
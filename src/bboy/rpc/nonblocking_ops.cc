@@ -0,0 +1,168 @@
+#include "bboy/rpc/nonblocking_ops.h"
+
+#include <errno.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/message_lite.h>
+
+#include "bboy/gbase/endian.h"
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/rpc/constants.h"
+#include "bboy/base/net/socket.h"
+
+DEFINE_int32(rpc_max_message_size, (50 * 1024 * 1024),
+  "The maximum size of a message that any RPC that the server will accept. "
+  "Must be at least 1MB.");
+
+using google::protobuf::MessageLite;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using strings::Substitute;
+
+namespace bb {
+namespace rpc {
+
+namespace {
+
+// Socket::Read()/Write() report "would block" as EAGAIN, while TlsSocket
+// reports it as a successful zero-byte transfer. Fold both into Incomplete.
+bool IsWouldBlock(const Status& s) {
+  return Socket::IsTemporarySocketError(s.posix_code());
+}
+
+} // anonymous namespace
+
+///////////////////// FramedMessageReader
+
+FramedMessageReader::FramedMessageReader()
+    : total_length_(-1),
+      cur_offset_(0) {
+  buf_.resize(kMsgLengthPrefixLength);
+}
+
+void FramedMessageReader::Reset() {
+  buf_.resize(kMsgLengthPrefixLength);
+  total_length_ = -1;
+  cur_offset_ = 0;
+}
+
+bool FramedMessageReader::TransferFinished() const {
+  return total_length_ >= 0 && cur_offset_ == kMsgLengthPrefixLength + total_length_;
+}
+
+Status FramedMessageReader::ReadFrom(Socket* sock) {
+  while (!TransferFinished()) {
+    size_t nread = 0;
+    Status s = sock->Read(buf_.data() + cur_offset_, buf_.size() - cur_offset_, &nread);
+    if (PREDICT_FALSE(!s.ok())) {
+      if (IsWouldBlock(s)) {
+        return Status::Incomplete("frame not yet fully received");
+      }
+      return s;
+    }
+    if (nread == 0) {
+      return Status::Incomplete("frame not yet fully received");
+    }
+    cur_offset_ += nread;
+
+    if (total_length_ < 0 && cur_offset_ == kMsgLengthPrefixLength) {
+      uint32_t len = NetworkByteOrder::Load32(buf_.data());
+      if (PREDICT_FALSE(len > FLAGS_rpc_max_message_size)) {
+        return Status::NetworkError(
+            Substitute("the frame had a length of $0, but we only support "
+                       "messages up to $1 bytes long.",
+                       len, FLAGS_rpc_max_message_size));
+      }
+      total_length_ = len;
+      buf_.resize(kMsgLengthPrefixLength + total_length_);
+    }
+  }
+  return Status::OK();
+}
+
+Status FramedMessageReader::ParseMessage(MessageLite* header, Slice* param_buf) const {
+  DCHECK(TransferFinished());
+  const uint8_t* body = buf_.data() + kMsgLengthPrefixLength;
+  CodedInputStream in(body, total_length_);
+  in.SetTotalBytesLimit(FLAGS_rpc_max_message_size);
+
+  uint32_t header_len;
+  if (PREDICT_FALSE(!in.ReadVarint32(&header_len))) {
+    return Status::Corruption("invalid frame: unable to decode header length");
+  }
+  CodedInputStream::Limit l = in.PushLimit(header_len);
+  if (PREDICT_FALSE(!header->ParseFromCodedStream(&in))) {
+    return Status::Corruption("invalid frame: unable to parse header",
+                              header->InitializationErrorString());
+  }
+  in.PopLimit(l);
+
+  uint32_t param_len;
+  if (PREDICT_FALSE(!in.ReadVarint32(&param_len))) {
+    return Status::Corruption("invalid frame: unable to decode message length");
+  }
+  int pos = in.CurrentPosition();
+  if (PREDICT_FALSE(pos + param_len != total_length_)) {
+    return Status::Corruption(
+        Substitute("invalid frame: message length $0 does not match the "
+                   "remaining $1 bytes", param_len, total_length_ - pos));
+  }
+  *param_buf = Slice(body + pos, param_len);
+  return Status::OK();
+}
+
+///////////////////// FramedMessageWriter
+
+FramedMessageWriter::FramedMessageWriter()
+    : cur_offset_(0) {
+}
+
+Status FramedMessageWriter::Init(const MessageLite& header, const MessageLite& msg) {
+  DCHECK(header.IsInitialized()) << "header not initialized";
+  DCHECK(msg.IsInitialized()) << "message not initialized";
+  const uint32_t header_len = header.ByteSizeLong();
+  const uint32_t msg_len = msg.ByteSizeLong();
+  const uint32_t total_len = CodedOutputStream::VarintSize32(header_len) + header_len +
+                             CodedOutputStream::VarintSize32(msg_len) + msg_len;
+  if (PREDICT_FALSE(total_len > FLAGS_rpc_max_message_size)) {
+    return Status::InvalidArgument(
+        Substitute("frame of $0 bytes exceeds the maximum message size of $1 bytes",
+                   total_len, FLAGS_rpc_max_message_size));
+  }
+
+  buf_.resize(kMsgLengthPrefixLength + total_len);
+  uint8_t* dst = buf_.data();
+  NetworkByteOrder::Store32(dst, total_len);
+  dst += kMsgLengthPrefixLength;
+  dst = CodedOutputStream::WriteVarint32ToArray(header_len, dst);
+  dst = header.SerializeWithCachedSizesToArray(dst);
+  dst = CodedOutputStream::WriteVarint32ToArray(msg_len, dst);
+  dst = msg.SerializeWithCachedSizesToArray(dst);
+  DCHECK_EQ(dst - buf_.data(), buf_.size());
+
+  cur_offset_ = 0;
+  return Status::OK();
+}
+
+Status FramedMessageWriter::WriteTo(Socket* sock) {
+  while (!TransferFinished()) {
+    size_t nwritten = 0;
+    Status s = sock->Write(buf_.data() + cur_offset_, buf_.size() - cur_offset_, &nwritten);
+    if (PREDICT_FALSE(!s.ok())) {
+      if (IsWouldBlock(s)) {
+        return Status::Incomplete("frame not yet fully sent");
+      }
+      return s;
+    }
+    if (nwritten == 0) {
+      return Status::Incomplete("frame not yet fully sent");
+    }
+    cur_offset_ += nwritten;
+  }
+  return Status::OK();
+}
+
+} // namespace rpc
+} // namespace bb
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "bboy/gbase/macros.h"
+#include "bboy/base/faststring.h"
+#include "bboy/base/slice.h"
+#include "bboy/base/status.h"
+
+namespace google { namespace protobuf {
+class MessageLite;
+} // namespace protobuf
+} // namespace google
+
+namespace bb {
+
+class Socket;
+
+namespace rpc {
+
+// Non-blocking counterparts of SendFramedMessageBlocking() and
+// ReceiveFramedMessageBlocking() from blocking_ops.h, using the same wire
+// format:
+//
+//   [4-byte big-endian total length][varint header length][header]
+//   [varint message length][message]
+//
+// Neither class ever waits on the socket. Each call moves as many bytes as
+// the (non-blocking) socket accepts and returns Status::Incomplete when the
+// caller should come back on the next readiness event. This lets connection
+// negotiation (magic number, NegotiatePB rounds including the TLS handshake
+// messages produced by TlsHandshake::Continue(), token exchange) be driven
+// by a reactor as a state machine, instead of parking one negotiation-pool
+// thread per connection inside the blocking helpers. Only the CPU-heavy
+// steps (TLS key exchange, token signature verification) need to be handed
+// to a thread pool.
+
+// Accumulates one inbound frame across as many reads as it takes.
+class FramedMessageReader {
+ public:
+  FramedMessageReader();
+
+  // Read whatever part of the current frame is available on 'sock'.
+  //
+  // Returns OK once the whole frame has been received, Status::Incomplete if
+  // the socket ran out of data first, or a network/corruption error.
+  Status ReadFrom(Socket* sock) WARN_UNUSED_RESULT;
+
+  // Parse a completely received frame into 'header', pointing 'param_buf'
+  // at the serialized message body. 'param_buf' refers to memory owned by
+  // this reader and stays valid until the next Reset().
+  Status ParseMessage(google::protobuf::MessageLite* header,
+                      Slice* param_buf) const WARN_UNUSED_RESULT;
+
+  bool TransferStarted() const { return cur_offset_ > 0; }
+  bool TransferFinished() const;
+
+  // Prepare to receive the next frame.
+  void Reset();
+
+ private:
+  faststring buf_;
+
+  // Length of the frame body (not including the length prefix), or -1 if
+  // the prefix has not been fully received yet.
+  int32_t total_length_;
+  size_t cur_offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(FramedMessageReader);
+};
+
+// Holds one serialized outbound frame and writes it out across as many
+// calls as the socket requires.
+class FramedMessageWriter {
+ public:
+  FramedMessageWriter();
+
+  // Serialize 'header' and 'msg' into a frame, replacing any previous one.
+  Status Init(const google::protobuf::MessageLite& header,
+              const google::protobuf::MessageLite& msg) WARN_UNUSED_RESULT;
+
+  // Write as much of the frame as 'sock' accepts.
+  //
+  // Returns OK once the whole frame has been sent, Status::Incomplete if the
+  // socket buffer filled up first, or a network error.
+  Status WriteTo(Socket* sock) WARN_UNUSED_RESULT;
+
+  bool TransferFinished() const { return cur_offset_ == buf_.size(); }
+
+ private:
+  faststring buf_;
+  size_t cur_offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(FramedMessageWriter);
+};
+
+} // namespace rpc
+} // namespace bb
@@ -24,11 +24,14 @@
 #include "bboy/security/openssl_util.h"
 #include "bboy/base/scoped_cleanup.h"
 #include "bboy/base/status.h"
+#include "bboy/base/sync/countdown_latch.h"
+#include "bboy/base/thread/threadpool.h"
 
 using std::lock_guard;
 using std::move;
 using std::ostringstream;
 using std::string;
+using std::vector;
 using strings::Substitute;
 
 namespace bb {
@@ -272,6 +275,63 @@ Status CertSigner::Sign(const CertSignRequest& req, Cert* ret) const {
   if (ca_cert_) {
     RETURN_NOT_OK(ca_cert_->CheckKeyMatch(*ca_private_key_));
   }
+  return SignUnchecked(req, ret);
+}
+
+Status CertSigner::SignBatch(const vector<const CertSignRequest*>& reqs,
+                             ThreadPool* pool,
+                             vector<Cert>* certs,
+                             vector<Status>* statuses) const {
+  InitializeOpenSSL();
+  CHECK(certs);
+  CHECK(statuses);
+  certs->clear();
+  statuses->clear();
+
+  // The CA cert and key are shared by all the requests in the batch,
+  // so it's enough to check them only once.
+  if (ca_cert_) {
+    RETURN_NOT_OK(ca_cert_->CheckKeyMatch(*ca_private_key_));
+  }
+  certs->resize(reqs.size());
+  statuses->resize(reqs.size());
+
+  auto sign_one = [&](size_t i) {
+    const CertSignRequest* req = CHECK_NOTNULL(reqs[i]);
+    Status s = VerifyRequest(req->GetRawData());
+    if (s.ok()) {
+      s = SignUnchecked(*req, &(*certs)[i]);
+    }
+    (*statuses)[i] = std::move(s);
+  };
+
+  if (!pool) {
+    for (size_t i = 0; i < reqs.size(); ++i) {
+      sign_one(i);
+    }
+    return Status::OK();
+  }
+
+  CountDownLatch latch(reqs.size());
+  for (size_t i = 0; i < reqs.size(); ++i) {
+    Status s = pool->SubmitFunc([&sign_one, &latch, i]() {
+      sign_one(i);
+      latch.CountDown();
+    });
+    if (!s.ok()) {
+      // The pool is at capacity or shutting down: sign the request in this
+      // thread rather than failing it.
+      sign_one(i);
+      latch.CountDown();
+    }
+  }
+  latch.Wait();
+
+  return Status::OK();
+}
+
+Status CertSigner::SignUnchecked(const CertSignRequest& req, Cert* ret) const {
+  CHECK(ret);
   auto x509 = ssl_make_unique(X509_new());
   RETURN_NOT_OK(FillCertTemplateFromRequest(req.GetRawData(), x509.get()));
   RETURN_NOT_OK(DoSign(EVP_sha256(), exp_interval_sec_, x509.get()));
@@ -352,6 +412,22 @@ Status CertSigner::GenerateSerial(c_unique_ptr<ASN1_INTEGER>* ret) {
   return Status::OK();
 }
 
+// Check that the request is signed by the private key matching the public
+// key it carries, i.e. that the requestor actually possesses that key.
+Status CertSigner::VerifyRequest(X509_REQ* req) {
+  CHECK(req);
+  auto pub_key = ssl_make_unique(X509_REQ_get_pubkey(req));
+  OPENSSL_RET_IF_NULL(pub_key, "error extracting public key from CSR");
+  const int rc = X509_REQ_verify(req, pub_key.get());
+  if (rc < 0) {
+    return Status::RuntimeError("error verifying CSR signature", GetOpenSSLErrors());
+  }
+  if (rc == 0) {
+    return Status::NotAuthorized("CSR signature does not match its public key");
+  }
+  return Status::OK();
+}
+
 Status CertSigner::DoSign(const EVP_MD* digest, int32_t exp_seconds,
                           X509* ret) const {
   CHECK(ret);
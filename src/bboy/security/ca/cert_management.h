@@ -27,6 +27,9 @@ typedef struct X509_req_st X509_REQ;
 struct stack_st_X509_EXTENSION; // STACK_OF(X509_EXTENSION)
 
 namespace bb {
+
+class ThreadPool;
+
 namespace security {
 
 class Cert;
@@ -125,7 +128,9 @@ class CaCertRequestGenerator : public CertRequestGeneratorBase {
 //      .set_expiration_interval(MonoDelta::FromSeconds(3600))
 //      .Sign(csr, &cert));
 //
-// As such, this class is not guaranteed thread-safe.
+// As such, the setters of this class are not thread-safe. Once configured,
+// Sign() and SignBatch() may be called concurrently from multiple threads:
+// they only read the CA cert and key.
 class CertSigner {
  public:
   // Generate a self-signed certificate authority using the given key
@@ -160,12 +165,30 @@ class CertSigner {
 
   Status Sign(const CertSignRequest& req, Cert* ret) const WARN_UNUSED_RESULT;
 
+  // Verify and sign a batch of CSRs. If 'pool' is not null, the requests are
+  // signed in parallel on its threads; otherwise they are signed in the
+  // calling thread. Before signing, the self-signature of every request is
+  // checked against its public key.
+  //
+  // On return, 'certs' and 'statuses' have the same size as 'reqs', and
+  // (*certs)[i] is valid iff (*statuses)[i] is OK. A non-OK return value
+  // indicates an error affecting the whole batch (e.g. a mismatch between
+  // the CA cert and key), in which case nothing has been signed.
+  Status SignBatch(const std::vector<const CertSignRequest*>& reqs,
+                   ThreadPool* pool,
+                   std::vector<Cert>* certs,
+                   std::vector<Status>* statuses) const WARN_UNUSED_RESULT;
+
  private:
 
   static Status CopyExtensions(X509_REQ* req, X509* x) WARN_UNUSED_RESULT;
   static Status FillCertTemplateFromRequest(X509_REQ* req, X509* tmpl) WARN_UNUSED_RESULT;
   static Status DigestSign(const EVP_MD* md, EVP_PKEY* pkey, X509* x) WARN_UNUSED_RESULT;
   static Status GenerateSerial(c_unique_ptr<ASN1_INTEGER>* ret) WARN_UNUSED_RESULT;
+  static Status VerifyRequest(X509_REQ* req) WARN_UNUSED_RESULT;
+
+  // Sign 'req' without checking that the CA cert and key match.
+  Status SignUnchecked(const CertSignRequest& req, Cert* ret) const WARN_UNUSED_RESULT;
 
   Status DoSign(const EVP_MD* digest, int32_t exp_seconds, X509 *ret) const WARN_UNUSED_RESULT;
 
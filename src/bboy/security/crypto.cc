@@ -5,9 +5,13 @@
 #include <cstdlib>
 #include <string>
 
+#include <strings.h>
+
 #include <glog/logging.h>
 #include <openssl/bio.h>
+#include <openssl/ec.h>
 #include <openssl/evp.h>
+#include <openssl/obj_mac.h>
 #include <openssl/pem.h>
 
 #include "bboy/gbase/strings/substitute.h"
@@ -21,47 +25,78 @@ using strings::Substitute;
 namespace bb {
 namespace security {
 
+template<> struct SslTypeTraits<BIGNUM> {
+  static constexpr auto free = &BN_free;
+};
+template<> struct SslTypeTraits<RSA> {
+  static constexpr auto free = &RSA_free;
+};
+template<> struct SslTypeTraits<EC_KEY> {
+  static constexpr auto free = &EC_KEY_free;
+};
+template<> struct SslTypeTraits<EVP_PKEY_CTX> {
+  static constexpr auto free = &EVP_PKEY_CTX_free;
+};
+
 namespace {
 
+bool IsRsaKey(EVP_PKEY* key) {
+  return EVP_PKEY_base_id(key) == EVP_PKEY_RSA;
+}
+
+bool IsEd25519Key(EVP_PKEY* key) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  return EVP_PKEY_base_id(key) == EVP_PKEY_ED25519;
+#else
+  return false;
+#endif
+}
+
 // Writing the private key from an EVP_PKEY has a different
 // signature than the rest of the write functions, so we
-// have to provide this wrapper.
+// have to provide this wrapper. RSA keys are written in the
+// traditional PKCS#1 form for compatibility with keys written
+// by older versions; other key types use PKCS#8.
 int PemWritePrivateKey(BIO* bio, EVP_PKEY* key) {
+  if (!IsRsaKey(key)) {
+    return PEM_write_bio_PrivateKey(
+        bio, key, nullptr, nullptr, 0, nullptr, nullptr);
+  }
   auto rsa = ssl_make_unique(EVP_PKEY_get1_RSA(key));
   return PEM_write_bio_RSAPrivateKey(
       bio, rsa.get(), nullptr, nullptr, 0, nullptr, nullptr);
 }
 
 int PemWritePublicKey(BIO* bio, EVP_PKEY* key) {
+  if (!IsRsaKey(key)) {
+    return PEM_write_bio_PUBKEY(bio, key);
+  }
   auto rsa = ssl_make_unique(EVP_PKEY_get1_RSA(key));
   return PEM_write_bio_RSA_PUBKEY(bio, rsa.get());
 }
 
 int DerWritePublicKey(BIO* bio, EVP_PKEY* key) {
+  if (!IsRsaKey(key)) {
+    return i2d_PUBKEY_bio(bio, key);
+  }
   auto rsa = ssl_make_unique(EVP_PKEY_get1_RSA(key));
   return i2d_RSA_PUBKEY_bio(bio, rsa.get());
 }
 
 } // anonymous namespace
 
-template<> struct SslTypeTraits<BIGNUM> {
-  static constexpr auto free = &BN_free;
-};
-struct RsaPrivateKeyTraits : public SslTypeTraits<EVP_PKEY> {
+struct PrivateKeyTraits : public SslTypeTraits<EVP_PKEY> {
   static constexpr auto read_pem = &PEM_read_bio_PrivateKey;
   static constexpr auto read_der = &d2i_PrivateKey_bio;
   static constexpr auto write_pem = &PemWritePrivateKey;
   static constexpr auto write_der = &i2d_PrivateKey_bio;
 };
-struct RsaPublicKeyTraits : public SslTypeTraits<EVP_PKEY> {
+struct PublicKeyTraits : public SslTypeTraits<EVP_PKEY> {
   static constexpr auto read_pem = &PEM_read_bio_PUBKEY;
   static constexpr auto read_der = &d2i_PUBKEY_bio;
   static constexpr auto write_pem = &PemWritePublicKey;
   static constexpr auto write_der = &DerWritePublicKey;
 };
-template<> struct SslTypeTraits<RSA> {
-  static constexpr auto free = &RSA_free;
-};
 template<> struct SslTypeTraits<EVP_MD_CTX> {
   static constexpr auto free = &EVP_MD_CTX_destroy;
 };
@@ -78,24 +113,36 @@ const EVP_MD* GetMessageDigest(DigestType digest_type) {
 
 } // anonymous namespace
 
+Status ParseKeyType(const string& name, KeyType* type) {
+  if (strcasecmp(name.c_str(), "rsa") == 0) {
+    *type = KeyType::RSA;
+  } else if (strcasecmp(name.c_str(), "ecdsa") == 0) {
+    *type = KeyType::ECDSA;
+  } else if (strcasecmp(name.c_str(), "ed25519") == 0) {
+    *type = KeyType::ED25519;
+  } else {
+    return Status::InvalidArgument("unknown key type", name);
+  }
+  return Status::OK();
+}
 
 Status PublicKey::FromString(const std::string& data, DataFormat format) {
-  return security::FromString<RawDataType, RsaPublicKeyTraits>(
+  return security::FromString<RawDataType, PublicKeyTraits>(
       data, format, &data_);
 }
 
 Status PublicKey::ToString(std::string* data, DataFormat format) const {
-  return security::ToString<RawDataType, RsaPublicKeyTraits>(
+  return security::ToString<RawDataType, PublicKeyTraits>(
       data, format, data_.get());
 }
 
 Status PublicKey::FromFile(const std::string& fpath, DataFormat format) {
-  return security::FromFile<RawDataType, RsaPublicKeyTraits>(
+  return security::FromFile<RawDataType, PublicKeyTraits>(
       fpath, format, &data_);
 }
 
 Status PublicKey::FromBIO(BIO* bio, DataFormat format) {
-  return security::FromBIO<RawDataType, RsaPublicKeyTraits>(
+  return security::FromBIO<RawDataType, PublicKeyTraits>(
       bio, format, &data_);
 }
 
@@ -103,13 +150,7 @@ Status PublicKey::FromBIO(BIO* bio, DataFormat format) {
 Status PublicKey::VerifySignature(DigestType digest,
                                   const std::string& data,
                                   const std::string& signature) const {
-  const EVP_MD* md = GetMessageDigest(digest);
   auto md_ctx = ssl_make_unique(EVP_MD_CTX_create());
-
-  OPENSSL_RET_NOT_OK(EVP_DigestVerifyInit(md_ctx.get(), nullptr, md, nullptr, GetRawData()),
-                     "error initializing verification digest");
-  OPENSSL_RET_NOT_OK(EVP_DigestVerifyUpdate(md_ctx.get(), data.data(), data.size()),
-                     "error verifying data signature");
 #if OPENSSL_VERSION_NUMBER < 0x10002000L
   unsigned char* sig_data = reinterpret_cast<unsigned char*>(
       const_cast<char*>(signature.data()));
@@ -117,9 +158,30 @@ Status PublicKey::VerifySignature(DigestType digest,
   const unsigned char* sig_data = reinterpret_cast<const unsigned char*>(
       signature.data());
 #endif
+  int rc = -1;
+  if (IsEd25519Key(GetRawData())) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    // EdDSA does not support the streaming interface: the message is hashed
+    // as a part of the signature algorithm itself.
+    OPENSSL_RET_NOT_OK(EVP_DigestVerifyInit(md_ctx.get(), nullptr, nullptr, nullptr,
+                                            GetRawData()),
+                       "error initializing verification digest");
+    rc = EVP_DigestVerify(md_ctx.get(), sig_data, signature.size(),
+                          reinterpret_cast<const unsigned char*>(data.data()),
+                          data.size());
+#else
+    LOG(FATAL) << "Ed25519 keys are not supported by this OpenSSL version";
+#endif
+  } else {
+    const EVP_MD* md = GetMessageDigest(digest);
+    OPENSSL_RET_NOT_OK(EVP_DigestVerifyInit(md_ctx.get(), nullptr, md, nullptr, GetRawData()),
+                       "error initializing verification digest");
+    OPENSSL_RET_NOT_OK(EVP_DigestVerifyUpdate(md_ctx.get(), data.data(), data.size()),
+                       "error verifying data signature");
+    rc = EVP_DigestVerifyFinal(md_ctx.get(), sig_data, signature.size());
+  }
   // The success is indicated by return code 1. All other values means
   // either wrong signature or error while performing signature verification.
-  const int rc = EVP_DigestVerifyFinal(md_ctx.get(), sig_data, signature.size());
   if (rc < 0 || rc > 1) {
     return Status::RuntimeError(
         Substitute("error verifying data signature: $0",
@@ -150,17 +212,17 @@ Status PublicKey::Equals(const PublicKey& other, bool* equals) const {
 }
 
 Status PrivateKey::FromString(const std::string& data, DataFormat format) {
-  return security::FromString<RawDataType, RsaPrivateKeyTraits>(
+  return security::FromString<RawDataType, PrivateKeyTraits>(
       data, format, &data_);
 }
 
 Status PrivateKey::ToString(std::string* data, DataFormat format) const {
-  return security::ToString<RawDataType, RsaPrivateKeyTraits>(
+  return security::ToString<RawDataType, PrivateKeyTraits>(
       data, format, data_.get());
 }
 
 Status PrivateKey::FromFile(const std::string& fpath, DataFormat format) {
-  return security::FromFile<RawDataType, RsaPrivateKeyTraits>(
+  return security::FromFile<RawDataType, PrivateKeyTraits>(
       fpath, format, &data_);
 }
 
@@ -169,15 +231,11 @@ Status PrivateKey::FromFile(const std::string& fpath, DataFormat format) {
 // keypair.
 Status PrivateKey::GetPublicKey(PublicKey* public_key) const {
   CHECK(public_key);
-  auto rsa = ssl_make_unique(EVP_PKEY_get1_RSA(CHECK_NOTNULL(data_.get())));
-  if (PREDICT_FALSE(!rsa)) {
-    return Status::RuntimeError(GetOpenSSLErrors());
-  }
   auto tmp = ssl_make_unique(BIO_new(BIO_s_mem()));
   CHECK(tmp);
   // Export public key in DER format into the temporary buffer.
-  OPENSSL_RET_NOT_OK(i2d_RSA_PUBKEY_bio(tmp.get(), rsa.get()),
-      "error extracting public RSA key");
+  OPENSSL_RET_NOT_OK(DerWritePublicKey(tmp.get(), CHECK_NOTNULL(data_.get())),
+      "error extracting public key");
   // Read the public key into the result placeholder.
   RETURN_NOT_OK(public_key->FromBIO(tmp.get(), DataFormat::DER));
 
@@ -189,19 +247,34 @@ Status PrivateKey::MakeSignature(DigestType digest,
                                  const std::string& data,
                                  std::string* signature) const {
   CHECK(signature);
-  const EVP_MD* md = GetMessageDigest(digest);
   auto md_ctx = ssl_make_unique(EVP_MD_CTX_create());
-
-  OPENSSL_RET_NOT_OK(EVP_DigestSignInit(md_ctx.get(), nullptr, md, nullptr, GetRawData()),
-                     "error initializing signing digest");
-  OPENSSL_RET_NOT_OK(EVP_DigestSignUpdate(md_ctx.get(), data.data(), data.size()),
-                     "error signing data");
   size_t sig_len = EVP_PKEY_size(GetRawData());
   static const size_t kSigBufSize = 4 * 1024;
   CHECK(sig_len <= kSigBufSize);
   unsigned char buf[kSigBufSize];
-  OPENSSL_RET_NOT_OK(EVP_DigestSignFinal(md_ctx.get(), buf, &sig_len),
-                     "error finalizing data signature");
+
+  if (IsEd25519Key(GetRawData())) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    // See the comment in PublicKey::VerifySignature().
+    OPENSSL_RET_NOT_OK(EVP_DigestSignInit(md_ctx.get(), nullptr, nullptr, nullptr,
+                                          GetRawData()),
+                       "error initializing signing digest");
+    OPENSSL_RET_NOT_OK(EVP_DigestSign(md_ctx.get(), buf, &sig_len,
+                                      reinterpret_cast<const unsigned char*>(data.data()),
+                                      data.size()),
+                       "error signing data");
+#else
+    LOG(FATAL) << "Ed25519 keys are not supported by this OpenSSL version";
+#endif
+  } else {
+    const EVP_MD* md = GetMessageDigest(digest);
+    OPENSSL_RET_NOT_OK(EVP_DigestSignInit(md_ctx.get(), nullptr, md, nullptr, GetRawData()),
+                       "error initializing signing digest");
+    OPENSSL_RET_NOT_OK(EVP_DigestSignUpdate(md_ctx.get(), data.data(), data.size()),
+                       "error signing data");
+    OPENSSL_RET_NOT_OK(EVP_DigestSignFinal(md_ctx.get(), buf, &sig_len),
+                       "error finalizing data signature");
+  }
   *signature = string(reinterpret_cast<char*>(buf), sig_len);
 
   return Status::OK();
@@ -226,5 +299,50 @@ Status GeneratePrivateKey(int num_bits, PrivateKey* ret) {
   return Status::OK();
 }
 
+Status GeneratePrivateKey(KeyType type, int num_bits, PrivateKey* ret) {
+  CHECK(ret);
+  switch (type) {
+    case KeyType::RSA:
+      return GeneratePrivateKey(num_bits, ret);
+    case KeyType::ECDSA: {
+      InitializeOpenSSL();
+      auto key = ssl_make_unique(EVP_PKEY_new());
+      auto ec = ssl_make_unique(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+      if (!ec) {
+        return Status::RuntimeError("error creating EC key", GetOpenSSLErrors());
+      }
+      // Encode the curve by name rather than by explicit parameters, so the
+      // DER/PEM output is the compact form expected by other implementations.
+      EC_KEY_set_asn1_flag(ec.get(), OPENSSL_EC_NAMED_CURVE);
+      OPENSSL_RET_NOT_OK(EC_KEY_generate_key(ec.get()), "error generating EC key");
+      OPENSSL_RET_NOT_OK(EVP_PKEY_set1_EC_KEY(key.get(), ec.get()),
+                         "error assigning EC key");
+      ret->AdoptRawData(key.release());
+      return Status::OK();
+    }
+    case KeyType::ED25519: {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+      InitializeOpenSSL();
+      auto ctx = ssl_make_unique(EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, nullptr));
+      if (!ctx) {
+        return Status::RuntimeError("error creating Ed25519 key context",
+                                    GetOpenSSLErrors());
+      }
+      OPENSSL_RET_NOT_OK(EVP_PKEY_keygen_init(ctx.get()),
+                         "error initializing Ed25519 key generation");
+      EVP_PKEY* raw_key = nullptr;
+      OPENSSL_RET_NOT_OK(EVP_PKEY_keygen(ctx.get(), &raw_key),
+                         "error generating Ed25519 key");
+      ret->AdoptRawData(raw_key);
+      return Status::OK();
+#else
+      return Status::NotSupported(
+          "Ed25519 keys require OpenSSL 1.1.1 or newer");
+#endif
+    }
+  }
+  LOG(FATAL) << "unknown key type";
+}
+
 } // namespace security
 } // namespace bb
@@ -20,8 +20,20 @@ enum class DigestType {
   SHA512,
 };
 
-// A class with generic public key interface, but actually it represents
-// an RSA key.
+// Supported asymmetric key algorithms.
+enum class KeyType {
+  RSA,
+  // ECDSA over the NIST P-256 curve.
+  ECDSA,
+  // EdDSA over Curve25519. Requires OpenSSL 1.1.1 or newer.
+  ED25519,
+};
+
+// Parses 'name' ("rsa", "ecdsa" or "ed25519", case-insensitive) into 'type'.
+Status ParseKeyType(const std::string& name, KeyType* type) WARN_UNUSED_RESULT;
+
+// A class with generic public key interface: it represents an RSA, ECDSA
+// or Ed25519 public key.
 class PublicKey : public RawDataWrapper<EVP_PKEY> {
  public:
   ~PublicKey() {}
@@ -35,6 +47,8 @@ class PublicKey : public RawDataWrapper<EVP_PKEY> {
   // Using the key, verify data signature using the specified message
   // digest algorithm for signature verification.
   // The input signature should be in in raw format (i.e. no base64 encoding).
+  // Ed25519 signatures are computed over the whole message, so 'digest' is
+  // ignored for such keys.
   Status VerifySignature(DigestType digest,
                          const std::string& data,
                          const std::string& signature) const WARN_UNUSED_RESULT;
@@ -43,8 +57,8 @@ class PublicKey : public RawDataWrapper<EVP_PKEY> {
   Status Equals(const PublicKey& other, bool* equals) const WARN_UNUSED_RESULT;
 };
 
-// A class with generic private key interface, but actually it represents
-// an RSA private key. It's important to have PrivateKey and PublicKey
+// A class with generic private key interface: it represents an RSA, ECDSA
+// or Ed25519 private key. It's important to have PrivateKey and PublicKey
 // be different types to avoid accidental leakage of private keys.
 class PrivateKey : public RawDataWrapper<EVP_PKEY> {
  public:
@@ -59,14 +73,20 @@ class PrivateKey : public RawDataWrapper<EVP_PKEY> {
 
   // Using the key, generate data signature using the specified
   // message digest algorithm. The result signature is in raw format
-  // (i.e. no base64 encoding).
+  // (i.e. no base64 encoding). As with PublicKey::VerifySignature(),
+  // 'digest' is ignored for Ed25519 keys.
   Status MakeSignature(DigestType digest,
                        const std::string& data,
                        std::string* signature) const WARN_UNUSED_RESULT;
 };
 
-// Utility method to generate private keys.
+// Utility method to generate RSA private keys.
 Status GeneratePrivateKey(int num_bits, PrivateKey* ret) WARN_UNUSED_RESULT;
 
+// Utility method to generate private keys of the specified type. The
+// 'num_bits' parameter is only used for RSA keys: EC keys have a fixed size
+// determined by the curve.
+Status GeneratePrivateKey(KeyType type, int num_bits, PrivateKey* ret) WARN_UNUSED_RESULT;
+
 } // namespace security
 } // namespace bb
@@ -0,0 +1,108 @@
+#include "bboy/security/key_pregenerator.h"
+
+#include <utility>
+
+#include <glog/logging.h>
+
+#include "bboy/base/thread/threadpool.h"
+
+using std::string;
+using std::unique_ptr;
+
+namespace bb {
+namespace security {
+
+KeyPregenerator::KeyPregenerator(string name, KeyType type, int num_bits,
+                                 int num_keys, bool replenish)
+    : name_(std::move(name)),
+      type_(type),
+      num_bits_(num_bits),
+      num_keys_(num_keys),
+      replenish_(replenish),
+      generated_(&lock_),
+      num_in_flight_(0) {
+  CHECK_GT(num_bits_, 0);
+  CHECK_GE(num_keys_, 0);
+}
+
+KeyPregenerator::~KeyPregenerator() {
+  if (pool_) {
+    pool_->Shutdown();
+  }
+}
+
+Status KeyPregenerator::Start() {
+  CHECK(!pool_);
+  // A single worker is enough: key generation is CPU-bound and the point is
+  // to move it off the caller's path, not to compete with the server's work.
+  RETURN_NOT_OK(ThreadPoolBuilder(name_)
+                .set_min_threads(0)
+                .set_max_threads(1)
+                .Build(&pool_));
+  MutexLock l(lock_);
+  ScheduleGenerationUnlocked();
+  return Status::OK();
+}
+
+Status KeyPregenerator::GetKey(unique_ptr<PrivateKey>* key) {
+  {
+    MutexLock l(lock_);
+    while (ready_keys_.empty() && num_in_flight_ > 0) {
+      generated_.Wait();
+    }
+    if (!ready_keys_.empty()) {
+      *key = std::move(ready_keys_.front());
+      ready_keys_.pop_front();
+      if (replenish_) {
+        ScheduleGenerationUnlocked();
+      }
+      return Status::OK();
+    }
+    if (!last_error_.ok()) {
+      LOG(WARNING) << name_ << ": background key generation failed, "
+                   << "generating key synchronously: " << last_error_.ToString();
+      last_error_ = Status::OK();
+    }
+    if (replenish_) {
+      ScheduleGenerationUnlocked();
+    }
+  }
+
+  unique_ptr<PrivateKey> new_key(new PrivateKey());
+  RETURN_NOT_OK(GeneratePrivateKey(type_, num_bits_, new_key.get()));
+  *key = std::move(new_key);
+  return Status::OK();
+}
+
+void KeyPregenerator::ScheduleGenerationUnlocked() {
+  lock_.AssertAcquired();
+  if (!pool_) {
+    return;
+  }
+  while (static_cast<int>(ready_keys_.size()) + num_in_flight_ < num_keys_) {
+    Status s = pool_->SubmitFunc([this]() { this->GenerateOne(); });
+    if (!s.ok()) {
+      // The pool is shutting down: callers fall back to synchronous generation.
+      VLOG(1) << name_ << ": could not schedule key generation: " << s.ToString();
+      return;
+    }
+    ++num_in_flight_;
+  }
+}
+
+void KeyPregenerator::GenerateOne() {
+  unique_ptr<PrivateKey> key(new PrivateKey());
+  Status s = GeneratePrivateKey(type_, num_bits_, key.get());
+
+  MutexLock l(lock_);
+  --num_in_flight_;
+  if (s.ok()) {
+    ready_keys_.emplace_back(std::move(key));
+  } else {
+    last_error_ = std::move(s);
+  }
+  generated_.Broadcast();
+}
+
+} // namespace security
+} // namespace bb
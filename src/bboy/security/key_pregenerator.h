@@ -0,0 +1,80 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "bboy/gbase/gscoped_ptr.h"
+#include "bboy/gbase/macros.h"
+#include "bboy/security/crypto.h"
+#include "bboy/base/status.h"
+#include "bboy/base/sync/condition_variable.h"
+#include "bboy/base/sync/mutex.h"
+
+namespace bb {
+
+class ThreadPool;
+
+namespace security {
+
+// Generates private keys ahead of time on a background thread, so that
+// callers which need a fresh key (TSK rotation, self-signed server certs) do
+// not have to pay the cost of key generation inline (multiple seconds for
+// RSA keys).
+//
+// Up to 'num_keys' generated keys are kept ready. If 'replenish' is true, every
+// key handed out by GetKey() is replaced in the background; otherwise the
+// generator is exhausted once the initial batch has been consumed.
+//
+// This class is thread-safe.
+class KeyPregenerator {
+ public:
+  // See GeneratePrivateKey() for the meaning of 'type' and 'num_bits'.
+  KeyPregenerator(std::string name, KeyType type, int num_bits, int num_keys,
+                  bool replenish);
+
+  // Stops background generation. Waits for a key generation which is already
+  // in progress, but drops the queued ones.
+  ~KeyPregenerator();
+
+  // Start generating keys in the background.
+  Status Start() WARN_UNUSED_RESULT;
+
+  // Output a freshly generated key into 'key'. If a pre-generated key is ready
+  // it is returned right away; if one is being generated, waits for it to
+  // complete. Otherwise, the key is generated synchronously.
+  Status GetKey(std::unique_ptr<PrivateKey>* key) WARN_UNUSED_RESULT;
+
+  KeyType key_type() const { return type_; }
+  int num_bits() const { return num_bits_; }
+
+ private:
+  // Schedule background generation to bring the number of ready and in-flight
+  // keys up to 'num_keys_'. Must be called with 'lock_' held.
+  void ScheduleGenerationUnlocked();
+
+  // Body of the background task: generates one key and queues it.
+  void GenerateOne();
+
+  const std::string name_;
+  const KeyType type_;
+  const int num_bits_;
+  const int num_keys_;
+  const bool replenish_;
+
+  gscoped_ptr<ThreadPool> pool_;
+
+  // Protects the members below.
+  Mutex lock_;
+  // Signalled whenever a background generation completes.
+  ConditionVariable generated_;
+  std::deque<std::unique_ptr<PrivateKey>> ready_keys_;
+  int num_in_flight_;
+  // The status of the most recent failed background generation, if any.
+  Status last_error_;
+
+  DISALLOW_COPY_AND_ASSIGN(KeyPregenerator);
+};
+
+} // namespace security
+} // namespace bb
@@ -15,6 +15,7 @@
 #include "bboy/security/cert.h"
 #include "bboy/security/crypto.h"
 #include "bboy/security/init.h"
+#include "bboy/security/key_pregenerator.h"
 #include "bboy/security/openssl_util.h"
 #include "bboy/security/tls_handshake.h"
 #include "bboy/base/net/net_util.h"
@@ -29,6 +30,11 @@ DEFINE_int32(ipki_server_key_size, 2048,
              "the number of bits for server cert's private key. The server cert "
              "is used for TLS connections to and from clients and other servers.");
 
+DEFINE_int32(rpc_tls_verified_cert_cache_capacity, 1024,
+             "Maximum number of peer certificates whose successful chain "
+             "verification is remembered, so that repeated connections from "
+             "the same peer skip the verification. Set to 0 to disable.");
+
 DEFINE_string(rpc_tls_ciphers,
               // This is the "modern compatibility" cipher list of the Mozilla Security
               // Server Side TLS recommendations, accessed Feb. 2017, with the addition of
@@ -65,12 +71,37 @@ template<> struct SslTypeTraits<X509_STORE_CTX> {
   static constexpr auto free = &X509_STORE_CTX_free;
 };
 
+namespace {
+
+// Cached chain verification results are not reused within this interval
+// before the cert's expiration, so an expiring cert gets re-verified (and
+// rejected once it's expired) by OpenSSL.
+const int64_t kVerifiedCertExpiryMarginSecs = 5 * 60;
+
+// Outputs the SHA-256 digest of the DER encoding of 'cert'.
+bool GetCertFingerprint(X509* cert, string* fingerprint) {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  if (X509_digest(cert, EVP_sha256(), md, &len) != 1) {
+    ERR_clear_error();
+    return false;
+  }
+  fingerprint->assign(reinterpret_cast<const char*>(md), len);
+  return true;
+}
+
+} // anonymous namespace
+
 TlsContext::TlsContext()
     : trusted_cert_count_(0),
-      has_cert_(false) {
+      has_cert_(false),
+      trust_generation_(0) {
   security::InitializeOpenSSL();
 }
 
+TlsContext::~TlsContext() {
+}
+
 Status TlsContext::Init() {
   CHECK(!ctx_);
 
@@ -140,12 +171,126 @@ Status TlsContext::Init() {
 #endif
 #endif
 
+  if (FLAGS_rpc_tls_verified_cert_cache_capacity > 0) {
+    SSL_CTX_set_cert_verify_callback(ctx_.get(), &TlsContext::VerifyCertCallback, this);
+  }
+
   // TODO(PKI): is it possible to disable client-side renegotiation? it seems there
   // have been various CVEs related to this feature that we don't need.
   return Status::OK();
 }
 
+int TlsContext::VerifyCertCallback(X509_STORE_CTX* store_ctx, void* arg) {
+  auto* self = static_cast<TlsContext*>(arg);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  X509* cert = store_ctx->cert;
+#else
+  X509* cert = X509_STORE_CTX_get0_cert(store_ctx);
+#endif
+  string key;
+  uint64_t trust_generation;
+  bool cacheable = cert && self->GetVerifiedCertKey(store_ctx, &key, &trust_generation);
+  if (cacheable && self->IsVerifiedCertCached(key)) {
+    return 1;
+  }
+  int rc = X509_verify_cert(store_ctx);
+  if (rc == 1 && cacheable) {
+    self->CacheVerifiedCert(key, trust_generation, cert);
+  }
+  return rc;
+}
+
+bool TlsContext::GetVerifiedCertKey(X509_STORE_CTX* store_ctx, string* key,
+                                    uint64_t* trust_generation) const {
+  // The role of this end of the handshake determines the purpose the peer's
+  // cert is verified for: a server verifies client certs and vice versa.
+  auto* ssl = static_cast<SSL*>(
+      X509_STORE_CTX_get_ex_data(store_ctx, SSL_get_ex_data_X509_STORE_CTX_idx()));
+  if (!ssl) {
+    return false;
+  }
+#if OPENSSL_VERSION_NUMBER < 0x10002000L
+  const bool is_server = ssl->server;
+#else
+  const bool is_server = SSL_is_server(ssl);
+#endif
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  X509* cert = store_ctx->cert;
+  STACK_OF(X509)* chain = store_ctx->untrusted;
+#else
+  X509* cert = X509_STORE_CTX_get0_cert(store_ctx);
+  STACK_OF(X509)* chain = X509_STORE_CTX_get0_untrusted(store_ctx);
+#endif
+  {
+    MutexLock lock(verified_certs_lock_);
+    *trust_generation = trust_generation_;
+  }
+  key->clear();
+  key->push_back(is_server ? 'c' : 's');
+  key->append(reinterpret_cast<const char*>(trust_generation), sizeof(*trust_generation));
+
+  // The leaf, then the chain the peer presented: the same leaf with another
+  // chain may not verify.
+  string fingerprint;
+  if (!GetCertFingerprint(cert, &fingerprint)) {
+    return false;
+  }
+  key->append(fingerprint);
+  if (chain) {
+    for (int i = 0; i < sk_X509_num(chain); i++) {
+      if (!GetCertFingerprint(sk_X509_value(chain, i), &fingerprint)) {
+        return false;
+      }
+      key->append(fingerprint);
+    }
+  }
+  return true;
+}
+
+bool TlsContext::IsVerifiedCertCached(const string& key) const {
+  MutexLock lock(verified_certs_lock_);
+  auto it = verified_certs_.find(key);
+  return it != verified_certs_.end() && MonoTime::Now() < it->second;
+}
+
+void TlsContext::CacheVerifiedCert(const string& key, uint64_t trust_generation, X509* cert) {
+  if (FLAGS_rpc_tls_verified_cert_cache_capacity <= 0) {
+    return;
+  }
+#if OPENSSL_VERSION_NUMBER < 0x10002000L
+  // There is no ASN1_TIME_diff() to compute the remaining validity of the cert.
+  return;
+#else
+  int days = 0;
+  int secs = 0;
+  if (ASN1_TIME_diff(&days, &secs, nullptr, X509_get_notAfter(cert)) != 1) {
+    ERR_clear_error();
+    return;
+  }
+  const int64_t remaining_secs = static_cast<int64_t>(days) * 24 * 60 * 60 + secs -
+                                 kVerifiedCertExpiryMarginSecs;
+  if (remaining_secs <= 0) {
+    return;
+  }
+  const MonoTime valid_until = MonoTime::Now() + MonoDelta::FromSeconds(remaining_secs);
+
+  MutexLock lock(verified_certs_lock_);
+  if (trust_generation != trust_generation_) {
+    // The trust store changed during the verification.
+    return;
+  }
+  if (verified_certs_.size() >= FLAGS_rpc_tls_verified_cert_cache_capacity) {
+    // The cache is full; the set of peers is usually stable, so starting
+    // over is simpler than tracking recency and rarely happens.
+    verified_certs_.clear();
+  }
+  verified_certs_[key] = valid_until;
+#endif
+}
+
 Status TlsContext::VerifyCertChain(const Cert& cert) {
+  // This verifies our own cert, for no particular purpose, so it doesn't use
+  // the cache of verified peer certs.
   X509_STORE* store = SSL_CTX_get_cert_store(ctx_.get());
   auto store_ctx = ssl_make_unique<X509_STORE_CTX>(X509_STORE_CTX_new());
 
@@ -212,11 +357,18 @@ Status TlsContext::AddTrustedCertificate(const Cert& cert) {
     }
     OPENSSL_RET_NOT_OK(rc, "failed to add trusted certificate");
   }
+  InvalidateVerifiedCerts();
   MutexLock lock(lock_);
   trusted_cert_count_ += 1;
   return Status::OK();
 }
 
+void TlsContext::InvalidateVerifiedCerts() {
+  MutexLock lock(verified_certs_lock_);
+  trust_generation_++;
+  verified_certs_.clear();
+}
+
 Status TlsContext::DumpTrustedCerts(vector<string>* cert_ders) const {
   vector<string> ret;
   auto* cert_store = SSL_CTX_get_cert_store(ctx_.get());
@@ -265,11 +417,25 @@ Status SetCertAttributes(CertRequestGenerator::Config* config) {
 Status TlsContext::GenerateSelfSignedCertAndKey() {
   CertRequestGenerator::Config config;
   RETURN_NOT_OK(SetCertAttributes(&config));
-  // Step 1: generate the private key to be self signed.
-  PrivateKey key;
-  RETURN_NOT_OK_PREPEND(GeneratePrivateKey(FLAGS_ipki_server_key_size,
-                                           &key),
-                                           "failed to generate private key");
+  // Step 1: generate the private key to be self signed, or pick up the one
+  // generated in the background by StartKeyPregeneration().
+  std::unique_ptr<KeyPregenerator> pregenerator;
+  {
+    MutexLock lock(lock_);
+    pregenerator = std::move(key_pregenerator_);
+  }
+  std::unique_ptr<PrivateKey> key_holder;
+  if (pregenerator && pregenerator->num_bits() == FLAGS_ipki_server_key_size) {
+    RETURN_NOT_OK_PREPEND(pregenerator->GetKey(&key_holder),
+                          "failed to generate private key");
+  } else {
+    key_holder.reset(new PrivateKey());
+    RETURN_NOT_OK_PREPEND(GeneratePrivateKey(FLAGS_ipki_server_key_size,
+                                             key_holder.get()),
+                                             "failed to generate private key");
+  }
+  pregenerator.reset();
+  const PrivateKey& key = *key_holder;
 
   // Step 2: generate a CSR so that the self-signed cert can eventually be
   // replaced with a CA-signed cert.
@@ -305,6 +471,24 @@ Status TlsContext::GenerateSelfSignedCertAndKey() {
   return Status::OK();
 }
 
+Status TlsContext::StartKeyPregeneration() {
+  MutexLock lock(lock_);
+  if (has_cert_ || key_pregenerator_) {
+    // Nothing to do: the key is already there or is being generated.
+    return Status::OK();
+  }
+  // Start() only schedules the generation, so it's cheap to call under the
+  // lock. A pregenerator which was started must not be dropped: destroying
+  // it waits for the key being generated.
+  std::unique_ptr<KeyPregenerator> pregenerator(
+      new KeyPregenerator("tls-keygen", KeyType::RSA, FLAGS_ipki_server_key_size,
+                          /*num_keys=*/1, /*replenish=*/false));
+  RETURN_NOT_OK_PREPEND(pregenerator->Start(),
+                        "could not start background key generation");
+  key_pregenerator_ = std::move(pregenerator);
+  return Status::OK();
+}
+
 boost::optional<CertSignRequest> TlsContext::GetCsrIfNecessary() const {
   MutexLock lock(lock_);
   if (csr_) {
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <functional>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <boost/optional.hpp>
@@ -10,12 +12,14 @@
 #include "bboy/security/tls_handshake.h"
 #include "bboy/base/sync/atomic.h"
 #include "bboy/base/sync/mutex.h"
+#include "bboy/base/monotime.h"
 #include "bboy/base/status.h"
 
 namespace bb {
 namespace security {
 
 class Cert;
+class KeyPregenerator;
 class PrivateKey;
 
 // TlsContext wraps data required by the OpenSSL library for creating and
@@ -51,7 +55,7 @@ class TlsContext {
 
   TlsContext();
 
-  ~TlsContext() = default;
+  ~TlsContext();
 
   Status Init() WARN_UNUSED_RESULT;
 
@@ -104,6 +108,11 @@ class TlsContext {
   // connections.
   Status GenerateSelfSignedCertAndKey() WARN_UNUSED_RESULT;
 
+  // Starts generating the private key for GenerateSelfSignedCertAndKey() in
+  // the background, so that the RSA key generation overlaps with the rest of
+  // server startup. Optional: if not called, the key is generated inline.
+  Status StartKeyPregeneration() WARN_UNUSED_RESULT;
+
   // Returns a new certificate signing request (CSR) in DER format, if this
   // context's cert is self-signed. If the cert is already signed, returns
   // boost::none.
@@ -145,6 +154,29 @@ class TlsContext {
 
   Status VerifyCertChain(const Cert& cert) WARN_UNUSED_RESULT;
 
+  // Certificate verification callback installed into the SSL context: it
+  // consults the cache of verified certs before running the full chain
+  // verification for peer certificates during TLS handshakes.
+  static int VerifyCertCallback(X509_STORE_CTX* store_ctx, void* arg);
+
+  // Computes the key of the verification of the peer cert in 'store_ctx' in
+  // the cache of verified certs. The key covers the role of this end of the
+  // handshake, the generation of the trust store, and the SHA-256
+  // fingerprints of the leaf cert and of the chain the peer presented.
+  // Returns false if the verification can't be cached.
+  bool GetVerifiedCertKey(X509_STORE_CTX* store_ctx, std::string* key,
+                          uint64_t* trust_generation) const;
+
+  // Returns true if the verification with the given key has succeeded.
+  bool IsVerifiedCertCached(const std::string& key) const;
+
+  // Records a successful verification of 'cert' against the trust store of
+  // the given generation. Dropped if the trust store has changed since.
+  void CacheVerifiedCert(const std::string& key, uint64_t trust_generation, X509* cert);
+
+  // Must be called whenever the trust store changes.
+  void InvalidateVerifiedCerts();
+
   // Owned SSL context.
   c_unique_ptr<SSL_CTX> ctx_;
 
@@ -154,6 +186,21 @@ class TlsContext {
   int32_t trusted_cert_count_;
   bool has_cert_;
   boost::optional<CertSignRequest> csr_;
+
+  // Set by StartKeyPregeneration() and consumed by
+  // GenerateSelfSignedCertAndKey().
+  std::unique_ptr<KeyPregenerator> key_pregenerator_;
+
+  // Cache of peer certificate chains verified during handshakes, keyed as
+  // described in GetVerifiedCertKey(). The value is the time until which the
+  // verification result may be reused: shortly before the cert expires. The
+  // whole cache is dropped when the trust store changes.
+  mutable Mutex verified_certs_lock_;
+  std::unordered_map<std::string, MonoTime> verified_certs_;
+
+  // Incremented whenever the trust store changes. Protected by
+  // verified_certs_lock_.
+  uint64_t trust_generation_;
 };
 
 } // namespace security
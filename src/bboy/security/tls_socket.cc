@@ -109,6 +109,25 @@ Status TlsSocket::Read(uint8_t *buf, size_t amt, size_t *nread) {
   return Status::OK();
 }
 
+Status TlsSocket::Readv(const struct ::iovec *iov, int iov_len, size_t *nread) {
+  CHECK(ssl_);
+  // SSL_read() has no scatter variant, so fill the buffers in order and stop
+  // as soon as the TLS layer runs out of decrypted data.
+  size_t total_read = 0;
+  for (int i = 0; i < iov_len; ++i) {
+    size_t frame_read = 0;
+    Status s = Read(static_cast<uint8_t*>(iov[i].iov_base), iov[i].iov_len, &frame_read);
+    if (!s.ok()) {
+      if (total_read > 0) break;
+      return s;
+    }
+    total_read += frame_read;
+    if (frame_read < iov[i].iov_len) break;
+  }
+  *nread = total_read;
+  return Status::OK();
+}
+
 Status TlsSocket::Close() {
   ERR_clear_error();
   errno = 0;
@@ -18,6 +18,7 @@ class TlsSocket : public Socket {
   virtual Status Write(const uint8_t *buf, size_t amt, size_t *nwritten) override WARN_UNUSED_RESULT;
   virtual Status Writev(const struct ::iovec *iov, int iov_len, size_t* nwritten) override WARN_UNUSED_RESULT;
   virtual Status Read(uint8_t *buf, size_t amt, size_t *nread) override WARN_UNUSED_RESULT;
+  virtual Status Readv(const struct ::iovec *iov, int iov_len, size_t *nread) override WARN_UNUSED_RESULT;
 
   Status Close() override WARN_UNUSED_RESULT;
 
@@ -11,6 +11,7 @@
 #include <gflags/gflags.h>
 
 #include "bboy/gbase/walltime.h"
+#include "bboy/security/key_pregenerator.h"
 #include "bboy/security/openssl_util.h"
 #include "bboy/security/token.pb.h"
 #include "bboy/security/token_signing_key.h"
@@ -20,6 +21,16 @@
 DEFINE_int32(tsk_num_rsa_bits, 2048,
              "Number of bits in RSA keys used for token signing.");
 
+DEFINE_string(tsk_key_type, "rsa",
+              "Type of keys used for token signing: 'rsa', 'ecdsa' (P-256) or "
+              "'ed25519'. EC keys are much cheaper to sign with than RSA keys. "
+              "Keys of different types may coexist while keys are rotated.");
+
+DEFINE_int32(tsk_num_pregenerated_keys, 1,
+             "Number of keys for future token signing keys to generate "
+             "ahead of time in the background. Set to 0 to generate keys "
+             "synchronously when a new token signing key is needed.");
+
 using std::lock_guard;
 using std::map;
 using std::shared_ptr;
@@ -31,6 +42,21 @@ using std::vector;
 namespace bb {
 namespace security {
 
+namespace {
+
+bool ValidateKeyType(const char* flagname, const std::string& value) {
+  KeyType type;
+  Status s = ParseKeyType(value, &type);
+  if (!s.ok()) {
+    LOG(ERROR) << flagname << ": " << s.ToString();
+    return false;
+  }
+  return true;
+}
+bool dummy = google::RegisterFlagValidator(&FLAGS_tsk_key_type, &ValidateKeyType);
+
+} // anonymous namespace
+
 TokenSigner::TokenSigner(int64_t authn_token_validity_seconds,
                          int64_t key_rotation_seconds,
                          shared_ptr<TokenVerifier> verifier)
@@ -43,6 +69,22 @@ TokenSigner::TokenSigner(int64_t authn_token_validity_seconds,
   CHECK_GE(key_rotation_seconds_, 0);
   CHECK_GE(authn_token_validity_seconds_, 0);
   CHECK(verifier_);
+
+  KeyType key_type;
+  if (FLAGS_tsk_num_pregenerated_keys > 0 &&
+      ParseKeyType(FLAGS_tsk_key_type, &key_type).ok()) {
+    key_pregenerator_.reset(new KeyPregenerator("tsk-keygen",
+                                                key_type,
+                                                FLAGS_tsk_num_rsa_bits,
+                                                FLAGS_tsk_num_pregenerated_keys,
+                                                /*replenish=*/true));
+    Status s = key_pregenerator_->Start();
+    if (!s.ok()) {
+      LOG(WARNING) << "could not start background TSK generation, "
+                   << "keys will be generated on demand: " << s.ToString();
+      key_pregenerator_.reset();
+    }
+  }
 }
 
 TokenSigner::~TokenSigner() {
@@ -59,7 +101,7 @@ Status TokenSigner::ImportKeys(const vector<TokenSigningPrivateKeyPB>& keys) {
     // Check the input for consistency.
     CHECK(key.has_key_seq_num());
     CHECK(key.has_expire_unix_epoch_seconds());
-    CHECK(key.has_rsa_key_der());
+    CHECK(key.has_rsa_key_der() || key.has_key_der());
 
     const int64_t key_seq_num = key.key_seq_num();
     unique_ptr<TokenSigningPrivateKey> tsk(new TokenSigningPrivateKey(key));
@@ -241,11 +283,22 @@ Status TokenSigner::TryRotateKey(bool* has_rotated) {
 
 Status TokenSigner::GenerateSigningKey(int64_t key_seq_num,
                                        int64_t key_expiration,
-                                       unique_ptr<TokenSigningPrivateKey>* tsk) {
-  unique_ptr<PrivateKey> key(new PrivateKey());
-  RETURN_NOT_OK_PREPEND(
-      GeneratePrivateKey(FLAGS_tsk_num_rsa_bits, key.get()),
-      "could not generate new RSA token-signing key");
+                                       unique_ptr<TokenSigningPrivateKey>* tsk) const {
+  KeyType key_type;
+  RETURN_NOT_OK_PREPEND(ParseKeyType(FLAGS_tsk_key_type, &key_type),
+                        "invalid --tsk_key_type");
+  unique_ptr<PrivateKey> key;
+  if (key_pregenerator_ &&
+      key_pregenerator_->key_type() == key_type &&
+      key_pregenerator_->num_bits() == FLAGS_tsk_num_rsa_bits) {
+    RETURN_NOT_OK_PREPEND(key_pregenerator_->GetKey(&key),
+                          "could not generate new token-signing key");
+  } else {
+    key.reset(new PrivateKey());
+    RETURN_NOT_OK_PREPEND(
+        GeneratePrivateKey(key_type, FLAGS_tsk_num_rsa_bits, key.get()),
+        "could not generate new token-signing key");
+  }
   tsk->reset(new TokenSigningPrivateKey(key_seq_num,
                                         key_expiration,
                                         std::move(key)));
@@ -16,6 +16,7 @@ namespace bb {
 class Status;
 
 namespace security {
+class KeyPregenerator;
 class SignedTokenPB;
 class TokenSigner;
 class TokenSigningPrivateKey;
@@ -224,9 +225,12 @@ class TokenSigner {
  private:
   FRIEND_TEST(TokenTest, TestEndToEnd_InvalidCases);
 
-  static Status GenerateSigningKey(int64_t key_seq_num,
-                                   int64_t key_expiration,
-                                   std::unique_ptr<TokenSigningPrivateKey>* tsk) WARN_UNUSED_RESULT;
+  // Generate a new TSK of the type specified by --tsk_key_type, taking
+  // the key from 'key_pregenerator_' if it's available.
+  Status GenerateSigningKey(int64_t key_seq_num,
+                            int64_t key_expiration,
+                            std::unique_ptr<TokenSigningPrivateKey>* tsk) const
+      WARN_UNUSED_RESULT;
 
   std::shared_ptr<TokenVerifier> verifier_;
 
@@ -255,6 +259,11 @@ class TokenSigner {
   // the newly added ones are pushed into back of the queue.
   std::deque<std::unique_ptr<TokenSigningPrivateKey>> tsk_deque_;
 
+  // Generates keys for future TSKs in the background, so CheckNeedKey()
+  // does not have to block on key generation. May be null if pre-generation
+  // is disabled or could not be started.
+  std::unique_ptr<KeyPregenerator> key_pregenerator_;
+
   DISALLOW_COPY_AND_ASSIGN(TokenSigner);
 };
 
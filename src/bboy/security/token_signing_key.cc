@@ -16,6 +16,22 @@ using std::string;
 namespace bb {
 namespace security {
 
+namespace {
+
+// Returns the DER-encoded key material from a private or public TSK PB.
+// RSA keys are stored in the 'rsa_key_der' field to stay compatible with
+// older readers; other key types use 'key_der'.
+template<class PB>
+const string& KeyDer(const PB& pb) {
+  return pb.has_key_der() ? pb.key_der() : pb.rsa_key_der();
+}
+
+bool IsRsaKey(const PrivateKey& key) {
+  return EVP_PKEY_base_id(key.GetRawData()) == EVP_PKEY_RSA;
+}
+
+} // anonymous namespace
+
 TokenSigningPublicKey::TokenSigningPublicKey(const TokenSigningPublicKeyPB& pb)
     : pb_(pb) {
 }
@@ -26,14 +42,16 @@ TokenSigningPublicKey::~TokenSigningPublicKey() {
 Status TokenSigningPublicKey::Init() {
   // This should be called only once.
   CHECK(!key_.GetRawData());
-  if (!pb_.has_rsa_key_der()) {
+  if (!pb_.has_rsa_key_der() && !pb_.has_key_der()) {
     return Status::RuntimeError("no key for token signing helper");
   }
-  RETURN_NOT_OK(key_.FromString(pb_.rsa_key_der(), DataFormat::DER));
+  RETURN_NOT_OK(key_.FromString(KeyDer(pb_), DataFormat::DER));
   return Status::OK();
 }
 
 bool TokenSigningPublicKey::VerifySignature(const SignedTokenPB& token) const {
+  // The digest is the same for RSA and ECDSA keys, and is not used by
+  // Ed25519 keys, so keys of different types may coexist during rotation.
   return key_.VerifySignature(DigestType::SHA256,
       token.token_data(), token.signature()).ok();
 }
@@ -41,8 +59,8 @@ bool TokenSigningPublicKey::VerifySignature(const SignedTokenPB& token) const {
 TokenSigningPrivateKey::TokenSigningPrivateKey(
     const TokenSigningPrivateKeyPB& pb)
     : key_(new PrivateKey) {
-  CHECK_OK(key_->FromString(pb.rsa_key_der(), DataFormat::DER));
-  private_key_der_ = pb.rsa_key_der();
+  CHECK_OK(key_->FromString(KeyDer(pb), DataFormat::DER));
+  private_key_der_ = KeyDer(pb);
   key_seq_num_ = pb.key_seq_num();
   expire_time_ = pb.expire_unix_epoch_seconds();
 
@@ -77,14 +95,22 @@ Status TokenSigningPrivateKey::Sign(SignedTokenPB* token) const {
 void TokenSigningPrivateKey::ExportPB(TokenSigningPrivateKeyPB* pb) const {
   pb->Clear();
   pb->set_key_seq_num(key_seq_num_);
-  pb->set_rsa_key_der(private_key_der_);
+  if (IsRsaKey(*key_)) {
+    pb->set_rsa_key_der(private_key_der_);
+  } else {
+    pb->set_key_der(private_key_der_);
+  }
   pb->set_expire_unix_epoch_seconds(expire_time_);
 }
 
 void TokenSigningPrivateKey::ExportPublicKeyPB(TokenSigningPublicKeyPB* pb) const {
   pb->Clear();
   pb->set_key_seq_num(key_seq_num_);
-  pb->set_rsa_key_der(public_key_der_);
+  if (IsRsaKey(*key_)) {
+    pb->set_rsa_key_der(public_key_der_);
+  } else {
+    pb->set_key_der(public_key_der_);
+  }
   pb->set_expire_unix_epoch_seconds(expire_time_);
 }
 
@@ -35,7 +35,8 @@ class TokenSigningPublicKey {
 
  private:
   const TokenSigningPublicKeyPB pb_;
-  // The 'key_' member is a parsed version of rsa_key_der() from pb_.
+  // The 'key_' member is a parsed version of rsa_key_der() or key_der()
+  // from pb_.
   // In essence, the 'key_' is a public key for message signature verification.
   PublicKey key_;
 
@@ -1,10 +1,16 @@
 #include "bboy/security/token_verifier.h"
 
 #include <algorithm>
+#include <list>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <gflags/gflags.h>
+#include <openssl/sha.h>
+
+#include "bboy/gbase/hash/city.h"
 #include "bboy/gbase/map-util.h"
 #include "bboy/gbase/walltime.h"
 #include "bboy/security/token.pb.h"
@@ -13,16 +19,132 @@
 
 #include <glog/logging.h>
 
+DEFINE_int32(token_verifier_cache_capacity, 8192,
+             "Maximum number of successfully verified authentication tokens "
+             "remembered by a TokenVerifier. Tokens found in the cache skip "
+             "signature verification until they expire. 0 disables the cache.");
+
+using std::list;
 using std::lock_guard;
 using std::string;
 using std::transform;
 using std::unique_ptr;
+using std::unordered_map;
 using std::vector;
 
 namespace bb {
 namespace security {
 
+// A bounded LRU set of token digests whose signatures have been verified.
+//
+// Entries are spread over a fixed number of shards, each with its own
+// spinlock, so concurrent negotiations do not serialize on a single lock.
+// The digest is a SHA-256 over the signing key sequence number, the token
+// data and the signature, so a cache hit implies the exact same bytes were
+// verified before.
+class VerifiedTokenCache {
+ public:
+  explicit VerifiedTokenCache(int capacity)
+      : shard_capacity_(std::max(1, capacity / kNumShards)) {
+  }
+
+  static string Digest(const SignedTokenPB& token) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    int64_t seq = token.signing_key_seq_num();
+    SHA256_Update(&ctx, &seq, sizeof(seq));
+    // Length-prefix the variable sized fields so that moving bytes between
+    // them yields a different digest.
+    uint64_t len = token.token_data().size();
+    SHA256_Update(&ctx, &len, sizeof(len));
+    SHA256_Update(&ctx, token.token_data().data(), len);
+    len = token.signature().size();
+    SHA256_Update(&ctx, &len, sizeof(len));
+    SHA256_Update(&ctx, token.signature().data(), len);
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    SHA256_Final(md, &ctx);
+    return string(reinterpret_cast<char*>(md), sizeof(md));
+  }
+
+  // Return true if 'digest' is cached and still valid at 'now'.
+  bool Lookup(const string& digest, int64_t now) {
+    Shard* shard = GetShard(digest);
+    lock_guard<simple_spinlock> l(shard->lock);
+    auto it = shard->entries.find(digest);
+    if (it == shard->entries.end()) {
+      return false;
+    }
+    if (it->second.expire_unix_epoch_seconds < now) {
+      shard->lru.erase(it->second.lru_pos);
+      shard->entries.erase(it);
+      return false;
+    }
+    shard->lru.splice(shard->lru.begin(), shard->lru, it->second.lru_pos);
+    return true;
+  }
+
+  // Remember 'digest' as verified until 'expire_unix_epoch_seconds'.
+  void Insert(const string& digest, int64_t key_seq_num, int64_t expire_unix_epoch_seconds) {
+    Shard* shard = GetShard(digest);
+    lock_guard<simple_spinlock> l(shard->lock);
+    if (ContainsKey(shard->entries, digest)) {
+      return;
+    }
+    while (shard->entries.size() >= shard_capacity_) {
+      shard->entries.erase(shard->lru.back());
+      shard->lru.pop_back();
+    }
+    shard->lru.push_front(digest);
+    Entry e = { key_seq_num, expire_unix_epoch_seconds, shard->lru.begin() };
+    shard->entries.emplace(digest, e);
+  }
+
+  // Drop every entry verified with the key 'key_seq_num'.
+  void EraseKey(int64_t key_seq_num) {
+    for (Shard& shard : shards_) {
+      lock_guard<simple_spinlock> l(shard.lock);
+      for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+        if (it->second.key_seq_num == key_seq_num) {
+          shard.lru.erase(it->second.lru_pos);
+          it = shard.entries.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+  }
+
+ private:
+  static const int kNumShards = 16;
+
+  struct Entry {
+    int64_t key_seq_num;
+    // Earliest of the token's and the signing key's expiration times.
+    int64_t expire_unix_epoch_seconds;
+    list<string>::iterator lru_pos;
+  };
+
+  struct Shard {
+    simple_spinlock lock;
+    // Most recently used digest at the front.
+    list<string> lru;
+    unordered_map<string, Entry> entries;
+  };
+
+  Shard* GetShard(const string& digest) {
+    return &shards_[util_hash::CityHash64(digest.data(), digest.size()) % kNumShards];
+  }
+
+  const size_t shard_capacity_;
+  Shard shards_[kNumShards];
+
+  DISALLOW_COPY_AND_ASSIGN(VerifiedTokenCache);
+};
+
 TokenVerifier::TokenVerifier() {
+  if (FLAGS_token_verifier_cache_capacity > 0) {
+    verified_cache_.reset(new VerifiedTokenCache(FLAGS_token_verifier_cache_capacity));
+  }
 }
 
 TokenVerifier::~TokenVerifier() {
@@ -45,7 +167,7 @@ Status TokenVerifier::ImportKeys(const vector<TokenSigningPublicKeyPB>& keys) {
   vector<unique_ptr<TokenSigningPublicKey>> tsks;
   for (const auto& pb : keys) {
     // Sanity check the key.
-    if (!pb.has_rsa_key_der()) {
+    if (!pb.has_rsa_key_der() && !pb.has_key_der()) {
       return Status::RuntimeError(
           "token-signing public key message must include the signing key");
     }
@@ -63,7 +185,13 @@ Status TokenVerifier::ImportKeys(const vector<TokenSigningPublicKeyPB>& keys) {
 
   lock_guard<RWMutex> l(lock_);
   for (auto&& tsk_ptr : tsks) {
-    keys_by_seq_.emplace(tsk_ptr->pb().key_seq_num(), std::move(tsk_ptr));
+    const int64_t seq_num = tsk_ptr->pb().key_seq_num();
+    unique_ptr<TokenSigningPublicKey>& slot = keys_by_seq_[seq_num];
+    if (slot && verified_cache_) {
+      // Tokens verified with the key being replaced must be checked again.
+      verified_cache_->EraseKey(seq_num);
+    }
+    slot = std::move(tsk_ptr);
   }
   return Status::OK();
 }
@@ -107,6 +235,14 @@ VerificationResult TokenVerifier::VerifyTokenSignature(const SignedTokenPB& sign
     }
   }
 
+  string digest;
+  if (verified_cache_) {
+    digest = VerifiedTokenCache::Digest(signed_token);
+    if (verified_cache_->Lookup(digest, now)) {
+      return VerificationResult::VALID;
+    }
+  }
+
   {
     shared_lock<RWMutex> l(lock_);
     auto* tsk = FindPointeeOrNull(keys_by_seq_, signed_token.signing_key_seq_num());
@@ -121,6 +257,13 @@ VerificationResult TokenVerifier::VerifyTokenSignature(const SignedTokenPB& sign
     if (!tsk->VerifySignature(signed_token)) {
       return VerificationResult::INVALID_SIGNATURE;
     }
+    if (verified_cache_) {
+      // Inserted under the shared lock so that a concurrent replacement of
+      // this key (which holds the exclusive lock) cannot be missed.
+      verified_cache_->Insert(digest, signed_token.signing_key_seq_num(),
+                              std::min(token->expire_unix_epoch_seconds(),
+                                       tsk->pb().expire_unix_epoch_seconds()));
+    }
   }
 
   return VerificationResult::VALID;
@@ -15,6 +15,7 @@ class SignedTokenPB;
 class TokenPB;
 class TokenSigningPublicKey;
 class TokenSigningPublicKeyPB;
+class VerifiedTokenCache;
 enum class VerificationResult;
 
 // Class responsible for verifying tokens provided to a server.
@@ -29,6 +30,13 @@ enum class VerificationResult;
 // so this class can look up the correct key and verify the token's
 // validity and expiration.
 //
+// Successful signature verifications are remembered in a bounded, sharded
+// cache keyed by a digest of the token data, signature and signing key
+// sequence number, so a token presented again (e.g. by every connection from
+// the same client) skips the public-key operation. A cached result is used
+// only until the token or its signing key expires, and is dropped when the
+// signing key is replaced.
+//
 // Note that this class does not perform any "business logic" around the
 // content of a token. It only verifies that the token has a valid signature
 // and is not yet expired. Any business rules around authorization or
@@ -76,6 +84,9 @@ class TokenVerifier {
   mutable RWMutex lock_;
   KeysMap keys_by_seq_;
 
+  // Recently verified tokens. Internally synchronized.
+  std::unique_ptr<VerifiedTokenCache> verified_cache_;
+
   DISALLOW_COPY_AND_ASSIGN(TokenVerifier);
 };
 
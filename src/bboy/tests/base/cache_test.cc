@@ -0,0 +1,202 @@
+#include "bboy/base/cache.h"
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/mem_tracker.h"
+#include "bboy/base/slice.h"
+
+DECLARE_double(cache_protected_segment_ratio);
+
+using std::string;
+using std::unique_ptr;
+using strings::Substitute;
+
+namespace bb {
+
+namespace {
+
+// Insert 'key' with the value 'val' and a charge of 1, and return its handle.
+Cache::Handle* InsertAndHold(Cache* cache, const string& key, const string& val) {
+  Cache::PendingHandle* pending = cache->Allocate(key, val.size(), 1);
+  memcpy(cache->MutableValue(pending), val.data(), val.size());
+  return cache->Insert(pending);
+}
+
+void Insert(Cache* cache, const string& key, const string& val = "") {
+  cache->Release(InsertAndHold(cache, key, val));
+}
+
+// Look up 'key', promoting it.
+bool Touch(Cache* cache, const string& key) {
+  Cache::Handle* h = cache->Lookup(key);
+  if (!h) {
+    return false;
+  }
+  cache->Release(h);
+  return true;
+}
+
+// Whether 'key' is in the cache, leaving its position unchanged.
+bool Contains(Cache* cache, const string& key) {
+  Cache::Handle* h = cache->Lookup(key, Cache::NO_PROMOTE);
+  if (!h) {
+    return false;
+  }
+  cache->Release(h);
+  return true;
+}
+
+string Key(int i) {
+  return Substitute("key-$0", i);
+}
+
+// A single-shard cache, whose protected segment takes 'protected_ratio' of
+// its capacity.
+unique_ptr<Cache> NewCache(const string& id, size_t capacity, double protected_ratio) {
+  const double old_ratio = FLAGS_cache_protected_segment_ratio;
+  FLAGS_cache_protected_segment_ratio = protected_ratio;
+  unique_ptr<Cache> cache(new Cache(id, capacity, std::shared_ptr<MemTracker>(), 1));
+  FLAGS_cache_protected_segment_ratio = old_ratio;
+  return cache;
+}
+
+} // anonymous namespace
+
+// Entries which were looked up again survive a scan of many more entries
+// than the cache holds.
+TEST(TestCache, TestScanResistance) {
+  unique_ptr<Cache> cache = NewCache("scan", 10, 0.8);
+  for (int i = 0; i < 8; i++) {
+    Insert(cache.get(), Key(i));
+    ASSERT_TRUE(Touch(cache.get(), Key(i)));
+  }
+
+  // Entries of the scan are looked up, but without promotion.
+  for (int i = 100; i < 1100; i++) {
+    Insert(cache.get(), Key(i));
+    ASSERT_TRUE(Contains(cache.get(), Key(i)));
+  }
+  for (int i = 0; i < 8; i++) {
+    ASSERT_TRUE(Contains(cache.get(), Key(i))) << i;
+  }
+  // The rest of the capacity holds the end of the scan.
+  ASSERT_TRUE(Contains(cache.get(), Key(1099)));
+  ASSERT_TRUE(Contains(cache.get(), Key(1098)));
+  ASSERT_FALSE(Contains(cache.get(), Key(1097)));
+}
+
+// Once the protected segment is full, promoting an entry demotes the least
+// recently used protected one back to probation, where it's evicted first.
+TEST(TestCache, TestDemotion) {
+  unique_ptr<Cache> cache = NewCache("demotion", 10, 0.5);
+  for (int i = 0; i < 10; i++) {
+    Insert(cache.get(), Key(i));
+  }
+  // The protected segment holds 5 entries: promoting key-5 demotes key-0.
+  for (int i = 0; i < 6; i++) {
+    ASSERT_TRUE(Touch(cache.get(), Key(i)));
+  }
+
+  // key-0 is now the most recently used probationary entry, so it's evicted
+  // after the other probationary ones, but before any protected one.
+  for (int i = 6; i < 10; i++) {
+    Insert(cache.get(), Key(100 + i));
+    ASSERT_FALSE(Contains(cache.get(), Key(i))) << i;
+    ASSERT_TRUE(Contains(cache.get(), Key(0))) << i;
+  }
+  Insert(cache.get(), Key(110));
+  ASSERT_FALSE(Contains(cache.get(), Key(0)));
+  for (int i = 1; i < 6; i++) {
+    ASSERT_TRUE(Contains(cache.get(), Key(i))) << i;
+  }
+
+  // Looking up a demoted entry promotes it again.
+  cache = NewCache("demotion2", 10, 0.5);
+  for (int i = 0; i < 6; i++) {
+    Insert(cache.get(), Key(i));
+    ASSERT_TRUE(Touch(cache.get(), Key(i)));
+  }
+  ASSERT_TRUE(Touch(cache.get(), Key(0)));
+  for (int i = 100; i < 110; i++) {
+    Insert(cache.get(), Key(i));
+  }
+  ASSERT_TRUE(Contains(cache.get(), Key(0)));
+  ASSERT_FALSE(Contains(cache.get(), Key(1)));
+}
+
+// A handle keeps its entry, and its memory, after the entry leaves the
+// cache.
+TEST(TestCache, TestHandleOutlivesEviction) {
+  unique_ptr<Cache> cache = NewCache("handle", 10, 0.8);
+  const int64_t empty_consumption = cache->mem_tracker()->consumption();
+  Cache::Handle* h = InsertAndHold(cache.get(), "held", "hello");
+  const int64_t entry_size = cache->mem_tracker()->consumption() - empty_consumption;
+  ASSERT_GT(entry_size, 0);
+
+  for (int i = 0; i < 20; i++) {
+    Insert(cache.get(), Key(i));
+  }
+  ASSERT_FALSE(Contains(cache.get(), "held"));
+  ASSERT_EQ("hello", cache->Value(h).ToString());
+  const int64_t consumption = cache->mem_tracker()->consumption();
+  cache->Release(h);
+  ASSERT_EQ(consumption - entry_size, cache->mem_tracker()->consumption());
+
+  // Likewise for an erased entry, and for one larger than the cache.
+  h = InsertAndHold(cache.get(), "erased", "world");
+  cache->Erase("erased");
+  ASSERT_FALSE(Contains(cache.get(), "erased"));
+  ASSERT_EQ("world", cache->Value(h).ToString());
+  cache->Release(h);
+
+  Cache::PendingHandle* pending = cache->Allocate("huge", 5, 11);
+  memcpy(cache->MutableValue(pending), "giant", 5);
+  h = cache->Insert(pending);
+  ASSERT_FALSE(Contains(cache.get(), "huge"));
+  ASSERT_EQ("giant", cache->Value(h).ToString());
+  cache->Release(h);
+}
+
+// Inserting an existing key replaces its entry, whose charge no longer
+// counts, while its handles stay valid.
+TEST(TestCache, TestDuplicateInsert) {
+  unique_ptr<Cache> cache = NewCache("duplicate", 2, 0.5);
+  Cache::Handle* old_handle = InsertAndHold(cache.get(), "dup", "old");
+  Cache::Handle* new_handle = InsertAndHold(cache.get(), "dup", "new");
+  ASSERT_EQ("old", cache->Value(old_handle).ToString());
+  ASSERT_EQ("new", cache->Value(new_handle).ToString());
+
+  Cache::Handle* h = cache->Lookup("dup");
+  ASSERT_TRUE(h != nullptr);
+  ASSERT_EQ("new", cache->Value(h).ToString());
+  cache->Release(h);
+
+  // There is room for one more entry.
+  Insert(cache.get(), "other");
+  ASSERT_TRUE(Contains(cache.get(), "dup"));
+  ASSERT_TRUE(Contains(cache.get(), "other"));
+
+  const int64_t consumption = cache->mem_tracker()->consumption();
+  cache->Release(old_handle);
+  ASSERT_LT(cache->mem_tracker()->consumption(), consumption);
+  cache->Release(new_handle);
+  ASSERT_TRUE(Contains(cache.get(), "dup"));
+
+  // The replacing entry starts on probation, even if the old one was
+  // protected.
+  cache = NewCache("duplicate2", 2, 0.5);
+  Insert(cache.get(), "dup", "old");
+  ASSERT_TRUE(Touch(cache.get(), "dup"));
+  Insert(cache.get(), "dup", "new");
+  Insert(cache.get(), "a");
+  Insert(cache.get(), "b");
+  ASSERT_FALSE(Contains(cache.get(), "dup"));
+}
+
+} // namespace bb
@@ -0,0 +1,93 @@
+#include "bboy/base/crc.h"
+
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+using std::string;
+using std::vector;
+
+namespace bb {
+namespace crc {
+
+namespace {
+
+vector<uint8_t> RandomBytes(size_t n, std::mt19937* rng) {
+  vector<uint8_t> data(n);
+  for (auto& b : data) {
+    b = (*rng)();
+  }
+  return data;
+}
+
+} // anonymous namespace
+
+TEST(TestCrc, TestKnownValues) {
+  const string check = "123456789";
+  EXPECT_EQ(0xe3069283, Crc32c(check.data(), check.size()));
+  EXPECT_EQ(0xe3069283, Crc32cSoftware(check.data(), check.size()));
+
+  uint8_t zeros[32];
+  memset(zeros, 0, sizeof(zeros));
+  EXPECT_EQ(0x8a9136aa, Crc32c(zeros, sizeof(zeros)));
+  uint8_t ones[32];
+  memset(ones, 0xff, sizeof(ones));
+  EXPECT_EQ(0x62a8ab43, Crc32c(ones, sizeof(ones)));
+
+  EXPECT_EQ(0, Crc32c(nullptr, 0));
+}
+
+TEST(TestCrc, TestHardwareMatchesSoftware) {
+  LOG(INFO) << "Hardware accelerated: " << IsCrc32cHardwareAccelerated();
+  std::mt19937 rng(1);
+  // Large enough for several rounds of both block sizes.
+  vector<uint8_t> data = RandomBytes(200 * 1024, &rng);
+  for (int i = 0; i < 2000; i++) {
+    size_t offset = rng() % 64;
+    size_t len = i < 1000 ? i : rng() % (data.size() - offset);
+    uint32_t seed = rng();
+    ASSERT_EQ(Crc32cSoftware(&data[offset], len, seed), Crc32c(&data[offset], len, seed))
+        << "offset " << offset << ", length " << len;
+  }
+}
+
+TEST(TestCrc, TestExtendAndCombine) {
+  std::mt19937 rng(2);
+  vector<uint8_t> data = RandomBytes(100 * 1024, &rng);
+  const uint32_t whole = Crc32c(data.data(), data.size());
+  for (int i = 0; i < 100; i++) {
+    size_t split = i < 10 ? i : rng() % data.size();
+    uint32_t a = Crc32c(data.data(), split);
+    uint32_t b = Crc32c(data.data() + split, data.size() - split);
+    ASSERT_EQ(whole, Crc32c(data.data() + split, data.size() - split, a));
+    ASSERT_EQ(whole, Crc32cCombine(a, b, data.size() - split));
+  }
+}
+
+TEST(TestCrc, BenchmarkCrc32c) {
+  const size_t kSize = 64 * 1024 * 1024;
+  std::mt19937 rng(3);
+  vector<uint8_t> data = RandomBytes(kSize, &rng);
+  for (size_t chunk : { size_t(64), size_t(4096), kSize }) {
+    for (bool software : { false, true }) {
+      auto start = std::chrono::steady_clock::now();
+      uint32_t crc = 0;
+      for (int round = 0; round < 4; round++) {
+        for (size_t off = 0; off < kSize; off += chunk) {
+          crc = software ? Crc32cSoftware(&data[off], chunk, crc) : Crc32c(&data[off], chunk, crc);
+        }
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      LOG(INFO) << (software ? "Software" : "Crc32c") << ", " << chunk << "-byte chunks: "
+                << 4.0 * kSize / elapsed.count() / 1e9 << " GB/s (crc " << crc << ")";
+    }
+  }
+}
+
+} // namespace crc
+} // namespace bb
@@ -0,0 +1,196 @@
+#include "bboy/base/net/dns_resolver.h"
+
+#include <dlfcn.h>
+#include <netdb.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "bboy/base/async_util.h"
+#include "bboy/base/monotime.h"
+#include "bboy/base/net/net_util.h"
+#include "bboy/base/net/sockaddr.h"
+#include "bboy/base/thread/thread.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+// The number of getaddrinfo() calls made by the process.
+std::atomic<int> num_lookups(0);
+
+// While set, getaddrinfo() calls wait before resolving anything.
+std::atomic<bool> lookups_blocked(false);
+
+} // anonymous namespace
+
+// Count the lookups on their way to libc, and hold them when asked to.
+extern "C" int getaddrinfo(const char* node, const char* service,
+                           const struct addrinfo* hints, struct addrinfo** res) {
+  typedef int (*GetaddrinfoFn)(const char*, const char*, const struct addrinfo*,
+                               struct addrinfo**);
+  static GetaddrinfoFn real_fn =
+      reinterpret_cast<GetaddrinfoFn>(dlsym(RTLD_NEXT, "getaddrinfo"));
+  num_lookups++;
+  while (lookups_blocked) {
+    bb::SleepFor(bb::MonoDelta::FromMilliseconds(1));
+  }
+  return real_fn(node, service, hints, res);
+}
+
+namespace bb {
+
+namespace {
+
+// A host which never resolves.
+const char* const kInvalidHost = "dns-resolver-test.invalid";
+
+// Wait until 'n' lookups have started.
+void WaitForLookups(int n) {
+  while (num_lookups < n) {
+    SleepFor(MonoDelta::FromMilliseconds(1));
+  }
+}
+
+} // anonymous namespace
+
+// The addresses of a host are looked up once, and reused with any port.
+TEST(TestDnsResolver, TestCacheHit) {
+  DnsResolver resolver;
+  ASSERT_TRUE(resolver.Init().ok());
+  num_lookups = 0;
+
+  vector<Sockaddr> addrs;
+  Status s = resolver.ResolveAddresses(HostPort("localhost", 12345), &addrs);
+  ASSERT_TRUE(s.ok()) << s.ToString();
+  ASSERT_FALSE(addrs.empty());
+  for (const Sockaddr& addr : addrs) {
+    ASSERT_EQ("127.0.0.1:12345", addr.ToString());
+  }
+  ASSERT_EQ(1, num_lookups);
+
+  // Cached requests complete on the calling thread.
+  addrs.clear();
+  Synchronizer sync;
+  resolver.ResolveAddressesAsync(HostPort("localhost", 80), &addrs, sync.AsStatusCallback());
+  s = sync.WaitFor(MonoDelta::FromSeconds(0));
+  ASSERT_TRUE(s.ok()) << s.ToString();
+  ASSERT_FALSE(addrs.empty());
+  for (const Sockaddr& addr : addrs) {
+    ASSERT_EQ("127.0.0.1:80", addr.ToString());
+  }
+  ASSERT_EQ(1, num_lookups);
+}
+
+// Concurrent requests for a host share a single lookup.
+TEST(TestDnsResolver, TestCoalescing) {
+  DnsResolver resolver;
+  ASSERT_TRUE(resolver.Init().ok());
+  num_lookups = 0;
+  lookups_blocked = true;
+
+  const int kNumRequests = 10;
+  vector<unique_ptr<Synchronizer>> syncs;
+  vector<vector<Sockaddr>> addrs(kNumRequests);
+  for (int i = 0; i < kNumRequests; i++) {
+    syncs.emplace_back(new Synchronizer());
+    resolver.ResolveAddressesAsync(HostPort("localhost", 1000 + i), &addrs[i],
+                                   syncs.back()->AsStatusCallback());
+  }
+  WaitForLookups(1);
+  // Give a wrongly started second lookup the time to show up.
+  SleepFor(MonoDelta::FromMilliseconds(100));
+  const int num_started = num_lookups;
+  lookups_blocked = false;
+  ASSERT_EQ(1, num_started);
+
+  for (int i = 0; i < kNumRequests; i++) {
+    Status s = syncs[i]->WaitFor(MonoDelta::FromSeconds(30));
+    ASSERT_TRUE(s.ok()) << s.ToString();
+    ASSERT_FALSE(addrs[i].empty());
+    ASSERT_EQ(1000 + i, addrs[i][0].port());
+  }
+  ASSERT_EQ(1, num_lookups);
+}
+
+// Failures are cached, for the negative TTL only.
+TEST(TestDnsResolver, TestNegativeCaching) {
+  DnsResolverOptions opts;
+  opts.negative_ttl = MonoDelta::FromMilliseconds(500);
+  DnsResolver resolver(opts);
+  ASSERT_TRUE(resolver.Init().ok());
+  num_lookups = 0;
+
+  vector<Sockaddr> addrs;
+  Status s = resolver.ResolveAddresses(HostPort(kInvalidHost, 80), &addrs);
+  ASSERT_TRUE(s.IsNetworkError()) << s.ToString();
+  ASSERT_EQ(1, num_lookups);
+  MonoTime failed = MonoTime::Now();
+  s = resolver.ResolveAddresses(HostPort(kInvalidHost, 81), &addrs);
+  ASSERT_TRUE(s.IsNetworkError()) << s.ToString();
+  ASSERT_TRUE(addrs.empty());
+  if (MonoTime::Now() - failed < opts.negative_ttl) {
+    ASSERT_EQ(1, num_lookups);
+  }
+
+  SleepFor(opts.negative_ttl);
+  s = resolver.ResolveAddresses(HostPort(kInvalidHost, 80), &addrs);
+  ASSERT_TRUE(s.IsNetworkError()) << s.ToString();
+  ASSERT_EQ(2, num_lookups);
+
+  // Other hosts are unaffected.
+  ASSERT_TRUE(resolver.ResolveAddresses(HostPort("localhost", 80), &addrs).ok());
+  ASSERT_FALSE(addrs.empty());
+}
+
+// Shutdown() completes the queued requests with ServiceUnavailable, and the
+// running ones with their outcome. Later requests fail, cached or not.
+TEST(TestDnsResolver, TestShutdown) {
+  DnsResolverOptions opts;
+  opts.max_threads = 1;
+  DnsResolver resolver(opts);
+  ASSERT_TRUE(resolver.Init().ok());
+  ASSERT_TRUE(resolver.ResolveAddresses(HostPort("localhost", 80), nullptr).ok());
+  num_lookups = 0;
+  lookups_blocked = true;
+
+  // The lookup of the first host runs, and the second one is queued behind
+  // it.
+  Synchronizer running;
+  Synchronizer queued;
+  resolver.ResolveAddressesAsync(HostPort("127.0.0.1", 80), nullptr,
+                                 running.AsStatusCallback());
+  WaitForLookups(1);
+  resolver.ResolveAddressesAsync(HostPort(kInvalidHost, 80), nullptr,
+                                 queued.AsStatusCallback());
+
+  // Shutdown() waits for the running lookup.
+  scoped_refptr<Thread> unblocker;
+  ASSERT_TRUE(Thread::Create("test", "unblocker", []() {
+    SleepFor(MonoDelta::FromMilliseconds(100));
+    lookups_blocked = false;
+  }, &unblocker).ok());
+  resolver.Shutdown();
+  unblocker->Join();
+
+  // Neither request is left waiting.
+  Status s = running.WaitFor(MonoDelta::FromSeconds(0));
+  ASSERT_TRUE(s.ok()) << s.ToString();
+  s = queued.WaitFor(MonoDelta::FromSeconds(0));
+  ASSERT_TRUE(s.IsServiceUnavailable()) << s.ToString();
+  ASSERT_EQ(1, num_lookups);
+
+  s = resolver.ResolveAddresses(HostPort("localhost", 80), nullptr);
+  ASSERT_TRUE(s.IsServiceUnavailable()) << s.ToString();
+  s = resolver.ResolveAddresses(HostPort("localhost", 81), nullptr);
+  ASSERT_TRUE(s.IsServiceUnavailable()) << s.ToString();
+  resolver.Shutdown();
+}
+
+} // namespace bb
@@ -0,0 +1,191 @@
+#include "bboy/base/file_cache.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/env.h"
+#include "bboy/base/mem_env.h"
+#include "bboy/base/slice.h"
+
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using strings::Substitute;
+
+namespace bb {
+
+namespace {
+
+// An in-memory Env which counts the opens and syncs of files.
+struct CountingMemEnv {
+  CountingMemEnv()
+    : num_opens_(0),
+      num_syncs_(0) {
+    MemEnvOptions opts;
+    opts.failure_injector = [this](MemEnvOptions::Operation op, const string& /* path */) {
+      if (op == MemEnvOptions::OPEN) {
+        num_opens_++;
+      } else if (op == MemEnvOptions::SYNC) {
+        num_syncs_++;
+      }
+      return Status::OK();
+    };
+    env_ = NewMemEnv(Env::Default(), opts);
+  }
+
+  // Create the files "/0" to "/<n-1>", each holding its own name. The
+  // counts start from there.
+  void CreateFiles(int n) {
+    for (int i = 0; i < n; i++) {
+      string name = Substitute("/$0", i);
+      CHECK_OK(WriteStringToFile(env_.get(), name, name));
+    }
+    num_opens_ = 0;
+    num_syncs_ = 0;
+  }
+
+  unique_ptr<Env> env_;
+  std::atomic<int> num_opens_;
+  std::atomic<int> num_syncs_;
+};
+
+string ReadAll(RandomAccessFile* file) {
+  uint64_t size;
+  CHECK_OK(file->Size(&size));
+  string data(size, '\0');
+  Slice result;
+  CHECK_OK(file->Read(0, size, &result, reinterpret_cast<uint8_t*>(&data[0])));
+  return result.ToString();
+}
+
+} // anonymous namespace
+
+// Only the most recently used files stay open; the others are reopened on
+// access.
+TEST(TestFileCache, TestEviction) {
+  CountingMemEnv t;
+  t.CreateFiles(3);
+  FileCache cache("test", t.env_.get(), 2, 1);
+
+  vector<shared_ptr<RandomAccessFile>> files(3);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(cache.OpenExistingFile(Substitute("/$0", i), &files[i]).ok());
+  }
+  ASSERT_EQ(2, cache.num_open_files());
+  ASSERT_EQ(3, t.num_opens_);
+
+  // "/1" and "/2" are open.
+  ASSERT_EQ("/2", ReadAll(files[2].get()));
+  ASSERT_EQ("/1", ReadAll(files[1].get()));
+  ASSERT_EQ(3, t.num_opens_);
+
+  // "/0" was evicted and is reopened, evicting "/2".
+  ASSERT_EQ("/0", ReadAll(files[0].get()));
+  ASSERT_EQ(4, t.num_opens_);
+  ASSERT_EQ("/1", ReadAll(files[1].get()));
+  ASSERT_EQ(4, t.num_opens_);
+  ASSERT_EQ("/2", ReadAll(files[2].get()));
+  ASSERT_EQ(5, t.num_opens_);
+  ASSERT_EQ(2, cache.num_open_files());
+
+  // The handles of a file share its descriptor.
+  shared_ptr<RandomAccessFile> again;
+  ASSERT_TRUE(cache.OpenExistingFile("/2", &again).ok());
+  ASSERT_EQ(5, t.num_opens_);
+
+  // Dropping the last handle of a file closes it.
+  files[2].reset();
+  again.reset();
+  ASSERT_EQ(1, cache.num_open_files());
+
+  shared_ptr<RandomAccessFile> missing;
+  ASSERT_TRUE(cache.OpenExistingFile("/missing", &missing).IsNotFound());
+  ASSERT_EQ(1, cache.num_open_files());
+}
+
+// Writes survive the eviction of the file, which doesn't sync it, and a sync
+// of the handle covers them.
+TEST(TestFileCache, TestReopenRWFile) {
+  CountingMemEnv t;
+  t.CreateFiles(3);
+  FileCache cache("test", t.env_.get(), 1, 1);
+
+  shared_ptr<RWFile> file;
+  ASSERT_TRUE(cache.OpenExistingFile("/0", &file).ok());
+  ASSERT_TRUE(file->Write(2, "abc").ok());
+
+  shared_ptr<RWFile> other;
+  ASSERT_TRUE(cache.OpenExistingFile("/1", &other).ok());
+  ASSERT_EQ(1, cache.num_open_files());
+  ASSERT_EQ(0, t.num_syncs_);
+
+  int opens = t.num_opens_;
+  ASSERT_TRUE(file->Write(5, "def").ok());
+  ASSERT_EQ(opens + 1, t.num_opens_);
+  ASSERT_TRUE(other->Write(0, "x").ok());
+  ASSERT_EQ(0, t.num_syncs_);
+  ASSERT_TRUE(file->Sync().ok());
+  ASSERT_EQ(1, t.num_syncs_);
+
+  uint64_t size;
+  ASSERT_TRUE(file->Size(&size).ok());
+  ASSERT_EQ(8, size);
+  uint8_t scratch[8];
+  Slice result;
+  ASSERT_TRUE(file->Read(0, 8, &result, scratch).ok());
+  ASSERT_EQ("/0abcdef", result.ToString());
+
+  // A file can't be open for reading only and for writing at once.
+  shared_ptr<RandomAccessFile> reader;
+  ASSERT_TRUE(cache.OpenExistingFile("/0", &reader).IsIllegalState());
+  file.reset();
+  other.reset();
+  // Neither does closing it.
+  ASSERT_EQ(1, t.num_syncs_);
+  ASSERT_TRUE(cache.OpenExistingFile("/0", &reader).ok());
+  ASSERT_EQ("/0abcdef", ReadAll(reader.get()));
+}
+
+// Deleting a file with handles is deferred until the last one is destroyed.
+TEST(TestFileCache, TestDeferredDeletion) {
+  CountingMemEnv t;
+  t.CreateFiles(2);
+  FileCache cache("test", t.env_.get(), 1, 1);
+
+  shared_ptr<RandomAccessFile> file;
+  ASSERT_TRUE(cache.OpenExistingFile("/0", &file).ok());
+  shared_ptr<RandomAccessFile> other;
+  ASSERT_TRUE(cache.OpenExistingFile("/1", &other).ok());
+  ASSERT_TRUE(cache.DeleteFile("/0").ok());
+  ASSERT_TRUE(t.env_->FileExists("/0"));
+  ASSERT_TRUE(cache.DeleteFile("/0").IsNotFound());
+
+  // The file can't be opened anew, but its handles still work, even though
+  // it was evicted.
+  shared_ptr<RandomAccessFile> again;
+  ASSERT_TRUE(cache.OpenExistingFile("/0", &again).IsNotFound());
+  ASSERT_EQ("/0", ReadAll(file.get()));
+
+  file.reset();
+  ASSERT_FALSE(t.env_->FileExists("/0"));
+  ASSERT_TRUE(cache.OpenExistingFile("/0", &again).IsNotFound());
+
+  // A file without handles is deleted right away.
+  other.reset();
+  ASSERT_TRUE(cache.DeleteFile("/1").ok());
+  ASSERT_FALSE(t.env_->FileExists("/1"));
+  ASSERT_EQ(0, cache.num_open_files());
+
+  // Once deleted, a file of the same name can be created and opened.
+  ASSERT_TRUE(WriteStringToFile(t.env_.get(), "new", "/0").ok());
+  ASSERT_TRUE(cache.OpenExistingFile("/0", &again).ok());
+  ASSERT_EQ("new", ReadAll(again.get()));
+}
+
+} // namespace bb
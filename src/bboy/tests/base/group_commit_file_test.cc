@@ -0,0 +1,196 @@
+#include "bboy/base/group_commit_file.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "bboy/gbase/ref_counted.h"
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/env.h"
+#include "bboy/base/mem_env.h"
+#include "bboy/base/monotime.h"
+#include "bboy/base/slice.h"
+#include "bboy/base/sync/countdown_latch.h"
+#include "bboy/base/thread/thread.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using strings::Substitute;
+
+// The number of fsync() and fdatasync() calls of the process. The test binary
+// replaces the libc functions to count the syncs which reach the kernel.
+static std::atomic<int> num_kernel_syncs(0);
+
+extern "C" int fsync(int fd) {
+  num_kernel_syncs++;
+  return syscall(SYS_fsync, fd);
+}
+
+extern "C" int fdatasync(int fd) {
+  num_kernel_syncs++;
+  return syscall(SYS_fdatasync, fd);
+}
+
+namespace bb {
+
+namespace {
+
+Status OpenGroupCommitFile(Env* env, const string& path, unique_ptr<GroupCommitFile>* file) {
+  unique_ptr<WritableFile> writable;
+  RETURN_NOT_OK(env->NewWritableFile(path, &writable));
+  return GroupCommitFile::Open(env, std::move(writable), file);
+}
+
+} // anonymous namespace
+
+// Concurrent writers share syncs: with slow syncs, far fewer syncs than
+// SyncUpTo() calls are issued.
+TEST(TestGroupCommitFile, TestConcurrentWritersShareSyncs) {
+  MemEnvOptions opts;
+  opts.failure_injector = [](MemEnvOptions::Operation op, const string& /* path */) {
+    if (op == MemEnvOptions::SYNC) {
+      SleepFor(MonoDelta::FromMilliseconds(10));
+    }
+    return Status::OK();
+  };
+  unique_ptr<Env> env = NewMemEnv(Env::Default(), opts);
+  unique_ptr<GroupCommitFile> file;
+  ASSERT_TRUE(OpenGroupCommitFile(env.get(), "/log", &file).ok());
+
+  const int kNumWriters = 16;
+  const int kNumWritesPerWriter = 10;
+  const string kRecord = "0123456789";
+  std::atomic<int> num_errors(0);
+  vector<scoped_refptr<Thread>> threads;
+  for (int i = 0; i < kNumWriters; i++) {
+    scoped_refptr<Thread> thread;
+    ASSERT_TRUE(Thread::Create("test", "writer", [&]() {
+      for (int j = 0; j < kNumWritesPerWriter; j++) {
+        int64_t seq;
+        Status s = file->Append(kRecord, &seq);
+        if (s.ok()) {
+          s = file->SyncUpTo(seq);
+        }
+        if (!s.ok()) {
+          LOG(ERROR) << s.ToString();
+          num_errors++;
+        }
+      }
+    }, &thread).ok());
+    threads.push_back(thread);
+  }
+  for (const auto& thread : threads) {
+    thread->Join();
+  }
+  ASSERT_EQ(0, num_errors);
+  LOG(INFO) << "Syncs: " << file->num_syncs();
+  ASSERT_LT(file->num_syncs(), kNumWriters * kNumWritesPerWriter / 2);
+  ASSERT_TRUE(file->Close().ok());
+
+  uint64_t size;
+  ASSERT_TRUE(env->GetFileSize("/log", &size).ok());
+  ASSERT_EQ(kNumWriters * kNumWritesPerWriter * kRecord.size(), size);
+}
+
+// Appends go ahead while a sync is in progress.
+TEST(TestGroupCommitFile, TestAppendDuringSync) {
+  CountDownLatch sync_started(1);
+  CountDownLatch appended(1);
+  std::atomic<bool> appended_during_sync(false);
+  MemEnvOptions opts;
+  opts.failure_injector = [&](MemEnvOptions::Operation op, const string& /* path */) {
+    if (op == MemEnvOptions::SYNC) {
+      sync_started.CountDown();
+      appended_during_sync = appended.WaitFor(MonoDelta::FromSeconds(10));
+    }
+    return Status::OK();
+  };
+  unique_ptr<Env> env = NewMemEnv(Env::Default(), opts);
+  unique_ptr<GroupCommitFile> file;
+  ASSERT_TRUE(OpenGroupCommitFile(env.get(), "/log", &file).ok());
+  ASSERT_TRUE(file->Append("a", nullptr).ok());
+
+  Status sync_status;
+  scoped_refptr<Thread> syncer;
+  ASSERT_TRUE(Thread::Create("test", "syncer", [&]() {
+    sync_status = file->Sync();
+  }, &syncer).ok());
+  sync_started.Wait();
+  ASSERT_TRUE(file->Append("b", nullptr).ok());
+  appended.CountDown();
+  syncer->Join();
+  ASSERT_TRUE(sync_status.ok());
+  ASSERT_TRUE(appended_during_sync);
+}
+
+// Once a sync fails, every later sync fails with the same error, even if the
+// underlying file would sync fine again.
+TEST(TestGroupCommitFile, TestFailedSyncIsSticky) {
+  std::atomic<bool> fail_syncs(false);
+  MemEnvOptions opts;
+  opts.failure_injector = [&](MemEnvOptions::Operation op, const string& /* path */) {
+    if (op == MemEnvOptions::SYNC && fail_syncs) {
+      return Status::IOError("injected sync failure");
+    }
+    return Status::OK();
+  };
+  unique_ptr<Env> env = NewMemEnv(Env::Default(), opts);
+  unique_ptr<GroupCommitFile> file;
+  ASSERT_TRUE(OpenGroupCommitFile(env.get(), "/log", &file).ok());
+
+  int64_t seq1;
+  ASSERT_TRUE(file->Append("a", &seq1).ok());
+  ASSERT_TRUE(file->SyncUpTo(seq1).ok());
+
+  int64_t seq2;
+  ASSERT_TRUE(file->Append("b", &seq2).ok());
+  fail_syncs = true;
+  Status s = file->SyncUpTo(seq2);
+  ASSERT_TRUE(s.IsIOError()) << s.ToString();
+
+  fail_syncs = false;
+  int64_t seq3;
+  ASSERT_TRUE(file->Append("c", &seq3).ok());
+  Status s2 = file->SyncUpTo(seq3);
+  ASSERT_TRUE(s2.IsIOError()) << s2.ToString();
+  ASSERT_EQ(s.ToString(), s2.ToString());
+  Status s3 = file->Sync();
+  ASSERT_TRUE(s3.IsIOError()) << s3.ToString();
+  // Including for appends which were synced before the failure.
+  ASSERT_TRUE(file->SyncUpTo(seq1).IsIOError());
+}
+
+// On a real filesystem, a sync through the second handle reaches the kernel
+// even though nothing was written through that handle.
+TEST(TestGroupCommitFile, TestSyncReachesKernel) {
+  Env* env = Env::Default();
+  string dir;
+  ASSERT_TRUE(env->GetTestDirectory(&dir).ok());
+  const string path = Substitute("$0/group_commit_file_test-$1", dir, getpid());
+  unique_ptr<GroupCommitFile> file;
+  ASSERT_TRUE(OpenGroupCommitFile(env, path, &file).ok());
+
+  int64_t seq;
+  ASSERT_TRUE(file->Append("a", &seq).ok());
+  int syncs_before = num_kernel_syncs;
+  ASSERT_TRUE(file->SyncUpTo(seq).ok());
+  ASSERT_EQ(syncs_before + 1, num_kernel_syncs);
+
+  // Every group syncs, not just the first one.
+  ASSERT_TRUE(file->Append("b", &seq).ok());
+  ASSERT_TRUE(file->SyncUpTo(seq).ok());
+  ASSERT_EQ(syncs_before + 2, num_kernel_syncs);
+
+  ASSERT_TRUE(file->Close().ok());
+  ASSERT_TRUE(env->DeleteFile(path).ok());
+}
+
+} // namespace bb
@@ -0,0 +1,406 @@
+#include "bboy/base/json/jsonwriter.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/dynamic_message.h>
+#include <google/protobuf/message.h>
+#include <gtest/gtest.h>
+
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/faststring.h"
+#include "bboy/tests/base/jsonwriter_test.pb.h"
+
+using google::protobuf::DescriptorPool;
+using google::protobuf::DynamicMessageFactory;
+using google::protobuf::FileDescriptor;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::Message;
+using std::numeric_limits;
+using std::ostringstream;
+using std::string;
+using std::unique_ptr;
+using strings::Substitute;
+
+namespace bb {
+
+namespace {
+
+// Every byte from 0x00 to 0x7f, then some UTF-8.
+string AllAsciiAndUtf8() {
+  string s;
+  for (int c = 0; c < 0x80; c++) {
+    s.push_back(static_cast<char>(c));
+  }
+  s.append("\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+  return s;
+}
+
+// Writes a document using every method of the writers, with doubles which
+// rapidjson writes exactly.
+template<class W>
+void WriteDocument(W* w) {
+  w->StartObject();
+
+  w->String("strings");
+  w->StartArray();
+  w->String("");
+  w->String("plain");
+  w->String("\"quoted\" and \\back\\slashed\\ with a /");
+  w->String("\b\f\n\r\t\x01\x1f\x7f");
+  w->String(AllAsciiAndUtf8());
+  w->String("embedded\0nul", 12);
+  w->EndArray();
+
+  w->String("ints");
+  w->StartArray();
+  w->Int(0);
+  w->Int(-1);
+  w->Int(numeric_limits<int32_t>::min());
+  w->Int(numeric_limits<int32_t>::max());
+  w->Uint(numeric_limits<uint32_t>::max());
+  w->Int64(numeric_limits<int64_t>::min());
+  w->Int64(numeric_limits<int64_t>::max());
+  w->Uint64(numeric_limits<uint64_t>::max());
+  w->EndArray();
+
+  w->String("doubles");
+  w->StartArray();
+  for (double d : { 0.0, -0.0, 1.0, -1.0, 0.5, -2.25, 0.1, 100000.0,
+                    1e15, -1e15, 1e16, 1e-5, 1.5e300 }) {
+    w->Double(d);
+  }
+  w->EndArray();
+
+  w->String("literals");
+  w->StartObject();
+  w->String("true");
+  w->Bool(true);
+  w->String("false");
+  w->Bool(false);
+  w->String("null");
+  w->Null();
+  w->EndObject();
+
+  w->String("empty object");
+  w->StartObject();
+  w->EndObject();
+  w->String("empty array");
+  w->StartArray();
+  w->EndArray();
+
+  w->String("nested \"key\"\n");
+  w->StartArray();
+  w->StartObject();
+  w->EndObject();
+  w->StartArray();
+  w->EndArray();
+  w->StartArray();
+  w->StartArray();
+  w->Int(1);
+  w->StartObject();
+  w->String("a");
+  w->StartObject();
+  w->String("b");
+  w->StartArray();
+  w->EndArray();
+  w->EndObject();
+  w->EndObject();
+  w->EndArray();
+  w->EndArray();
+  w->EndArray();
+
+  w->EndObject();
+}
+
+template<JsonWriter::Mode kMode>
+void CheckSameAsRapidjson() {
+  ostringstream expected;
+  {
+    JsonWriter w(&expected, kMode);
+    WriteDocument(&w);
+  }
+
+  faststring buf;
+  JsonBufferWriter<kMode> w(&buf);
+  WriteDocument(&w);
+  ASSERT_EQ(expected.str(), buf.ToString());
+
+  faststring facade_buf;
+  JsonWriter facade(&facade_buf, kMode);
+  WriteDocument(&facade);
+  ASSERT_EQ(expected.str(), facade_buf.ToString());
+
+  // Including as a top-level array.
+  expected.str("");
+  {
+    JsonWriter rw(&expected, kMode);
+    rw.StartArray();
+    WriteDocument(&rw);
+    rw.StartArray();
+    rw.EndArray();
+    rw.EndArray();
+  }
+  buf.clear();
+  JsonBufferWriter<kMode> aw(&buf);
+  aw.StartArray();
+  WriteDocument(&aw);
+  aw.StartArray();
+  aw.EndArray();
+  aw.EndArray();
+  ASSERT_EQ(expected.str(), buf.ToString());
+}
+
+// The output of 'd' alone in an array.
+template<JsonWriter::Mode kMode>
+string DoubleToJson(double d) {
+  faststring buf;
+  JsonBufferWriter<kMode> w(&buf);
+  w.StartArray();
+  w.Double(d);
+  w.EndArray();
+  string s = buf.ToString();
+  if (kMode == JsonWriter::PRETTY) {
+    CHECK_EQ("[\n    ", s.substr(0, 6));
+    CHECK_EQ("\n]", s.substr(s.size() - 2));
+    return s.substr(6, s.size() - 8);
+  }
+  return s.substr(1, s.size() - 2);
+}
+
+template<JsonWriter::Mode kMode>
+void CheckDoubles() {
+  // The integers up to 1e15 are written as such, unlike by rapidjson, which
+  // only keeps 6 significant digits.
+  EXPECT_EQ("999999999999999", DoubleToJson<kMode>(1e15 - 1));
+  EXPECT_EQ("-999999999999999", DoubleToJson<kMode>(-(1e15 - 1)));
+  EXPECT_EQ("123456789", DoubleToJson<kMode>(123456789.0));
+  EXPECT_EQ("1e+15", DoubleToJson<kMode>(1e15));
+  EXPECT_EQ("-1e+15", DoubleToJson<kMode>(-1e15));
+  EXPECT_EQ("-0", DoubleToJson<kMode>(-0.0));
+  EXPECT_EQ("0", DoubleToJson<kMode>(0.0));
+
+  // Every double round-trips, including around the boundaries of the
+  // integer fast path.
+  for (double d : { 1e15 - 1, 1e15, 1e15 + 1, 1e15 + 2, -(1e15 + 1), 1e15 - 0.5,
+                    1.0 / 3, -2.0 / 3, 0.1 + 0.2, 1e-300, 4.9e-324,
+                    numeric_limits<double>::max(), numeric_limits<double>::lowest(),
+                    9007199254740993.0, 123456789.125, -0.0, 0.0 }) {
+    SCOPED_TRACE(d);
+    string json = DoubleToJson<kMode>(d);
+    double parsed = strtod(json.c_str(), nullptr);
+    EXPECT_EQ(d, parsed) << json;
+    EXPECT_EQ(std::signbit(d), std::signbit(parsed)) << json;
+  }
+
+  // JSON has no representation for these.
+  EXPECT_EQ("null", DoubleToJson<kMode>(numeric_limits<double>::quiet_NaN()));
+  EXPECT_EQ("null", DoubleToJson<kMode>(numeric_limits<double>::infinity()));
+  EXPECT_EQ("null", DoubleToJson<kMode>(-numeric_limits<double>::infinity()));
+}
+
+// Makes copies of generated messages whose types come from another
+// descriptor pool. JsonWriter has no plans for those, so it writes them with
+// reflection.
+class DynamicCopier {
+ public:
+  DynamicCopier() {
+    Import(TestAllTypesPB::descriptor()->file());
+  }
+
+  unique_ptr<Message> Copy(const Message& pb) {
+    const google::protobuf::Descriptor* descriptor =
+        pool_.FindMessageTypeByName(pb.GetDescriptor()->full_name());
+    CHECK(descriptor != nullptr);
+    CHECK(descriptor != pb.GetDescriptor());
+    unique_ptr<Message> copy(factory_.GetPrototype(descriptor)->New());
+    CHECK(copy->ParseFromString(pb.SerializeAsString()));
+    return copy;
+  }
+
+ private:
+  // Add 'file' and its dependencies to the pool.
+  void Import(const FileDescriptor* file) {
+    if (pool_.FindFileByName(file->name())) {
+      return;
+    }
+    for (int i = 0; i < file->dependency_count(); i++) {
+      Import(file->dependency(i));
+    }
+    FileDescriptorProto proto;
+    file->CopyTo(&proto);
+    CHECK(pool_.BuildFile(proto) != nullptr);
+  }
+
+  DescriptorPool pool_;
+  DynamicMessageFactory factory_;
+};
+
+void FillScalars(int i, TestAllTypesPB* pb) {
+  pb->set_first_val(-i);
+  pb->set_int32_val(numeric_limits<int32_t>::min() + i);
+  pb->set_int64_val(numeric_limits<int64_t>::min() + i);
+  pb->set_uint32_val(numeric_limits<uint32_t>::max() - i);
+  pb->set_uint64_val(numeric_limits<uint64_t>::max() - i);
+  pb->set_double_val(1.0 / (i + 3));
+  pb->set_float_val(0.1f * i);
+  pb->set_bool_val(i % 2 == 0);
+  pb->set_enum_val(i % 2 == 0 ? TestAllTypesPB::RED : TestAllTypesPB::GREEN);
+  pb->set_string_val(Substitute("string \"$0\"\n", i));
+  pb->set_bytes_val(string("\0\x01\xff", 3));
+  pb->set_secret_val(Substitute("secret $0", i));
+  pb->set_secret_bytes_val(Substitute("secret bytes $0", i));
+}
+
+// A message with every kind of field set, nested 'depth' times through its
+// recursive fields.
+TestAllTypesPB MakeAllTypes(int depth) {
+  TestAllTypesPB pb;
+  FillScalars(depth, &pb);
+  for (int i = 0; i < 3; i++) {
+    pb.add_repeated_int32(-i);
+    pb.add_repeated_int64(numeric_limits<int64_t>::max() - i);
+    pb.add_repeated_uint32(i);
+    pb.add_repeated_uint64(numeric_limits<uint64_t>::max() - i);
+    pb.add_repeated_double(i * 1e20);
+    pb.add_repeated_float(-0.5f * i);
+    pb.add_repeated_bool(i == 1);
+    pb.add_repeated_enum(i == 1 ? TestAllTypesPB::RED : TestAllTypesPB::GREEN);
+    pb.add_repeated_string(Substitute("repeated $0", i));
+    pb.add_repeated_secret(Substitute("repeated secret $0", i));
+  }
+  pb.mutable_nested()->set_name("nested");
+  pb.mutable_nested()->add_children()->add_children()->set_name("grandchild");
+  pb.add_repeated_nested();
+  pb.add_repeated_nested()->set_name("second");
+  if (depth > 0) {
+    *pb.mutable_child() = MakeAllTypes(depth - 1);
+    TestExtensiblePB* ext = pb.mutable_extensible();
+    ext->set_id(depth);
+    ext->SetExtension(ext_string, "extension");
+    *ext->mutable_all_types() = MakeAllTypes(depth - 1);
+    *ext->AddExtension(ext_all_types) = MakeAllTypes(depth - 1);
+  }
+  return pb;
+}
+
+string RapidjsonToJson(const Message& pb, JsonWriter::Mode mode) {
+  ostringstream out;
+  JsonWriter w(&out, mode);
+  w.Protobuf(pb);
+  return out.str();
+}
+
+// Check that 'pb', written with the plans of its types, is the same as
+// written with reflection, with every writer.
+void CheckPlanSameAsReflection(const Message& pb) {
+  DynamicCopier copier;
+  unique_ptr<Message> copy = copier.Copy(pb);
+  for (JsonWriter::Mode mode : { JsonWriter::COMPACT, JsonWriter::PRETTY }) {
+    SCOPED_TRACE(mode);
+    string expected = JsonWriter::ToJson(*copy, mode);
+    ASSERT_EQ(expected, JsonWriter::ToJson(pb, mode));
+    // Once the plans are cached too.
+    ASSERT_EQ(expected, JsonWriter::ToJson(pb, mode));
+    ASSERT_EQ(RapidjsonToJson(*copy, mode), RapidjsonToJson(pb, mode));
+  }
+}
+
+} // anonymous namespace
+
+TEST(TestJsonWriter, TestBufferWriterSameAsRapidjsonCompact) {
+  CheckSameAsRapidjson<JsonWriter::COMPACT>();
+}
+
+TEST(TestJsonWriter, TestBufferWriterSameAsRapidjsonPretty) {
+  CheckSameAsRapidjson<JsonWriter::PRETTY>();
+}
+
+TEST(TestJsonWriter, TestBufferWriterDoubles) {
+  CheckDoubles<JsonWriter::COMPACT>();
+  CheckDoubles<JsonWriter::PRETTY>();
+
+  // Non-finite values are still separated from their neighbours.
+  faststring buf;
+  CompactJsonBufferWriter w(&buf);
+  w.StartObject();
+  w.String("nan");
+  w.Double(numeric_limits<double>::quiet_NaN());
+  w.String("inf");
+  w.Double(numeric_limits<double>::infinity());
+  w.EndObject();
+  ASSERT_EQ("{\"nan\":null,\"inf\":null}", buf.ToString());
+}
+
+TEST(TestJsonWriter, TestProtobufPlanSameAsReflection) {
+  CheckPlanSameAsReflection(TestAllTypesPB());
+  CheckPlanSameAsReflection(MakeAllTypes(0));
+  CheckPlanSameAsReflection(MakeAllTypes(3));
+
+  TestAllTypesPB pb;
+  pb.add_repeated_int32(1);
+  pb.mutable_nested();
+  pb.mutable_child()->mutable_child()->set_string_val("deep");
+  CheckPlanSameAsReflection(pb);
+  ASSERT_EQ("{\"repeated_int32\":[1],\"nested\":{},\"child\":{\"child\":{\"string_val\":\"deep\"}}}",
+            JsonWriter::ToJson(pb, JsonWriter::COMPACT));
+
+  // Fields are written in the order of their numbers.
+  pb.Clear();
+  pb.set_int32_val(2);
+  pb.set_first_val(1);
+  ASSERT_EQ("{\"first_val\":1,\"int32_val\":2}", JsonWriter::ToJson(pb, JsonWriter::COMPACT));
+  CheckPlanSameAsReflection(pb);
+}
+
+TEST(TestJsonWriter, TestProtobufRedaction) {
+  TestAllTypesPB pb = MakeAllTypes(1);
+  CheckPlanSameAsReflection(pb);
+  for (JsonWriter::Mode mode : { JsonWriter::COMPACT, JsonWriter::PRETTY }) {
+    string json = JsonWriter::ToJson(pb, mode);
+    ASSERT_EQ(string::npos, json.find("secret ")) << json;
+    ASSERT_NE(string::npos, json.find("<redacted>")) << json;
+    json = RapidjsonToJson(pb, mode);
+    ASSERT_EQ(string::npos, json.find("secret ")) << json;
+  }
+
+  pb.Clear();
+  pb.set_secret_val("hidden");
+  pb.add_repeated_secret("hidden");
+  pb.add_repeated_secret("hidden");
+  ASSERT_EQ("{\"secret_val\":\"<redacted>\","
+            "\"repeated_secret\":[\"<redacted>\",\"<redacted>\"]}",
+            JsonWriter::ToJson(pb, JsonWriter::COMPACT));
+}
+
+// Messages with extension ranges are written with reflection, which lists
+// the extensions that are set, even when they're nested in messages with
+// plans.
+TEST(TestJsonWriter, TestProtobufExtensions) {
+  TestExtensiblePB pb;
+  pb.set_id(1);
+  pb.SetExtension(ext_string, "ext");
+  pb.AddExtension(ext_all_types)->set_first_val(5);
+  pb.mutable_all_types()->mutable_extensible()->SetExtension(ext_string, "inner");
+  const string expected =
+      "{\"id\":1,"
+      "\"all_types\":{\"extensible\":{\"ext_string\":\"inner\"}},"
+      "\"ext_string\":\"ext\","
+      "\"ext_all_types\":[{\"first_val\":5}]}";
+  ASSERT_EQ(expected, JsonWriter::ToJson(pb, JsonWriter::COMPACT));
+  CheckPlanSameAsReflection(pb);
+
+  TestAllTypesPB outer;
+  *outer.mutable_extensible() = pb;
+  ASSERT_EQ("{\"extensible\":" + expected + "}",
+            JsonWriter::ToJson(outer, JsonWriter::COMPACT));
+  CheckPlanSameAsReflection(outer);
+}
+
+} // namespace bb
@@ -0,0 +1,266 @@
+#include "bboy/base/mem_env.h"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "bboy/gbase/bind.h"
+#include "bboy/base/env.h"
+#include "bboy/base/faststring.h"
+#include "bboy/base/path_util.h"
+#include "bboy/base/slice.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace bb {
+
+namespace {
+
+const uint64_t kBlockSize = 4096;
+
+Status AddWalkEntry(vector<string>* entries, Env::FileType /* type */,
+                    const string& dirname, const string& basename) {
+  entries->push_back(dirname == basename ? dirname : JoinPathSegments(dirname, basename));
+  return Status::OK();
+}
+
+string ReadFile(Env* env, const string& path) {
+  faststring data;
+  CHECK_OK(ReadFileToString(env, path, &data));
+  return data.ToString();
+}
+
+} // anonymous namespace
+
+// Files only take up the blocks which were written or preallocated.
+TEST(TestMemEnv, TestPreAllocateAndPunchHole) {
+  unique_ptr<Env> env = NewMemEnv(Env::Default());
+  unique_ptr<RWFile> file;
+  ASSERT_TRUE(env->NewRWFile("/f", &file).ok());
+  uint64_t size;
+  uint64_t size_on_disk;
+
+  ASSERT_TRUE(file->PreAllocate(0, 2 * kBlockSize + 1, RWFile::DONT_CHANGE_FILE_SIZE).ok());
+  ASSERT_TRUE(file->Size(&size).ok());
+  ASSERT_EQ(0, size);
+  ASSERT_TRUE(env->GetFileSizeOnDisk("/f", &size_on_disk).ok());
+  ASSERT_EQ(3 * kBlockSize, size_on_disk);
+
+  // Preallocating the same range again doesn't allocate anything more.
+  ASSERT_TRUE(file->PreAllocate(0, 3 * kBlockSize, RWFile::CHANGE_FILE_SIZE).ok());
+  ASSERT_TRUE(file->Size(&size).ok());
+  ASSERT_EQ(3 * kBlockSize, size);
+  ASSERT_TRUE(env->GetFileSizeOnDisk("/f", &size_on_disk).ok());
+  ASSERT_EQ(3 * kBlockSize, size_on_disk);
+
+  // A write past the end of the file leaves a hole.
+  const string data(kBlockSize, 'x');
+  ASSERT_TRUE(file->Write(5 * kBlockSize, data).ok());
+  ASSERT_TRUE(file->Size(&size).ok());
+  ASSERT_EQ(6 * kBlockSize, size);
+  ASSERT_TRUE(env->GetFileSizeOnDisk("/f", &size_on_disk).ok());
+  ASSERT_EQ(4 * kBlockSize, size_on_disk);
+
+  // Punching a hole frees the blocks it covers entirely and zeroes the rest.
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(file->Write(i * kBlockSize, data).ok());
+  }
+  ASSERT_TRUE(file->PunchHole(kBlockSize / 2, 2 * kBlockSize).ok());
+  ASSERT_TRUE(file->Size(&size).ok());
+  ASSERT_EQ(6 * kBlockSize, size);
+  ASSERT_TRUE(env->GetFileSizeOnDisk("/f", &size_on_disk).ok());
+  ASSERT_EQ(3 * kBlockSize, size_on_disk);
+  uint8_t scratch[3 * kBlockSize];
+  Slice result;
+  ASSERT_TRUE(file->Read(0, sizeof(scratch), &result, scratch).ok());
+  for (uint64_t i = 0; i < sizeof(scratch); i++) {
+    bool in_hole = i >= kBlockSize / 2 && i < 5 * kBlockSize / 2;
+    ASSERT_EQ(in_hole ? '\0' : 'x', result[i]) << i;
+  }
+
+  // Truncation frees the blocks past the new end, preallocated or not.
+  ASSERT_TRUE(file->Truncate(kBlockSize / 2).ok());
+  ASSERT_TRUE(env->GetFileSizeOnDisk("/f", &size_on_disk).ok());
+  ASSERT_EQ(kBlockSize, size_on_disk);
+  ASSERT_TRUE(file->Close().ok());
+}
+
+// Writes which would take the data past the capacity fail with ENOSPC,
+// without doing anything, until space is freed.
+TEST(TestMemEnv, TestCapacity) {
+  MemEnvOptions opts;
+  opts.capacity_bytes = 4 * kBlockSize;
+  unique_ptr<Env> env = NewMemEnv(Env::Default(), opts);
+  int64_t bytes_free;
+  ASSERT_TRUE(env->GetBytesFree("/", &bytes_free).ok());
+  ASSERT_EQ(4 * kBlockSize, bytes_free);
+
+  const string block(kBlockSize, 'x');
+  ASSERT_TRUE(WriteStringToFile(env.get(), block + block + block, "/a").ok());
+  ASSERT_TRUE(env->GetBytesFree("/", &bytes_free).ok());
+  ASSERT_EQ(kBlockSize, bytes_free);
+
+  unique_ptr<WritableFile> file;
+  ASSERT_TRUE(env->NewWritableFile("/b", &file).ok());
+  Status s = file->Append(block + "y");
+  ASSERT_TRUE(s.IsIOError()) << s.ToString();
+  ASSERT_EQ(ENOSPC, s.posix_code());
+  ASSERT_EQ(0, file->Size());
+  unique_ptr<RWFile> rw_file;
+  ASSERT_TRUE(env->NewRWFile("/c", &rw_file).ok());
+  s = rw_file->PreAllocate(0, 2 * kBlockSize, RWFile::CHANGE_FILE_SIZE);
+  ASSERT_EQ(ENOSPC, s.posix_code()) << s.ToString();
+  uint64_t size;
+  ASSERT_TRUE(rw_file->Size(&size).ok());
+  ASSERT_EQ(0, size);
+
+  // The last block fits.
+  ASSERT_TRUE(file->Append(block).ok());
+  s = file->Append("y");
+  ASSERT_EQ(ENOSPC, s.posix_code()) << s.ToString();
+
+  ASSERT_TRUE(env->DeleteFile("/a").ok());
+  ASSERT_TRUE(file->Append("y").ok());
+  ASSERT_TRUE(env->GetBytesFree("/", &bytes_free).ok());
+  ASSERT_EQ(2 * kBlockSize, bytes_free);
+  ASSERT_TRUE(file->Close().ok());
+  ASSERT_TRUE(rw_file->Close().ok());
+}
+
+// Injected failures fail only the operations and files they target, and
+// leave them untouched.
+TEST(TestMemEnv, TestFailureInjection) {
+  MemEnvOptions opts;
+  vector<MemEnvOptions::Operation> failing_ops;
+  opts.failure_injector = [&](MemEnvOptions::Operation op, const string& path) {
+    if (path == "/bad" &&
+        std::find(failing_ops.begin(), failing_ops.end(), op) != failing_ops.end()) {
+      return Status::IOError("injected failure", path);
+    }
+    return Status::OK();
+  };
+  unique_ptr<Env> env = NewMemEnv(Env::Default(), opts);
+  ASSERT_TRUE(WriteStringToFile(env.get(), "abc", "/bad").ok());
+  ASSERT_TRUE(WriteStringToFile(env.get(), "abc", "/good").ok());
+
+  failing_ops = { MemEnvOptions::OPEN };
+  unique_ptr<WritableFile> file;
+  ASSERT_TRUE(env->NewWritableFile("/bad", &file).IsIOError());
+  ASSERT_EQ("abc", ReadFile(env.get(), "/good"));
+  unique_ptr<RandomAccessFile> reader;
+  ASSERT_TRUE(env->NewRandomAccessFile("/bad", &reader).IsIOError());
+
+  failing_ops = { MemEnvOptions::READ, MemEnvOptions::WRITE, MemEnvOptions::SYNC };
+  WritableFileOptions wopts;
+  wopts.mode = Env::OPEN_EXISTING;
+  ASSERT_TRUE(env->NewWritableFile(wopts, "/bad", &file).ok());
+  ASSERT_TRUE(env->NewRandomAccessFile("/bad", &reader).ok());
+  ASSERT_TRUE(file->Append("def").IsIOError());
+  ASSERT_TRUE(file->Sync().IsIOError());
+  uint8_t scratch[3];
+  Slice result;
+  ASSERT_TRUE(reader->Read(0, 3, &result, scratch).IsIOError());
+
+  failing_ops = { MemEnvOptions::METADATA };
+  ASSERT_TRUE(env->RenameFile("/bad", "/other").IsIOError());
+  ASSERT_TRUE(env->DeleteFile("/bad").IsIOError());
+  ASSERT_TRUE(env->FileExists("/bad"));
+  ASSERT_FALSE(env->FileExists("/other"));
+
+  failing_ops.clear();
+  ASSERT_TRUE(file->Append("def").ok());
+  ASSERT_TRUE(file->Close().ok());
+  ASSERT_EQ("abcdef", ReadFile(env.get(), "/bad"));
+}
+
+// As on POSIX filesystems, open files follow renames and remain usable once
+// deleted.
+TEST(TestMemEnv, TestRenameAndDeleteOpenFiles) {
+  unique_ptr<Env> env = NewMemEnv(Env::Default());
+  unique_ptr<WritableFile> writer;
+  ASSERT_TRUE(env->NewWritableFile("/a", &writer).ok());
+  ASSERT_TRUE(writer->Append("abc").ok());
+  ASSERT_TRUE(env->RenameFile("/a", "/b").ok());
+  ASSERT_FALSE(env->FileExists("/a"));
+  ASSERT_TRUE(writer->Append("def").ok());
+  ASSERT_EQ("abcdef", ReadFile(env.get(), "/b"));
+
+  unique_ptr<RandomAccessFile> reader;
+  ASSERT_TRUE(env->NewRandomAccessFile("/b", &reader).ok());
+  ASSERT_TRUE(env->DeleteFile("/b").ok());
+  ASSERT_FALSE(env->FileExists("/b"));
+  ASSERT_TRUE(writer->Append("ghi").ok());
+  uint8_t scratch[9];
+  Slice result;
+  ASSERT_TRUE(reader->Read(0, sizeof(scratch), &result, scratch).ok());
+  ASSERT_EQ("abcdefghi", result.ToString());
+
+  // A new file of the same name is a different file.
+  ASSERT_TRUE(WriteStringToFile(env.get(), "xyz", "/b").ok());
+  ASSERT_TRUE(writer->Close().ok());
+  ASSERT_EQ("xyz", ReadFile(env.get(), "/b"));
+
+  // Renaming a directory moves the open files under it.
+  ASSERT_TRUE(env->CreateDir("/d").ok());
+  ASSERT_TRUE(env->NewWritableFile("/d/f", &writer).ok());
+  ASSERT_TRUE(env->RenameFile("/d", "/e").ok());
+  ASSERT_TRUE(writer->Append("abc").ok());
+  ASSERT_TRUE(writer->Close().ok());
+  ASSERT_EQ("abc", ReadFile(env.get(), "/e/f"));
+  ASSERT_FALSE(env->FileExists("/d/f"));
+}
+
+TEST(TestMemEnv, TestWalkAndGlob) {
+  unique_ptr<Env> env = NewMemEnv(Env::Default());
+  ASSERT_TRUE(env->CreateDir("/d").ok());
+  ASSERT_TRUE(env->CreateDir("/d/e").ok());
+  ASSERT_TRUE(WriteStringToFile(env.get(), "", "/d/e/f2").ok());
+  ASSERT_TRUE(WriteStringToFile(env.get(), "", "/d/f1").ok());
+  ASSERT_TRUE(WriteStringToFile(env.get(), "", "/d/.hidden").ok());
+  ASSERT_TRUE(WriteStringToFile(env.get(), "", "/g").ok());
+
+  vector<string> entries;
+  ASSERT_TRUE(env->Walk("/d", Env::PRE_ORDER, Bind(&AddWalkEntry, &entries)).ok());
+  vector<string> expected = { "/d", "/d/.hidden", "/d/e", "/d/e/f2", "/d/f1" };
+  ASSERT_EQ(expected, entries);
+
+  entries.clear();
+  ASSERT_TRUE(env->Walk("/d", Env::POST_ORDER, Bind(&AddWalkEntry, &entries)).ok());
+  expected = { "/d/f1", "/d/e/f2", "/d/e", "/d/.hidden", "/d" };
+  ASSERT_EQ(expected, entries);
+
+  entries.clear();
+  ASSERT_TRUE(env->Walk("/", Env::PRE_ORDER, Bind(&AddWalkEntry, &entries)).ok());
+  ASSERT_EQ(7, entries.size());
+  ASSERT_EQ("/", entries[0]);
+  ASSERT_TRUE(env->Walk("/missing", Env::PRE_ORDER, Bind(&AddWalkEntry, &entries)).IsNotFound());
+
+  // Wildcards don't match slashes or leading dots.
+  vector<string> paths;
+  ASSERT_TRUE(env->Glob("/d/*", &paths).ok());
+  expected = { "/d/e", "/d/f1" };
+  ASSERT_EQ(expected, paths);
+  paths.clear();
+  ASSERT_TRUE(env->Glob("/*/*/f?", &paths).ok());
+  expected = { "/d/e/f2" };
+  ASSERT_EQ(expected, paths);
+
+  // Relative patterns yield absolute paths.
+  ASSERT_TRUE(env->ChangeDir("/d").ok());
+  paths.clear();
+  ASSERT_TRUE(env->Glob("f*", &paths).ok());
+  expected = { "/d/f1" };
+  ASSERT_EQ(expected, paths);
+  paths.clear();
+  ASSERT_TRUE(env->Glob("x*", &paths).ok());
+  ASSERT_TRUE(paths.empty());
+}
+
+} // namespace bb
@@ -0,0 +1,289 @@
+#include "bboy/base/pb_util.h"
+
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/env.h"
+#include "bboy/base/mem_env.h"
+#include "bboy/base/pb_util.pb.h"
+#include "bboy/base/slice.h"
+
+DECLARE_int32(pb_container_read_ahead_bytes);
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using strings::Substitute;
+
+namespace bb {
+namespace pb_util {
+
+namespace {
+
+// The records of the tests are ContainerSupHeaderPBs, told apart by their
+// type.
+ContainerSupHeaderPB MakeRecord(int i) {
+  ContainerSupHeaderPB pb;
+  pb.mutable_protos();
+  pb.set_pb_type(Substitute("record-$0", i));
+  return pb;
+}
+
+// Create a container at 'path' holding records [0, 'num_records').
+Status WriteContainer(Env* env, const string& path, int num_records) {
+  unique_ptr<WritableFile> file;
+  RETURN_NOT_OK(env->NewWritableFile(path, &file));
+  WritablePBContainerFile writer(std::move(file));
+  RETURN_NOT_OK(writer.CreateNew(ContainerSupHeaderPB()));
+  for (int i = 0; i < num_records; i++) {
+    RETURN_NOT_OK(writer.Append(MakeRecord(i)));
+  }
+  return writer.Close();
+}
+
+// Read the records of the container at 'path' into 'types', and return the
+// status which ended the reading. 'end_offset', if not null, is set to the
+// end of the last record read.
+Status ReadContainer(Env* env, const string& path, const RandomAccessFileOptions& opts,
+                     vector<string>* types, uint64_t* end_offset = nullptr) {
+  unique_ptr<RandomAccessFile> file;
+  RETURN_NOT_OK(env->NewRandomAccessFile(opts, path, &file));
+  ReadablePBContainerFile reader(std::move(file));
+  RETURN_NOT_OK(reader.Open());
+  EXPECT_EQ("bb.ContainerSupHeaderPB", reader.pb_type());
+  Status s;
+  while (true) {
+    ContainerSupHeaderPB pb;
+    s = reader.ReadNextPB(&pb);
+    if (!s.ok()) {
+      break;
+    }
+    types->push_back(pb.pb_type());
+  }
+  if (end_offset) {
+    *end_offset = reader.offset();
+  }
+  return s;
+}
+
+Status ReadContainer(Env* env, const string& path, vector<string>* types,
+                     uint64_t* end_offset = nullptr) {
+  return ReadContainer(env, path, RandomAccessFileOptions(), types, end_offset);
+}
+
+Status TruncateFile(Env* env, const string& path, uint64_t size) {
+  RWFileOptions opts;
+  opts.mode = Env::OPEN_EXISTING;
+  unique_ptr<RWFile> file;
+  RETURN_NOT_OK(env->NewRWFile(opts, path, &file));
+  RETURN_NOT_OK(file->Truncate(size));
+  return file->Close();
+}
+
+// Flip the bits of the byte at 'offset' of 'path'.
+Status FlipByte(Env* env, const string& path, uint64_t offset) {
+  RWFileOptions opts;
+  opts.mode = Env::OPEN_EXISTING;
+  unique_ptr<RWFile> file;
+  RETURN_NOT_OK(env->NewRWFile(opts, path, &file));
+  uint8_t byte;
+  Slice result;
+  RETURN_NOT_OK(file->Read(offset, 1, &result, &byte));
+  uint8_t flipped = ~result[0];
+  RETURN_NOT_OK(file->Write(offset, Slice(&flipped, 1)));
+  return file->Close();
+}
+
+void CheckRecords(const vector<string>& types, int num_records) {
+  ASSERT_EQ(num_records, types.size());
+  for (int i = 0; i < num_records; i++) {
+    ASSERT_EQ(MakeRecord(i).pb_type(), types[i]);
+  }
+}
+
+} // anonymous namespace
+
+TEST(TestPBUtil, TestContainerRoundTrip) {
+  unique_ptr<Env> env = NewMemEnv(Env::Default());
+  ASSERT_TRUE(WriteContainer(env.get(), "/c", 100).ok());
+
+  vector<string> types;
+  uint64_t end_offset;
+  Status s = ReadContainer(env.get(), "/c", &types, &end_offset);
+  ASSERT_TRUE(s.IsEndOfFile()) << s.ToString();
+  CheckRecords(types, 100);
+  uint64_t size;
+  ASSERT_TRUE(env->GetFileSize("/c", &size).ok());
+  ASSERT_EQ(size, end_offset);
+
+  // An empty container.
+  ASSERT_TRUE(WriteContainer(env.get(), "/empty", 0).ok());
+  types.clear();
+  s = ReadContainer(env.get(), "/empty", &types);
+  ASSERT_TRUE(s.IsEndOfFile()) << s.ToString();
+  ASSERT_TRUE(types.empty());
+}
+
+TEST(TestPBUtil, TestContainerTypeMismatch) {
+  unique_ptr<Env> env = NewMemEnv(Env::Default());
+  ASSERT_TRUE(WriteContainer(env.get(), "/c", 1).ok());
+  unique_ptr<RandomAccessFile> file;
+  ASSERT_TRUE(env->NewRandomAccessFile("/c", &file).ok());
+  ReadablePBContainerFile reader(std::move(file));
+  ASSERT_TRUE(reader.Open().ok());
+  google::protobuf::FileDescriptorSet pb;
+  Status s = reader.ReadNextPB(&pb);
+  ASSERT_TRUE(s.IsInvalidArgument()) << s.ToString();
+}
+
+// A record cut short, in its header or its data, reads as Incomplete, and
+// TruncateIncompleteRecord() drops it.
+TEST(TestPBUtil, TestContainerTruncatedTail) {
+  unique_ptr<Env> env = NewMemEnv(Env::Default());
+  ASSERT_TRUE(WriteContainer(env.get(), "/c", 3).ok());
+  vector<string> types;
+  uint64_t two_records_end;
+  ASSERT_TRUE(WriteContainer(env.get(), "/two", 2).ok());
+  ASSERT_TRUE(ReadContainer(env.get(), "/two", &types, &two_records_end).IsEndOfFile());
+  uint64_t size;
+  ASSERT_TRUE(env->GetFileSize("/c", &size).ok());
+
+  // From within the data checksum of the last record to within its length.
+  for (uint64_t cut : { size - 1, two_records_end + 10, two_records_end + 3 }) {
+    SCOPED_TRACE(cut);
+    ASSERT_TRUE(WriteContainer(env.get(), "/c", 3).ok());
+    ASSERT_TRUE(TruncateFile(env.get(), "/c", cut).ok());
+    types.clear();
+    uint64_t end_offset;
+    Status s = ReadContainer(env.get(), "/c", &types, &end_offset);
+    ASSERT_TRUE(s.IsIncomplete()) << s.ToString();
+    CheckRecords(types, 2);
+    ASSERT_EQ(two_records_end, end_offset);
+
+    ASSERT_TRUE(TruncateIncompleteRecord(env.get(), "/c").ok());
+    uint64_t new_size;
+    ASSERT_TRUE(env->GetFileSize("/c", &new_size).ok());
+    ASSERT_EQ(two_records_end, new_size);
+    types.clear();
+    s = ReadContainer(env.get(), "/c", &types);
+    ASSERT_TRUE(s.IsEndOfFile()) << s.ToString();
+    CheckRecords(types, 2);
+  }
+
+  // A container ending with a whole record is left alone.
+  ASSERT_TRUE(WriteContainer(env.get(), "/c", 3).ok());
+  ASSERT_TRUE(TruncateIncompleteRecord(env.get(), "/c").ok());
+  uint64_t new_size;
+  ASSERT_TRUE(env->GetFileSize("/c", &new_size).ok());
+  ASSERT_EQ(size, new_size);
+}
+
+// A flipped byte in the length or the data of a record reads as Corruption,
+// which TruncateIncompleteRecord() refuses to truncate away.
+TEST(TestPBUtil, TestContainerCorruption) {
+  unique_ptr<Env> env = NewMemEnv(Env::Default());
+  vector<string> types;
+  uint64_t one_record_end;
+  ASSERT_TRUE(WriteContainer(env.get(), "/one", 1).ok());
+  ASSERT_TRUE(ReadContainer(env.get(), "/one", &types, &one_record_end).IsEndOfFile());
+
+  // The second record starts with its length, its length checksum and its
+  // data.
+  for (uint64_t offset : { one_record_end, one_record_end + 5, one_record_end + 10 }) {
+    SCOPED_TRACE(offset);
+    ASSERT_TRUE(WriteContainer(env.get(), "/c", 3).ok());
+    uint64_t size;
+    ASSERT_TRUE(env->GetFileSize("/c", &size).ok());
+    ASSERT_TRUE(FlipByte(env.get(), "/c", offset).ok());
+
+    types.clear();
+    uint64_t end_offset;
+    Status s = ReadContainer(env.get(), "/c", &types, &end_offset);
+    ASSERT_TRUE(s.IsCorruption()) << s.ToString();
+    CheckRecords(types, 1);
+    ASSERT_EQ(one_record_end, end_offset);
+
+    s = TruncateIncompleteRecord(env.get(), "/c");
+    ASSERT_TRUE(s.IsCorruption()) << s.ToString();
+    uint64_t new_size;
+    ASSERT_TRUE(env->GetFileSize("/c", &new_size).ok());
+    ASSERT_EQ(size, new_size);
+  }
+}
+
+// Memory-mapped reads and read-ahead in chunks much smaller than the file
+// return the same records.
+TEST(TestPBUtil, TestContainerMmapAndReadAhead) {
+  Env* env = Env::Default();
+  string dir;
+  ASSERT_TRUE(env->GetTestDirectory(&dir).ok());
+  const string path = Substitute("$0/pb_util_test-$1", dir, getpid());
+  const int kNumRecords = 1000;
+  ASSERT_TRUE(WriteContainer(env, path, kNumRecords).ok());
+
+  const int32_t old_read_ahead = FLAGS_pb_container_read_ahead_bytes;
+  for (int32_t read_ahead : { 1, 100, 4096, 256 * 1024 }) {
+    SCOPED_TRACE(read_ahead);
+    FLAGS_pb_container_read_ahead_bytes = read_ahead;
+    vector<string> types;
+    Status s = ReadContainer(env, path, &types);
+    ASSERT_TRUE(s.IsEndOfFile()) << s.ToString();
+    CheckRecords(types, kNumRecords);
+  }
+  FLAGS_pb_container_read_ahead_bytes = old_read_ahead;
+
+  RandomAccessFileOptions opts;
+  opts.mmap = true;
+  vector<string> types;
+  Status s = ReadContainer(env, path, opts, &types);
+  ASSERT_TRUE(s.IsEndOfFile()) << s.ToString();
+  CheckRecords(types, kNumRecords);
+
+  // Including a truncated tail.
+  uint64_t size;
+  ASSERT_TRUE(env->GetFileSize(path, &size).ok());
+  ASSERT_TRUE(TruncateFile(env, path, size - 1).ok());
+  types.clear();
+  s = ReadContainer(env, path, opts, &types);
+  ASSERT_TRUE(s.IsIncomplete()) << s.ToString();
+  CheckRecords(types, kNumRecords - 1);
+
+  ASSERT_TRUE(env->DeleteFile(path).ok());
+}
+
+// A container cut short by a crash can be appended to once its incomplete
+// record is truncated.
+TEST(TestPBUtil, TestContainerAppendAfterTruncation) {
+  unique_ptr<Env> env = NewMemEnv(Env::Default());
+  ASSERT_TRUE(WriteContainer(env.get(), "/c", 3).ok());
+  uint64_t size;
+  ASSERT_TRUE(env->GetFileSize("/c", &size).ok());
+  ASSERT_TRUE(TruncateFile(env.get(), "/c", size - 2).ok());
+  ASSERT_TRUE(TruncateIncompleteRecord(env.get(), "/c").ok());
+
+  WritableFileOptions opts;
+  opts.mode = Env::OPEN_EXISTING;
+  unique_ptr<WritableFile> file;
+  ASSERT_TRUE(env->NewWritableFile(opts, "/c", &file).ok());
+  WritablePBContainerFile writer(std::move(file));
+  ASSERT_TRUE(writer.OpenExisting().ok());
+  for (int i = 2; i < 5; i++) {
+    ASSERT_TRUE(writer.Append(MakeRecord(i)).ok());
+  }
+  ASSERT_TRUE(writer.Close().ok());
+
+  vector<string> types;
+  Status s = ReadContainer(env.get(), "/c", &types);
+  ASSERT_TRUE(s.IsEndOfFile()) << s.ToString();
+  CheckRecords(types, 5);
+}
+
+} // namespace pb_util
+} // namespace bb
@@ -0,0 +1,253 @@
+#include "bboy/base/process/subprocess_manager.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "bboy/gbase/strings/substitute.h"
+#include "bboy/base/monotime.h"
+#include "bboy/base/process/subprocess.h"
+#include "bboy/base/sync/mutex.h"
+
+DECLARE_bool(subprocess_manager_inject_pidfd_failure);
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using strings::Substitute;
+
+namespace bb {
+
+namespace {
+
+// Collects the outcomes of the children launched through it.
+class Runner {
+ public:
+  explicit Runner(const SubprocessManagerOptions& opts = SubprocessManagerOptions())
+    : num_completed_(0),
+      manager_(opts) {
+    CHECK_OK(manager_.Init());
+  }
+
+  // Run 'script' with the shell, writing 'stdin_data' to its stdin.
+  Status Launch(const string& script, const string& stdin_data = "") {
+    return Launch(unique_ptr<Subprocess>(new Subprocess("/bin/sh", { "sh", "-c", script })),
+                  stdin_data);
+  }
+
+  // Launch 'proc'. Its outcome is the i'th one, in the order of the
+  // successful launches.
+  Status Launch(unique_ptr<Subprocess> proc, const string& stdin_data = "") {
+    int i;
+    {
+      MutexLock l(lock_);
+      i = statuses_.size();
+      statuses_.emplace_back(Status::Incomplete("not completed"));
+      results_.emplace_back();
+    }
+    Status s = manager_.Launch(std::move(proc), stdin_data,
+                               [this, i](const Status& s, const SubprocessResult& result) {
+      MutexLock l(lock_);
+      statuses_[i] = s;
+      results_[i] = result;
+      num_completed_++;
+    });
+    if (!s.ok()) {
+      MutexLock l(lock_);
+      statuses_.pop_back();
+      results_.pop_back();
+    }
+    return s;
+  }
+
+  // Wait for the children launched so far to complete.
+  bool WaitAll(const MonoDelta& timeout = MonoDelta::FromSeconds(30)) {
+    MonoTime deadline = MonoTime::Now() + timeout;
+    while (true) {
+      {
+        MutexLock l(lock_);
+        if (num_completed_ == statuses_.size()) {
+          return true;
+        }
+      }
+      if (MonoTime::Now() > deadline) {
+        return false;
+      }
+      SleepFor(MonoDelta::FromMilliseconds(10));
+    }
+  }
+
+  Status status(int i) {
+    MutexLock l(lock_);
+    return statuses_[i];
+  }
+
+  SubprocessResult result(int i) {
+    MutexLock l(lock_);
+    return results_[i];
+  }
+
+  SubprocessManager* manager() { return &manager_; }
+
+ private:
+  Mutex lock_;
+  vector<Status> statuses_;
+  vector<SubprocessResult> results_;
+  int num_completed_;
+  // Last, since it calls the callbacks when it's destroyed.
+  SubprocessManager manager_;
+};
+
+int ExitStatus(const SubprocessResult& result) {
+  CHECK(WIFEXITED(result.wait_status)) << result.wait_status;
+  return WEXITSTATUS(result.wait_status);
+}
+
+} // anonymous namespace
+
+// Many children run at once, each with its output captured and its exit
+// status reported.
+TEST(TestSubprocessManager, TestLaunchAndCapture) {
+  Runner r;
+  const int kNumChildren = 20;
+  for (int i = 0; i < kNumChildren; i++) {
+    Status s = r.Launch(Substitute("echo out-$0; echo err-$0 >&2; sleep 0.1; exit $0", i));
+    ASSERT_TRUE(s.ok()) << s.ToString();
+  }
+  ASSERT_TRUE(r.WaitAll());
+  ASSERT_EQ(0, r.manager()->num_running());
+  for (int i = 0; i < kNumChildren; i++) {
+    SCOPED_TRACE(i);
+    ASSERT_TRUE(r.status(i).ok()) << r.status(i).ToString();
+    SubprocessResult result = r.result(i);
+    ASSERT_EQ(i, ExitStatus(result));
+    ASSERT_EQ(Substitute("out-$0\n", i), result.stdout_output);
+    ASSERT_EQ(Substitute("err-$0\n", i), result.stderr_output);
+    ASSERT_FALSE(result.stdout_truncated);
+    ASSERT_FALSE(result.stderr_truncated);
+  }
+
+  // A child killed by a signal, and one which can't be exec()ed.
+  ASSERT_TRUE(r.Launch("kill -9 $$").ok());
+  ASSERT_TRUE(r.Launch(unique_ptr<Subprocess>(
+      new Subprocess("/nonexistent", { "nonexistent" }))).ok());
+  ASSERT_TRUE(r.WaitAll());
+  SubprocessResult result = r.result(kNumChildren);
+  ASSERT_TRUE(WIFSIGNALED(result.wait_status));
+  ASSERT_EQ(SIGKILL, WTERMSIG(result.wait_status));
+  ASSERT_TRUE(r.status(kNumChildren + 1).ok());
+  ASSERT_EQ(ENOENT, ExitStatus(r.result(kNumChildren + 1)));
+}
+
+// Without pidfds, the children are polled for their exit.
+TEST(TestSubprocessManager, TestPollingFallback) {
+  const bool old_inject = FLAGS_subprocess_manager_inject_pidfd_failure;
+  FLAGS_subprocess_manager_inject_pidfd_failure = true;
+  {
+    Runner r;
+    // Children exiting right away, possibly before they're registered, and
+    // some time after, with their output closed early.
+    ASSERT_TRUE(r.Launch("exit 1").ok());
+    ASSERT_TRUE(r.Launch("echo early; exec >&- 2>&-; sleep 0.3; exit 2").ok());
+    ASSERT_TRUE(r.Launch("sleep 0.3; echo late; exit 3").ok());
+    MonoTime start = MonoTime::Now();
+    ASSERT_TRUE(r.WaitAll());
+    // The children complete within a few poll intervals of their exit.
+    ASSERT_LT((MonoTime::Now() - start).ToMilliseconds(), 5000);
+    for (int i = 0; i < 3; i++) {
+      ASSERT_TRUE(r.status(i).ok()) << r.status(i).ToString();
+      ASSERT_EQ(i + 1, ExitStatus(r.result(i)));
+    }
+    ASSERT_EQ("early\n", r.result(1).stdout_output);
+    ASSERT_EQ("late\n", r.result(2).stdout_output);
+    ASSERT_EQ(0, r.manager()->num_running());
+  }
+  FLAGS_subprocess_manager_inject_pidfd_failure = old_inject;
+}
+
+// Output beyond max_output_bytes is read and dropped.
+TEST(TestSubprocessManager, TestOutputTruncation) {
+  SubprocessManagerOptions opts;
+  opts.max_output_bytes = 1000;
+  Runner r(opts);
+  ASSERT_TRUE(r.Launch("head -c 1000000 /dev/zero; head -c 1000 /dev/zero >&2").ok());
+  ASSERT_TRUE(r.Launch("head -c 1001 /dev/zero").ok());
+  ASSERT_TRUE(r.WaitAll());
+
+  ASSERT_TRUE(r.status(0).ok()) << r.status(0).ToString();
+  SubprocessResult result = r.result(0);
+  ASSERT_EQ(0, ExitStatus(result));
+  ASSERT_EQ(string(1000, '\0'), result.stdout_output);
+  ASSERT_TRUE(result.stdout_truncated);
+  ASSERT_EQ(string(1000, '\0'), result.stderr_output);
+  ASSERT_FALSE(result.stderr_truncated);
+
+  result = r.result(1);
+  ASSERT_EQ(1000, result.stdout_output.size());
+  ASSERT_TRUE(result.stdout_truncated);
+}
+
+// The stdin data is streamed to the child, however large, and it's not an
+// error for the child not to read it.
+TEST(TestSubprocessManager, TestStdin) {
+  SubprocessManagerOptions opts;
+  opts.max_output_bytes = 4 * 1024 * 1024;
+  Runner r(opts);
+  string data;
+  for (int i = 0; data.size() < 4 * 1024 * 1024; i++) {
+    data.append(Substitute("line $0\n", i));
+  }
+  data.resize(4 * 1024 * 1024);
+  ASSERT_TRUE(r.Launch("cat", data).ok());
+  ASSERT_TRUE(r.Launch("cat", "").ok());
+  ASSERT_TRUE(r.Launch("exit 0", data).ok());
+  ASSERT_TRUE(r.Launch("head -c 10", data).ok());
+  ASSERT_TRUE(r.WaitAll());
+
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(r.status(i).ok()) << r.status(i).ToString();
+    ASSERT_EQ(0, ExitStatus(r.result(i)));
+  }
+  ASSERT_EQ(data, r.result(0).stdout_output);
+  ASSERT_FALSE(r.result(0).stdout_truncated);
+  ASSERT_EQ("", r.result(1).stdout_output);
+  ASSERT_EQ(data.substr(0, 10), r.result(3).stdout_output);
+}
+
+// Shutdown() kills the running children and aborts them.
+TEST(TestSubprocessManager, TestShutdown) {
+  Runner r;
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(r.Launch("exec sleep 60").ok());
+  }
+  ASSERT_TRUE(r.Launch("exit 0").ok());
+  while (r.status(3).IsIncomplete()) {
+    SleepFor(MonoDelta::FromMilliseconds(10));
+  }
+  ASSERT_EQ(3, r.manager()->num_running());
+
+  MonoTime start = MonoTime::Now();
+  r.manager()->Shutdown();
+  ASSERT_LT((MonoTime::Now() - start).ToSeconds(), 30);
+  ASSERT_TRUE(r.WaitAll(MonoDelta::FromSeconds(0)));
+  ASSERT_EQ(0, r.manager()->num_running());
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(r.status(i).IsAborted()) << r.status(i).ToString();
+    SubprocessResult result = r.result(i);
+    ASSERT_TRUE(WIFSIGNALED(result.wait_status));
+    ASSERT_EQ(SIGKILL, WTERMSIG(result.wait_status));
+  }
+  ASSERT_TRUE(r.status(3).ok());
+
+  Status s = r.Launch("exit 0");
+  ASSERT_TRUE(s.IsIllegalState()) << s.ToString();
+  r.manager()->Shutdown();
+}
+
+} // namespace bb
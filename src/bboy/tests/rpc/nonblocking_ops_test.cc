@@ -0,0 +1,214 @@
+#include "bboy/rpc/nonblocking_ops.h"
+
+#include <sys/socket.h>
+
+#include <string>
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "bboy/gbase/endian.h"
+#include "bboy/rpc/constants.h"
+#include "bboy/rpc/rpc_header.pb.h"
+#include "bboy/base/net/socket.h"
+
+DECLARE_int32(rpc_max_message_size);
+
+using std::string;
+
+namespace bb {
+namespace rpc {
+
+namespace {
+
+// A connected pair of non-blocking sockets.
+struct SocketPair {
+  SocketPair() {
+    int fds[2];
+    CHECK_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds));
+    a.Reset(fds[0]);
+    b.Reset(fds[1]);
+  }
+
+  Socket a;
+  Socket b;
+};
+
+Status InitWriter(int call_id, const string& text, FramedMessageWriter* writer) {
+  ResponseHeader header;
+  header.set_call_id(call_id);
+  ErrorStatusPB msg;
+  msg.set_message(text);
+  return writer->Init(header, msg);
+}
+
+// Check that 'reader' holds the frame written by InitWriter().
+void CheckFrame(const FramedMessageReader& reader, int call_id, const string& text) {
+  ASSERT_TRUE(reader.TransferFinished());
+  ResponseHeader header;
+  Slice param_buf;
+  Status s = reader.ParseMessage(&header, &param_buf);
+  ASSERT_TRUE(s.ok()) << s.ToString();
+  ASSERT_EQ(call_id, header.call_id());
+  ErrorStatusPB msg;
+  ASSERT_TRUE(msg.ParseFromArray(param_buf.data(), param_buf.size()));
+  ASSERT_EQ(text, msg.message());
+}
+
+// The bytes of the frame written by InitWriter().
+string SerializeFrame(int call_id, const string& text) {
+  SocketPair p;
+  FramedMessageWriter writer;
+  CHECK_OK(InitWriter(call_id, text, &writer));
+  CHECK_OK(writer.WriteTo(&p.a));
+  string frame(64 * 1024, '\0');
+  size_t nread;
+  CHECK_OK(p.b.Read(reinterpret_cast<uint8_t*>(&frame[0]), frame.size(), &nread));
+  frame.resize(nread);
+  return frame;
+}
+
+void SendRaw(Socket* sock, const string& data) {
+  size_t nwritten;
+  CHECK_OK(sock->Write(reinterpret_cast<const uint8_t*>(data.data()), data.size(), &nwritten));
+  CHECK_EQ(data.size(), nwritten);
+}
+
+} // anonymous namespace
+
+TEST(TestNonBlockingOps, TestRoundTrip) {
+  SocketPair p;
+  FramedMessageWriter writer;
+  FramedMessageReader reader;
+  ASSERT_FALSE(reader.TransferStarted());
+  ASSERT_TRUE(reader.ReadFrom(&p.b).IsIncomplete());
+  ASSERT_FALSE(reader.TransferStarted());
+
+  for (int call_id = 1; call_id <= 3; call_id++) {
+    ASSERT_TRUE(InitWriter(call_id, "hello", &writer).ok());
+    ASSERT_FALSE(writer.TransferFinished());
+    ASSERT_TRUE(writer.WriteTo(&p.a).ok());
+    ASSERT_TRUE(writer.TransferFinished());
+    Status s = reader.ReadFrom(&p.b);
+    ASSERT_TRUE(s.ok()) << s.ToString();
+    CheckFrame(reader, call_id, "hello");
+    reader.Reset();
+  }
+}
+
+// A frame arriving a byte at a time, including its length prefix, is
+// accumulated across reads.
+TEST(TestNonBlockingOps, TestPartialReads) {
+  SocketPair p;
+  const string frame = SerializeFrame(7, "partial");
+  FramedMessageReader reader;
+  for (size_t i = 0; i < frame.size(); i++) {
+    SendRaw(&p.a, frame.substr(i, 1));
+    Status s = reader.ReadFrom(&p.b);
+    if (i + 1 < frame.size()) {
+      ASSERT_TRUE(s.IsIncomplete()) << i << ": " << s.ToString();
+      ASSERT_TRUE(reader.TransferStarted());
+      ASSERT_FALSE(reader.TransferFinished());
+    } else {
+      ASSERT_TRUE(s.ok()) << s.ToString();
+    }
+  }
+  CheckFrame(reader, 7, "partial");
+
+  // Bytes of the next frame aren't consumed with the current one.
+  reader.Reset();
+  SendRaw(&p.a, frame + frame.substr(0, 3));
+  ASSERT_TRUE(reader.ReadFrom(&p.b).ok());
+  CheckFrame(reader, 7, "partial");
+  reader.Reset();
+  ASSERT_TRUE(reader.ReadFrom(&p.b).IsIncomplete());
+  SendRaw(&p.a, frame.substr(3));
+  ASSERT_TRUE(reader.ReadFrom(&p.b).ok());
+  CheckFrame(reader, 7, "partial");
+}
+
+// A frame larger than the socket buffers is written out across several
+// calls, as the reader drains the socket.
+TEST(TestNonBlockingOps, TestPartialWrites) {
+  SocketPair p;
+  const string text(8 * 1024 * 1024, 'x');
+  FramedMessageWriter writer;
+  FramedMessageReader reader;
+  ASSERT_TRUE(InitWriter(9, text, &writer).ok());
+
+  int num_incomplete_writes = 0;
+  while (true) {
+    Status ws = writer.WriteTo(&p.a);
+    if (ws.IsIncomplete()) {
+      num_incomplete_writes++;
+    } else {
+      ASSERT_TRUE(ws.ok()) << ws.ToString();
+    }
+    Status rs = reader.ReadFrom(&p.b);
+    if (rs.ok()) {
+      break;
+    }
+    ASSERT_TRUE(rs.IsIncomplete()) << rs.ToString();
+  }
+  ASSERT_GT(num_incomplete_writes, 0);
+  ASSERT_TRUE(writer.TransferFinished());
+  CheckFrame(reader, 9, text);
+}
+
+TEST(TestNonBlockingOps, TestOversizedFrame) {
+  const int32_t old_max = FLAGS_rpc_max_message_size;
+  FLAGS_rpc_max_message_size = 1024;
+
+  FramedMessageWriter writer;
+  Status s = InitWriter(1, string(1024, 'x'), &writer);
+  ASSERT_TRUE(s.IsInvalidArgument()) << s.ToString();
+  ASSERT_TRUE(InitWriter(1, string(512, 'x'), &writer).ok());
+
+  // The frame is rejected as soon as its length prefix is received.
+  SocketPair p;
+  uint8_t prefix[kMsgLengthPrefixLength];
+  NetworkByteOrder::Store32(prefix, 1025);
+  SendRaw(&p.a, string(reinterpret_cast<const char*>(prefix), sizeof(prefix)));
+  FramedMessageReader reader;
+  s = reader.ReadFrom(&p.b);
+  ASSERT_TRUE(s.IsNetworkError()) << s.ToString();
+
+  FLAGS_rpc_max_message_size = old_max;
+}
+
+// The end of the stream in the middle of a frame is an error, not a frame
+// which is still incomplete.
+TEST(TestNonBlockingOps, TestEofMidFrame) {
+  const string frame = SerializeFrame(3, "cut short");
+  for (size_t cut : { static_cast<size_t>(0), static_cast<size_t>(2), frame.size() - 1 }) {
+    SCOPED_TRACE(cut);
+    SocketPair p;
+    if (cut > 0) {
+      SendRaw(&p.a, frame.substr(0, cut));
+    }
+    ASSERT_TRUE(p.a.Close().ok());
+    FramedMessageReader reader;
+    Status s = reader.ReadFrom(&p.b);
+    ASSERT_TRUE(s.IsNetworkError()) << s.ToString();
+    ASSERT_FALSE(reader.TransferFinished());
+  }
+}
+
+// A frame whose message length doesn't match its total length is corrupt.
+TEST(TestNonBlockingOps, TestCorruptFrame) {
+  string frame = SerializeFrame(3, "corrupt");
+  // Lengthen the frame by a byte without changing the message length.
+  NetworkByteOrder::Store32(&frame[0], frame.size() + 1 - kMsgLengthPrefixLength);
+  frame.push_back('\0');
+  SocketPair p;
+  SendRaw(&p.a, frame);
+  FramedMessageReader reader;
+  ASSERT_TRUE(reader.ReadFrom(&p.b).ok());
+  ResponseHeader header;
+  Slice param_buf;
+  Status s = reader.ParseMessage(&header, &param_buf);
+  ASSERT_TRUE(s.IsCorruption()) << s.ToString();
+}
+
+} // namespace rpc
+} // namespace bb
@@ -0,0 +1,170 @@
+#include "bboy/security/token_verifier.h"
+
+#include <dlfcn.h>
+#include <openssl/evp.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "bboy/gbase/walltime.h"
+#include "bboy/security/crypto.h"
+#include "bboy/security/token.pb.h"
+#include "bboy/security/token_signing_key.h"
+#include "bboy/base/monotime.h"
+
+DECLARE_int32(token_verifier_cache_capacity);
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+// The number of RSA signatures checked by the process.
+std::atomic<int> num_signature_checks(0);
+
+} // anonymous namespace
+
+// Count the signature checks on their way to OpenSSL.
+extern "C" int EVP_DigestVerifyFinal(EVP_MD_CTX* ctx, const unsigned char* sig,
+                                     size_t siglen) {
+  typedef int (*VerifyFinalFn)(EVP_MD_CTX*, const unsigned char*, size_t);
+  static VerifyFinalFn real_fn =
+      reinterpret_cast<VerifyFinalFn>(dlsym(RTLD_NEXT, "EVP_DigestVerifyFinal"));
+  num_signature_checks++;
+  return real_fn(ctx, sig, siglen);
+}
+
+namespace bb {
+namespace security {
+
+namespace {
+
+unique_ptr<TokenSigningPrivateKey> MakeKey(int64_t seq_num, int64_t expire_time) {
+  unique_ptr<PrivateKey> key(new PrivateKey());
+  CHECK_OK(GeneratePrivateKey(1024, key.get()));
+  return unique_ptr<TokenSigningPrivateKey>(
+      new TokenSigningPrivateKey(seq_num, expire_time, std::move(key)));
+}
+
+Status ImportKey(const TokenSigningPrivateKey& key, TokenVerifier* verifier) {
+  TokenSigningPublicKeyPB pb;
+  key.ExportPublicKeyPB(&pb);
+  return verifier->ImportKeys({ pb });
+}
+
+// An authentication token for 'username' signed with 'key'.
+SignedTokenPB MakeToken(const TokenSigningPrivateKey& key, const string& username,
+                        int64_t expire_time) {
+  TokenPB token;
+  token.set_expire_unix_epoch_seconds(expire_time);
+  token.mutable_authn()->set_username(username);
+  SignedTokenPB signed_token;
+  CHECK(token.SerializeToString(signed_token.mutable_token_data()));
+  CHECK_OK(key.Sign(&signed_token));
+  return signed_token;
+}
+
+VerificationResult Verify(const TokenVerifier& verifier, const SignedTokenPB& signed_token) {
+  TokenPB token;
+  return verifier.VerifyTokenSignature(signed_token, &token);
+}
+
+} // anonymous namespace
+
+// A token verified once isn't checked again, but its copies with another
+// signature are.
+TEST(TestTokenVerifier, TestCacheHit) {
+  const int64_t expire_time = WallTime_Now() + 3600;
+  unique_ptr<TokenSigningPrivateKey> key = MakeKey(1, expire_time);
+  TokenVerifier verifier;
+  ASSERT_TRUE(ImportKey(*key, &verifier).ok());
+
+  const SignedTokenPB token = MakeToken(*key, "alice", expire_time);
+  num_signature_checks = 0;
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, token));
+  ASSERT_EQ(1, num_signature_checks);
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, token));
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, token));
+  ASSERT_EQ(1, num_signature_checks);
+
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, MakeToken(*key, "bob", expire_time)));
+  ASSERT_EQ(2, num_signature_checks);
+
+  // Bad signatures aren't remembered.
+  SignedTokenPB forged = token;
+  (*forged.mutable_signature())[0] ^= 1;
+  ASSERT_EQ(VerificationResult::INVALID_SIGNATURE, Verify(verifier, forged));
+  ASSERT_EQ(VerificationResult::INVALID_SIGNATURE, Verify(verifier, forged));
+  ASSERT_EQ(4, num_signature_checks);
+
+  // Nor is anything with the cache disabled.
+  const int32_t old_capacity = FLAGS_token_verifier_cache_capacity;
+  FLAGS_token_verifier_cache_capacity = 0;
+  TokenVerifier uncached;
+  FLAGS_token_verifier_cache_capacity = old_capacity;
+  ASSERT_TRUE(ImportKey(*key, &uncached).ok());
+  ASSERT_EQ(VerificationResult::VALID, Verify(uncached, token));
+  ASSERT_EQ(VerificationResult::VALID, Verify(uncached, token));
+  ASSERT_EQ(6, num_signature_checks);
+}
+
+// A cached token stops being valid when its signing key expires, even
+// though the token itself doesn't.
+TEST(TestTokenVerifier, TestCacheExpiry) {
+  const int64_t now = WallTime_Now();
+  unique_ptr<TokenSigningPrivateKey> key = MakeKey(1, now + 1);
+  TokenVerifier verifier;
+  ASSERT_TRUE(ImportKey(*key, &verifier).ok());
+
+  const SignedTokenPB token = MakeToken(*key, "alice", now + 3600);
+  const SignedTokenPB short_token = MakeToken(*key, "bob", now + 1);
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, token));
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, short_token));
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, token));
+
+  while (static_cast<int64_t>(WallTime_Now()) <= now + 1) {
+    SleepFor(MonoDelta::FromMilliseconds(100));
+  }
+  ASSERT_EQ(VerificationResult::EXPIRED_SIGNING_KEY, Verify(verifier, token));
+  ASSERT_EQ(VerificationResult::EXPIRED_TOKEN, Verify(verifier, short_token));
+}
+
+// Replacing a signing key drops the tokens verified with the old key, and
+// only those.
+TEST(TestTokenVerifier, TestKeyReplacement) {
+  const int64_t expire_time = WallTime_Now() + 3600;
+  unique_ptr<TokenSigningPrivateKey> old_key = MakeKey(1, expire_time);
+  unique_ptr<TokenSigningPrivateKey> other_key = MakeKey(2, expire_time);
+  TokenVerifier verifier;
+  ASSERT_TRUE(ImportKey(*old_key, &verifier).ok());
+  ASSERT_TRUE(ImportKey(*other_key, &verifier).ok());
+
+  const SignedTokenPB old_token = MakeToken(*old_key, "alice", expire_time);
+  const SignedTokenPB other_token = MakeToken(*other_key, "bob", expire_time);
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, old_token));
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, other_token));
+
+  unique_ptr<TokenSigningPrivateKey> new_key = MakeKey(1, expire_time);
+  ASSERT_TRUE(ImportKey(*new_key, &verifier).ok());
+  ASSERT_EQ(VerificationResult::INVALID_SIGNATURE, Verify(verifier, old_token));
+  ASSERT_EQ(VerificationResult::VALID,
+            Verify(verifier, MakeToken(*new_key, "alice", expire_time)));
+
+  num_signature_checks = 0;
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, other_token));
+  ASSERT_EQ(0, num_signature_checks);
+
+  // Importing the same key again is a replacement too.
+  ASSERT_TRUE(ImportKey(*other_key, &verifier).ok());
+  ASSERT_EQ(VerificationResult::VALID, Verify(verifier, other_token));
+  ASSERT_EQ(1, num_signature_checks);
+}
+
+} // namespace security
+} // namespace bb